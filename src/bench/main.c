@@ -0,0 +1,476 @@
+/**
+ * @file main.c
+ * @brief Microbenchmarks of the server's hot paths.
+ *
+ * The benchmarks link the server's code and call it directly: message processing per
+ * message type, the encoding of an outbound public message, username lookups in client
+ * registries of growing sizes, broadcasts to clients connected through socketpairs, and the
+ * UTF-8 validation of inbound messages.
+ * Each benchmark runs for at least BENCH_MIN_NS, and its result is printed on standard
+ * output as one JSON object per line, so results can be stored and compared per commit.
+ * Whatever the server code itself prints is discarded.
+ */
+#include "../server/client_manager.h"
+#include "../server/messaging.h"
+#include "../server/utf8.h"
+#include "../common/clock.h"
+#include "../libs/cJSON/cJSON.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BENCH_MIN_NS 200000000ULL
+#define BENCH_MAX_ITERATIONS (1L << 30)
+#define BENCH_LOOKUPS 1024
+
+typedef struct {
+    client_t *client;
+    const char *message;
+} process_arg_t;
+
+typedef struct {
+    const char *names[BENCH_LOOKUPS];
+    int (*lookup)(const char *username);
+} lookup_arg_t;
+
+typedef struct {
+    const char *data;
+    size_t length;
+} validate_arg_t;
+
+typedef struct {
+    int *fds;
+    int count;
+    volatile int stop;
+} drain_arg_t;
+
+static FILE *results = NULL;
+static const char *label = "";
+static const char *filter = NULL;
+static int null_fd = -1;
+static volatile unsigned long long sink = 0;
+
+/**
+ * @brief Runs a benchmark and prints its result.
+ *
+ * The number of iterations doubles until a run lasts at least BENCH_MIN_NS; the last run
+ * is reported.
+ *
+ * @param name The name of the benchmark.
+ * @param body Runs the benchmarked operation `iterations` times.
+ * @param arg The argument passed to `body`.
+ *
+ * @return void
+ */
+static void run_benchmark(const char *name, void (*body)(long iterations, void *arg), void *arg) {
+    unsigned long long elapsed = 0;
+    long iterations = 1;
+
+    if (filter && !strstr(name, filter)) {
+        return;
+    }
+    while (iterations < BENCH_MAX_ITERATIONS) {
+        unsigned long long start = clock_monotonic_ns();
+        body(iterations, arg);
+        elapsed = clock_monotonic_ns() - start;
+        if (elapsed >= BENCH_MIN_NS) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    fprintf(results, "{\"label\":\"%s\",\"benchmark\":\"%s\",\"iterations\":%ld,\"ns_per_op\":%.1f,"
+            "\"ops_per_second\":%.0f,\"registry_slots\":%d}\n",
+            label, name, iterations, (double)elapsed / iterations, iterations * 1e9 / (double)elapsed, MAX_CLIENTS);
+    fflush(results);
+}
+
+/**
+ * @brief Creates an identified client writing to /dev/null and adds it to the registry.
+ *
+ * @param username The name of the client.
+ * @param slot The registry slot to use, or -1 to let `add_client` pick one.
+ * @param fd The socket of the client.
+ *
+ * @return client_t* The client.
+ */
+static client_t *create_client(const char *username, int slot, int fd) {
+    client_t *client = calloc(1, sizeof(client_t));
+
+    if (!client) {
+        perror("ERROR: calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    client->sockfd = fd;
+    client->id = allocate_client_id();
+    client->compression = COMPRESSION_NONE;
+    pthread_mutex_init(&client->send_mutex, NULL);
+    pthread_cond_init(&client->resume_cond, NULL);
+    snprintf(client->user_name, sizeof(client->user_name), "%s", username);
+    snprintf(client->status, sizeof(client->status), "ACTIVE");
+
+    if (slot < 0) {
+        add_client(client);
+    } else {
+        // Filling the registry slot by slot avoids the quadratic cost of add_client.
+        pthread_mutex_lock(&clients_mutex);
+        clients[slot] = client;
+        pthread_mutex_unlock(&clients_mutex);
+    }
+    return client;
+}
+
+/**
+ * @brief Empties the registry and frees its clients.
+ *
+ * @return void
+ */
+static void clear_registry(void) {
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        free(clients[i]);
+        clients[i] = NULL;
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+/**
+ * @brief Processes the same message again and again.
+ *
+ * @param iterations The number of messages to process.
+ * @param arg The client and the message.
+ *
+ * @return void
+ */
+static void bench_process(long iterations, void *arg) {
+    process_arg_t *process = (process_arg_t *)arg;
+
+    for (long i = 0; i < iterations; ++i) {
+        process_client_message(process->client, process->message);
+    }
+}
+
+/**
+ * @brief Encodes a public message the way the server broadcasts it.
+ *
+ * @param iterations The number of messages to encode.
+ * @param arg Unused.
+ *
+ * @return void
+ */
+static void bench_encode_public(long iterations, void *arg) {
+    (void)arg;
+
+    for (long i = 0; i < iterations; ++i) {
+        cJSON *json_message = cJSON_CreateObject();
+        cJSON_AddStringToObject(json_message, "type", "PUBLIC_TEXT_FROM");
+        cJSON_AddStringToObject(json_message, "username", "bench0");
+        cJSON_AddStringToObject(json_message, "text", "hello everyone, this is a benchmark message");
+        char *json_message_str = cJSON_PrintUnformatted(json_message);
+        sink += (unsigned char)json_message_str[0];
+        free(json_message_str);
+        cJSON_Delete(json_message);
+    }
+}
+
+/**
+ * @brief Looks usernames up in the registry.
+ *
+ * @param iterations The number of lookups.
+ * @param arg The names to look up and the lookup function.
+ *
+ * @return void
+ */
+static void bench_lookup(long iterations, void *arg) {
+    lookup_arg_t *lookup = (lookup_arg_t *)arg;
+
+    for (long i = 0; i < iterations; ++i) {
+        sink += (unsigned long long)lookup->lookup(lookup->names[i % BENCH_LOOKUPS]);
+    }
+}
+
+/**
+ * @brief Adapts `find_client_by_username` to the lookup benchmark.
+ *
+ * @param username The username to find.
+ * @return int 1 if the client was found, 0 otherwise.
+ */
+static int find_client(const char *username) {
+    return find_client_by_username(username) != NULL;
+}
+
+/**
+ * @brief Broadcasts the same message again and again.
+ *
+ * @param iterations The number of broadcasts.
+ * @param arg The message.
+ *
+ * @return void
+ */
+static void bench_broadcast(long iterations, void *arg) {
+    for (long i = 0; i < iterations; ++i) {
+        broadcast_message((const char *)arg, -1);
+    }
+}
+
+/**
+ * @brief Reads and discards what the broadcasts write to the client ends of the socketpairs.
+ *
+ * @param arg The client ends and the stop flag.
+ *
+ * @return void* Always NULL.
+ */
+static void *drain_sockets(void *arg) {
+    drain_arg_t *drain = (drain_arg_t *)arg;
+    struct pollfd *fds = calloc((size_t)drain->count, sizeof(struct pollfd));
+    char buffer[65536];
+
+    if (!fds) {
+        return NULL;
+    }
+    for (int i = 0; i < drain->count; ++i) {
+        fds[i].fd = drain->fds[i];
+        fds[i].events = POLLIN;
+    }
+    while (!drain->stop) {
+        if (poll(fds, (nfds_t)drain->count, 100) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < drain->count; ++i) {
+            if (fds[i].revents & POLLIN) {
+                while (recv(fds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+                }
+            }
+        }
+    }
+    free(fds);
+    return NULL;
+}
+
+/**
+ * @brief Benchmarks the processing of each message type by an identified client.
+ *
+ * @return void
+ */
+static void bench_message_types(void) {
+    static const struct {
+        const char *name;
+        const char *message;
+    } types[] = {
+        { "process/PUBLIC_TEXT", "{\"type\":\"PUBLIC_TEXT\",\"text\":\"hello everyone, this is a benchmark message\"}" },
+        { "process/TEXT", "{\"type\":\"TEXT\",\"username\":\"bench1\",\"text\":\"hello, this is a private benchmark message\"}" },
+        { "process/STATUS", "{\"type\":\"STATUS\",\"status\":\"BUSY\"}" },
+        { "process/USERS", "{\"type\":\"USERS\"}" },
+        { "process/METRICS", "{\"type\":\"METRICS\"}" },
+        { "process/ACK", "{\"type\":\"ACK\",\"seq\":1}" },
+        { "process/unknown", "{\"type\":\"NOOP\",\"text\":\"ignored by the server\"}" },
+    };
+    process_arg_t process;
+
+    process.client = create_client("bench0", -1, null_fd);
+    create_client("bench1", -1, null_fd);
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+        process.message = types[i].message;
+        run_benchmark(types[i].name, bench_process, &process);
+    }
+    clear_registry();
+
+    run_benchmark("encode/PUBLIC_TEXT_FROM", bench_encode_public, NULL);
+}
+
+/**
+ * @brief Benchmarks username lookups in registries of 100, 10k and 100k clients.
+ *
+ * Sizes beyond MAX_CLIENTS are skipped.
+ *
+ * @return void
+ */
+static void bench_registry(void) {
+    static const int sizes[] = { 100, 10000, 100000 };
+    static char names[BENCH_LOOKUPS][32];
+    lookup_arg_t lookup;
+    char name[64];
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        int size = sizes[s];
+        unsigned int seed = 12345;
+
+        if (size > MAX_CLIENTS) {
+            fprintf(stderr, "Skipping the registry of %d clients, MAX_CLIENTS is %d\n", size, MAX_CLIENTS);
+            continue;
+        }
+        for (int i = 0; i < size; ++i) {
+            snprintf(name, sizeof(name), "user%d", i);
+            create_client(name, i, null_fd);
+        }
+        for (int i = 0; i < BENCH_LOOKUPS; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            snprintf(names[i], sizeof(names[i]), "user%u", (seed >> 8) % (unsigned int)size);
+            lookup.names[i] = names[i];
+        }
+
+        lookup.lookup = find_client;
+        snprintf(name, sizeof(name), "registry/find_client_by_username/%d", size);
+        run_benchmark(name, bench_lookup, &lookup);
+
+        // A new user's name is not taken, which scans the whole registry.
+        for (int i = 0; i < BENCH_LOOKUPS; ++i) {
+            lookup.names[i] = "newcomer";
+        }
+        lookup.lookup = is_username_taken;
+        snprintf(name, sizeof(name), "registry/is_username_taken/%d", size);
+        run_benchmark(name, bench_lookup, &lookup);
+
+        clear_registry();
+    }
+}
+
+/**
+ * @brief Benchmarks broadcasts to 1, 10, 100 and 1000 clients connected through socketpairs.
+ *
+ * Sizes needing more descriptors than the process may open are skipped.
+ *
+ * @return void
+ */
+static void bench_fan_out(void) {
+    static const int sizes[] = { 1, 10, 100, 1000 };
+    const char *message = "{\"type\":\"PUBLIC_TEXT_FROM\",\"username\":\"bench0\","
+                          "\"text\":\"hello everyone, this is a benchmark message\"}";
+    struct rlimit limit;
+    char name[64];
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        int size = sizes[s];
+        drain_arg_t drain = { calloc((size_t)size, sizeof(int)), 0, 0 };
+        pthread_t tid;
+
+        if (!drain.fds) {
+            continue;
+        }
+        for (int i = 0; i < size; ++i) {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+                break;
+            }
+            snprintf(name, sizeof(name), "user%d", i);
+            create_client(name, i, pair[0]);
+            drain.fds[drain.count++] = pair[1];
+        }
+
+        if (drain.count == size && pthread_create(&tid, NULL, drain_sockets, &drain) == 0) {
+            snprintf(name, sizeof(name), "broadcast/socketpair/%d", size);
+            run_benchmark(name, bench_broadcast, (void *)message);
+            drain.stop = 1;
+            pthread_join(tid, NULL);
+        } else {
+            fprintf(stderr, "Skipping the broadcast to %d clients, not enough descriptors\n", size);
+        }
+
+        for (int i = 0; i < MAX_CLIENTS; ++i) {
+            if (clients[i]) {
+                close(clients[i]->sockfd);
+            }
+        }
+        clear_registry();
+        for (int i = 0; i < drain.count; ++i) {
+            close(drain.fds[i]);
+        }
+        free(drain.fds);
+    }
+}
+
+/**
+ * @brief Validates a message the way the server does before parsing it.
+ *
+ * @param iterations The number of validations.
+ * @param arg The message and its length.
+ *
+ * @return void
+ */
+static void bench_validate(long iterations, void *arg) {
+    validate_arg_t *validate = (validate_arg_t *)arg;
+
+    for (long i = 0; i < iterations; ++i) {
+        sink += (unsigned long long)utf8_valid(validate->data, validate->length);
+    }
+}
+
+/**
+ * @brief Benchmarks the UTF-8 validation of a short ASCII message and of a 4 KiB message
+ * mixing ASCII and multibyte text, with the scalar validator and then with the one chosen
+ * for the CPU.
+ *
+ * @return void
+ */
+static void bench_utf8(void) {
+    static const char chat[] = "{\"type\":\"PUBLIC_TEXT\",\"text\":\"hello everyone, this is a benchmark message\"}";
+    static const char mixed[] = "héllo wörld, ça va? привет мир 你好世界 😀 ";
+    static char text[4096];
+    validate_arg_t messages[2] = { { chat, sizeof(chat) - 1 }, { text, 0 } };
+    const char *names[2] = { "PUBLIC_TEXT", "mixed_4KiB" };
+    char name[64];
+
+    while (messages[1].length + sizeof(mixed) - 1 <= sizeof(text)) {
+        memcpy(text + messages[1].length, mixed, sizeof(mixed) - 1);
+        messages[1].length += sizeof(mixed) - 1;
+    }
+
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            utf8_init();
+            if (strcmp(utf8_implementation(), "scalar") == 0) {
+                break;
+            }
+        }
+        for (int i = 0; i < 2; ++i) {
+            snprintf(name, sizeof(name), "utf8/%s/%s", utf8_implementation(), names[i]);
+            run_benchmark(name, bench_validate, &messages[i]);
+        }
+    }
+}
+
+/**
+ * @brief Main function that runs the benchmarks.
+ *
+ * An optional first argument only runs the benchmarks whose name contains it, and an
+ * optional second argument labels the results, for instance with the commit they measure.
+ *
+ * @param argc Number of command-line arguments.
+ * @param argv Array of command-line argument strings.
+ * @return int Returns EXIT_SUCCESS on successful execution or EXIT_FAILURE on error.
+ */
+int main(int argc, char **argv) {
+    if (argc > 1 && argv[1][0]) {
+        filter = argv[1];
+    }
+    if (argc > 2) {
+        label = argv[2];
+    }
+
+    // Results keep the original standard output; the server code prints to /dev/null.
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    null_fd = open("/dev/null", O_WRONLY);
+    if (!results || null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+        perror("ERROR: redirect standard output failed");
+        return EXIT_FAILURE;
+    }
+
+    bench_message_types();
+    bench_registry();
+    bench_fan_out();
+    bench_utf8();
+
+    fclose(results);
+    return sink == 42 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+/**
+ * @file bot.c
+ * @brief Implements the statistics reported by the client's bot mode.
+ */
+#include "bot.h"
+#include "../common/clock.h"
+#include <stdio.h>
+#include <string.h>
+
+#define BOT_MAX_RESULTS 16
+#define BOT_NAME_SIZE 32
+
+/**
+ * @brief The number of responses with a given operation and result.
+ */
+typedef struct {
+    char operation[BOT_NAME_SIZE];
+    char result[BOT_NAME_SIZE];
+    unsigned long count;
+} bot_result_t;
+
+static unsigned long long started;
+static unsigned long commands = 0;
+static unsigned long sends = 0;
+static unsigned long long bytes_sent = 0;
+static unsigned long messages = 0;
+static unsigned long failures = 0;
+static bot_result_t results[BOT_MAX_RESULTS];
+static int result_count = 0;
+
+/**
+ * @brief Resets the statistics and starts the clock.
+ *
+ * @return void
+ */
+void bot_start() {
+    commands = 0;
+    sends = 0;
+    bytes_sent = 0;
+    messages = 0;
+    failures = 0;
+    result_count = 0;
+    started = clock_monotonic_ns();
+}
+
+/**
+ * @brief Counts a command read from the script.
+ *
+ * @return void
+ */
+void bot_record_command() {
+    commands++;
+}
+
+/**
+ * @brief Counts a `send` call and the bytes it wrote.
+ *
+ * @param bytes The number of bytes written.
+ *
+ * @return void
+ */
+void bot_record_send(size_t bytes) {
+    sends++;
+    bytes_sent += bytes;
+}
+
+/**
+ * @brief Counts a message received from the server.
+ *
+ * @return void
+ */
+void bot_record_message() {
+    messages++;
+}
+
+/**
+ * @brief Counts a RESPONSE message that did not report a success.
+ *
+ * Responses are grouped by operation and result. Once BOT_MAX_RESULTS different pairs were
+ * seen, further pairs are only included in the total.
+ *
+ * @param operation The operation the response refers to.
+ * @param result The result reported by the server.
+ *
+ * @return void
+ */
+void bot_record_response(const char *operation, const char *result) {
+    failures++;
+    for (int i = 0; i < result_count; ++i) {
+        if (strcmp(results[i].operation, operation) == 0 && strcmp(results[i].result, result) == 0) {
+            results[i].count++;
+            return;
+        }
+    }
+    if (result_count < BOT_MAX_RESULTS) {
+        snprintf(results[result_count].operation, BOT_NAME_SIZE, "%s", operation);
+        snprintf(results[result_count].result, BOT_NAME_SIZE, "%s", result);
+        results[result_count].count = 1;
+        result_count++;
+    }
+}
+
+/**
+ * @brief Prints the throughput and the failed responses.
+ *
+ * @return void
+ */
+void bot_report() {
+    double elapsed = (double)(clock_monotonic_ns() - started) / 1e9;
+
+    if (elapsed <= 0) {
+        elapsed = 1e-9;
+    }
+
+    printf("Sent %lu commands (%llu bytes) in %lu send calls over %.3f s\n",
+           commands, bytes_sent, sends, elapsed);
+    printf("Throughput: %.0f commands/s, %.2f MB/s\n",
+           (double)commands / elapsed, (double)bytes_sent / elapsed / (1024 * 1024));
+    printf("Received %lu messages from the server\n", messages);
+    if (failures == 0) {
+        printf("No failed responses\n");
+        return;
+    }
+    printf("Failed responses: %lu\n", failures);
+    for (int i = 0; i < result_count; ++i) {
+        printf(" - %s %s: %lu\n", results[i].operation, results[i].result, results[i].count);
+    }
+}
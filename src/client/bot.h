@@ -0,0 +1,62 @@
+/**
+ * @file bot.h
+ * @brief Declares the statistics reported by the client's bot mode.
+ *
+ * In bot mode the client sends the commands of a script without waiting for the server's
+ * answers and without displaying the messages it receives. It only counts them, and prints
+ * the throughput and the failed RESPONSE messages when the script is finished.
+ */
+
+#ifndef BOT_H
+#define BOT_H
+
+#include <stddef.h>
+
+/**
+ * @brief Resets the statistics and starts the clock.
+ *
+ * @return void
+ */
+void bot_start();
+
+/**
+ * @brief Counts a command read from the script.
+ *
+ * @return void
+ */
+void bot_record_command();
+
+/**
+ * @brief Counts a `send` call and the bytes it wrote.
+ *
+ * @param bytes The number of bytes written.
+ *
+ * @return void
+ */
+void bot_record_send(size_t bytes);
+
+/**
+ * @brief Counts a message received from the server.
+ *
+ * @return void
+ */
+void bot_record_message();
+
+/**
+ * @brief Counts a RESPONSE message that did not report a success.
+ *
+ * @param operation The operation the response refers to.
+ * @param result The result reported by the server.
+ *
+ * @return void
+ */
+void bot_record_response(const char *operation, const char *result);
+
+/**
+ * @brief Prints the throughput and the failed responses.
+ *
+ * @return void
+ */
+void bot_report();
+
+#endif // BOT_H
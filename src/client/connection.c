@@ -7,8 +7,11 @@
 
 int sockfd = 0;  
 char user_name[32];  
+int use_compression = 0;
 volatile sig_atomic_t indicator = 0;  
 
+static struct sockaddr_in server_addr;
+
 /**
  * @brief Connects the client to the server.
  *
@@ -20,8 +23,6 @@ volatile sig_atomic_t indicator = 0;
  * @return void
  */
 void connect_to_server(const char *ip, int port) {
-    struct sockaddr_in server_addr;
-
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
         perror("socket error");
@@ -39,6 +40,28 @@ void connect_to_server(const char *ip, int port) {
     }
 }
 
+/**
+ * @brief Opens a new connection to the server the client first connected to.
+ *
+ * The previous socket is closed and replaced, so senders pick up the new connection.
+ *
+ * @return int 0 on success, -1 if the server could not be reached.
+ */
+int reconnect_to_server() {
+    int new_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (new_sockfd < 0) {
+        return -1;
+    }
+    if (connect(new_sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        close(new_sockfd);
+        return -1;
+    }
+    close(sockfd);
+    sockfd = new_sockfd;
+    return 0;
+}
+
 /**
  * @brief Closes the client's socket connection.
  *
@@ -29,6 +29,13 @@ extern char user_name[32];
  * This buffer stores the username entered by the client, which will be sent to the server.
  */
 
+extern int use_compression;
+/**
+ * @brief Compression request flag.
+ *
+ * When set, the client asks the server for deflate compression in its IDENTIFY message.
+ */
+
 extern volatile sig_atomic_t indicator;
 /**
  * @brief Signal indicator.
@@ -50,6 +57,16 @@ extern volatile sig_atomic_t indicator;
  */
 void connect_to_server(const char *ip, int port);
 
+/**
+ * @brief Reconnects to the server after the connection dropped.
+ *
+ * This function opens a new connection to the address given to `connect_to_server` and
+ * replaces the socket with it.
+ *
+ * @return int 0 on success, -1 if the server could not be reached.
+ */
+int reconnect_to_server();
+
 /**
  * @brief Closes the connection with the server.
  *
@@ -0,0 +1,162 @@
+/**
+ * @file input.c
+ * @brief Implements the line editor reading the user's commands.
+ */
+#include "input.h"
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define INPUT_PENDING_SIZE 65536
+#define KEY_CTRL_D 4
+#define KEY_BACKSPACE 8
+#define KEY_CTRL_U 21
+#define KEY_ESCAPE 27
+#define KEY_DELETE 127
+
+static char pending[INPUT_PENDING_SIZE];
+static size_t pending_length = 0;
+static size_t pending_offset = 0;
+static char current[INPUT_LINE_SIZE];
+static size_t current_length = 0;
+static int interactive = 0;
+static int escape_state = 0;
+static struct termios saved_termios;
+
+/**
+ * @brief Prepares standard input for the event loop.
+ *
+ * A terminal is switched to non-canonical mode without echo. Signals stay enabled, so
+ * Ctrl-C still interrupts the client.
+ *
+ * @return int 1 if standard input is an interactive terminal, 0 otherwise.
+ */
+int input_init() {
+    struct termios raw;
+
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved_termios) < 0) {
+        return 0;
+    }
+    raw = saved_termios;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) < 0) {
+        return 0;
+    }
+    interactive = 1;
+    return 1;
+}
+
+/**
+ * @brief Restores the terminal settings saved by `input_init`.
+ *
+ * @return void
+ */
+void input_restore() {
+    if (interactive) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+    }
+}
+
+/**
+ * @brief Reads the bytes available on standard input.
+ *
+ * @return int The number of bytes read, 0 at end of input, or -1 on error.
+ */
+int input_fill() {
+    ssize_t received;
+
+    if (pending_offset > 0) {
+        memmove(pending, pending + pending_offset, pending_length - pending_offset);
+        pending_length -= pending_offset;
+        pending_offset = 0;
+    }
+    if (pending_length == sizeof(pending)) {
+        return -1;
+    }
+    received = read(STDIN_FILENO, pending + pending_length, sizeof(pending) - pending_length);
+    if (received > 0) {
+        pending_length += (size_t)received;
+    }
+    return (int)received;
+}
+
+/**
+ * @brief Removes the last UTF-8 character of the current line.
+ *
+ * @return void
+ */
+static void erase_character() {
+    while (current_length > 0) {
+        unsigned char byte = (unsigned char)current[--current_length];
+        if ((byte & 0xC0) != 0x80) {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Extracts the next complete line from the bytes read so far.
+ *
+ * Escape sequences such as arrow keys are ignored in interactive mode.
+ *
+ * @param line The buffer receiving the line, without its newline.
+ * @param size The size of the buffer.
+ *
+ * @return int 1 if a line was extracted, 0 if no complete line is available yet.
+ */
+int input_next_line(char *line, size_t size) {
+    while (pending_offset < pending_length) {
+        unsigned char byte = (unsigned char)pending[pending_offset++];
+
+        if (byte == '\n' || (interactive && byte == '\r')) {
+            size_t length = current_length < size - 1 ? current_length : size - 1;
+            memcpy(line, current, length);
+            line[length] = '\0';
+            current_length = 0;
+            return 1;
+        }
+        if (!interactive) {
+            if (current_length < sizeof(current)) {
+                current[current_length++] = (char)byte;
+            }
+            continue;
+        }
+
+        if (escape_state == 1) {
+            escape_state = (byte == '[' || byte == 'O') ? 2 : 0;
+        } else if (escape_state == 2) {
+            if (byte >= 0x40 && byte <= 0x7E) {
+                escape_state = 0;
+            }
+        } else if (byte == KEY_ESCAPE) {
+            escape_state = 1;
+        } else if (byte == KEY_DELETE || byte == KEY_BACKSPACE) {
+            erase_character();
+        } else if (byte == KEY_CTRL_U) {
+            current_length = 0;
+        } else if (byte == KEY_CTRL_D) {
+            if (current_length == 0) {
+                strncpy(line, "/exit", size - 1);
+                line[size - 1] = '\0';
+                return 1;
+            }
+        } else if ((byte >= 0x20 || byte == '\t') && current_length < sizeof(current) - 1) {
+            current[current_length++] = (char)byte;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the line currently being typed.
+ *
+ * @param length Receives the length of the line in bytes.
+ *
+ * @return const char* The partial line, not null-terminated.
+ */
+const char *input_current(size_t *length) {
+    *length = current_length;
+    return current;
+}
@@ -0,0 +1,60 @@
+/**
+ * @file input.h
+ * @brief Declares the line editor reading the user's commands.
+ *
+ * When standard input is a terminal it is switched to non-canonical mode without echo, and
+ * the client edits the line itself so it can be drawn again below incoming messages. When
+ * standard input is a pipe or a file, lines are read as they are.
+ */
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+
+#define INPUT_LINE_SIZE 2048
+
+/**
+ * @brief Prepares standard input for the event loop.
+ *
+ * @return int 1 if standard input is an interactive terminal, 0 otherwise.
+ */
+int input_init();
+
+/**
+ * @brief Restores the terminal settings saved by `input_init`.
+ *
+ * @return void
+ */
+void input_restore();
+
+/**
+ * @brief Reads the bytes available on standard input.
+ *
+ * @return int The number of bytes read, 0 at end of input, or -1 on error.
+ */
+int input_fill();
+
+/**
+ * @brief Extracts the next complete line from the bytes read so far.
+ *
+ * Editing keys are applied while scanning: backspace erases a character, Ctrl-U erases the
+ * line, and Ctrl-D on an empty line is reported as `/exit`.
+ *
+ * @param line The buffer receiving the line, without its newline.
+ * @param size The size of the buffer.
+ *
+ * @return int 1 if a line was extracted, 0 if no complete line is available yet.
+ */
+int input_next_line(char *line, size_t size);
+
+/**
+ * @brief Returns the line currently being typed.
+ *
+ * @param length Receives the length of the line in bytes.
+ *
+ * @return const char* The partial line, not null-terminated.
+ */
+const char *input_current(size_t *length);
+
+#endif // INPUT_H
@@ -2,37 +2,101 @@
  * @file main.c
  * @brief Entry point for the client-side application.
  *
- * This program allows a client to connect to a server, send and receive messages in parallel 
- * using threads, and disconnect gracefully when finished. It requires an IP address and port 
- * to establish the connection.
+ * This program allows a client to connect to a server, send and receive messages from a
+ * single event loop, and disconnect gracefully when finished. It requires an IP address and
+ * port to establish the connection.
  */
 #include "connection.h"
 #include "messaging.h"
 #include "tui.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
 #include <string.h>
+#include <unistd.h>
+
+/**
+ * @brief Asks the event loop to leave the chat when the user presses Ctrl-C.
+ *
+ * @param signal The signal number.
+ *
+ * @return void
+ */
+static void handle_interrupt(int signal) {
+    (void)signal;
+    indicator = 1;
+}
+
+/**
+ * @brief Prints the command-line usage of the client.
+ *
+ * @param program The name the client was started with.
+ *
+ * @return void
+ */
+static void print_usage(const char *program) {
+    printf("Usage: %s <ip> <port> [--compress] [--bot <script>]\n", program);
+}
 
 /**
  * @brief Main function that starts the client application.
  *
- * The program expects two command-line arguments: the server's IP address and port number. 
- * It prompts the user for a username, establishes a connection to the server, and then 
- * creates two threads for sending and receiving messages. The connection is closed when 
- * the user terminates the session.
+ * The program expects two command-line arguments: the server's IP address and port number,
+ * optionally followed by `--compress` to request a compressed connection. It prompts the
+ * user for a username, establishes a connection to the server, and then runs the event loop
+ * sending and receiving messages. The connection is closed when the user terminates the
+ * session. With `--bot`, the username and the commands are read from a script instead
+ * (`-` for standard input), and the client reports its throughput when the script ends.
  *
  * @param argc Number of command-line arguments.
  * @param argv Array of command-line argument strings.
  * @return int Returns EXIT_SUCCESS on successful execution or EXIT_FAILURE on error.
  */
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        printf("Usage: %s <ip> <port>\n", argv[0]);
+    static const struct option long_options[] = {
+        {"compress", no_argument, NULL, 'c'},
+        {"bot", required_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *script = NULL;
+    int option;
+
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'c':
+            use_compression = 1;
+            break;
+        case 'b':
+            script = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2) {
+        print_usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    char *ip = argv[1];
-    int port = atoi(argv[2]);
+    char *ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
+
+    if (script && strcmp(script, "-") != 0) {
+        int script_fd = open(script, O_RDONLY);
+        if (script_fd < 0 || dup2(script_fd, STDIN_FILENO) < 0) {
+            perror("script open error");
+            return EXIT_FAILURE;
+        }
+        close(script_fd);
+    }
 
-    printf("What's your name?: ");
+    // The event loop reads standard input directly, so nothing may be left buffered by stdio.
+    setvbuf(stdin, NULL, _IONBF, 0);
+    if (!script) {
+        printf("What's your name?: ");
+    }
     if (fgets(user_name, sizeof(user_name), stdin) == NULL) {
         perror("fgets error");
         return EXIT_FAILURE;
@@ -40,22 +104,17 @@ int main(int argc, char **argv) {
     user_name[strcspn(user_name, "\n")] = '\0';  
 
     connect_to_server(ip, port);
-    show_commands_menu();
+    signal(SIGINT, handle_interrupt);
 
-    if (pthread_create(&send_msg_thread, NULL, (void*)send_msg, NULL) != 0) {
-        perror("pthread_create send_msg error");
+    if (script) {
+        run_bot();
         close_connection();
-        return EXIT_FAILURE;
-    }
-
-    if (pthread_create(&recv_msg_thread, NULL, (void*)recv_msg, NULL) != 0) {
-        perror("pthread_create recv_msg error");
-        close_connection();
-        return EXIT_FAILURE;
+        return EXIT_SUCCESS;
     }
 
-    pthread_join(send_msg_thread, NULL);
-    pthread_join(recv_msg_thread, NULL);
+    show_commands_menu();
+    fflush(stdout);
+    run_client();
 
     printf("\nCome back soon!\n");
     close_connection();
@@ -1,202 +1,933 @@
 /**
  * @file messaging.c
  * @brief Manages the sending and receiving of messages for the client.
+ *
+ * The client runs a single-threaded event loop: `poll` waits on standard input and the
+ * server socket, every complete line and message available in a tick is handled, and the
+ * resulting output is written to the terminal in one batch at the end of the tick.
  */
 #include "messaging.h"
 #include "connection.h"
+#include "bot.h"
+#include "input.h"
+#include "render.h"
+#include "transfer.h"
+#include "../common/clock.h"
+#include "../common/compression.h"
+#include "../common/framing.h"
 #include "../libs/cJSON/cJSON.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
-pthread_t send_msg_thread;
-pthread_t recv_msg_thread;
+#define RECV_BUFFER_SIZE 65536
+#define RECV_BUFFER_MAX_SIZE (16 * 1024 * 1024)
+#define ACK_INTERVAL 16
+#define RECONNECT_ATTEMPTS 60
+#define RECONNECT_DELAY_MS 1000
+#define BOT_BATCH_SIZE 65536
+
+static char *recv_buffer = NULL;
+static size_t recv_capacity = 0;
+static size_t recv_length = 0;
+static int skipping = 0;
+static int skip_depth = 0;
+static int skip_in_string = 0;
+static int skip_escaped = 0;
+static int compression_active = 0;
+static decompressor_t decompressor;
+
+static char session_token[64] = "";
+static unsigned long last_seq = 0;
+static unsigned long acked_seq = 0;
+static int exiting = 0;
+static int connected = 1;
+static int reconnect_attempts = 0;
+static long long reconnect_at = 0;
+
+static int bot_mode = 0;
+static char *batch = NULL;
+static size_t batch_length = 0;
+static size_t batch_size = 0;
 
 /**
- * @brief Sends messages to the server.
+ * @brief Appends a message to the batch of messages waiting to be sent in bot mode.
+ *
+ * @param message The encoded message.
+ * @param length The length of the message in bytes.
  *
- * This function manages user input and sends messages in JSON format to the server,
- * including public messages, private messages, status changes, and user list requests.
- * It also handles the client's disconnection.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int append_to_batch(const char *message, size_t length) {
+    if (batch_length + length > batch_size) {
+        size_t size = batch_size ? batch_size : BOT_BATCH_SIZE;
+        char *grown;
+        while (size < batch_length + length) {
+            size *= 2;
+        }
+        grown = realloc(batch, size);
+        if (!grown) {
+            return -1;
+        }
+        batch = grown;
+        batch_size = size;
+    }
+    memcpy(batch + batch_length, message, length);
+    batch_length += length;
+    return 0;
+}
+
+/**
+ * @brief Writes as much of the pending batch as the socket accepts with a single `send`.
  *
- * @return void*
+ * @return int 0 on success, -1 if the connection failed.
  */
-void* send_msg() {
-    char buffer[2048] = {};
-    char message[2048] = {};
+static int flush_batch() {
+    ssize_t sent = send(sockfd, batch, batch_length, MSG_NOSIGNAL);
 
+    if (sent < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    bot_record_send((size_t)sent);
+    memmove(batch, batch + sent, batch_length - (size_t)sent);
+    batch_length -= (size_t)sent;
+    return 0;
+}
+
+/**
+ * @brief Sends a message to the server.
+ *
+ * Messages typed while the client is reconnecting are dropped with a notice. In bot mode
+ * the message is appended to the pending batch instead.
+ *
+ * @param message A null-terminated JSON message.
+ *
+ * @return void
+ */
+static void send_to_server(const char *message) {
+    if (!connected) {
+        render_printf("Not connected to the server, the message was not sent.\n");
+        return;
+    }
+    if (bot_mode) {
+        if (append_to_batch(message, strlen(message)) < 0) {
+            fprintf(stderr, "Out of memory, the message was not sent.\n");
+        }
+        return;
+    }
+    send(sockfd, message, strlen(message), MSG_NOSIGNAL);
+}
+
+/**
+ * @brief Builds a JSON message, sends it to the server and frees it.
+ *
+ * @param json The message to send.
+ *
+ * @return void
+ */
+static void send_json(cJSON *json) {
+    char *json_string = cJSON_PrintUnformatted(json);
+
+    if (json_string) {
+        send_to_server(json_string);
+        free(json_string);
+    }
+    cJSON_Delete(json);
+}
+
+/**
+ * @brief Identifies the user and, unless running a script, asks for a resumable session.
+ *
+ * @return void
+ */
+static void send_identify() {
     cJSON *json_identify = cJSON_CreateObject();
     cJSON_AddStringToObject(json_identify, "type", "IDENTIFY");
     cJSON_AddStringToObject(json_identify, "username", user_name);
-    const char *json_identify_string = cJSON_PrintUnformatted(json_identify);
-    send(sockfd, json_identify_string, strlen(json_identify_string), 0);
-    cJSON_Delete(json_identify);
+    if (use_compression) {
+        cJSON_AddStringToObject(json_identify, "compression", COMPRESSION_NAME_DEFLATE);
+    }
+    if (!bot_mode) {
+        cJSON_AddBoolToObject(json_identify, "resume", 1);
+    }
+    send_json(json_identify);
+}
 
-    while (1) {
-        if (fgets(message, 2048, stdin) == NULL) {
-            if (feof(stdin)) {
-                break;
+/**
+ * @brief Asks the server to resume the session after a reconnection.
+ *
+ * @return void
+ */
+static void send_resume() {
+    cJSON *json_resume = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_resume, "type", "RESUME");
+    cJSON_AddStringToObject(json_resume, "username", user_name);
+    cJSON_AddStringToObject(json_resume, "session", session_token);
+    cJSON_AddNumberToObject(json_resume, "seq", (double)last_seq);
+    if (use_compression) {
+        cJSON_AddStringToObject(json_resume, "compression", COMPRESSION_NAME_DEFLATE);
+    }
+    send_json(json_resume);
+}
+
+/**
+ * @brief Acknowledges the received messages once enough of them are pending.
+ *
+ * @return void
+ */
+static void send_ack_if_needed() {
+    if (last_seq - acked_seq < ACK_INTERVAL) {
+        return;
+    }
+    cJSON *json_ack = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_ack, "type", "ACK");
+    cJSON_AddNumberToObject(json_ack, "seq", (double)last_seq);
+    send_json(json_ack);
+    acked_seq = last_seq;
+}
+
+/**
+ * @brief Sends a command typed by the user to the server.
+ *
+ * This function turns a line of user input into a JSON message for the server, including
+ * public messages, private messages, status changes, and user list requests. It also
+ * starts file transfers and handles the client's disconnection.
+ *
+ * @param message The line typed by the user.
+ *
+ * @return int 1 if the user left the chat, 0 otherwise.
+ */
+static int handle_command(char *message) {
+    if (message[0] == '/') {
+        if (strncmp(message, "/public ", 8) == 0) {
+            char *public_text = message + 8;
+            cJSON *json_public = cJSON_CreateObject();
+            cJSON_AddStringToObject(json_public, "type", "PUBLIC_TEXT");
+            cJSON_AddStringToObject(json_public, "text", public_text);
+            send_json(json_public);
+
+        } else if (strncmp(message, "/status ", 8) == 0) {
+            char *status = message + 8;
+            cJSON *json_status = cJSON_CreateObject();
+            cJSON_AddStringToObject(json_status, "type", "STATUS");
+            cJSON_AddStringToObject(json_status, "status", status);
+            send_json(json_status);
+
+        } else if (strcmp(message, "/users") == 0) {
+            cJSON *json_users = cJSON_CreateObject();
+            cJSON_AddStringToObject(json_users, "type", "USERS");
+            send_json(json_users);
+
+        } else if (strncmp(message, "/private ", 9) == 0) {
+            char *msg_parts = message + 9;
+            char *recipient = strtok(msg_parts, " ");
+            char *private_text = strtok(NULL, "");
+
+            if (recipient && private_text) {
+                cJSON *json_private = cJSON_CreateObject();
+                cJSON_AddStringToObject(json_private, "type", "TEXT");
+                cJSON_AddStringToObject(json_private, "username", recipient);  
+                cJSON_AddStringToObject(json_private, "text", private_text);
+                send_json(json_private);
             } else {
-                continue;
+                render_printf("Usage: /private [username] [message]\n");
+            }
+
+        } else if (strncmp(message, "/send ", 6) == 0) {
+            char *path = strtok(message + 6, " ");
+            char *recipient = strtok(NULL, " ");
+
+            if (bot_mode) {
+                fprintf(stderr, "Files can't be sent from a script.\n");
+            } else if (!connected) {
+                render_printf("Not connected to the server, the file was not sent.\n");
+            } else if (path) {
+                transfer_send_file(path, recipient);
+            } else {
+                render_printf("Usage: /send [file] [username]\n");
+            }
+
+        } else if (strncmp(message, "/get ", 5) == 0) {
+            char *id = strtok(message + 5, " ");
+
+            if (bot_mode) {
+                fprintf(stderr, "Files can't be received by a script.\n");
+            } else if (!connected) {
+                render_printf("Not connected to the server, the file was not requested.\n");
+            } else if (id) {
+                transfer_get_file(id);
+            } else {
+                render_printf("Usage: /get [id]\n");
             }
+
+        } else if (strcmp(message, "/exit") == 0) {
+            exiting = 1;
+            cJSON *json_disconnect = cJSON_CreateObject();
+            cJSON_AddStringToObject(json_disconnect, "type", "DISCONNECT");
+            send_json(json_disconnect);
+    
+            return 1;
+        }
+        else {
+            render_printf("Unknown command. Try again.\n");
+        }
+    } else {
+        cJSON *json_public = cJSON_CreateObject();
+        cJSON_AddStringToObject(json_public, "type", "PUBLIC_TEXT");
+        cJSON_AddStringToObject(json_public, "text", message);
+        send_json(json_public);
+    }
+    return 0;
+}
+
+/**
+ * @brief Switches the receiver to compressed frames when the server confirmed compression.
+ *
+ * @param operation The operation of a RESPONSE message.
+ * @param compression The compression named in the response, or NULL.
+ *
+ * @return void
+ */
+static void start_decompression(const cJSON *operation, const cJSON *compression) {
+    if (cJSON_IsString(operation) &&
+        (strcmp(operation->valuestring, "IDENTIFY") == 0 || strcmp(operation->valuestring, "RESUME") == 0) &&
+        cJSON_IsString(compression) && compression_from_name(compression->valuestring) != COMPRESSION_NONE) {
+        if (decompressor_init(&decompressor) == 0) {
+            compression_active = 1;
+        } else {
+            render_printf("Error initializing decompression.\n");
+        }
+    }
+}
+
+/**
+ * @brief Counts a message received while running a script.
+ *
+ * Nothing is displayed: RESPONSE messages that don't report a success are kept for the
+ * final report, and everything else is only counted.
+ *
+ * @param json_msg The parsed message.
+ *
+ * @return void
+ */
+static void handle_bot_message(cJSON *json_msg) {
+    cJSON *type = cJSON_GetObjectItemCaseSensitive(json_msg, "type");
+
+    bot_record_message();
+    if (cJSON_IsString(type) && strcmp(type->valuestring, "RESPONSE") == 0) {
+        cJSON *operation = cJSON_GetObjectItemCaseSensitive(json_msg, "operation");
+        cJSON *result = cJSON_GetObjectItemCaseSensitive(json_msg, "result");
+        if (cJSON_IsString(operation) && cJSON_IsString(result) && strcmp(result->valuestring, "SUCCESS") != 0) {
+            bot_record_response(operation->valuestring, result->valuestring);
+        }
+        start_decompression(operation, cJSON_GetObjectItemCaseSensitive(json_msg, "compression"));
+    }
+}
+
+/**
+ * @brief Displays a message received from the server.
+ *
+ * Depending on the message type (public text, private message, status update, or disconnection),
+ * it formats and prints the received message to the terminal. An IDENTIFY or RESUME response
+ * that confirms compression switches the receiver to compressed frames. Numbered messages
+ * that were already received before a reconnection are skipped.
+ *
+ * @param json_msg The parsed message.
+ *
+ * @return void
+ */
+static void handle_server_message(cJSON *json_msg) {
+    cJSON *type = cJSON_GetObjectItemCaseSensitive(json_msg, "type");
+    cJSON *seq = cJSON_GetObjectItemCaseSensitive(json_msg, "seq");
+
+    if (cJSON_IsNumber(seq)) {
+        unsigned long number = (unsigned long)seq->valuedouble;
+        if (number <= last_seq) {
+            return;
         }
+        if (last_seq && number > last_seq + 1) {
+            render_printf("⚠️ %lu message(s) were lost while disconnected\n", number - last_seq - 1);
+        }
+        last_seq = number;
+    }
+
+    if (cJSON_IsString(type)) {
+        if (strcmp(type->valuestring, "PUBLIC_TEXT_FROM") == 0) {
+            cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
+            cJSON *text = cJSON_GetObjectItemCaseSensitive(json_msg, "text");
+            if (cJSON_IsString(username) && cJSON_IsString(text)) {
+                render_printf("📩 [Public] %s 🗣️: %s\n", username->valuestring, text->valuestring);
+            }
+
+        } else if (strcmp(type->valuestring, "TEXT_FROM") == 0) {
+            cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
+            cJSON *text = cJSON_GetObjectItemCaseSensitive(json_msg, "text");
+            if (cJSON_IsString(username) && cJSON_IsString(text)) {
+                render_printf("📩 [Private] %s 🗣️: %s\n", username->valuestring, text->valuestring);
+            }
+
+        } else if (strcmp(type->valuestring, "MENTION") == 0) {
+            cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
+            cJSON *text = cJSON_GetObjectItemCaseSensitive(json_msg, "text");
+            if (cJSON_IsString(username) && cJSON_IsString(text)) {
+                render_printf("🔔 [Mention] %s 🗣️: %s\n", username->valuestring, text->valuestring);
+            } else if (cJSON_IsString(username)) {
+                render_printf("🔔 %s mentioned you\a\n", username->valuestring);
+            }
+
+        } else if (strcmp(type->valuestring, "NEW_STATUS") == 0) {
+            cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
+            cJSON *status = cJSON_GetObjectItemCaseSensitive(json_msg, "status");
+            if (cJSON_IsString(username) && cJSON_IsString(status)) {
+                render_printf("🔄 %s is now %s\n", username->valuestring, status->valuestring);
+            }
 
-        new_line_trim(message, 2048);
-
-        if (message[0] == '/') {
-            if (strncmp(message, "/public ", 8) == 0) {
-                char *public_text = message + 8;
-                cJSON *json_public = cJSON_CreateObject();
-                cJSON_AddStringToObject(json_public, "type", "PUBLIC_TEXT");
-                cJSON_AddStringToObject(json_public, "text", public_text);
-                const char *json_public_string = cJSON_PrintUnformatted(json_public);
-                send(sockfd, json_public_string, strlen(json_public_string), 0);
-                cJSON_Delete(json_public);
-
-            } else if (strncmp(message, "/status ", 8) == 0) {
-                char *status = message + 8;
-                cJSON *json_status = cJSON_CreateObject();
-                cJSON_AddStringToObject(json_status, "type", "STATUS");
-                cJSON_AddStringToObject(json_status, "status", status);
-                const char *json_status_string = cJSON_PrintUnformatted(json_status);
-                send(sockfd, json_status_string, strlen(json_status_string), 0);
-                cJSON_Delete(json_status);
-
-            } else if (strcmp(message, "/users") == 0) {
-                cJSON *json_users = cJSON_CreateObject();
-                cJSON_AddStringToObject(json_users, "type", "USERS");
-                const char *json_users_string = cJSON_PrintUnformatted(json_users);
-                send(sockfd, json_users_string, strlen(json_users_string), 0);
-                cJSON_Delete(json_users);
-
-            } else if (strncmp(message, "/private ", 9) == 0) {
-                char *msg_parts = message + 9;
-                char *recipient = strtok(msg_parts, " ");
-                char *private_text = strtok(NULL, "");
-
-                if (recipient && private_text) {
-                    cJSON *json_private = cJSON_CreateObject();
-                    cJSON_AddStringToObject(json_private, "type", "TEXT");
-                    cJSON_AddStringToObject(json_private, "username", recipient);  
-                    cJSON_AddStringToObject(json_private, "text", private_text);
-                    const char *json_private_string = cJSON_PrintUnformatted(json_private);
-                    send(sockfd, json_private_string, strlen(json_private_string), 0);
-                    cJSON_Delete(json_private);
+        } else if (strcmp(type->valuestring, "USER_LIST") == 0) {
+            cJSON *users = cJSON_GetObjectItemCaseSensitive(json_msg, "users");
+            if (cJSON_IsObject(users)) {
+                render_printf("👥 Connected Users:\n");
+                cJSON *user;
+                cJSON_ArrayForEach(user, users) {
+                    render_printf(" - %s: %s\n", user->string, user->valuestring);
+                }
+            }
+
+        } else if (strcmp(type->valuestring, "NEW_USER") == 0) {
+            cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
+            if (cJSON_IsString(username)) {
+                render_printf("🎉 New user connected: %s\n", username->valuestring);  
+            }
+        } else if (strcmp(type->valuestring, "RESPONSE") == 0) {
+            cJSON *operation = cJSON_GetObjectItemCaseSensitive(json_msg, "operation");
+            cJSON *result = cJSON_GetObjectItemCaseSensitive(json_msg, "result");
+            cJSON *extra = cJSON_GetObjectItemCaseSensitive(json_msg, "extra");
+            cJSON *compression = cJSON_GetObjectItemCaseSensitive(json_msg, "compression");
+            cJSON *session = cJSON_GetObjectItemCaseSensitive(json_msg, "session");
+            if (cJSON_IsString(operation) && strcmp(operation->valuestring, "IDENTIFY") == 0 && cJSON_IsString(session)) {
+                snprintf(session_token, sizeof(session_token), "%s", session->valuestring);
+            }
+            if (cJSON_IsString(operation) && strcmp(operation->valuestring, "RESUME") == 0 && cJSON_IsString(result)) {
+                cJSON *gap = cJSON_GetObjectItemCaseSensitive(json_msg, "gap");
+                if (strcmp(result->valuestring, "SUCCESS") == 0 && cJSON_IsNumber(gap)) {
+                    render_printf("🔄 Reconnected, but %.0f message(s) sent meanwhile were lost\n", gap->valuedouble);
+                } else if (strcmp(result->valuestring, "SUCCESS") == 0) {
+                    render_printf("🔄 Reconnected, session resumed\n");
                 } else {
-                    printf("Usage: /private [username] [message]\n");
+                    render_printf("🔄 Reconnected, but the session expired. Identifying again...\n");
+                    session_token[0] = '\0';
+                    last_seq = 0;
+                    acked_seq = 0;
+                    send_identify();
+                }
+            }
+            if (cJSON_IsString(operation) && strcmp(operation->valuestring, "TEXT") == 0 &&
+                cJSON_IsString(result) && cJSON_IsString(extra)) {
+                if (strcmp(result->valuestring, "QUEUED") == 0) {
+                    render_printf("📭 %s is offline, the message will be delivered when they reconnect\n", extra->valuestring);
+                } else if (strcmp(result->valuestring, "NO_SUCH_USER") == 0) {
+                    render_printf("User %s does not exist\n", extra->valuestring);
                 }
+            }
+            if (cJSON_IsString(operation) && strncmp(operation->valuestring, "FILE_", 5) == 0) {
+                transfer_handle_response(json_msg);
+            }
+            if (cJSON_IsString(operation) && strcmp(operation->valuestring, "CONNECT") == 0 && cJSON_IsString(result)) {
+                render_printf("⛔ The server refused the connection (%s)\n", result->valuestring);
+            }
+            if (cJSON_IsString(operation) && strcmp(operation->valuestring, "IDENTIFY") == 0 &&
+                cJSON_IsString(result) && strcmp(result->valuestring, "SUCCESS") != 0) {
+                render_printf("The server refused the username (%s)\n", result->valuestring);
+            }
+            start_decompression(operation, compression);
+        } else if (strcmp(type->valuestring, "FILE") == 0) {
+            cJSON *id = cJSON_GetObjectItemCaseSensitive(json_msg, "id");
+            cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
+            cJSON *name = cJSON_GetObjectItemCaseSensitive(json_msg, "name");
+            cJSON *size = cJSON_GetObjectItemCaseSensitive(json_msg, "size");
+            if (cJSON_IsString(id) && cJSON_IsString(username) && cJSON_IsString(name) && cJSON_IsNumber(size)) {
+                render_printf("📎 %s shared %s (%.0f bytes), type /get %s to download it\n", username->valuestring,
+                              name->valuestring, size->valuedouble, id->valuestring);
+            }
 
-            } else if (strcmp(message, "/exit") == 0) {
-                cJSON *json_disconnect = cJSON_CreateObject();
-                cJSON_AddStringToObject(json_disconnect, "type", "DISCONNECT");
-                const char *disconnect_str = cJSON_PrintUnformatted(json_disconnect);
-    
-                send(sockfd, disconnect_str, strlen(disconnect_str), 0);
-                cJSON_Delete(json_disconnect);
-    
-                close_connection();
-                break;
+        } else if (strcmp(type->valuestring, "FILE_DATA") == 0) {
+            transfer_handle_data(json_msg);
+        } else if (strcmp(type->valuestring, "DISCONNECTED") == 0) {
+            cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
+            if (cJSON_IsString(username)) {
+                render_printf("❌ User disconnected: %s\n", username->valuestring);  
             }
-            else {
-                printf("Unknown command. Try again.\n");
+        }
+    }
+}
+
+/**
+ * @brief Parses and displays the JSON messages of a decompressed frame.
+ *
+ * A frame usually holds a single message, but batches such as offline messages hold
+ * several messages back to back. A FILE_DATA header is followed by the bytes of its chunk.
+ *
+ * @param message The message text.
+ * @param length The length of the text in bytes.
+ *
+ * @return void
+ */
+static void handle_server_text(const char *message, size_t length) {
+    while (length > 0) {
+        long message_length;
+        cJSON *json_msg;
+
+        if (transfer_data_pending()) {
+            size_t consumed = transfer_receive(message, length);
+            message += consumed;
+            length -= consumed;
+            continue;
+        }
+        message_length = json_frame_length(message, length);
+        if (message_length <= 0) {
+            render_printf("Error parsing received message.\n");
+            return;
+        }
+        json_msg = cJSON_ParseWithLength(message, (size_t)message_length);
+        if (json_msg != NULL) {
+            if (bot_mode) {
+                handle_bot_message(json_msg);
+            } else {
+                handle_server_message(json_msg);
             }
+            cJSON_Delete(json_msg);
         } else {
-            cJSON *json_public = cJSON_CreateObject();
-            cJSON_AddStringToObject(json_public, "type", "PUBLIC_TEXT");
-            cJSON_AddStringToObject(json_public, "text", message);
-            const char *json_public_string = cJSON_PrintUnformatted(json_public);
-            send(sockfd, json_public_string, strlen(json_public_string), 0);
-            cJSON_Delete(json_public);
+            render_printf("Error parsing received message.\n");
         }
+        message += message_length;
+        length -= (size_t)message_length;
+    }
+}
+
+/**
+ * @brief Doubles the capacity of the receive buffer, up to RECV_BUFFER_MAX_SIZE.
+ *
+ * @return int 0 on success, -1 if the buffer is already at its largest or out of memory.
+ */
+static int grow_recv_buffer() {
+    size_t capacity = recv_capacity ? recv_capacity * 2 : RECV_BUFFER_SIZE;
+    char *grown;
 
-        memset(buffer, 0, 2048);  
+    if (capacity > RECV_BUFFER_MAX_SIZE) {
+        return -1;
+    }
+    grown = realloc(recv_buffer, capacity);
+    if (!grown) {
+        return -1;
     }
+    recv_buffer = grown;
+    recv_capacity = capacity;
+    return 0;
+}
 
-    pthread_exit(NULL);
+/**
+ * @brief Discards a plain JSON message too large for the receive buffer, up to its end.
+ *
+ * The message is scanned for its closing brace like json_frame_length does, but the nesting
+ * and string state is kept across calls, so the message may span any number of `recv`.
+ *
+ * @param data The received bytes, starting inside the message or at its beginning.
+ * @param length The number of bytes available.
+ *
+ * @return size_t The number of bytes that belonged to the message.
+ */
+static size_t skip_oversized(const char *data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        char c = data[i];
+
+        if (skip_escaped) {
+            skip_escaped = 0;
+        } else if (skip_in_string) {
+            if (c == '\\') {
+                skip_escaped = 1;
+            } else if (c == '"') {
+                skip_in_string = 0;
+            }
+        } else if (c == '"') {
+            skip_in_string = 1;
+        } else if (c == '{' || c == '[') {
+            skip_depth++;
+        } else if ((c == '}' || c == ']') && --skip_depth == 0) {
+            skipping = 0;
+            return i + 1;
+        }
+    }
+    return length;
 }
 
 /**
- * @brief Receives messages from the server.
+ * @brief Consumes every complete message in the receive buffer.
  *
- * This function runs in an infinite loop to receive messages from the server. 
- * Depending on the message type (public text, private message, status update, or disconnection),
- * it formats and prints the received message to the terminal.
- *
- * @return void*
- */
-void* recv_msg() {
-    char buffer[2048] = {};
-
-    while (1) {
-        int received = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-        if (received > 0) {
-            buffer[received] = '\0';
-
-            cJSON *json_msg = cJSON_Parse(buffer);
-
-            if (json_msg != NULL) {
-                cJSON *type = cJSON_GetObjectItemCaseSensitive(json_msg, "type");
-
-                if (cJSON_IsString(type)) {
-                    if (strcmp(type->valuestring, "PUBLIC_TEXT_FROM") == 0) {
-                        cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
-                        cJSON *text = cJSON_GetObjectItemCaseSensitive(json_msg, "text");
-                        if (cJSON_IsString(username) && cJSON_IsString(text)) {
-                            printf("📩 [Public] %s 🗣️: %s\n", username->valuestring, text->valuestring);
-                        }
-
-                    } else if (strcmp(type->valuestring, "TEXT_FROM") == 0) {
-                        cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
-                        cJSON *text = cJSON_GetObjectItemCaseSensitive(json_msg, "text");
-                        if (cJSON_IsString(username) && cJSON_IsString(text)) {
-                            printf("📩 [Private] %s 🗣️: %s\n", username->valuestring, text->valuestring);
-                        }
-
-                    } else if (strcmp(type->valuestring, "NEW_STATUS") == 0) {
-                        cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
-                        cJSON *status = cJSON_GetObjectItemCaseSensitive(json_msg, "status");
-                        if (cJSON_IsString(username) && cJSON_IsString(status)) {
-                            printf("🔄 %s is now %s\n", username->valuestring, status->valuestring);
-                        }
-
-                    } else if (strcmp(type->valuestring, "USER_LIST") == 0) {
-                        cJSON *users = cJSON_GetObjectItemCaseSensitive(json_msg, "users");
-                        if (cJSON_IsObject(users)) {
-                            printf("👥 Connected Users:\n");
-                            cJSON *user;
-                            cJSON_ArrayForEach(user, users) {
-                                printf(" - %s: %s\n", user->string, user->valuestring);
-                            }
-                        }
-
-                    } else if (strcmp(type->valuestring, "NEW_USER") == 0) {
-                        cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
-                        if (cJSON_IsString(username)) {
-                            printf("🎉 New user connected: %s\n", username->valuestring);  
-                        }
-                    } else if (strcmp(type->valuestring, "DISCONNECTED") == 0) {
-                        cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
-                        if (cJSON_IsString(username)) {
-                            printf("❌ User disconnected: %s\n", username->valuestring);  
-                        }
-                    }
-                }
+ * Plain JSON messages are split on object boundaries and compressed frames on their length
+ * header. On plain connections, the bytes of a downloaded chunk follow its FILE_DATA header
+ * and are written to the file as they arrive. Any incomplete trailing message is kept for
+ * the next `recv`, and the buffer grows when that message fills it. A plain message that
+ * doesn't fit in RECV_BUFFER_MAX_SIZE is skipped up to its end, so the next one is read
+ * correctly.
+ *
+ * @return void
+ */
+static void process_received_data() {
+    size_t offset = 0;
+
+    while (offset < recv_length) {
+        long frame_length;
+
+        if (skipping) {
+            offset += skip_oversized(recv_buffer + offset, recv_length - offset);
+            continue;
+        }
+        if (!compression_active && transfer_data_pending()) {
+            offset += transfer_receive(recv_buffer + offset, recv_length - offset);
+            continue;
+        }
+        if (compression_active) {
+            frame_length = compression_frame_length((unsigned char *)recv_buffer + offset, recv_length - offset);
+        } else {
+            frame_length = json_frame_length(recv_buffer + offset, recv_length - offset);
+        }
+
+        if (frame_length < 0) {
+            render_printf("Error parsing received message.\n");
+            offset = recv_length;
+            break;
+        }
+        if (frame_length == 0 || offset + (size_t)frame_length > recv_length) {
+            break;
+        }
 
-                cJSON_Delete(json_msg);  
+        if (compression_active) {
+            char *message;
+            size_t message_length;
+            if (decompress_frame(&decompressor, (unsigned char *)recv_buffer + offset, (size_t)frame_length,
+                                 &message, &message_length) == 0) {
+                handle_server_text(message, message_length);
+                free(message);
             } else {
-                printf("Error parsing received message.\n");
+                render_printf("Error decompressing received message.\n");
             }
-        } else if (received == 0) {
-            printf("\nConnection closed by the server.\n");
+        } else {
+            handle_server_text(recv_buffer + offset, (size_t)frame_length);
+        }
+        offset += (size_t)frame_length;
+    }
+
+    if (offset == 0 && recv_length == recv_capacity && grow_recv_buffer() < 0) {
+        render_printf("Error: received message is too large.\n");
+        if (!compression_active) {
+            skipping = 1;
+            skip_depth = 0;
+            skip_in_string = 0;
+            skip_escaped = 0;
+            offset = skip_oversized(recv_buffer, recv_length);
+        } else {
+            offset = recv_length;
+        }
+    }
+    memmove(recv_buffer, recv_buffer + offset, recv_length - offset);
+    recv_length -= offset;
+}
+
+/**
+ * @brief Returns the current time of the monotonic clock.
+ *
+ * @return long long The time in milliseconds.
+ */
+static long long now_ms() {
+    return (long long)(clock_monotonic_ns() / 1000000ULL);
+}
+
+/**
+ * @brief Schedules the next reconnection attempt.
+ *
+ * Attempts are spread randomly between half and one and a half RECONNECT_DELAY_MS, so the
+ * clients dropped by a server restart don't all reconnect at the same instant.
+ *
+ * @return void
+ */
+static void schedule_reconnect() {
+    reconnect_at = now_ms() + RECONNECT_DELAY_MS / 2 + rand() % RECONNECT_DELAY_MS;
+}
+
+/**
+ * @brief Tries once to reconnect to the server and resume the session.
+ *
+ * The receive state is reset, since the new connection starts uncompressed and the server
+ * replays every message numbered after the last one received. Failed attempts are retried
+ * about every RECONNECT_DELAY_MS milliseconds by the event loop.
+ *
+ * @return int 0 once reconnected, -1 if the attempt failed.
+ */
+static int try_reconnect() {
+    if (reconnect_to_server() < 0) {
+        reconnect_attempts++;
+        schedule_reconnect();
+        return -1;
+    }
+    if (compression_active) {
+        decompressor_end(&decompressor);
+        compression_active = 0;
+    }
+    connected = 1;
+    recv_length = 0;
+    skipping = 0;
+    acked_seq = last_seq;
+    send_resume();
+    return 0;
+}
+
+/**
+ * @brief Receives the data available on the server socket.
+ *
+ * Every complete message is handed to the display logic. Several messages may arrive in a
+ * single `recv`, and a message may be split across several of them. Received messages are
+ * acknowledged every ACK_INTERVAL messages.
+ *
+ * @return int 0 on success, -1 if the connection closed or failed.
+ */
+static int receive_from_server() {
+    int received;
+
+    if (!recv_buffer && grow_recv_buffer() < 0) {
+        render_printf("\nOut of memory for the receive buffer\n");
+        return -1;
+    }
+    received = recv(sockfd, recv_buffer + recv_length, recv_capacity - recv_length, 0);
+    if (received > 0) {
+        recv_length += (size_t)received;
+        process_received_data();
+        send_ack_if_needed();
+        return 0;
+    }
+    if (received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (received == 0) {
+        if (!bot_mode) {
+            render_printf("\nConnection closed by the server.\n");
+        }
+    } else {
+        render_printf("\nrecv error: %s\n", strerror(errno));
+    }
+    return -1;
+}
+
+/**
+ * @brief Reads the user's input and sends every complete line.
+ *
+ * @return int 1 if the user left the chat, -1 at end of input, 0 otherwise.
+ */
+static int receive_from_input() {
+    char line[INPUT_LINE_SIZE];
+    int received = input_fill();
+    const char *current;
+    size_t current_length;
+
+    if (received < 0 && errno == EINTR) {
+        return 0;
+    }
+    while (input_next_line(line, sizeof(line))) {
+        if (handle_command(line)) {
+            return 1;
+        }
+    }
+    current = input_current(&current_length);
+    render_set_input(current, current_length);
+    return received <= 0 ? -1 : 0;
+}
+
+/**
+ * @brief Runs the client until the user leaves or the server can't be reached.
+ *
+ * A single `poll` loop waits on standard input and the server socket, so the terminal is
+ * only ever written by this thread, once per tick. When the connection drops and the client
+ * has a resumable session, it reconnects in the background of the loop while the user
+ * keeps typing.
+ *
+ * @return void
+ */
+void run_client() {
+    int input_open = 1;
+
+    render_init(input_init());
+    srand((unsigned int)(getpid() ^ now_ms()));
+    send_identify();
+
+    while (!exiting) {
+        struct pollfd fds[2];
+        nfds_t count = 0;
+        int timeout = -1;
+        int socket_index = -1;
+
+        if (indicator) {
+            char exit_command[] = "/exit";
+            handle_command(exit_command);
             break;
+        }
+        if (input_open) {
+            fds[count].fd = STDIN_FILENO;
+            fds[count].events = POLLIN;
+            count++;
+        }
+        if (connected) {
+            socket_index = (int)count;
+            fds[count].fd = sockfd;
+            fds[count].events = POLLIN;
+            count++;
         } else {
-            perror("recv error");
+            long long delay = reconnect_at - now_ms();
+            timeout = delay > 0 ? (int)delay : 0;
+        }
+
+        render_flush();
+        if (poll(fds, count, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error");
             break;
         }
 
-        memset(buffer, 0, 2048);  
+        if (input_open && (fds[0].revents & (POLLIN | POLLHUP))) {
+            int result = receive_from_input();
+            if (result > 0) {
+                break;
+            }
+            if (result < 0) {
+                input_open = 0;
+            }
+        }
+
+        if (socket_index >= 0 && (fds[socket_index].revents & (POLLIN | POLLHUP | POLLERR))) {
+            if (receive_from_server() < 0) {
+                connected = 0;
+                transfer_abort();
+                if (!session_token[0]) {
+                    break;
+                }
+                render_printf("Connection lost. Reconnecting...\n");
+                reconnect_attempts = 0;
+                schedule_reconnect();
+            }
+        } else if (!connected && now_ms() >= reconnect_at && try_reconnect() < 0 &&
+                   reconnect_attempts >= RECONNECT_ATTEMPTS) {
+            render_printf("Could not reconnect to the server.\n");
+            break;
+        }
     }
 
-    pthread_exit(NULL);
+    render_flush();
+    input_restore();
+    if (compression_active) {
+        decompressor_end(&decompressor);
+    }
+    free(recv_buffer);
+    recv_buffer = NULL;
+    recv_capacity = 0;
 }
 
+/**
+ * @brief Runs a script of commands without waiting for the server's answers.
+ *
+ * The script is read from standard input, one command per line as they would be typed.
+ * Commands are encoded as they are read and sent in batches: every `send` writes as much
+ * of the pending batch as the socket accepts, and no more of the script is read while
+ * BOT_BATCH_SIZE bytes are waiting. The server's messages are read in the same loop, so a
+ * large script can't stall the server on a full socket. At the end of the script the
+ * client disconnects, waits for the server to close the connection so every response is
+ * counted, and prints its report.
+ *
+ * @return void
+ */
+void run_bot() {
+    int script_open = 1;
+    int failed = 0;
+
+    bot_mode = 1;
+    render_init(0);
+    input_init();
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    bot_start();
+    send_identify();
+
+    while (!failed) {
+        struct pollfd fds[2];
+        nfds_t count = 1;
+
+        if (indicator && script_open) {
+            char exit_command[] = "/exit";
+            handle_command(exit_command);
+            script_open = 0;
+        }
+
+        fds[0].fd = sockfd;
+        fds[0].events = POLLIN | (batch_length > 0 ? POLLOUT : 0);
+        if (script_open && batch_length < BOT_BATCH_SIZE) {
+            fds[1].fd = STDIN_FILENO;
+            fds[1].events = POLLIN;
+            count = 2;
+        }
+
+        render_flush();
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error");
+            break;
+        }
+
+        if (count == 2 && (fds[1].revents & (POLLIN | POLLHUP))) {
+            char line[INPUT_LINE_SIZE];
+            int received = input_fill();
+
+            while (script_open && input_next_line(line, sizeof(line))) {
+                if (line[0] == '\0') {
+                    continue;
+                }
+                bot_record_command();
+                if (handle_command(line)) {
+                    script_open = 0;
+                }
+            }
+            if (script_open && received == 0) {
+                char exit_command[] = "/exit";
+                handle_command(exit_command);
+                script_open = 0;
+            } else if (received < 0 && errno != EINTR) {
+                perror("read error");
+                failed = 1;
+            }
+        }
+
+        if ((fds[0].revents & POLLOUT) && flush_batch() < 0) {
+            perror("send error");
+            failed = 1;
+        }
+        if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) && receive_from_server() < 0) {
+            break;
+        }
+    }
+
+    render_flush();
+    if (batch_length > 0) {
+        fprintf(stderr, "%zu bytes were not sent\n", batch_length);
+    }
+    bot_report();
+    free(batch);
+    if (compression_active) {
+        decompressor_end(&decompressor);
+    }
+    free(recv_buffer);
+    recv_buffer = NULL;
+    recv_capacity = 0;
+}
@@ -1,37 +1,33 @@
 /**
  * @file messaging.h
- * @brief Declares the functions and thread variables for message sending and receiving.
+ * @brief Declares the event loop sending and receiving the client's messages.
  *
- * This header file defines the threads and functions responsible for sending and receiving 
- * messages between the client and server in a concurrent manner.
+ * The client runs on a single thread: one `poll` loop reads the user's input, receives
+ * the server's messages, and redraws the terminal once per tick.
  */
 
 #ifndef MESSAGING_H
 #define MESSAGING_H
 
-#include <pthread.h>
-
-extern pthread_t send_msg_thread; /**< Thread used for sending messages to the server. */
-extern pthread_t recv_msg_thread; /**< Thread used for receiving messages from the server. */
-
 /**
- * @brief Function responsible for sending messages to the server.
+ * @brief Runs the client until the user leaves or the server can't be reached.
  *
- * This function is designed to run in a separate thread. It handles reading user input 
- * and sending it to the server through the established socket connection.
+ * It identifies the user to the server, then sends every line typed by the user and
+ * displays every message received from the server. A dropped connection is resumed in
+ * the background when the server granted a session.
  *
- * @return void* A pointer to the result of the thread execution (usually NULL).
+ * @return void
  */
-void* send_msg();
+void run_client();
 
 /**
- * @brief Function responsible for receiving messages from the server.
+ * @brief Runs a script of commands read from standard input, then reports the throughput.
  *
- * This function is designed to run in a separate thread. It continuously listens for 
- * incoming messages from the server and displays them to the user.
+ * The commands are sent in batches without waiting for the server's answers, and the
+ * messages received are counted instead of displayed.
  *
- * @return void* A pointer to the result of the thread execution (usually NULL).
+ * @return void
  */
-void* recv_msg();
+void run_bot();
 
 #endif // MESSAGING_H
@@ -0,0 +1,158 @@
+/**
+ * @file render.c
+ * @brief Implements the batched terminal output of the client.
+ */
+#include "render.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RENDER_INITIAL_SIZE 65536
+#define RENDER_INPUT_SIZE 2048
+#define RENDER_PROMPT "> "
+#define RENDER_CLEAR_LINE "\r\033[K"
+
+static char *output = NULL;
+static size_t output_length = 0;
+static size_t output_size = 0;
+static char input_line[RENDER_INPUT_SIZE];
+static size_t input_length = 0;
+static int input_changed = 0;
+static int interactive_mode = 0;
+
+/**
+ * @brief Makes room for `extra` more bytes in the output buffer.
+ *
+ * @param extra The number of bytes about to be appended.
+ *
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int render_reserve(size_t extra) {
+    size_t size = output_size ? output_size : RENDER_INITIAL_SIZE;
+    char *grown;
+
+    if (output_length + extra <= output_size) {
+        return 0;
+    }
+    while (size < output_length + extra) {
+        size *= 2;
+    }
+    grown = realloc(output, size);
+    if (!grown) {
+        return -1;
+    }
+    output = grown;
+    output_size = size;
+    return 0;
+}
+
+/**
+ * @brief Appends raw bytes to the output buffer.
+ *
+ * @param data The bytes to append.
+ * @param length The number of bytes.
+ *
+ * @return void
+ */
+static void render_append(const char *data, size_t length) {
+    if (render_reserve(length) == 0) {
+        memcpy(output + output_length, data, length);
+        output_length += length;
+    }
+}
+
+/**
+ * @brief Initializes the output buffer.
+ *
+ * @param interactive Non-zero to redraw the input line after each batch of output.
+ *
+ * @return void
+ */
+void render_init(int interactive) {
+    interactive_mode = interactive;
+    input_changed = interactive;
+    render_reserve(RENDER_INITIAL_SIZE);
+}
+
+/**
+ * @brief Appends formatted text to the pending output.
+ *
+ * @param format A printf-style format string.
+ *
+ * @return void
+ */
+void render_printf(const char *format, ...) {
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length <= 0 || render_reserve((size_t)length + 1) < 0) {
+        return;
+    }
+
+    va_start(args, format);
+    vsnprintf(output + output_length, (size_t)length + 1, format, args);
+    va_end(args);
+    output_length += (size_t)length;
+}
+
+/**
+ * @brief Sets the input line drawn below the output.
+ *
+ * @param line The line being typed.
+ * @param length The length of the line in bytes.
+ *
+ * @return void
+ */
+void render_set_input(const char *line, size_t length) {
+    if (length >= sizeof(input_line)) {
+        length = sizeof(input_line) - 1;
+    }
+    memcpy(input_line, line, length);
+    input_length = length;
+    input_changed = 1;
+}
+
+/**
+ * @brief Writes the pending output and the input line to the terminal.
+ *
+ * In interactive mode the batch is framed by erasing the input line and drawing it again,
+ * all in the same `write`.
+ *
+ * @return void
+ */
+void render_flush() {
+    const char *cursor;
+
+    if (output_length == 0 && !(interactive_mode && input_changed)) {
+        return;
+    }
+
+    if (interactive_mode) {
+        size_t prefix_length = strlen(RENDER_CLEAR_LINE);
+        if (render_reserve(prefix_length + strlen(RENDER_PROMPT) + input_length) < 0) {
+            return;
+        }
+        memmove(output + prefix_length, output, output_length);
+        memcpy(output, RENDER_CLEAR_LINE, prefix_length);
+        output_length += prefix_length;
+        render_append(RENDER_PROMPT, strlen(RENDER_PROMPT));
+        render_append(input_line, input_length);
+        input_changed = 0;
+    }
+
+    cursor = output;
+    while (output_length > 0) {
+        ssize_t written = write(STDOUT_FILENO, cursor, output_length);
+        if (written <= 0) {
+            break;
+        }
+        cursor += written;
+        output_length -= (size_t)written;
+    }
+    output_length = 0;
+}
@@ -0,0 +1,53 @@
+/**
+ * @file render.h
+ * @brief Declares the batched terminal output of the client.
+ *
+ * Everything the client displays is appended to an output buffer, and the buffer is written
+ * to the terminal in a single `write` once per event loop tick. In interactive mode the line
+ * being typed is erased before the batch and drawn again after it, so incoming messages never
+ * break up the user's input.
+ */
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stddef.h>
+
+/**
+ * @brief Initializes the output buffer.
+ *
+ * @param interactive Non-zero to redraw the input line after each batch of output.
+ *
+ * @return void
+ */
+void render_init(int interactive);
+
+/**
+ * @brief Appends formatted text to the pending output.
+ *
+ * @param format A printf-style format string.
+ *
+ * @return void
+ */
+void render_printf(const char *format, ...);
+
+/**
+ * @brief Sets the input line drawn below the output.
+ *
+ * @param line The line being typed.
+ * @param length The length of the line in bytes.
+ *
+ * @return void
+ */
+void render_set_input(const char *line, size_t length);
+
+/**
+ * @brief Writes the pending output and the input line to the terminal.
+ *
+ * Nothing is written if neither the output nor the input line changed since the last flush.
+ *
+ * @return void
+ */
+void render_flush();
+
+#endif // RENDER_H
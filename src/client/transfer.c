@@ -0,0 +1,420 @@
+/**
+ * @file transfer.c
+ * @brief Implements the file uploads and downloads of the client.
+ */
+#include "transfer.h"
+#include "connection.h"
+#include "render.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+    int fd;
+    char id[64];
+    char name[128];
+    unsigned long long size;
+    unsigned long long sent;
+    unsigned long long acked;
+    size_t chunk;
+} upload_t;
+
+typedef struct {
+    int active;
+    int fd;
+    int failed;
+    char id[64];
+    char path[256];
+    unsigned long long size;
+    unsigned long long written;
+    unsigned long long requested;
+    unsigned long long chunk_offset;
+    unsigned long long chunk_length;
+    unsigned long long chunk_remaining;
+    size_t chunk;
+} download_t;
+
+static upload_t upload = { .fd = -1 };
+static download_t download = { .fd = -1 };
+
+/**
+ * @brief Writes a whole buffer to the server socket.
+ *
+ * @param data The bytes to write.
+ * @param length The number of bytes to write.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int send_all(const void *data, size_t length) {
+    const char *cursor = data;
+
+    while (length > 0) {
+        ssize_t sent = send(sockfd, cursor, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        cursor += sent;
+        length -= (size_t)sent;
+    }
+    return 0;
+}
+
+/**
+ * @brief Builds a JSON message, sends it to the server and frees it.
+ *
+ * @param json The message to send.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int send_json_message(cJSON *json) {
+    char *json_string = cJSON_PrintUnformatted(json);
+    int result = -1;
+
+    if (json_string) {
+        result = send_all(json_string, strlen(json_string));
+        free(json_string);
+    }
+    cJSON_Delete(json);
+    return result;
+}
+
+/**
+ * @brief Ends the upload in progress.
+ *
+ * @return void
+ */
+static void close_upload() {
+    if (upload.fd >= 0) {
+        close(upload.fd);
+    }
+    upload.fd = -1;
+    upload.id[0] = '\0';
+}
+
+/**
+ * @brief Ends the download in progress.
+ *
+ * An incomplete file is deleted.
+ *
+ * @param complete Non-zero if the whole file was received.
+ *
+ * @return void
+ */
+static void close_download(int complete) {
+    if (download.fd >= 0) {
+        close(download.fd);
+        if (!complete) {
+            unlink(download.path);
+        }
+    }
+    download.fd = -1;
+    download.active = 0;
+}
+
+/**
+ * @brief Sends chunks of the upload until TRANSFER_WINDOW of them are unacknowledged.
+ *
+ * @return void
+ */
+static void send_upload_window() {
+    char *data = malloc(upload.chunk);
+
+    if (!data) {
+        render_printf("Out of memory, the upload of %s was abandoned.\n", upload.name);
+        close_upload();
+        return;
+    }
+    while (upload.sent < upload.size && upload.sent - upload.acked < TRANSFER_WINDOW * upload.chunk) {
+        size_t length = upload.size - upload.sent < upload.chunk ? (size_t)(upload.size - upload.sent) : upload.chunk;
+        cJSON *json_chunk;
+
+        if (pread(upload.fd, data, length, (off_t)upload.sent) != (ssize_t)length) {
+            render_printf("Could not read %s, the upload was abandoned.\n", upload.name);
+            close_upload();
+            break;
+        }
+        json_chunk = cJSON_CreateObject();
+        cJSON_AddStringToObject(json_chunk, "type", "FILE_CHUNK");
+        cJSON_AddStringToObject(json_chunk, "id", upload.id);
+        cJSON_AddNumberToObject(json_chunk, "offset", (double)upload.sent);
+        cJSON_AddNumberToObject(json_chunk, "length", (double)length);
+        if (send_json_message(json_chunk) < 0 || send_all(data, length) < 0) {
+            break;
+        }
+        upload.sent += length;
+    }
+    free(data);
+}
+
+/**
+ * @brief Asks for chunks of the download until TRANSFER_WINDOW of them are in flight.
+ *
+ * @return void
+ */
+static void request_download_window() {
+    while (download.requested < download.size &&
+           download.requested - download.written < TRANSFER_WINDOW * download.chunk) {
+        cJSON *json_get = cJSON_CreateObject();
+        cJSON_AddStringToObject(json_get, "type", "FILE_GET");
+        cJSON_AddStringToObject(json_get, "id", download.id);
+        cJSON_AddNumberToObject(json_get, "offset", (double)download.requested);
+        if (send_json_message(json_get) < 0) {
+            break;
+        }
+        download.requested += download.chunk;
+    }
+}
+
+/**
+ * @brief Offers a file to the server, to a single user or to everyone.
+ *
+ * @param path The file to send.
+ * @param recipient The user to send the file to, or NULL to share it publicly.
+ *
+ * @return int 0 if the offer was sent, -1 if the file can't be sent.
+ */
+int transfer_send_file(const char *path, const char *recipient) {
+    const char *base_name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    struct stat info;
+
+    if (upload.fd >= 0) {
+        render_printf("Wait for the upload of %s to finish.\n", upload.name);
+        return -1;
+    }
+    upload.fd = open(path, O_RDONLY);
+    if (upload.fd < 0 || fstat(upload.fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+        render_printf("Cannot send %s: not a readable, non-empty file.\n", path);
+        close_upload();
+        return -1;
+    }
+    snprintf(upload.name, sizeof(upload.name), "%s", base_name);
+    upload.size = (unsigned long long)info.st_size;
+    upload.sent = 0;
+    upload.acked = 0;
+
+    cJSON *json_offer = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_offer, "type", "FILE_OFFER");
+    cJSON_AddStringToObject(json_offer, "name", upload.name);
+    cJSON_AddNumberToObject(json_offer, "size", (double)upload.size);
+    if (recipient) {
+        cJSON_AddStringToObject(json_offer, "username", recipient);
+    }
+    if (send_json_message(json_offer) < 0) {
+        close_upload();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Starts downloading a file into the current directory.
+ *
+ * @param id The ID of the file, as announced by the server.
+ *
+ * @return void
+ */
+void transfer_get_file(const char *id) {
+    if (download.active) {
+        render_printf("Wait for the download of %s to finish.\n", download.path);
+        return;
+    }
+    // The chunk fields are kept: bytes of an abandoned download may still be arriving.
+    download.active = 1;
+    download.fd = -1;
+    download.path[0] = '\0';
+    download.size = 0;
+    download.written = 0;
+    download.requested = 0;
+    download.chunk = 0;
+    snprintf(download.id, sizeof(download.id), "%s", id);
+
+    // The size and the chunk size are only known from the first FILE_DATA header.
+    cJSON *json_get = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_get, "type", "FILE_GET");
+    cJSON_AddStringToObject(json_get, "id", id);
+    cJSON_AddNumberToObject(json_get, "offset", 0);
+    if (send_json_message(json_get) < 0) {
+        download.active = 0;
+    }
+}
+
+/**
+ * @brief Handles the server's answer to a FILE_OFFER, FILE_CHUNK or FILE_GET request.
+ *
+ * @param json_msg The RESPONSE message.
+ *
+ * @return void
+ */
+void transfer_handle_response(const cJSON *json_msg) {
+    cJSON *operation = cJSON_GetObjectItemCaseSensitive(json_msg, "operation");
+    cJSON *result = cJSON_GetObjectItemCaseSensitive(json_msg, "result");
+    cJSON *id = cJSON_GetObjectItemCaseSensitive(json_msg, "id");
+
+    if (!cJSON_IsString(operation) || !cJSON_IsString(result)) {
+        return;
+    }
+    if (strcmp(operation->valuestring, "FILE_OFFER") == 0 && upload.fd >= 0) {
+        cJSON *chunk = cJSON_GetObjectItemCaseSensitive(json_msg, "chunk");
+        if (strcmp(result->valuestring, "READY") == 0 && cJSON_IsString(id) && cJSON_IsNumber(chunk) &&
+            chunk->valuedouble >= 1) {
+            snprintf(upload.id, sizeof(upload.id), "%s", id->valuestring);
+            upload.chunk = (size_t)chunk->valuedouble;
+            render_printf("📤 Sending %s (%llu bytes)...\n", upload.name, upload.size);
+            send_upload_window();
+        } else {
+            render_printf("The server refused %s: %s\n", upload.name, result->valuestring);
+            close_upload();
+        }
+
+    } else if (strcmp(operation->valuestring, "FILE_CHUNK") == 0 && upload.fd >= 0 && cJSON_IsString(id) &&
+               strcmp(id->valuestring, upload.id) == 0) {
+        cJSON *received = cJSON_GetObjectItemCaseSensitive(json_msg, "received");
+        if (strcmp(result->valuestring, "COMPLETE") == 0) {
+            render_printf("📤 Sent %s, its ID is %s\n", upload.name, upload.id);
+            close_upload();
+        } else if (strcmp(result->valuestring, "OK") == 0 && cJSON_IsNumber(received)) {
+            upload.acked = (unsigned long long)received->valuedouble;
+            send_upload_window();
+        } else {
+            render_printf("The upload of %s failed: %s\n", upload.name, result->valuestring);
+            close_upload();
+        }
+
+    } else if (strcmp(operation->valuestring, "FILE_GET") == 0 && download.active) {
+        render_printf("The download of %s failed: %s\n", download.id, result->valuestring);
+        close_download(0);
+    }
+}
+
+/**
+ * @brief Creates the file a download is written to.
+ *
+ * @param name The name the file was shared with.
+ *
+ * @return int 0 on success, -1 if no file could be created.
+ */
+static int create_download_file(const char *name) {
+    const char *base_name = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+
+    if (base_name[0] == '\0' || strcmp(base_name, ".") == 0 || strcmp(base_name, "..") == 0) {
+        base_name = "download";
+    }
+    snprintf(download.path, sizeof(download.path), "%s", base_name);
+    download.fd = open(download.path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (download.fd < 0 && errno == EEXIST) {
+        snprintf(download.path, sizeof(download.path), "%s-%s", download.id, base_name);
+        download.fd = open(download.path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    }
+    return download.fd < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Handles a FILE_DATA header announcing the bytes of a downloaded chunk.
+ *
+ * The first header creates the file and fills the window of requested chunks.
+ *
+ * @param json_msg The FILE_DATA message.
+ *
+ * @return void
+ */
+void transfer_handle_data(const cJSON *json_msg) {
+    cJSON *id = cJSON_GetObjectItemCaseSensitive(json_msg, "id");
+    cJSON *name = cJSON_GetObjectItemCaseSensitive(json_msg, "name");
+    cJSON *size = cJSON_GetObjectItemCaseSensitive(json_msg, "size");
+    cJSON *offset = cJSON_GetObjectItemCaseSensitive(json_msg, "offset");
+    cJSON *length = cJSON_GetObjectItemCaseSensitive(json_msg, "length");
+
+    if (!cJSON_IsNumber(offset) || !cJSON_IsNumber(length) || length->valuedouble < 1) {
+        return;
+    }
+    download.chunk_offset = (unsigned long long)offset->valuedouble;
+    download.chunk_length = (unsigned long long)length->valuedouble;
+    download.chunk_remaining = download.chunk_length;
+
+    // Bytes of a download that was abandoned are still read, and discarded.
+    if (!download.active || !cJSON_IsString(id) || strcmp(id->valuestring, download.id) != 0) {
+        download.failed = 1;
+        return;
+    }
+    download.failed = 0;
+    if (download.fd < 0) {
+        if (!cJSON_IsString(name) || !cJSON_IsNumber(size) || create_download_file(name->valuestring) < 0) {
+            render_printf("Cannot create a file for the download of %s.\n", download.id);
+            download.active = 0;
+            download.failed = 1;
+            return;
+        }
+        download.size = (unsigned long long)size->valuedouble;
+        download.chunk = (size_t)download.chunk_length;
+        download.requested = download.chunk_length;
+        render_printf("📥 Receiving %s (%llu bytes)...\n", download.path, download.size);
+        request_download_window();
+    }
+}
+
+/**
+ * @brief Tells whether the next received bytes belong to a downloaded chunk.
+ *
+ * @return int Non-zero if bytes of a chunk are expected.
+ */
+int transfer_data_pending() {
+    return download.chunk_remaining > 0;
+}
+
+/**
+ * @brief Writes the received bytes of the pending chunk to the downloaded file.
+ *
+ * @param data The received bytes.
+ * @param length The number of received bytes.
+ *
+ * @return size_t The number of bytes that belonged to the chunk.
+ */
+size_t transfer_receive(const char *data, size_t length) {
+    size_t count = length < download.chunk_remaining ? length : (size_t)download.chunk_remaining;
+    off_t position = (off_t)(download.chunk_offset + download.chunk_length - download.chunk_remaining);
+
+    download.chunk_remaining -= count;
+    if (download.failed) {
+        return count;
+    }
+    if (pwrite(download.fd, data, count, position) != (ssize_t)count) {
+        render_printf("Could not write %s, the download was abandoned.\n", download.path);
+        close_download(0);
+        download.failed = 1;
+        return count;
+    }
+    if (download.chunk_remaining == 0) {
+        download.written += download.chunk_length;
+        if (download.written >= download.size) {
+            render_printf("📥 Saved %s\n", download.path);
+            close_download(1);
+        } else {
+            request_download_window();
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Abandons the transfers in progress after the connection dropped.
+ *
+ * @return void
+ */
+void transfer_abort() {
+    if (upload.fd >= 0) {
+        render_printf("The upload of %s was interrupted.\n", upload.name);
+        close_upload();
+    }
+    if (download.active) {
+        render_printf("The download of %s was interrupted.\n", download.id);
+        close_download(0);
+    }
+    download.chunk_remaining = 0;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file transfer.h
+ * @brief Declares the file uploads and downloads of the client.
+ *
+ * A file is offered to the server with FILE_OFFER and uploaded in FILE_CHUNK messages, each
+ * followed by the raw bytes of the chunk. A file shared by another user is downloaded by
+ * asking for its chunks with FILE_GET; each FILE_DATA header from the server is followed by
+ * the raw bytes of the chunk. Both directions keep at most TRANSFER_WINDOW chunks in flight,
+ * so chat messages keep flowing while a large file is transferred. One upload and one
+ * download can run at a time.
+ */
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include "../libs/cJSON/cJSON.h"
+#include <stddef.h>
+
+#define TRANSFER_WINDOW 4
+
+/**
+ * @brief Offers a file to the server, to a single user or to everyone.
+ *
+ * @param path The file to send.
+ * @param recipient The user to send the file to, or NULL to share it publicly.
+ *
+ * @return int 0 if the offer was sent, -1 if the file can't be sent.
+ */
+int transfer_send_file(const char *path, const char *recipient);
+
+/**
+ * @brief Starts downloading a file into the current directory.
+ *
+ * The file keeps the name it was shared with, prefixed by its ID if a file of that name
+ * already exists.
+ *
+ * @param id The ID of the file, as announced by the server.
+ *
+ * @return void
+ */
+void transfer_get_file(const char *id);
+
+/**
+ * @brief Handles the server's answer to a FILE_OFFER, FILE_CHUNK or FILE_GET request.
+ *
+ * Accepted offers and acknowledged chunks send the next chunks of the upload.
+ *
+ * @param json_msg The RESPONSE message.
+ *
+ * @return void
+ */
+void transfer_handle_response(const cJSON *json_msg);
+
+/**
+ * @brief Handles a FILE_DATA header announcing the bytes of a downloaded chunk.
+ *
+ * @param json_msg The FILE_DATA message.
+ *
+ * @return void
+ */
+void transfer_handle_data(const cJSON *json_msg);
+
+/**
+ * @brief Tells whether the next received bytes belong to a downloaded chunk.
+ *
+ * @return int Non-zero if bytes of a chunk are expected.
+ */
+int transfer_data_pending();
+
+/**
+ * @brief Writes the received bytes of the pending chunk to the downloaded file.
+ *
+ * @param data The received bytes.
+ * @param length The number of received bytes.
+ *
+ * @return size_t The number of bytes that belonged to the chunk.
+ */
+size_t transfer_receive(const char *data, size_t length);
+
+/**
+ * @brief Abandons the transfers in progress after the connection dropped.
+ *
+ * @return void
+ */
+void transfer_abort();
+
+#endif // TRANSFER_H
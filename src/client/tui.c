@@ -33,6 +33,8 @@ void show_commands_menu() {
     printf(" %s/status [status]%s    %s->%s Change your %sstatus%s (active, away, busy)\n", COLOR_CYAN, RESET_COLOR, COLOR_GREEN, RESET_COLOR, BOLD, RESET_COLOR);
     printf(" %s/users%s              %s->%s Show the list of %sconnected users%s\n", COLOR_CYAN, RESET_COLOR, COLOR_GREEN, RESET_COLOR, BOLD, RESET_COLOR);
     printf(" %s/private [user] [msg]%s%s->%s Send a %sprivate%s message to a user\n", COLOR_CYAN, RESET_COLOR, COLOR_GREEN, RESET_COLOR, BOLD, RESET_COLOR);
+    printf(" %s/send [file] [user]%s %s->%s Send a %sfile%s to a user, or to everyone\n", COLOR_CYAN, RESET_COLOR, COLOR_GREEN, RESET_COLOR, BOLD, RESET_COLOR);
+    printf(" %s/get [id]%s           %s->%s %sDownload%s a file shared with you\n", COLOR_CYAN, RESET_COLOR, COLOR_GREEN, RESET_COLOR, BOLD, RESET_COLOR);
     printf(" %s/exit%s               %s->%s %sLeave%s the chat\n", COLOR_CYAN, RESET_COLOR, COLOR_GREEN, RESET_COLOR, BOLD, RESET_COLOR);
     printf(" %sAny message without a slash (%s/%s) will be public by default.%s\n", COLOR_YELLOW, COLOR_RED, COLOR_YELLOW, RESET_COLOR);
     
@@ -0,0 +1,116 @@
+/**
+ * @file capture.c
+ * @brief Implements the encoding and decoding of traffic captures.
+ */
+#include "capture.h"
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @brief Writes a big-endian integer.
+ *
+ * @param data The destination bytes.
+ * @param value The value to write.
+ * @param size The number of bytes to write.
+ *
+ * @return void
+ */
+static void put_be(unsigned char *data, uint64_t value, int size) {
+    for (int i = size - 1; i >= 0; --i) {
+        data[i] = (unsigned char)value;
+        value >>= 8;
+    }
+}
+
+/**
+ * @brief Reads a big-endian integer.
+ *
+ * @param data The source bytes.
+ * @param size The number of bytes to read.
+ * @return uint64_t The value.
+ */
+static uint64_t get_be(const unsigned char *data, int size) {
+    uint64_t value = 0;
+
+    for (int i = 0; i < size; ++i) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+/**
+ * @brief Encodes the header starting a capture.
+ *
+ * @param header The CAPTURE_FILE_HEADER_SIZE bytes receiving the header.
+ * @param start_time The wall-clock time the capture started, in nanoseconds.
+ *
+ * @return void
+ */
+void capture_encode_file_header(unsigned char *header, unsigned long long start_time) {
+    memcpy(header, CAPTURE_MAGIC, 4);
+    put_be(header + 4, CAPTURE_VERSION, 4);
+    put_be(header + 8, start_time, 8);
+}
+
+/**
+ * @brief Encodes the header of a record.
+ *
+ * @param header The CAPTURE_RECORD_HEADER_SIZE bytes receiving the header.
+ * @param record The record.
+ *
+ * @return void
+ */
+void capture_encode_record_header(unsigned char *header, const capture_record_t *record) {
+    put_be(header, record->time, 8);
+    put_be(header + 8, record->connection, 4);
+    header[12] = (unsigned char)record->event;
+    put_be(header + 13, record->length, 4);
+}
+
+/**
+ * @brief Reads and checks the header starting a capture.
+ *
+ * @param file The capture file.
+ * @param start_time Receives the wall-clock time the capture started, in nanoseconds.
+ *
+ * @return int 0 on success, -1 if the file is not a capture.
+ */
+int capture_read_file_header(FILE *file, unsigned long long *start_time) {
+    unsigned char header[CAPTURE_FILE_HEADER_SIZE];
+
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, CAPTURE_MAGIC, 4) != 0 ||
+        get_be(header + 4, 4) != CAPTURE_VERSION) {
+        return -1;
+    }
+    *start_time = get_be(header + 8, 8);
+    return 0;
+}
+
+/**
+ * @brief Reads the next record of a capture.
+ *
+ * @param file The capture file.
+ * @param record Receives the record.
+ * @param data The CAPTURE_MAX_DATA bytes receiving the data of the record.
+ *
+ * @return int 1 if a record was read, 0 at the end of the capture, or -1 if it is corrupt.
+ */
+int capture_read_record(FILE *file, capture_record_t *record, char *data) {
+    unsigned char header[CAPTURE_RECORD_HEADER_SIZE];
+    size_t read = fread(header, 1, sizeof(header), file);
+
+    if (read == 0) {
+        return 0;
+    }
+    if (read != sizeof(header)) {
+        return -1;
+    }
+    record->time = get_be(header, 8);
+    record->connection = (unsigned int)get_be(header + 8, 4);
+    record->event = header[12];
+    record->length = get_be(header + 13, 4);
+    if (record->length > CAPTURE_MAX_DATA || fread(data, 1, record->length, file) != record->length) {
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,39 @@
+/**
+ * @file capture.h
+ * @brief Binary capture of the traffic received by the server, read back by the replayer.
+ *
+ * A capture starts with the magic "CHCP", a 4-byte version and the 8-byte wall-clock time
+ * the capture started, in nanoseconds. Each record then holds an 8-byte time relative to
+ * that start in nanoseconds, the 4-byte ID of the connection, a 1-byte event and the 4-byte
+ * length of the bytes that follow. All integers are big-endian. A connection's records are
+ * framed by an OPEN and a CLOSE event, and its DATA records hold the bytes of each `recv`.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "CHCP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_FILE_HEADER_SIZE 16
+#define CAPTURE_RECORD_HEADER_SIZE 17
+#define CAPTURE_MAX_DATA (1024 * 1024)
+
+#define CAPTURE_OPEN 1
+#define CAPTURE_DATA 2
+#define CAPTURE_CLOSE 3
+
+typedef struct {
+    unsigned long long time;
+    unsigned int connection;
+    int event;
+    size_t length;
+} capture_record_t;
+
+void capture_encode_file_header(unsigned char *header, unsigned long long start_time);
+void capture_encode_record_header(unsigned char *header, const capture_record_t *record);
+int capture_read_file_header(FILE *file, unsigned long long *start_time);
+int capture_read_record(FILE *file, capture_record_t *record, char *data);
+
+#endif // CAPTURE_H
@@ -0,0 +1,38 @@
+/**
+ * @file clock.c
+ * @brief Implements the clock readings.
+ */
+#include "clock.h"
+#include <time.h>
+
+/**
+ * @brief Reads a clock.
+ *
+ * @param clock The clock to read.
+ *
+ * @return unsigned long long The time in nanoseconds.
+ */
+static unsigned long long clock_read_ns(clockid_t clock) {
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+/**
+ * @brief Returns the current time of the monotonic clock.
+ *
+ * @return unsigned long long The time in nanoseconds, since an arbitrary point.
+ */
+unsigned long long clock_monotonic_ns(void) {
+    return clock_read_ns(CLOCK_MONOTONIC);
+}
+
+/**
+ * @brief Returns the current time of the wall clock.
+ *
+ * @return unsigned long long The time in nanoseconds since the epoch.
+ */
+unsigned long long clock_realtime_ns(void) {
+    return clock_read_ns(CLOCK_REALTIME);
+}
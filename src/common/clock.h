@@ -0,0 +1,14 @@
+/**
+ * @file clock.h
+ * @brief Clock readings in nanoseconds, shared by the server, the client and the tools.
+ *
+ * Timings, deadlines and trace spans all use the monotonic clock, so they are unaffected by
+ * changes of the system time. The wall clock is only read for timestamps meant for people.
+ */
+#ifndef CLOCK_H
+#define CLOCK_H
+
+unsigned long long clock_monotonic_ns(void);
+unsigned long long clock_realtime_ns(void);
+
+#endif // CLOCK_H
@@ -0,0 +1,371 @@
+/**
+ * @file compression.c
+ * @brief Implements the deflate framing used by compressed connections.
+ *
+ * Stream frames are produced with Z_SYNC_FLUSH on a per-connection deflate context, so each
+ * message can reference everything previously sent on that connection. The trailing empty
+ * stored block emitted by the flush is stripped and restored by the receiver. Shared frames
+ * are complete raw deflate streams that only depend on the preset dictionary, which is what
+ * allows the server to compress a broadcast once for every compressed recipient.
+ */
+#include "compression.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Preset dictionary assembled from the envelopes the server emits. zlib favours matches
+ * close to the end of the dictionary, so the most frequent fragments are placed last.
+ */
+static const char protocol_dictionary[] =
+    "{\"type\":\"RESPONSE\",\"operation\":\"TEXT\",\"result\":\"NO_SUCH_USER\",\"extra\":\""
+    "{\"type\":\"RESPONSE\",\"operation\":\"IDENTIFY\",\"result\":\"SUCCESS\",\"extra\":\""
+    "{\"type\":\"NEW_USER\",\"username\":\""
+    "{\"type\":\"DISCONNECTED\",\"username\":\""
+    "{\"type\":\"USER_LIST\",\"users\":{\""
+    "\":\"ACTIVE\",\"\":\"AWAY\",\"\":\"BUSY\",\""
+    "{\"type\":\"NEW_STATUS\",\"username\":\"\",\"status\":\"ACTIVE\"}"
+    "{\"type\":\"TEXT_FROM\",\"username\":\"\",\"text\":\"\"}"
+    "{\"type\":\"PUBLIC_TEXT_FROM\",\"username\":\"\",\"text\":\"";
+
+static const unsigned char sync_flush_tail[4] = {0x00, 0x00, 0xff, 0xff};
+
+static z_stream shared_deflater;
+static int shared_deflater_ready = 0;
+static pthread_mutex_t shared_deflater_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Maps a codec name received at IDENTIFY to a compression mode.
+ *
+ * @param name The codec name requested by the client, or NULL.
+ * @return int COMPRESSION_DEFLATE if the codec is supported, COMPRESSION_NONE otherwise.
+ */
+int compression_from_name(const char *name) {
+    if (name && strcmp(name, COMPRESSION_NAME_DEFLATE) == 0) {
+        return COMPRESSION_DEFLATE;
+    }
+    return COMPRESSION_NONE;
+}
+
+/**
+ * @brief Initializes a raw deflate context primed with the protocol dictionary.
+ *
+ * @param stream The zlib stream to initialize.
+ * @return int 0 on success, -1 on failure.
+ */
+static int init_deflater(z_stream *stream) {
+    memset(stream, 0, sizeof(*stream));
+    if (deflateInit2(stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    if (deflateSetDictionary(stream, (const Bytef *)protocol_dictionary, sizeof(protocol_dictionary) - 1) != Z_OK) {
+        deflateEnd(stream);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes the kind and big-endian payload length at the start of a frame.
+ *
+ * @param frame The frame buffer, at least COMPRESSION_FRAME_HEADER_SIZE bytes long.
+ * @param kind The frame kind.
+ * @param payload_length The number of payload bytes following the header.
+ *
+ * @return void
+ */
+static void write_frame_header(unsigned char *frame, int kind, size_t payload_length) {
+    frame[0] = (unsigned char)kind;
+    frame[1] = (unsigned char)(payload_length >> 24);
+    frame[2] = (unsigned char)(payload_length >> 16);
+    frame[3] = (unsigned char)(payload_length >> 8);
+    frame[4] = (unsigned char)payload_length;
+}
+
+/**
+ * @brief Runs deflate over a message and wraps the output in a frame.
+ *
+ * @param stream The deflate context to use.
+ * @param flush Z_SYNC_FLUSH for stream frames, Z_FINISH for shared frames.
+ * @param kind The frame kind written in the header.
+ * @param message The message to compress.
+ * @param length The length of the message in bytes.
+ * @param frame Receives a malloc'd frame that the caller must free.
+ * @param frame_length Receives the total frame length.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int deflate_frame(z_stream *stream, int flush, int kind, const char *message, size_t length,
+                         unsigned char **frame, size_t *frame_length) {
+    size_t capacity = COMPRESSION_FRAME_HEADER_SIZE + deflateBound(stream, length) + 16;
+    size_t used = COMPRESSION_FRAME_HEADER_SIZE;
+    unsigned char *out = malloc(capacity);
+    int result;
+
+    if (!out) {
+        return -1;
+    }
+
+    stream->next_in = (Bytef *)message;
+    stream->avail_in = (uInt)length;
+    do {
+        if (used == capacity) {
+            unsigned char *grown = realloc(out, capacity * 2);
+            if (!grown) {
+                free(out);
+                return -1;
+            }
+            out = grown;
+            capacity *= 2;
+        }
+        stream->next_out = out + used;
+        stream->avail_out = (uInt)(capacity - used);
+        result = deflate(stream, flush);
+        if (result == Z_STREAM_ERROR) {
+            free(out);
+            return -1;
+        }
+        used = capacity - stream->avail_out;
+    } while (flush == Z_FINISH ? result != Z_STREAM_END : stream->avail_out == 0);
+
+    if (flush == Z_SYNC_FLUSH && used >= COMPRESSION_FRAME_HEADER_SIZE + sizeof(sync_flush_tail) &&
+        memcmp(out + used - sizeof(sync_flush_tail), sync_flush_tail, sizeof(sync_flush_tail)) == 0) {
+        used -= sizeof(sync_flush_tail);
+    }
+
+    write_frame_header(out, kind, used - COMPRESSION_FRAME_HEADER_SIZE);
+    *frame = out;
+    *frame_length = used;
+    return 0;
+}
+
+/**
+ * @brief Initializes the per-connection compression context.
+ *
+ * @param compressor The compressor to initialize.
+ * @return int 0 on success, -1 on failure.
+ */
+int compressor_init(compressor_t *compressor) {
+    if (init_deflater(&compressor->stream) < 0) {
+        compressor->initialized = 0;
+        return -1;
+    }
+    compressor->initialized = 1;
+    return 0;
+}
+
+/**
+ * @brief Releases the per-connection compression context.
+ *
+ * @param compressor The compressor to release.
+ * @return void
+ */
+void compressor_end(compressor_t *compressor) {
+    if (compressor->initialized) {
+        deflateEnd(&compressor->stream);
+        compressor->initialized = 0;
+    }
+}
+
+/**
+ * @brief Compresses a message with the connection's streaming context.
+ *
+ * The caller must serialize calls for a given compressor, since every frame depends on the
+ * history of the frames produced before it.
+ *
+ * @param compressor The connection's compressor.
+ * @param message The message to compress.
+ * @param length The length of the message in bytes.
+ * @param frame Receives a malloc'd frame that the caller must free.
+ * @param frame_length Receives the total frame length.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+int compress_stream_frame(compressor_t *compressor, const char *message, size_t length,
+                          unsigned char **frame, size_t *frame_length) {
+    if (!compressor->initialized) {
+        return -1;
+    }
+    return deflate_frame(&compressor->stream, Z_SYNC_FLUSH, COMPRESSION_FRAME_STREAM, message, length, frame, frame_length);
+}
+
+/**
+ * @brief Compresses a message into a self-contained frame.
+ *
+ * The resulting frame only depends on the preset dictionary, so the same bytes can be written
+ * to every compressed connection. A single deflate context is reused behind a mutex to avoid
+ * paying the allocation cost on every broadcast.
+ *
+ * @param message The message to compress.
+ * @param length The length of the message in bytes.
+ * @param frame Receives a malloc'd frame that the caller must free.
+ * @param frame_length Receives the total frame length.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+int compress_shared_frame(const char *message, size_t length, unsigned char **frame, size_t *frame_length) {
+    int result = -1;
+
+    pthread_mutex_lock(&shared_deflater_mutex);
+    if (!shared_deflater_ready) {
+        shared_deflater_ready = init_deflater(&shared_deflater) == 0;
+    } else if (deflateReset(&shared_deflater) != Z_OK ||
+               deflateSetDictionary(&shared_deflater, (const Bytef *)protocol_dictionary,
+                                    sizeof(protocol_dictionary) - 1) != Z_OK) {
+        deflateEnd(&shared_deflater);
+        shared_deflater_ready = 0;
+    }
+    if (shared_deflater_ready) {
+        result = deflate_frame(&shared_deflater, Z_FINISH, COMPRESSION_FRAME_SHARED, message, length, frame, frame_length);
+    }
+    pthread_mutex_unlock(&shared_deflater_mutex);
+
+    return result;
+}
+
+/**
+ * @brief Initializes the receiving side of a compressed connection.
+ *
+ * @param decompressor The decompressor to initialize.
+ * @return int 0 on success, -1 on failure.
+ */
+int decompressor_init(decompressor_t *decompressor) {
+    memset(decompressor, 0, sizeof(*decompressor));
+    if (inflateInit2(&decompressor->stream, -MAX_WBITS) != Z_OK) {
+        return -1;
+    }
+    if (inflateSetDictionary(&decompressor->stream, (const Bytef *)protocol_dictionary, sizeof(protocol_dictionary) - 1) != Z_OK ||
+        inflateInit2(&decompressor->shared, -MAX_WBITS) != Z_OK) {
+        inflateEnd(&decompressor->stream);
+        return -1;
+    }
+    decompressor->initialized = 1;
+    return 0;
+}
+
+/**
+ * @brief Releases the receiving side of a compressed connection.
+ *
+ * @param decompressor The decompressor to release.
+ * @return void
+ */
+void decompressor_end(decompressor_t *decompressor) {
+    if (decompressor->initialized) {
+        inflateEnd(&decompressor->stream);
+        inflateEnd(&decompressor->shared);
+        decompressor->initialized = 0;
+    }
+}
+
+/**
+ * @brief Determines the length of the frame at the start of a receive buffer.
+ *
+ * @param buffer The received bytes.
+ * @param length The number of bytes available.
+ * @return long The total frame length, 0 if the header is incomplete, or -1 if the header is invalid.
+ */
+long compression_frame_length(const unsigned char *buffer, size_t length) {
+    size_t payload_length;
+
+    if (length < COMPRESSION_FRAME_HEADER_SIZE) {
+        return 0;
+    }
+    if (buffer[0] != COMPRESSION_FRAME_STREAM && buffer[0] != COMPRESSION_FRAME_SHARED) {
+        return -1;
+    }
+    payload_length = ((size_t)buffer[1] << 24) | ((size_t)buffer[2] << 16) | ((size_t)buffer[3] << 8) | buffer[4];
+    if (payload_length > COMPRESSION_MAX_FRAME) {
+        return -1;
+    }
+    return (long)(COMPRESSION_FRAME_HEADER_SIZE + payload_length);
+}
+
+/**
+ * @brief Feeds input to an inflate context, appending the output to a growing buffer.
+ *
+ * @param stream The inflate context.
+ * @param input The compressed bytes.
+ * @param input_length The number of compressed bytes.
+ * @param out The output buffer, reallocated as needed.
+ * @param capacity The capacity of the output buffer.
+ * @param used The number of bytes already written to the output buffer.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int inflate_append(z_stream *stream, const unsigned char *input, size_t input_length,
+                          char **out, size_t *capacity, size_t *used) {
+    int result;
+
+    stream->next_in = (Bytef *)input;
+    stream->avail_in = (uInt)input_length;
+    do {
+        if (*used + 1 >= *capacity) {
+            char *grown = realloc(*out, *capacity * 2);
+            if (!grown) {
+                return -1;
+            }
+            *out = grown;
+            *capacity *= 2;
+        }
+        stream->next_out = (Bytef *)(*out + *used);
+        stream->avail_out = (uInt)(*capacity - *used - 1);
+        result = inflate(stream, Z_SYNC_FLUSH);
+        *used = *capacity - 1 - stream->avail_out;
+        if (result == Z_STREAM_END || (result == Z_BUF_ERROR && stream->avail_in == 0)) {
+            break;
+        }
+        if (result != Z_OK || *used > COMPRESSION_MAX_FRAME * 4) {
+            return -1;
+        }
+    } while (stream->avail_in > 0 || stream->avail_out == 0);
+    return 0;
+}
+
+/**
+ * @brief Decompresses a complete frame into a null-terminated message.
+ *
+ * @param decompressor The connection's decompressor.
+ * @param frame The frame, including its header.
+ * @param frame_length The total frame length as returned by compression_frame_length().
+ * @param message Receives a malloc'd, null-terminated message that the caller must free.
+ * @param message_length Receives the message length.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+int decompress_frame(decompressor_t *decompressor, const unsigned char *frame, size_t frame_length,
+                     char **message, size_t *message_length) {
+    const unsigned char *payload = frame + COMPRESSION_FRAME_HEADER_SIZE;
+    size_t payload_length = frame_length - COMPRESSION_FRAME_HEADER_SIZE;
+    size_t capacity = payload_length * 4 + 256;
+    size_t used = 0;
+    char *out = malloc(capacity);
+    int result;
+
+    if (!out || !decompressor->initialized) {
+        free(out);
+        return -1;
+    }
+
+    if (frame[0] == COMPRESSION_FRAME_STREAM) {
+        result = inflate_append(&decompressor->stream, payload, payload_length, &out, &capacity, &used);
+        if (result == 0) {
+            result = inflate_append(&decompressor->stream, sync_flush_tail, sizeof(sync_flush_tail), &out, &capacity, &used);
+        }
+    } else {
+        result = -1;
+        if (inflateReset(&decompressor->shared) == Z_OK &&
+            inflateSetDictionary(&decompressor->shared, (const Bytef *)protocol_dictionary, sizeof(protocol_dictionary) - 1) == Z_OK) {
+            result = inflate_append(&decompressor->shared, payload, payload_length, &out, &capacity, &used);
+        }
+    }
+
+    if (result < 0) {
+        free(out);
+        return -1;
+    }
+
+    out[used] = '\0';
+    *message = out;
+    *message_length = used;
+    return 0;
+}
@@ -0,0 +1,53 @@
+/**
+ * @file compression.h
+ * @brief Optional deflate transport shared by the client and the server.
+ *
+ * Once a client negotiates compression at IDENTIFY, every message the server sends to it
+ * travels inside a small binary frame instead of as raw JSON. Two frame kinds exist:
+ * stream frames, compressed with the connection's own deflate context, and shared frames,
+ * compressed independently so a broadcast can be compressed once and written to every
+ * compressed recipient. Both kinds are primed with a preset dictionary built from the
+ * protocol's JSON envelopes.
+ */
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+#define COMPRESSION_NONE 0
+#define COMPRESSION_DEFLATE 1
+
+#define COMPRESSION_NAME_DEFLATE "deflate"
+
+#define COMPRESSION_FRAME_STREAM 0x01
+#define COMPRESSION_FRAME_SHARED 0x02
+#define COMPRESSION_FRAME_HEADER_SIZE 5
+#define COMPRESSION_MAX_FRAME (1024 * 1024)
+
+typedef struct {
+    z_stream stream;
+    int initialized;
+} compressor_t;
+
+typedef struct {
+    z_stream stream;
+    z_stream shared;
+    int initialized;
+} decompressor_t;
+
+int compression_from_name(const char *name);
+
+int compressor_init(compressor_t *compressor);
+void compressor_end(compressor_t *compressor);
+int compress_stream_frame(compressor_t *compressor, const char *message, size_t length,
+                          unsigned char **frame, size_t *frame_length);
+int compress_shared_frame(const char *message, size_t length, unsigned char **frame, size_t *frame_length);
+
+int decompressor_init(decompressor_t *decompressor);
+void decompressor_end(decompressor_t *decompressor);
+long compression_frame_length(const unsigned char *buffer, size_t length);
+int decompress_frame(decompressor_t *decompressor, const unsigned char *frame, size_t frame_length,
+                     char **message, size_t *message_length);
+
+#endif // COMPRESSION_H
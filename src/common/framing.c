@@ -0,0 +1,52 @@
+/**
+ * @file framing.c
+ * @brief Implements JSON message boundary detection for receive buffers.
+ */
+#include "framing.h"
+
+/**
+ * @brief Finds the end of the JSON object at the start of a buffer.
+ *
+ * Leading whitespace is included in the returned length. Braces that appear inside strings,
+ * including escaped quotes, are ignored.
+ *
+ * @param buffer The received bytes.
+ * @param length The number of bytes available.
+ * @return long The number of bytes up to and including the closing brace, 0 if the object is
+ *              not complete yet, or -1 if the buffer does not start with a JSON object.
+ */
+long json_frame_length(const char *buffer, size_t length) {
+    size_t i = 0;
+    int depth = 0;
+    int in_string = 0;
+
+    while (i < length && (buffer[i] == ' ' || buffer[i] == '\n' || buffer[i] == '\r' || buffer[i] == '\t')) {
+        i++;
+    }
+    if (i == length) {
+        return 0;
+    }
+    if (buffer[i] != '{') {
+        return -1;
+    }
+
+    for (; i < length; ++i) {
+        char c = buffer[i];
+        if (in_string) {
+            if (c == '\\') {
+                i++;
+            } else if (c == '"') {
+                in_string = 0;
+            }
+        } else if (c == '"') {
+            in_string = 1;
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (--depth == 0) {
+                return (long)(i + 1);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,16 @@
+/**
+ * @file framing.h
+ * @brief Locates JSON message boundaries in a stream of received bytes.
+ *
+ * Messages are written back to back on the socket without any delimiter, so a single `recv`
+ * may return several messages, or only part of one. These helpers find where the message at
+ * the start of a receive buffer ends without parsing it.
+ */
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+
+long json_frame_length(const char *buffer, size_t length);
+
+#endif // FRAMING_H
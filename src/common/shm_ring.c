@@ -0,0 +1,281 @@
+/**
+ * @file shm_ring.c
+ * @brief Implements the single-producer single-consumer message ring in shared memory.
+ */
+#define _GNU_SOURCE
+#include "shm_ring.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Maps a ring's memfd and points the ring at its header and data area.
+ *
+ * @param ring The ring, whose memfd is set.
+ * @param size The size of the memfd in bytes.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int shm_ring_map(shm_ring_t *ring, size_t size) {
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+
+    if (memory == MAP_FAILED) {
+        return -1;
+    }
+    ring->header = memory;
+    ring->data = (unsigned char *)memory + sizeof(shm_ring_header_t);
+    ring->mapped_size = size;
+    return 0;
+}
+
+/**
+ * @brief Copies bytes into the data area, wrapping around its end.
+ *
+ * @param ring The ring.
+ * @param position The absolute write position.
+ * @param source The bytes to copy.
+ * @param length The number of bytes.
+ *
+ * @return void
+ */
+static void shm_ring_copy_in(shm_ring_t *ring, uint64_t position, const void *source, size_t length) {
+    size_t offset = (size_t)(position & (ring->capacity - 1));
+    size_t first = length < ring->capacity - offset ? length : ring->capacity - offset;
+
+    memcpy(ring->data + offset, source, first);
+    memcpy(ring->data, (const unsigned char *)source + first, length - first);
+}
+
+/**
+ * @brief Copies bytes out of the data area, wrapping around its end.
+ *
+ * @param ring The ring.
+ * @param position The absolute read position.
+ * @param destination The buffer receiving the bytes.
+ * @param length The number of bytes.
+ *
+ * @return void
+ */
+static void shm_ring_copy_out(shm_ring_t *ring, uint64_t position, void *destination, size_t length) {
+    size_t offset = (size_t)(position & (ring->capacity - 1));
+    size_t first = length < ring->capacity - offset ? length : ring->capacity - offset;
+
+    memcpy(destination, ring->data + offset, first);
+    memcpy((unsigned char *)destination + first, ring->data, length - first);
+}
+
+/**
+ * @brief Creates a ring in a new memfd, with its eventfd, on the producer side.
+ *
+ * @param ring The ring to initialize.
+ * @param capacity The requested size of the data area, rounded up to a power of two between
+ *        SHM_RING_MIN_CAPACITY and SHM_RING_MAX_CAPACITY.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+int shm_ring_create(shm_ring_t *ring, size_t capacity) {
+    size_t rounded = SHM_RING_MIN_CAPACITY;
+
+    while (rounded < capacity && rounded < SHM_RING_MAX_CAPACITY) {
+        rounded *= 2;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->memfd = memfd_create("chat-ring", MFD_CLOEXEC);
+    if (ring->memfd < 0) {
+        return -1;
+    }
+    ring->eventfd = eventfd(0, EFD_CLOEXEC);
+    if (ring->eventfd < 0 || ftruncate(ring->memfd, (off_t)(sizeof(shm_ring_header_t) + rounded)) < 0 ||
+        shm_ring_map(ring, sizeof(shm_ring_header_t) + rounded) < 0) {
+        if (ring->eventfd >= 0) {
+            close(ring->eventfd);
+        }
+        close(ring->memfd);
+        return -1;
+    }
+
+    ring->header->magic = SHM_RING_MAGIC;
+    ring->header->version = SHM_RING_VERSION;
+    ring->header->capacity = rounded;
+    ring->capacity = rounded;
+    atomic_init(&ring->header->head, 0);
+    atomic_init(&ring->header->tail, 0);
+    atomic_init(&ring->header->consumer_waiting, 0);
+    atomic_init(&ring->header->closed, 0);
+    atomic_init(&ring->header->dropped, 0);
+    return 0;
+}
+
+/**
+ * @brief Maps a ring received from the producer on the consumer side.
+ *
+ * @param ring The ring to initialize.
+ * @param memfd The memfd holding the ring.
+ * @param eventfd The eventfd the producer signals.
+ *
+ * @return int 0 on success, -1 if the memfd doesn't hold a valid ring.
+ */
+int shm_ring_attach(shm_ring_t *ring, int memfd, int eventfd) {
+    struct stat info;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->memfd = memfd;
+    ring->eventfd = eventfd;
+    if (fstat(memfd, &info) < 0 || (size_t)info.st_size <= sizeof(shm_ring_header_t) ||
+        shm_ring_map(ring, (size_t)info.st_size) < 0) {
+        return -1;
+    }
+    if (ring->header->magic != SHM_RING_MAGIC || ring->header->version != SHM_RING_VERSION ||
+        sizeof(shm_ring_header_t) + ring->header->capacity != ring->mapped_size) {
+        munmap(ring->header, ring->mapped_size);
+        ring->header = NULL;
+        return -1;
+    }
+    ring->capacity = ring->header->capacity;
+    return 0;
+}
+
+/**
+ * @brief Appends a message to the ring and wakes the consumer if it is sleeping.
+ *
+ * Only the tail is read from the shared header. A tail behind the oldest unread record or
+ * ahead of the head can only come from a corrupted consumer: nothing is written, and the
+ * caller is expected to close the ring.
+ *
+ * @param ring The ring, on the producer side.
+ * @param message The message.
+ * @param length The length of the message in bytes.
+ *
+ * @return int 0 on success, -1 with errno set to ENOBUFS if the ring has no room for the
+ *         message yet, to EMSGSIZE if the message can never fit and was dropped, or to EPROTO
+ *         if the tail is invalid.
+ */
+int shm_ring_write(shm_ring_t *ring, const void *message, size_t length) {
+    shm_ring_header_t *header = ring->header;
+    uint64_t head = ring->head;
+    uint64_t tail = atomic_load_explicit(&header->tail, memory_order_acquire);
+    uint32_t record_length = (uint32_t)length;
+
+    if (head - tail > ring->capacity) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (length > UINT32_MAX || length > ring->capacity - SHM_RING_RECORD_HEADER_SIZE) {
+        atomic_fetch_add_explicit(&header->dropped, 1, memory_order_relaxed);
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (ring->capacity - (head - tail) < SHM_RING_RECORD_HEADER_SIZE + length) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    shm_ring_copy_in(ring, head, &record_length, SHM_RING_RECORD_HEADER_SIZE);
+    shm_ring_copy_in(ring, head + SHM_RING_RECORD_HEADER_SIZE, message, length);
+    ring->head = head + SHM_RING_RECORD_HEADER_SIZE + length;
+    atomic_store_explicit(&header->head, ring->head, memory_order_release);
+
+    // Pairs with the fence in shm_ring_wait: either the consumer sees the new head, or this
+    // sees its waiting flag.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&header->consumer_waiting, memory_order_relaxed)) {
+        uint64_t one = 1;
+        if (write(ring->eventfd, &one, sizeof(one)) < 0) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Takes the next message out of the ring without blocking.
+ *
+ * A message that doesn't fit in the buffer is skipped, so the next call reads the one after
+ * it.
+ *
+ * @param ring The ring, on the consumer side.
+ * @param buffer The buffer receiving the message.
+ * @param size The size of the buffer.
+ *
+ * @return long The length of the message, 0 if the ring is empty, or -1 with errno set to
+ *         EPIPE if the ring is empty and closed, to EMSGSIZE if the message was skipped, or to
+ *         EPROTO if the ring is corrupted.
+ */
+long shm_ring_read(shm_ring_t *ring, void *buffer, size_t size) {
+    shm_ring_header_t *header = ring->header;
+    uint64_t tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_acquire);
+    uint32_t record_length;
+
+    if (head == tail) {
+        if (atomic_load_explicit(&header->closed, memory_order_acquire)) {
+            errno = EPIPE;
+            return -1;
+        }
+        return 0;
+    }
+    shm_ring_copy_out(ring, tail, &record_length, SHM_RING_RECORD_HEADER_SIZE);
+    if (head - tail > ring->capacity || SHM_RING_RECORD_HEADER_SIZE + (uint64_t)record_length > head - tail) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (record_length > size) {
+        atomic_store_explicit(&header->tail, tail + SHM_RING_RECORD_HEADER_SIZE + record_length, memory_order_release);
+        errno = EMSGSIZE;
+        return -1;
+    }
+    shm_ring_copy_out(ring, tail + SHM_RING_RECORD_HEADER_SIZE, buffer, record_length);
+    atomic_store_explicit(&header->tail, tail + SHM_RING_RECORD_HEADER_SIZE + record_length, memory_order_release);
+    return (long)record_length;
+}
+
+/**
+ * @brief Sleeps until the ring holds a message or is closed.
+ *
+ * @param ring The ring, on the consumer side.
+ *
+ * @return int 0 on success, -1 if waiting on the eventfd failed.
+ */
+int shm_ring_wait(shm_ring_t *ring) {
+    shm_ring_header_t *header = ring->header;
+    uint64_t value;
+    int result = 0;
+
+    atomic_store_explicit(&header->consumer_waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&header->head, memory_order_acquire) ==
+            atomic_load_explicit(&header->tail, memory_order_relaxed) &&
+        !atomic_load_explicit(&header->closed, memory_order_acquire)) {
+        if (read(ring->eventfd, &value, sizeof(value)) < 0) {
+            result = -1;
+        }
+    }
+    atomic_store_explicit(&header->consumer_waiting, 0, memory_order_relaxed);
+    return result;
+}
+
+/**
+ * @brief Marks the ring closed, wakes the consumer, and releases this side's mapping.
+ *
+ * @param ring The ring.
+ *
+ * @return void
+ */
+void shm_ring_close(shm_ring_t *ring) {
+    uint64_t one = 1;
+
+    if (ring->header) {
+        atomic_store_explicit(&ring->header->closed, 1, memory_order_release);
+        if (write(ring->eventfd, &one, sizeof(one)) < 0) {
+            perror("ERROR: eventfd write failed");
+        }
+        munmap(ring->header, ring->mapped_size);
+        ring->header = NULL;
+    }
+    close(ring->eventfd);
+    close(ring->memfd);
+}
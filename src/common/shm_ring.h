@@ -0,0 +1,59 @@
+/**
+ * @file shm_ring.h
+ * @brief Single-producer single-consumer message ring in shared memory.
+ *
+ * The ring lives in a memfd mapped by both processes: a header holding the producer and
+ * consumer positions on separate cache lines, followed by a power-of-two data area. Each
+ * record is a 4-byte native-endian length followed by the message bytes, and records wrap
+ * around the end of the data area. Writing never blocks: a message that doesn't fit yet is
+ * refused, and the producer decides whether to wait for the consumer; a message larger than
+ * the whole data area is dropped and counted in the header. An eventfd wakes the consumer, and it is only written
+ * when the consumer announced it is about to sleep, so a busy consumer costs no syscalls.
+ *
+ * The consumer maps the ring writable and is not trusted by the producer: the producer keeps
+ * its own copies of the capacity and the head, and refuses to write once the consumer's tail
+ * is no longer consistent with them.
+ */
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_RING_MAGIC 0x474E4952
+#define SHM_RING_VERSION 1
+#define SHM_RING_MIN_CAPACITY 4096
+#define SHM_RING_MAX_CAPACITY (64 * 1024 * 1024)
+#define SHM_RING_RECORD_HEADER_SIZE 4
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    alignas(64) _Atomic uint64_t head;
+    alignas(64) _Atomic uint64_t tail;
+    alignas(64) _Atomic uint32_t consumer_waiting;
+    _Atomic uint32_t closed;
+    _Atomic uint64_t dropped;
+} shm_ring_header_t;
+
+typedef struct {
+    shm_ring_header_t *header;
+    unsigned char *data;
+    size_t mapped_size;
+    uint64_t capacity;
+    uint64_t head;
+    int memfd;
+    int eventfd;
+} shm_ring_t;
+
+int shm_ring_create(shm_ring_t *ring, size_t capacity);
+int shm_ring_attach(shm_ring_t *ring, int memfd, int eventfd);
+int shm_ring_write(shm_ring_t *ring, const void *message, size_t length);
+long shm_ring_read(shm_ring_t *ring, void *buffer, size_t size);
+int shm_ring_wait(shm_ring_t *ring);
+void shm_ring_close(shm_ring_t *ring);
+
+#endif // SHM_RING_H
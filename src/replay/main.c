@@ -0,0 +1,78 @@
+/**
+ * @file main.c
+ * @brief Entry point for the traffic replayer.
+ *
+ * The replayer sends a capture recorded by a server started with `--record` to another
+ * server, to reproduce its load and compare server builds.
+ */
+#include "replay.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Prints the command-line usage of the replayer.
+ *
+ * @param program The name the replayer was started with.
+ *
+ * @return void
+ */
+static void print_usage(const char *program) {
+    printf("Usage: %s <capture> <ip> <port> [--speed <factor>|max] [--save <report>] [--baseline <report>]\n",
+           program);
+}
+
+/**
+ * @brief Main function that replays a capture against a server.
+ *
+ * `--speed` scales the pace of the capture: 1 (the default) replays it at its original
+ * pace, 10 ten times faster, and `max` as fast as the server accepts it. `--save` writes the
+ * results to a report, and `--baseline` compares the results with a report saved before,
+ * for instance against another server build.
+ *
+ * @param argc Number of command-line arguments.
+ * @param argv Array of command-line argument strings.
+ * @return int Returns EXIT_SUCCESS on successful execution or EXIT_FAILURE on error.
+ */
+int main(int argc, char **argv) {
+    static const struct option long_options[] = {
+        {"speed", required_argument, NULL, 's'},
+        {"save", required_argument, NULL, 'o'},
+        {"baseline", required_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0}
+    };
+    replay_options_t options = { NULL, NULL, 0, 1.0, NULL, NULL };
+    int option;
+
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (option) {
+        case 's':
+            options.speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg);
+            if (options.speed < 0 || (options.speed == 0 && strcmp(optarg, "max") != 0)) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            options.save = optarg;
+            break;
+        case 'b':
+            options.baseline = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 3) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    options.capture = argv[optind];
+    options.host = argv[optind + 1];
+    options.port = atoi(argv[optind + 2]);
+
+    return replay_run(&options) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
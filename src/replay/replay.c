@@ -0,0 +1,644 @@
+/**
+ * @file replay.c
+ * @brief Implements the replayer sending a traffic capture to a server again.
+ *
+ * The replayer is a single event loop over non-blocking sockets, so a server that stops
+ * reading never stalls the other connections and the replayer always drains what the
+ * server sends. The bytes sent and received on each connection are split into messages to
+ * match the answers with the requests waiting for them.
+ */
+#define _GNU_SOURCE
+#include "replay.h"
+#include "../common/capture.h"
+#include "../common/clock.h"
+#include "../common/framing.h"
+#include "../libs/cJSON/cJSON.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t size;
+} byte_buffer_t;
+
+typedef struct {
+    int fd;
+    int closing;
+    int unframed;
+    byte_buffer_t output;
+    size_t output_offset;
+    byte_buffer_t sent;
+    byte_buffer_t received;
+    const char *awaiting[REPLAY_MAX_AWAITING];
+    unsigned long long awaiting_since[REPLAY_MAX_AWAITING];
+    int awaiting_head;
+    int awaiting_count;
+} connection_t;
+
+typedef struct {
+    unsigned long long records;
+    unsigned long long connections;
+    unsigned long long failed_connections;
+    unsigned long long messages;
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+    unsigned long long *latencies;
+    size_t latency_count;
+    size_t latency_size;
+} replay_stats_t;
+
+static connection_t **connections = NULL;
+static size_t connection_slots = 0;
+static replay_stats_t stats;
+static unsigned long long last_send = 0;
+
+/**
+ * @brief Appends bytes to a buffer.
+ *
+ * @param buffer The buffer.
+ * @param data The bytes to append.
+ * @param length The number of bytes.
+ *
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int buffer_append(byte_buffer_t *buffer, const char *data, size_t length) {
+    if (buffer->length + length + 1 > buffer->size) {
+        size_t size = buffer->size ? buffer->size : 4096;
+        char *grown;
+        while (size < buffer->length + length + 1) {
+            size *= 2;
+        }
+        grown = realloc(buffer->data, size);
+        if (!grown) {
+            return -1;
+        }
+        buffer->data = grown;
+        buffer->size = size;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return 0;
+}
+
+/**
+ * @brief Removes bytes from the start of a buffer.
+ *
+ * @param buffer The buffer.
+ * @param length The number of bytes to remove.
+ *
+ * @return void
+ */
+static void buffer_consume(byte_buffer_t *buffer, size_t length) {
+    memmove(buffer->data, buffer->data + length, buffer->length - length);
+    buffer->length -= length;
+}
+
+/**
+ * @brief Returns the answer the server sends to a request.
+ *
+ * @param type The type of the request.
+ * @return const char* The type of the answer, or the operation of a RESPONSE answer, or NULL
+ *                     if the request is not answered directly.
+ */
+static const char *expected_answer(const char *type) {
+    if (strcmp(type, "IDENTIFY") == 0) {
+        return "IDENTIFY";
+    } else if (strcmp(type, "USERS") == 0) {
+        return "USER_LIST";
+    } else if (strcmp(type, "METRICS") == 0) {
+        return "METRICS";
+    } else if (strcmp(type, "SEARCH") == 0) {
+        return "SEARCH_RESULTS";
+    }
+    return NULL;
+}
+
+/**
+ * @brief Returns the type of a message, or the operation of a RESPONSE message.
+ *
+ * @param json_msg The parsed message.
+ * @return const char* The type or operation, or NULL if the message has none.
+ */
+static const char *message_kind(cJSON *json_msg) {
+    cJSON *type = cJSON_GetObjectItemCaseSensitive(json_msg, "type");
+    cJSON *operation = cJSON_GetObjectItemCaseSensitive(json_msg, "operation");
+
+    if (!cJSON_IsString(type)) {
+        return NULL;
+    }
+    if (strcmp(type->valuestring, "RESPONSE") == 0) {
+        return cJSON_IsString(operation) ? operation->valuestring : NULL;
+    }
+    return type->valuestring;
+}
+
+/**
+ * @brief Splits a buffer of JSON messages and passes each complete one to a callback.
+ *
+ * @param connection The connection the bytes belong to.
+ * @param buffer The buffer, from which the complete messages are removed.
+ * @param handle Called with each parsed message.
+ *
+ * @return void
+ */
+static void split_messages(connection_t *connection, byte_buffer_t *buffer,
+                           void (*handle)(connection_t *, cJSON *)) {
+    size_t offset = 0;
+
+    while (!connection->unframed && offset < buffer->length) {
+        long length = json_frame_length(buffer->data + offset, buffer->length - offset);
+        char next;
+        cJSON *json_msg;
+
+        if (length < 0) {
+            // Compressed or otherwise unframed traffic: stop timing this connection.
+            connection->unframed = 1;
+            offset = buffer->length;
+            break;
+        }
+        if (length == 0) {
+            break;
+        }
+        next = buffer->data[offset + (size_t)length];
+        buffer->data[offset + (size_t)length] = '\0';
+        json_msg = cJSON_Parse(buffer->data + offset);
+        buffer->data[offset + (size_t)length] = next;
+        if (json_msg) {
+            handle(connection, json_msg);
+            cJSON_Delete(json_msg);
+        }
+        offset += (size_t)length;
+    }
+    buffer_consume(buffer, connection->unframed ? buffer->length : offset);
+}
+
+/**
+ * @brief Counts a message sent and starts timing it if the server answers it.
+ *
+ * @param connection The connection the message was sent on.
+ * @param json_msg The parsed message.
+ *
+ * @return void
+ */
+static void handle_sent_message(connection_t *connection, cJSON *json_msg) {
+    const char *kind = message_kind(json_msg);
+    const char *answer = kind ? expected_answer(kind) : NULL;
+
+    stats.messages++;
+    if (answer && connection->awaiting_count < REPLAY_MAX_AWAITING) {
+        int slot = (connection->awaiting_head + connection->awaiting_count) % REPLAY_MAX_AWAITING;
+        connection->awaiting[slot] = answer;
+        connection->awaiting_since[slot] = clock_monotonic_ns();
+        connection->awaiting_count++;
+    }
+}
+
+/**
+ * @brief Records the latency of the request a received message answers.
+ *
+ * @param connection The connection the message was received on.
+ * @param json_msg The parsed message.
+ *
+ * @return void
+ */
+static void handle_received_message(connection_t *connection, cJSON *json_msg) {
+    const char *kind = message_kind(json_msg);
+    int head = connection->awaiting_head;
+
+    if (!kind || connection->awaiting_count == 0 || strcmp(kind, connection->awaiting[head]) != 0) {
+        return;
+    }
+    if (stats.latency_count == stats.latency_size) {
+        size_t size = stats.latency_size ? stats.latency_size * 2 : 1024;
+        unsigned long long *grown = realloc(stats.latencies, size * sizeof(unsigned long long));
+        if (!grown) {
+            return;
+        }
+        stats.latencies = grown;
+        stats.latency_size = size;
+    }
+    stats.latencies[stats.latency_count++] = clock_monotonic_ns() - connection->awaiting_since[head];
+    connection->awaiting_head = (head + 1) % REPLAY_MAX_AWAITING;
+    connection->awaiting_count--;
+}
+
+/**
+ * @brief Closes a connection and forgets it.
+ *
+ * @param id The capture ID of the connection.
+ *
+ * @return void
+ */
+static void close_connection(unsigned int id) {
+    connection_t *connection = connections[id];
+
+    close(connection->fd);
+    free(connection->output.data);
+    free(connection->sent.data);
+    free(connection->received.data);
+    free(connection);
+    connections[id] = NULL;
+}
+
+/**
+ * @brief Writes as much pending output of a connection as the socket accepts.
+ *
+ * Once a connection the capture closed has sent everything, only its sending side is shut
+ * down, so the answers still on their way are read until the server closes it too.
+ *
+ * @param id The capture ID of the connection.
+ *
+ * @return void
+ */
+static void flush_connection(unsigned int id) {
+    connection_t *connection = connections[id];
+
+    while (connection->output_offset < connection->output.length) {
+        ssize_t written = send(connection->fd, connection->output.data + connection->output_offset,
+                               connection->output.length - connection->output_offset, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                connection->output_offset = connection->output.length;
+            }
+            break;
+        }
+        connection->output_offset += (size_t)written;
+        stats.bytes_sent += (unsigned long long)written;
+        last_send = clock_monotonic_ns();
+    }
+    if (connection->output_offset == connection->output.length) {
+        connection->output.length = 0;
+        connection->output_offset = 0;
+        if (connection->closing == 1) {
+            shutdown(connection->fd, SHUT_WR);
+            connection->closing = 2;
+        }
+    }
+}
+
+/**
+ * @brief Reads what the server sent on a connection.
+ *
+ * @param id The capture ID of the connection.
+ *
+ * @return void
+ */
+static void receive_connection(unsigned int id) {
+    connection_t *connection = connections[id];
+    char data[65536];
+    ssize_t received;
+
+    while ((received = recv(connection->fd, data, sizeof(data), MSG_DONTWAIT)) > 0) {
+        stats.bytes_received += (unsigned long long)received;
+        if (!connection->unframed && buffer_append(&connection->received, data, (size_t)received) == 0) {
+            split_messages(connection, &connection->received, handle_received_message);
+        }
+    }
+    if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        close_connection(id);
+    }
+}
+
+/**
+ * @brief Opens the connection of an OPEN record.
+ *
+ * @param id The capture ID of the connection.
+ * @param address The address of the server.
+ *
+ * @return void
+ */
+static void open_connection(unsigned int id, const struct sockaddr_in *address) {
+    connection_t *connection;
+
+    if (id >= connection_slots) {
+        size_t slots = connection_slots ? connection_slots : 64;
+        connection_t **grown;
+        while (slots <= id) {
+            slots *= 2;
+        }
+        grown = realloc(connections, slots * sizeof(connection_t *));
+        if (!grown) {
+            return;
+        }
+        memset(grown + connection_slots, 0, (slots - connection_slots) * sizeof(connection_t *));
+        connections = grown;
+        connection_slots = slots;
+    }
+    if (connections[id]) {
+        close_connection(id);
+    }
+
+    connection = calloc(1, sizeof(connection_t));
+    if (!connection) {
+        return;
+    }
+    connection->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connection->fd < 0 || connect(connection->fd, (const struct sockaddr *)address, sizeof(*address)) < 0) {
+        if (connection->fd >= 0) {
+            close(connection->fd);
+        }
+        free(connection);
+        stats.failed_connections++;
+        return;
+    }
+    fcntl(connection->fd, F_SETFL, fcntl(connection->fd, F_GETFL, 0) | O_NONBLOCK);
+    connections[id] = connection;
+    stats.connections++;
+}
+
+/**
+ * @brief Applies a record of the capture.
+ *
+ * @param record The record.
+ * @param data The data of a DATA record.
+ * @param address The address of the server.
+ *
+ * @return void
+ */
+static void apply_record(const capture_record_t *record, const char *data, const struct sockaddr_in *address) {
+    unsigned int id = record->connection;
+    connection_t *connection;
+
+    stats.records++;
+    if (record->event == CAPTURE_OPEN) {
+        open_connection(id, address);
+        return;
+    }
+    if (id >= connection_slots || !connections[id]) {
+        return;
+    }
+    connection = connections[id];
+    if (record->event == CAPTURE_DATA) {
+        buffer_append(&connection->output, data, record->length);
+        if (!connection->unframed && buffer_append(&connection->sent, data, record->length) == 0) {
+            split_messages(connection, &connection->sent, handle_sent_message);
+        }
+        flush_connection(id);
+    } else if (record->event == CAPTURE_CLOSE) {
+        connection->closing = 1;
+        flush_connection(id);
+    }
+}
+
+/**
+ * @brief Waits for socket events and handles them.
+ *
+ * @param timeout_ns How long to wait at most, in nanoseconds.
+ *
+ * @return int The number of open connections.
+ */
+static int poll_connections(unsigned long long timeout_ns) {
+    static struct pollfd *fds = NULL;
+    static unsigned int *ids = NULL;
+    static size_t fds_size = 0;
+    struct timespec timeout = { (time_t)(timeout_ns / 1000000000ULL), (long)(timeout_ns % 1000000000ULL) };
+    size_t count = 0;
+
+    if (fds_size < connection_slots) {
+        struct pollfd *grown_fds = realloc(fds, connection_slots * sizeof(struct pollfd));
+        unsigned int *grown_ids = grown_fds ? realloc(ids, connection_slots * sizeof(unsigned int)) : NULL;
+        if (grown_fds) {
+            fds = grown_fds;
+        }
+        if (!grown_ids) {
+            return 0;
+        }
+        ids = grown_ids;
+        fds_size = connection_slots;
+    }
+    for (unsigned int id = 0; id < connection_slots; ++id) {
+        if (connections[id]) {
+            fds[count].fd = connections[id]->fd;
+            fds[count].events = POLLIN | (connections[id]->output.length ? POLLOUT : 0);
+            fds[count].revents = 0;
+            ids[count++] = id;
+        }
+    }
+
+    if (ppoll(fds, count, &timeout, NULL) <= 0) {
+        return (int)count;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if ((fds[i].revents & POLLOUT) && connections[ids[i]]) {
+            flush_connection(ids[i]);
+        }
+        if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && connections[ids[i]]) {
+            receive_connection(ids[i]);
+        }
+    }
+    return (int)count;
+}
+
+/**
+ * @brief Compares two latencies, for sorting.
+ *
+ * @param a The first latency.
+ * @param b The second latency.
+ * @return int The comparison result.
+ */
+static int compare_latencies(const void *a, const void *b) {
+    unsigned long long first = *(const unsigned long long *)a;
+    unsigned long long second = *(const unsigned long long *)b;
+
+    return (first > second) - (first < second);
+}
+
+/**
+ * @brief Returns a percentile of the sorted latencies.
+ *
+ * @param percentile The percentile, between 0 and 100.
+ * @return double The latency in microseconds, or 0 if none was measured.
+ */
+static double latency_percentile(double percentile) {
+    size_t index;
+
+    if (stats.latency_count == 0) {
+        return 0;
+    }
+    index = (size_t)(percentile / 100.0 * (double)(stats.latency_count - 1) + 0.5);
+    return stats.latencies[index] / 1000.0;
+}
+
+/**
+ * @brief Prints a result, compared with the baseline report if there is one.
+ *
+ * @param baseline The baseline report, or NULL.
+ * @param name The name of the result in the reports.
+ * @param label The label printed.
+ * @param value The value.
+ * @param save The report being written, or NULL.
+ *
+ * @return void
+ */
+static void report_value(FILE *baseline, const char *name, const char *label, double value, FILE *save) {
+    char line[128];
+    char key[64];
+    double previous;
+
+    printf("  %-22s %14.1f", label, value);
+    if (baseline) {
+        rewind(baseline);
+        while (fgets(line, sizeof(line), baseline)) {
+            if (sscanf(line, "%63s %lf", key, &previous) == 2 && strcmp(key, name) == 0) {
+                printf("   baseline %14.1f", previous);
+                if (previous != 0) {
+                    printf("  %+7.1f%%", (value - previous) / previous * 100.0);
+                }
+                break;
+            }
+        }
+    }
+    printf("\n");
+    if (save) {
+        fprintf(save, "%s %.3f\n", name, value);
+    }
+}
+
+/**
+ * @brief Prints the results of the replay.
+ *
+ * @param options The replay options naming the report files.
+ * @param elapsed_ns The time from the start of the replay to the last byte sent.
+ * @param capture_ns The duration of the capture.
+ *
+ * @return void
+ */
+static void report(const replay_options_t *options, unsigned long long elapsed_ns, unsigned long long capture_ns) {
+    double seconds = elapsed_ns / 1e9;
+    FILE *baseline = options->baseline ? fopen(options->baseline, "r") : NULL;
+    FILE *save = options->save ? fopen(options->save, "w") : NULL;
+
+    if (options->baseline && !baseline) {
+        perror("ERROR: open baseline report failed");
+    }
+    if (options->save && !save) {
+        perror("ERROR: create report failed");
+    }
+    qsort(stats.latencies, stats.latency_count, sizeof(unsigned long long), compare_latencies);
+
+    printf("Replayed %llu record(s) on %llu connection(s) in %.3f s, the capture lasted %.3f s\n",
+           stats.records, stats.connections, seconds, capture_ns / 1e9);
+    if (stats.failed_connections) {
+        printf("%llu connection(s) could not be opened\n", stats.failed_connections);
+    }
+    printf("Sent %llu message(s) in %llu bytes, received %llu bytes, timed %zu answer(s)\n",
+           stats.messages, stats.bytes_sent, stats.bytes_received, stats.latency_count);
+    report_value(baseline, "messages_per_second", "messages/s", seconds > 0 ? stats.messages / seconds : 0, save);
+    report_value(baseline, "sent_mb_per_second", "sent MB/s", seconds > 0 ? stats.bytes_sent / seconds / 1e6 : 0, save);
+    report_value(baseline, "received_mb_per_second", "received MB/s",
+                 seconds > 0 ? stats.bytes_received / seconds / 1e6 : 0, save);
+    report_value(baseline, "latency_p50_us", "answer p50 (us)", latency_percentile(50), save);
+    report_value(baseline, "latency_p90_us", "answer p90 (us)", latency_percentile(90), save);
+    report_value(baseline, "latency_p99_us", "answer p99 (us)", latency_percentile(99), save);
+    report_value(baseline, "latency_max_us", "answer max (us)", latency_percentile(100), save);
+
+    if (baseline) {
+        fclose(baseline);
+    }
+    if (save) {
+        fclose(save);
+        printf("Saved the report to %s\n", options->save);
+    }
+}
+
+/**
+ * @brief Replays a capture and reports the results.
+ *
+ * Records are applied when their time, divided by the speed factor, has come; a speed of 0
+ * applies them as fast as possible, polling the sockets every REPLAY_POLL_BATCH records.
+ * After the last record, the replayer keeps reading answers for up to REPLAY_DRAIN_MS.
+ *
+ * @param options The capture, the server and how to replay.
+ *
+ * @return int 0 on success, -1 if the capture could not be read.
+ */
+int replay_run(const replay_options_t *options) {
+    struct sockaddr_in address;
+    static char data[CAPTURE_MAX_DATA];
+    capture_record_t record;
+    unsigned long long capture_start;
+    unsigned long long start;
+    unsigned long long last_time = 0;
+    unsigned long long drain_deadline;
+    int batch = 0;
+    int has_record;
+    FILE *file = fopen(options->capture, "rb");
+
+    if (!file) {
+        perror("ERROR: open capture failed");
+        return -1;
+    }
+    if (capture_read_file_header(file, &capture_start) < 0) {
+        printf("%s is not a capture file\n", options->capture);
+        fclose(file);
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)options->port);
+    if (inet_pton(AF_INET, options->host, &address.sin_addr) != 1) {
+        printf("Invalid server address: %s\n", options->host);
+        fclose(file);
+        return -1;
+    }
+
+    start = clock_monotonic_ns();
+    has_record = capture_read_record(file, &record, data);
+    while (has_record > 0) {
+        unsigned long long now = clock_monotonic_ns();
+        unsigned long long due = options->speed > 0 ? start + (unsigned long long)(record.time / options->speed) : now;
+
+        if (now >= due) {
+            apply_record(&record, data, &address);
+            last_time = record.time;
+            has_record = capture_read_record(file, &record, data);
+            if (++batch < REPLAY_POLL_BATCH) {
+                continue;
+            }
+            due = now;
+        }
+        batch = 0;
+        poll_connections(due > now ? due - now : 0);
+    }
+    if (has_record < 0) {
+        printf("The capture is truncated or corrupt, stopping there\n");
+    }
+    fclose(file);
+
+    drain_deadline = clock_monotonic_ns() + REPLAY_DRAIN_MS * 1000000ULL;
+    while (1) {
+        unsigned long long now = clock_monotonic_ns();
+        int pending = 0;
+
+        for (unsigned int id = 0; id < connection_slots; ++id) {
+            if (connections[id] && (connections[id]->awaiting_count || connections[id]->output.length)) {
+                pending = 1;
+            }
+        }
+        if (!pending || now >= drain_deadline) {
+            break;
+        }
+        poll_connections(drain_deadline - now);
+    }
+
+    report(options, last_send > start ? last_send - start : 0, last_time);
+    for (unsigned int id = 0; id < connection_slots; ++id) {
+        if (connections[id]) {
+            close_connection(id);
+        }
+    }
+    free(connections);
+    free(stats.latencies);
+    return 0;
+}
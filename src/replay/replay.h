@@ -0,0 +1,37 @@
+/**
+ * @file replay.h
+ * @brief Declares the replayer sending a traffic capture to a server again.
+ *
+ * Every connection of the capture is opened again over TCP, and its recorded bytes are
+ * sent at their original pace, scaled by a speed factor, or as fast as the server accepts
+ * them. Requests that the server answers directly (IDENTIFY, USERS, METRICS and SEARCH) are
+ * timed until their answer arrives. At the end the replayer reports the throughput and the
+ * answer latencies, and can compare them with the report of a previous run.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#define REPLAY_MAX_AWAITING 1024
+#define REPLAY_DRAIN_MS 2000
+#define REPLAY_POLL_BATCH 64
+
+typedef struct {
+    const char *capture;
+    const char *host;
+    int port;
+    double speed;
+    const char *save;
+    const char *baseline;
+} replay_options_t;
+
+/**
+ * @brief Replays a capture and reports the results.
+ *
+ * @param options The capture, the server and how to replay.
+ *
+ * @return int 0 on success, -1 if the capture could not be read.
+ */
+int replay_run(const replay_options_t *options);
+
+#endif // REPLAY_H
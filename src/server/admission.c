@@ -0,0 +1,244 @@
+/**
+ * @file admission.c
+ * @brief Implements the admission control of accepted connections.
+ *
+ * Connections are counted per IPv4 address in an open-addressing table sized for the
+ * global limit at startup, so admitting a connection never allocates. Local clients
+ * connected through the Unix domain socket only count towards the global limit.
+ */
+#include "admission.h"
+#include "client_manager.h"
+#include "metrics.h"
+#include "../common/clock.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef struct {
+    in_addr_t address;
+    int count;
+} address_slot_t;
+
+static const char *rejections[] = {
+    [ADMISSION_SERVER_FULL] = "{\"type\":\"RESPONSE\",\"operation\":\"CONNECT\",\"result\":\"SERVER_FULL\"}",
+    [ADMISSION_TOO_MANY_CONNECTIONS] =
+        "{\"type\":\"RESPONSE\",\"operation\":\"CONNECT\",\"result\":\"TOO_MANY_CONNECTIONS\"}",
+    [ADMISSION_RATE_LIMITED] = "{\"type\":\"RESPONSE\",\"operation\":\"CONNECT\",\"result\":\"RATE_LIMITED\"}",
+};
+
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int connection_limit = MAX_CLIENTS;
+static int address_limit = 0;
+static int identify_deadline = ADMISSION_DEFAULT_IDENTIFY_TIMEOUT;
+static int connections = 0;
+
+static address_slot_t *slots = NULL;
+static unsigned int slot_bits = 0;
+
+static double accept_tokens = 0;
+static int accept_rate_limit = 0;
+static unsigned long long accept_refilled_ns = 0;
+
+/**
+ * @brief Finds the home slot of an address in the per-address table.
+ *
+ * @param address The IPv4 address, in network byte order.
+ *
+ * @return size_t The index of the slot.
+ */
+static size_t slot_of(in_addr_t address) {
+    return (uint32_t)((uint32_t)address * 2654435761u) >> (32 - slot_bits);
+}
+
+/**
+ * @brief Finds the slot holding an address, or the empty slot where it would go.
+ *
+ * Called with the admission lock held.
+ *
+ * @param address The IPv4 address, in network byte order.
+ *
+ * @return address_slot_t* The slot.
+ */
+static address_slot_t *find_slot(in_addr_t address) {
+    size_t mask = ((size_t)1 << slot_bits) - 1;
+    size_t index = slot_of(address);
+
+    while (slots[index].count > 0 && slots[index].address != address) {
+        index = (index + 1) & mask;
+    }
+    return &slots[index];
+}
+
+/**
+ * @brief Empties a slot, moving back the entries that probed past it.
+ *
+ * Called with the admission lock held.
+ *
+ * @param slot The slot to empty.
+ *
+ * @return void
+ */
+static void remove_slot(address_slot_t *slot) {
+    size_t mask = ((size_t)1 << slot_bits) - 1;
+    size_t hole = (size_t)(slot - slots);
+    size_t index = (hole + 1) & mask;
+
+    while (slots[index].count > 0) {
+        size_t home = slot_of(slots[index].address);
+
+        if (((index - home) & mask) >= ((index - hole) & mask)) {
+            slots[hole] = slots[index];
+            hole = index;
+        }
+        index = (index + 1) & mask;
+    }
+    slots[hole].count = 0;
+}
+
+/**
+ * @brief Sets the limits applied to accepted connections.
+ *
+ * @param max_connections The maximum number of connections, at most MAX_CLIENTS, or 0 for
+ *                        MAX_CLIENTS.
+ * @param max_per_address The maximum number of connections from one IPv4 address, or 0 for
+ *                        no limit.
+ * @param accept_rate The maximum number of connections accepted per second, or 0 for no
+ *                    limit.
+ * @param identify_timeout The seconds a connection has to identify, or 0 for no deadline.
+ *
+ * @return int 0 on success, -1 on invalid limits or allocation failure.
+ */
+int admission_init(int max_connections, int max_per_address, int accept_rate, int identify_timeout) {
+    if (max_connections < 0 || max_connections > MAX_CLIENTS || max_per_address < 0 || accept_rate < 0 ||
+        identify_timeout < 0) {
+        printf("Invalid connection limits\n");
+        return -1;
+    }
+    connection_limit = max_connections ? max_connections : MAX_CLIENTS;
+    address_limit = max_per_address;
+    accept_rate_limit = accept_rate;
+    accept_tokens = accept_rate;
+    accept_refilled_ns = clock_monotonic_ns();
+    identify_deadline = identify_timeout;
+
+    if (address_limit > 0) {
+        slot_bits = 1;
+        while (((size_t)1 << slot_bits) < (size_t)connection_limit * 2) {
+            slot_bits++;
+        }
+        slots = calloc((size_t)1 << slot_bits, sizeof(address_slot_t));
+        if (!slots) {
+            perror("ERROR: calloc failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Decides whether an accepted connection may stay.
+ *
+ * Called by the accepting thread only. An admitted connection counts towards the limits
+ * until admission_release.
+ *
+ * @param address The address of a TCP client, or NULL for a local client.
+ *
+ * @return int ADMISSION_ACCEPTED, or the reason the connection is refused.
+ */
+int admission_admit(const struct sockaddr_in *address) {
+    address_slot_t *slot = NULL;
+
+    if (accept_rate_limit > 0) {
+        unsigned long long now = clock_monotonic_ns();
+
+        accept_tokens += (double)(now - accept_refilled_ns) * accept_rate_limit / 1e9;
+        if (accept_tokens > accept_rate_limit) {
+            accept_tokens = accept_rate_limit;
+        }
+        accept_refilled_ns = now;
+        if (accept_tokens < 1) {
+            return ADMISSION_RATE_LIMITED;
+        }
+        accept_tokens--;
+    }
+
+    pthread_mutex_lock(&admission_mutex);
+    if (connections >= connection_limit) {
+        pthread_mutex_unlock(&admission_mutex);
+        return ADMISSION_SERVER_FULL;
+    }
+    if (slots && address) {
+        slot = find_slot(address->sin_addr.s_addr);
+        if (slot->count >= address_limit) {
+            pthread_mutex_unlock(&admission_mutex);
+            return ADMISSION_TOO_MANY_CONNECTIONS;
+        }
+        slot->address = address->sin_addr.s_addr;
+        slot->count++;
+    }
+    connections++;
+    metrics_set(METRIC_CONNECTIONS_ACTIVE, (unsigned long long)connections);
+    pthread_mutex_unlock(&admission_mutex);
+
+    return ADMISSION_ACCEPTED;
+}
+
+/**
+ * @brief Stops counting a connection that closed.
+ *
+ * @param address The address the connection was admitted with, or NULL for a local client.
+ *
+ * @return void
+ */
+void admission_release(const struct sockaddr_in *address) {
+    pthread_mutex_lock(&admission_mutex);
+    if (slots && address) {
+        address_slot_t *slot = find_slot(address->sin_addr.s_addr);
+
+        if (slot->count > 0 && --slot->count == 0) {
+            remove_slot(slot);
+        }
+    }
+    connections--;
+    metrics_set(METRIC_CONNECTIONS_ACTIVE, (unsigned long long)connections);
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+/**
+ * @brief Tells a refused connection why and closes it.
+ *
+ * The response is written without blocking, since the accepting thread can't wait for a
+ * client that does not read. Whatever the client already sent is read first, so closing the
+ * socket does not reset the connection before the response arrives.
+ *
+ * @param sockfd The socket of the refused connection.
+ * @param reason The reason returned by admission_admit.
+ *
+ * @return void
+ */
+void admission_reject(int sockfd, int reason) {
+    const char *response = rejections[reason];
+    char discarded[1024];
+
+    if (send(sockfd, response, strlen(response), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        perror("ERROR: send rejection failed");
+    }
+    shutdown(sockfd, SHUT_WR);
+    for (int i = 0; i < 4 && recv(sockfd, discarded, sizeof(discarded), MSG_DONTWAIT) > 0; ++i) {
+    }
+    close(sockfd);
+    metrics_add(METRIC_CONNECTIONS_REJECTED, 1);
+}
+
+/**
+ * @brief Returns the seconds a new connection has to identify.
+ *
+ * @return int The deadline in seconds, or 0 for no deadline.
+ */
+int admission_identify_timeout(void) {
+    return identify_deadline;
+}
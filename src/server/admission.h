@@ -0,0 +1,30 @@
+/**
+ * @file admission.h
+ * @brief Admission control for accepted connections.
+ *
+ * Every accepted connection is checked against a global connection limit, a per-address
+ * limit and an accept-rate limit before anything is allocated for it. A refused connection
+ * receives a single `{"type":"RESPONSE","operation":"CONNECT","result":...}` message and is
+ * closed by the accepting thread, so a reconnect storm costs no thread and no memory. An
+ * admitted connection that does not identify within the IDENTIFY deadline is disconnected.
+ */
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <arpa/inet.h>
+
+#define ADMISSION_DEFAULT_IDENTIFY_TIMEOUT 10
+#define ADMISSION_ACCEPT_BACKOFF_MS 100
+
+#define ADMISSION_ACCEPTED 0
+#define ADMISSION_SERVER_FULL 1
+#define ADMISSION_TOO_MANY_CONNECTIONS 2
+#define ADMISSION_RATE_LIMITED 3
+
+int admission_init(int max_connections, int max_per_address, int accept_rate, int identify_timeout);
+int admission_admit(const struct sockaddr_in *address);
+void admission_release(const struct sockaddr_in *address);
+void admission_reject(int sockfd, int reason);
+int admission_identify_timeout(void);
+
+#endif // ADMISSION_H
@@ -3,13 +3,527 @@
  * @brief Manages the list of clients on the server.
  */
 #include "client_manager.h"
+#include "cluster.h"
+#include "connection.h"
+#include "gateway.h"
+#include "metrics.h"
+#include "trace.h"
+#include "../common/framing.h"
+#include "../libs/cJSON/cJSON.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 
 client_t *clients[MAX_CLIENTS];
 pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int next_client_id = 1;
+
+/**
+ * @brief Writes a whole buffer to a socket.
+ *
+ * Retries partial writes so compressed frames are never cut short.
+ *
+ * @param sockfd The socket to write to.
+ * @param data The bytes to write.
+ * @param length The number of bytes to write.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int write_all(int sockfd, const void *data, size_t length) {
+    const char *cursor = data;
+
+    while (length > 0) {
+        ssize_t written = write(sockfd, cursor, length);
+        if (written < 0) {
+            return -1;
+        }
+        cursor += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a message to the shared-memory ring of a client whose send lock is held.
+ *
+ * A full ring holds the writer back like a full socket: the writer checks every
+ * CLIENT_RING_POLL_MS whether the consumer made room, while later messages wait in the
+ * client's queue, until the client is disconnected as too slow and its socket is hung up. A
+ * client whose ring was corrupted, or is too small for the message, is disconnected.
+ *
+ * @param client The destination client.
+ * @param message The message to write.
+ * @param length The length of the message in bytes.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int write_ring_locked(client_t *client, const char *message, size_t length) {
+    struct pollfd hangup = { .fd = client->sockfd, .events = 0 };
+
+    while (shm_ring_write(client->ring, message, length) < 0) {
+        if (errno == ENOBUFS) {
+            if (poll(&hangup, 1, CLIENT_RING_POLL_MS) > 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (errno == EPROTO) {
+            printf("Client %d corrupted its shared-memory ring, disconnecting it\n", client->id);
+        } else {
+            printf("Client %d has a ring too small for a %zu byte message, disconnecting it\n", client->id, length);
+        }
+        shm_ring_close(client->ring);
+        free(client->ring);
+        client->ring = NULL;
+        shutdown(client->sockfd, SHUT_RDWR);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes an already numbered message to a client whose send lock is already held.
+ *
+ * Nothing is written while the client is detached or its session is being resumed; the
+ * message stays in the retransmit buffer instead. Clients with a shared-memory ring receive
+ * the message uncompressed in the ring.
+ *
+ * @param client The destination client.
+ * @param message The message to write.
+ * @param length The length of the message in bytes.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int write_frame_locked(client_t *client, const char *message, size_t length) {
+    unsigned char *frame;
+    size_t frame_length;
+    int result;
+
+    if (client->sockfd < 0 || client->resuming) {
+        return 0;
+    }
+    if (client->ring) {
+        return write_ring_locked(client, message, length);
+    }
+    if (client->compression == COMPRESSION_NONE) {
+        return write_all(client->sockfd, message, length);
+    }
+    if (compress_stream_frame(&client->compressor, message, length, &frame, &frame_length) < 0) {
+        return -1;
+    }
+    result = write_all(client->sockfd, frame, frame_length);
+    free(frame);
+    return result;
+}
+
+static int write_message_locked(client_t *client, const char *message, size_t length);
+static int queue_entry(client_t *client, outbox_lane_t lane, outbox_entry_t *entry);
+
+/**
+ * @brief Frees an entry taken from the queue of a connection.
+ *
+ * An entry addressed to a single user of a gateway no longer counts in the user's share of
+ * the queue, and drops its reference on the user.
+ *
+ * @param client The connection whose queue held the entry.
+ * @param entry The entry.
+ *
+ * @return void
+ */
+static void discard_entry(client_t *client, outbox_entry_t *entry) {
+    client_t *user = entry->user;
+
+    if (user) {
+        pthread_mutex_lock(&client->outbox->mutex);
+        user->gateway_bytes -= entry->size;
+        pthread_mutex_unlock(&client->outbox->mutex);
+    }
+    outbox_entry_free(entry);
+    release_client(user);
+}
+
+/**
+ * @brief Queues a message once for a gateway connection, addressed to some of its users.
+ *
+ * The addressed copy travels in the lane of the original message. A copy for a single user
+ * names the user, unless it is a presence message.
+ *
+ * @param gateway The gateway connection.
+ * @param message The message to write.
+ * @param length The length of the message in bytes.
+ * @param recipients The recipients as a JSON array of usernames.
+ * @param user The single recipient, or NULL.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int write_addressed(client_t *gateway, const char *message, size_t length, const char *recipients,
+                           client_t *user) {
+    size_t addressed_length;
+    char *addressed = gateway_address(message, length, recipients, &addressed_length);
+    outbox_data_t *data;
+    int result = -1;
+
+    if (!addressed) {
+        return -1;
+    }
+    data = outbox_data_create(addressed, addressed_length);
+    if (data) {
+        outbox_lane_t lane = outbox_lane_of(message, length);
+        outbox_entry_t *entry = outbox_entry_create(data, NULL);
+
+        if (entry && user && lane != OUTBOX_PRESENCE) {
+            entry->user = retain_client(user);
+        }
+        result = queue_entry(gateway, lane, entry);
+        outbox_data_release(data);
+    }
+    free(addressed);
+    return result;
+}
+
+/**
+ * @brief Writes a message to a single user of a gateway.
+ *
+ * @param user The recipient.
+ * @param message The message to write.
+ * @param length The length of the message in bytes.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int write_to_gateway(client_t *user, const char *message, size_t length) {
+    cJSON *recipients = cJSON_CreateArray();
+    char *recipients_str;
+    int result = -1;
+
+    cJSON_AddItemToArray(recipients, cJSON_CreateString(user->user_name));
+    recipients_str = cJSON_PrintUnformatted(recipients);
+    if (recipients_str) {
+        result = write_addressed(user->gateway, message, length, recipients_str, user);
+        free(recipients_str);
+    }
+    cJSON_Delete(recipients);
+    return result;
+}
+
+/**
+ * @brief Writes a message to a client whose send lock is already held.
+ *
+ * Clients with a resumable session receive the message numbered and buffered for
+ * retransmission, each message of the buffer with its own number. Users of a gateway receive
+ * it through the queue of the gateway connection.
+ *
+ * @param client The destination client.
+ * @param message The message to write.
+ * @param length The length of the message in bytes.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int write_message_locked(client_t *client, const char *message, size_t length) {
+    if (client->gateway) {
+        return write_to_gateway(client, message, length);
+    }
+    if (client->session) {
+        size_t offset = 0;
+
+        // A buffer may hold several messages back to back, like a batch of offline messages:
+        // each one is numbered and buffered on its own.
+        while (offset < length) {
+            long frame_length = json_frame_length(message + offset, length - offset);
+            const session_entry_t *entry;
+
+            if (frame_length < 2) {
+                frame_length = (long)(length - offset);
+            }
+            entry = session_stamp(client->session, message + offset, (size_t)frame_length);
+            if (!entry || write_frame_locked(client, entry->message, entry->length) < 0) {
+                return -1;
+            }
+            offset += (size_t)frame_length;
+        }
+        return 0;
+    }
+    return write_frame_locked(client, message, length);
+}
+
+/**
+ * @brief Adapts write_frame_locked to the session replay callback.
+ *
+ * @param arg The client being resumed.
+ * @param message The numbered message.
+ * @param length The length of the message in bytes.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int replay_frame(void *arg, const char *message, size_t length) {
+    return write_frame_locked((client_t *)arg, message, length);
+}
+
+/**
+ * @brief Sends a header followed by a range of a file to a client whose send lock is held.
+ *
+ * On plain connections the range is sent with `sendfile`, straight from the page cache. On
+ * compressed connections the header and the range are compressed together into one frame.
+ * The data is neither numbered nor kept for retransmission, and nothing is sent while the
+ * client is detached: the client asks for the range again after resuming its session.
+ *
+ * @param client The destination client.
+ * @param entry The queue entry holding the header and the range.
+ *
+ * @return int 0 on success, -1 if the range could not be sent.
+ */
+static int write_range_locked(client_t *client, const outbox_entry_t *entry) {
+    const char *header = entry->message->bytes;
+    size_t header_length = entry->message->length;
+    size_t length = entry->file_length;
+    off_t offset = entry->offset;
+    int result = 0;
+
+    if (client->sockfd < 0 || client->resuming) {
+        return 0;
+    }
+    if (client->compression == COMPRESSION_NONE) {
+        result = write_all(client->sockfd, header, header_length);
+        while (result == 0 && length > 0) {
+            ssize_t sent = sendfile(client->sockfd, entry->fd, &offset, length);
+            if (sent <= 0) {
+                result = -1;
+                break;
+            }
+            length -= (size_t)sent;
+        }
+    } else {
+        char *data = malloc(header_length + length);
+        unsigned char *frame;
+        size_t frame_length;
+
+        result = data ? 0 : -1;
+        if (data) {
+            memcpy(data, header, header_length);
+            result = pread(entry->fd, data + header_length, length, offset) == (ssize_t)length ? 0 : -1;
+        }
+        if (result == 0 && compress_stream_frame(&client->compressor, data, header_length + length, &frame,
+                                                 &frame_length) == 0) {
+            result = write_all(client->sockfd, frame, frame_length);
+            free(frame);
+        } else {
+            result = -1;
+        }
+        free(data);
+    }
+    return result;
+}
+
+/**
+ * @brief Writes a queue entry to a client whose send lock is already held.
+ *
+ * Messages are numbered and compressed when they are written, so the session and the
+ * compression stream see them in the order the client receives them. Clients that
+ * negotiated compression without a session or a ring receive the shared frame of a
+ * broadcast when the entry has one.
+ *
+ * @param client The destination client.
+ * @param entry The entry to write.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int write_entry_locked(client_t *client, const outbox_entry_t *entry) {
+    if (entry->fd >= 0) {
+        return write_range_locked(client, entry);
+    }
+    if (entry->frame && client->compression != COMPRESSION_NONE && !client->session && !client->ring) {
+        return write_all(client->sockfd, entry->frame->bytes, entry->frame->length);
+    }
+    return write_message_locked(client, entry->message->bytes, entry->message->length);
+}
+
+/**
+ * @brief Writes the entries queued for a client, by weighted priority of their lanes.
+ *
+ * Runs until stop_client_writer asks it to leave and the queue is empty. A failed write
+ * shuts the connection down; the entries written after that are still numbered into the
+ * client's session, if it has one, so they can be replayed once the session is resumed.
+ *
+ * @param arg The client.
+ *
+ * @return void* Always returns NULL when the thread exits.
+ */
+static void *client_writer(void *arg) {
+    client_t *client = (client_t *)arg;
+    outbox_t *outbox = client->outbox;
+    int failed = 0;
+
+    pthread_mutex_lock(&outbox->mutex);
+    while (1) {
+        outbox_entry_t *entry = outbox_pop_locked(outbox);
+        int result;
+
+        if (!entry) {
+            if (outbox->hangup) {
+                shutdown(client->sockfd, SHUT_RDWR);
+                outbox->hangup = 0;
+            }
+            if (outbox->closing) {
+                break;
+            }
+            pthread_cond_wait(&outbox->cond, &outbox->mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&outbox->mutex);
+
+        pthread_mutex_lock(&client->send_mutex);
+        result = write_entry_locked(client, entry);
+        pthread_mutex_unlock(&client->send_mutex);
+        discard_entry(client, entry);
+        if (result < 0 && !failed) {
+            perror("ERROR: write to descriptor failed");
+            shutdown(client->sockfd, SHUT_RDWR);
+            failed = 1;
+        }
+
+        pthread_mutex_lock(&outbox->mutex);
+    }
+    outbox->running = 0;
+    pthread_mutex_unlock(&outbox->mutex);
+
+    return NULL;
+}
+
+/**
+ * @brief Queues an entry for a client, or writes it right away if the client has no writer.
+ *
+ * Users of a gateway have no writer of their own, and the writer of a connection stops
+ * when the connection closes; their entries are written, or numbered into a lingering
+ * session, by the calling thread. When the queue is over budget, a presence entry replaces
+ * the queued one about the same user, and any other entry shuts the connection down as too
+ * slow. On a gateway, an entry for a single user is also refused once the user has
+ * OUTBOX_MAX_BYTES queued, and a refused entry for a single user only disconnects that user.
+ *
+ * @param client The destination client.
+ * @param lane The lane of the entry.
+ * @param entry The entry, always consumed, or NULL after an allocation failure.
+ *
+ * @return int 0 if the entry was queued or written, -1 on failure.
+ */
+static int queue_entry(client_t *client, outbox_lane_t lane, outbox_entry_t *entry) {
+    unsigned long long queue_start = trace_start();
+    outbox_t *outbox = client->outbox;
+    outbox_result_t queued;
+    int result;
+    int shed;
+
+    if (!entry) {
+        return -1;
+    }
+    if (outbox) {
+        pthread_mutex_lock(&outbox->mutex);
+        if (outbox->running) {
+            client_t *user = entry->user;
+
+            if (user && user->gateway_bytes > 0 && user->gateway_bytes + entry->size > OUTBOX_MAX_BYTES) {
+                queued = OUTBOX_FULL;
+            } else {
+                queued = outbox_push_locked(outbox, lane, entry);
+            }
+            if (queued == OUTBOX_QUEUED) {
+                if (user) {
+                    user->gateway_bytes += entry->size;
+                }
+                pthread_cond_signal(&outbox->cond);
+            }
+            pthread_mutex_unlock(&outbox->mutex);
+            trace_end("queue", queue_start, client->id);
+
+            if (queued == OUTBOX_QUEUED) {
+                return 0;
+            }
+            if (queued == OUTBOX_COALESCED) {
+                metrics_add(METRIC_OUTBOX_COALESCED, 1);
+                return 0;
+            }
+            outbox_entry_free(entry);
+            if (user) {
+                release_client(user);
+                errno = ENOBUFS;
+                return -1;
+            }
+            printf("Client %d is too slow, disconnecting it\n", client->id);
+            metrics_add(METRIC_OUTBOX_DISCONNECTS, 1);
+            shutdown(client->sockfd, SHUT_RDWR);
+            errno = ENOBUFS;
+            return -1;
+        }
+        pthread_mutex_unlock(&outbox->mutex);
+    }
+
+    pthread_mutex_lock(&client->send_mutex);
+    result = write_entry_locked(client, entry);
+    shed = result < 0 && errno == ENOBUFS && client->gateway;
+    pthread_mutex_unlock(&client->send_mutex);
+    outbox_entry_free(entry);
+    trace_end("write", queue_start, client->id);
+
+    if (shed) {
+        shed_gateway_user(client);
+    }
+    return result;
+}
+
+/**
+ * @brief Returns a new client ID.
+ *
+ * @return int An ID no other client had.
+ */
+int allocate_client_id(void) {
+    int id;
+
+    pthread_mutex_lock(&clients_mutex);
+    id = next_client_id++;
+    pthread_mutex_unlock(&clients_mutex);
+    return id;
+}
+
+/**
+ * @brief Keeps allocate_client_id from returning an ID restored from a snapshot.
+ *
+ * @param id The restored ID.
+ *
+ * @return void
+ */
+void reserve_client_id(int id) {
+    pthread_mutex_lock(&clients_mutex);
+    if (id >= next_client_id) {
+        next_client_id = id + 1;
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+/**
+ * @brief Sizes the queue budget of a gateway to its number of users.
+ *
+ * Called with the client list locked.
+ *
+ * @param gateway The gateway connection.
+ * @param delta The number of users added, or removed if negative.
+ *
+ * @return void
+ */
+static void count_gateway_users(client_t *gateway, int delta) {
+    size_t budget;
+
+    gateway->gateway_users += delta;
+    budget = OUTBOX_MAX_BYTES + (size_t)gateway->gateway_users * OUTBOX_GATEWAY_USER_BYTES;
+    if (gateway->outbox) {
+        pthread_mutex_lock(&gateway->outbox->mutex);
+        gateway->outbox->max_bytes = budget < OUTBOX_GATEWAY_MAX_BYTES ? budget : OUTBOX_GATEWAY_MAX_BYTES;
+        pthread_mutex_unlock(&gateway->outbox->mutex);
+    }
+}
 
 /**
  * @brief Adds a client to the list of connected clients.
@@ -18,46 +532,167 @@ pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
  *
  * @param client A pointer to the client to add.
  *
- * @return void
+ * @return int 0 on success, -1 if the list is full.
  */
-void add_client(client_t *client) {
+int add_client(client_t *client) {
+    int result = -1;
+
     pthread_mutex_lock(&clients_mutex);
     for (int i = 0; i < MAX_CLIENTS; ++i) {
         if (!clients[i]) {
             clients[i] = client;
+            if (client->gateway) {
+                count_gateway_users(client->gateway, 1);
+            }
+            result = 0;
             break;
         }
     }
     pthread_mutex_unlock(&clients_mutex);
+
+    if (result < 0) {
+        printf("The list of clients is full\n");
+    }
+    return result;
 }
 
 /**
  * @brief Removes a client from the list of connected clients.
  *
- * Removes a client from the list of active clients based on their ID.
+ * Removes a client from the list of active clients based on their ID. If the client had
+ * identified itself, the other cluster nodes are told to forget its username. When several
+ * threads remove the same client, only one of them finds it.
  *
  * @param id The ID of the client to remove.
  *
- * @return void
+ * @return int 1 if the client was in the list, 0 otherwise.
  */
-void remove_client(int id) {
+int remove_client(int id) {
+    char user_name[32] = "";
+    int removed = 0;
+
     pthread_mutex_lock(&clients_mutex);
     for (int i = 0; i < MAX_CLIENTS; ++i) {
         if (clients[i] && clients[i]->id == id) {
+            strcpy(user_name, clients[i]->user_name);
+            if (clients[i]->gateway) {
+                count_gateway_users(clients[i]->gateway, -1);
+            }
             clients[i] = NULL;
+            removed = 1;
             break;
         }
     }
     pthread_mutex_unlock(&clients_mutex);
+
+    if (user_name[0]) {
+        cluster_publish_leave(user_name);
+    }
+    return removed;
+}
+
+/**
+ * @brief Takes a reference on a client entry, so it stays valid once it is removed.
+ *
+ * @param client The client, or NULL.
+ *
+ * @return client_t* The client.
+ */
+client_t *retain_client(client_t *client) {
+    if (client) {
+        atomic_fetch_add_explicit(&client->references, 1, memory_order_relaxed);
+    }
+    return client;
+}
+
+/**
+ * @brief Frees a client entry nobody refers to anymore.
+ *
+ * The writer thread of the connection, if any, has already exited. A user of a gateway
+ * drops the reference it held on the gateway's entry.
+ *
+ * @param client The client to free.
+ *
+ * @return void
+ */
+static void free_client(client_t *client) {
+    client_t *gateway = client->gateway;
+
+    if (client->outbox) {
+        outbox_entry_t *entry;
+
+        while ((entry = outbox_pop_locked(client->outbox))) {
+            discard_entry(client, entry);
+        }
+        outbox_destroy(client->outbox);
+        free(client->outbox);
+    }
+    session_destroy(client->session);
+    pthread_mutex_destroy(&client->send_mutex);
+    pthread_cond_destroy(&client->resume_cond);
+    free(client);
+    release_client(gateway);
+}
+
+/**
+ * @brief Drops a reference on a client entry, and frees the entry with the last one.
+ *
+ * The last reference is only dropped once the client was removed from the list.
+ *
+ * @param client The client, or NULL.
+ *
+ * @return void
+ */
+void release_client(client_t *client) {
+    if (client && atomic_fetch_sub_explicit(&client->references, 1, memory_order_acq_rel) == 1) {
+        free_client(client);
+    }
+}
+
+/**
+ * @brief Queues one copy of a broadcast for a gateway, addressed to all of its users.
+ *
+ * Called with the client list locked.
+ *
+ * @param gateway The gateway connection.
+ * @param message The message to broadcast.
+ * @param length The length of the message in bytes.
+ * @param sender_id The ID of the client that sent the message (will not receive the broadcast).
+ *
+ * @return void
+ */
+static void broadcast_to_gateway(client_t *gateway, const char *message, size_t length, int sender_id) {
+    cJSON *recipients = cJSON_CreateArray();
+    int count = 0;
+
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        if (clients[i] && clients[i]->gateway == gateway && clients[i]->id != sender_id) {
+            cJSON_AddItemToArray(recipients, cJSON_CreateString(clients[i]->user_name));
+            count++;
+        }
+    }
+    if (count > 0) {
+        char *recipients_str = cJSON_PrintUnformatted(recipients);
+        if (!recipients_str || write_addressed(gateway, message, length, recipients_str, NULL) < 0) {
+            perror("ERROR: write to descriptor failed");
+            shutdown(gateway->sockfd, SHUT_RDWR);
+        }
+        free(recipients_str);
+    }
+    cJSON_Delete(recipients);
 }
 
 /**
  * @brief Broadcasts a message to all connected clients except the sender.
  *
- * This function sends a message to all connected clients, excluding the client
- * identified by `sender_id`. The message is sent through the socket of each client.
- * If a client socket fails during the transmission, the client is removed from the
- * list of connected clients.
+ * This function queues a message for all connected clients, excluding the client
+ * identified by `sender_id`. All the queue entries share one copy of the message.
+ * Clients that negotiated compression all receive the same shared frame, which is
+ * compressed once per broadcast, unless they have a resumable session, in which case the
+ * message is numbered for each of them, or a shared-memory ring. Each gateway connection
+ * receives a single copy addressed to all of its users. If a client socket fails during the
+ * transmission, the connection is shut down and the client's handler thread removes it from
+ * the list of connected clients.
  *
  * @param message A string containing the message to broadcast.
  * @param sender_id The ID of the client that sent the message (will not receive the broadcast).
@@ -65,15 +700,452 @@ void remove_client(int id) {
  * @return void
  */
 void broadcast_message(const char *message, int sender_id) {
+    size_t length = strlen(message);
+    outbox_lane_t lane = outbox_lane_of(message, length);
+    outbox_data_t *data = outbox_data_create(message, length);
+    outbox_data_t *shared_frame = NULL;
+    int shared_frame_ready = 0;
+    unsigned long long fan_out_start = trace_start();
+
+    if (!data) {
+        perror("ERROR: malloc failed");
+        return;
+    }
+
     pthread_mutex_lock(&clients_mutex);
+    trace_end("lock clients", fan_out_start, -1);
     for (int i = 0; i < MAX_CLIENTS; ++i) {
         if (clients[i] && clients[i]->id != sender_id) {
-            if (write(clients[i]->sockfd, message, strlen(message)) < 0) {
+            client_t *client = clients[i];
+            outbox_data_t *frame;
+
+            if (client->gateway) {
+                continue;
+            }
+            if (client->is_gateway) {
+                broadcast_to_gateway(client, message, length, sender_id);
+                continue;
+            }
+
+            if (client->compression != COMPRESSION_NONE && !shared_frame_ready) {
+                unsigned char *bytes;
+                size_t bytes_length;
+
+                if (compress_shared_frame(message, length, &bytes, &bytes_length) == 0) {
+                    shared_frame = outbox_data_create(bytes, bytes_length);
+                    free(bytes);
+                }
+                shared_frame_ready = 1;
+            }
+            frame = client->compression != COMPRESSION_NONE ? shared_frame : NULL;
+            if (queue_entry(client, lane, outbox_entry_create(data, frame)) < 0) {
                 perror("ERROR: write to descriptor failed");
-                close(clients[i]->sockfd);
-                remove_client(clients[i]->id);
+                shutdown(client->sockfd, SHUT_RDWR);
             }
         }
     }
     pthread_mutex_unlock(&clients_mutex);
+
+    outbox_data_release(shared_frame);
+    outbox_data_release(data);
+    trace_end("fan-out", fan_out_start, -1);
+}
+
+/**
+ * @brief Sends a message to a single client.
+ *
+ * The message is queued in the lane of its type, and written as-is, or as a stream frame if
+ * the client negotiated compression. Writes are serialized per client so concurrent senders
+ * never interleave their bytes.
+ *
+ * @param client The client to send the message to.
+ * @param message A null-terminated JSON message.
+ *
+ * @return int 0 on success, -1 if the message could not be queued or written.
+ */
+int send_to_client(client_t *client, const char *message) {
+    size_t length = strlen(message);
+    outbox_data_t *data = outbox_data_create(message, length);
+    int result;
+
+    if (!data) {
+        return -1;
+    }
+    result = queue_entry(client, outbox_lane_of(message, length), outbox_entry_create(data, NULL));
+    outbox_data_release(data);
+
+    return result;
+}
+
+/**
+ * @brief Sends a header followed by a range of a file to a single client.
+ *
+ * The range is queued in the bulk lane with its own descriptor of the file, and sent as
+ * write_range_locked describes.
+ *
+ * @param client The client to send the range to.
+ * @param header A null-terminated JSON header announcing the range.
+ * @param fd The file to read, still owned by the caller.
+ * @param offset The offset of the range in the file.
+ * @param length The length of the range in bytes.
+ *
+ * @return int 0 on success, -1 if the range could not be queued or sent.
+ */
+int send_file_to_client(client_t *client, const char *header, int fd, off_t offset, size_t length) {
+    outbox_data_t *data = outbox_data_create(header, strlen(header));
+    outbox_entry_t *entry = data ? outbox_entry_create(data, NULL) : NULL;
+
+    outbox_data_release(data);
+    if (!entry) {
+        return -1;
+    }
+    entry->fd = dup(fd);
+    if (entry->fd < 0) {
+        outbox_entry_free(entry);
+        return -1;
+    }
+    entry->offset = offset;
+    entry->file_length = length;
+    entry->size += length;
+
+    return queue_entry(client, OUTBOX_BULK, entry);
+}
+
+/**
+ * @brief Starts the writer thread that drains the outbound queue of a new connection.
+ *
+ * @param client The new connection, not yet in the list of connected clients.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+int start_client_writer(client_t *client) {
+    outbox_t *outbox = malloc(sizeof(outbox_t));
+
+    if (!outbox) {
+        perror("ERROR: malloc failed");
+        return -1;
+    }
+    outbox_init(outbox);
+    outbox->running = 1;
+    client->outbox = outbox;
+    if (pthread_create(&client->writer, NULL, client_writer, client) != 0) {
+        perror("ERROR: pthread_create failed");
+        client->outbox = NULL;
+        free(outbox);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Stops the writer thread of a connection that closed.
+ *
+ * The writer still takes every queued entry, which numbers the messages into the client's
+ * session, if it has one, before the session lingers. Callers shut the socket down for
+ * writing first, so the writer can't block on a peer that stopped reading.
+ *
+ * @param client The client whose connection closed.
+ *
+ * @return void
+ */
+void stop_client_writer(client_t *client) {
+    outbox_t *outbox = client->outbox;
+    int running;
+
+    if (!outbox) {
+        return;
+    }
+    pthread_mutex_lock(&outbox->mutex);
+    running = outbox->running;
+    outbox->closing = 1;
+    pthread_cond_signal(&outbox->cond);
+    pthread_mutex_unlock(&outbox->mutex);
+    if (running) {
+        pthread_join(client->writer, NULL);
+    }
+}
+
+/**
+ * @brief Shuts a connection down once the messages queued for it are written.
+ *
+ * Used after a final response, such as a refused IDENTIFY, so the response reaches the
+ * client before the connection closes.
+ *
+ * @param client The client to disconnect.
+ *
+ * @return void
+ */
+void disconnect_client(client_t *client) {
+    outbox_t *outbox = client->outbox;
+
+    if (outbox) {
+        pthread_mutex_lock(&outbox->mutex);
+        if (outbox->running) {
+            outbox->hangup = 1;
+            pthread_cond_signal(&outbox->cond);
+            pthread_mutex_unlock(&outbox->mutex);
+            return;
+        }
+        pthread_mutex_unlock(&outbox->mutex);
+    }
+    shutdown(client->sockfd, SHUT_RDWR);
+}
+
+/**
+ * @brief Sends the IDENTIFY response and switches the client to compressed frames.
+ *
+ * The response itself is sent uncompressed so the client can read the negotiated codec.
+ * Both steps happen under the client's send lock, so no other message can slip in between
+ * the response and the first compressed frame. Users of a gateway share the compression of
+ * the gateway connection, so they only receive the response.
+ *
+ * @param client The client that negotiated compression.
+ * @param mode The negotiated compression mode.
+ * @param response The IDENTIFY response announcing the codec.
+ *
+ * @return int 0 on success, -1 if the response could not be written.
+ */
+int start_client_compression(client_t *client, int mode, const char *response) {
+    int result;
+
+    pthread_mutex_lock(&client->send_mutex);
+    if (client->gateway) {
+        result = write_message_locked(client, response, strlen(response));
+    } else {
+        result = write_all(client->sockfd, response, strlen(response));
+        if (result == 0 && mode != COMPRESSION_NONE && compressor_init(&client->compressor) == 0) {
+            client->compression = mode;
+        }
+    }
+    pthread_mutex_unlock(&client->send_mutex);
+
+    return result;
+}
+
+/**
+ * @brief Releases the compression context of a disconnecting client.
+ *
+ * @param client The client whose compression context is released.
+ *
+ * @return void
+ */
+void stop_client_compression(client_t *client) {
+    pthread_mutex_lock(&client->send_mutex);
+    if (client->compression != COMPRESSION_NONE) {
+        compressor_end(&client->compressor);
+        client->compression = COMPRESSION_NONE;
+    }
+    pthread_mutex_unlock(&client->send_mutex);
+}
+
+/**
+ * @brief Sends the RING response with the ring's descriptors and switches the client to it.
+ *
+ * Both steps happen under the client's send lock, so every message sent after the response
+ * goes through the ring.
+ *
+ * @param client The local client that asked for a ring.
+ * @param ring The new ring, owned by the client on success.
+ * @param response The RING response.
+ *
+ * @return int 0 on success, -1 if the response could not be written.
+ */
+int start_client_ring(client_t *client, shm_ring_t *ring, const char *response) {
+    int fds[2] = { ring->memfd, ring->eventfd };
+    int result;
+
+    pthread_mutex_lock(&client->send_mutex);
+    result = send_with_fds(client->sockfd, response, strlen(response), fds, 2);
+    if (result == 0) {
+        client->ring = ring;
+    }
+    pthread_mutex_unlock(&client->send_mutex);
+
+    return result;
+}
+
+/**
+ * @brief Closes the shared-memory ring of a disconnecting client.
+ *
+ * The consumer is woken up and sees the ring closed once it drained it.
+ *
+ * @param client The client whose ring is closed.
+ *
+ * @return void
+ */
+void close_client_ring(client_t *client) {
+    pthread_mutex_lock(&client->send_mutex);
+    if (client->ring) {
+        shm_ring_close(client->ring);
+        free(client->ring);
+        client->ring = NULL;
+    }
+    pthread_mutex_unlock(&client->send_mutex);
+}
+
+/**
+ * @brief Gives a client a resumable session.
+ *
+ * @param client The client that asked for a resumable session at IDENTIFY.
+ *
+ * @return int 0 on success, -1 on allocation failure.
+ */
+int open_client_session(client_t *client) {
+    session_t *session = session_create();
+
+    if (!session) {
+        return -1;
+    }
+    pthread_mutex_lock(&client->send_mutex);
+    client->session = session;
+    pthread_mutex_unlock(&client->send_mutex);
+    return 0;
+}
+
+/**
+ * @brief Ends the session of a client that disconnected on purpose.
+ *
+ * @param client The disconnecting client.
+ *
+ * @return void
+ */
+void close_client_session(client_t *client) {
+    pthread_mutex_lock(&client->send_mutex);
+    session_destroy(client->session);
+    client->session = NULL;
+    pthread_mutex_unlock(&client->send_mutex);
+}
+
+/**
+ * @brief Drops the messages a client acknowledged from its retransmit buffer.
+ *
+ * @param client The client sending the ACK.
+ * @param seq The highest sequence number the client received.
+ *
+ * @return void
+ */
+void acknowledge_client(client_t *client, unsigned long seq) {
+    pthread_mutex_lock(&client->send_mutex);
+    if (client->session) {
+        session_ack(client->session, seq);
+    }
+    pthread_mutex_unlock(&client->send_mutex);
+}
+
+/**
+ * @brief Keeps the session of a client whose connection dropped until it is resumed.
+ *
+ * The socket is closed and the client stays in the list of connected clients, so messages
+ * keep being numbered and buffered for it. Called by the client's handler thread, which
+ * waits until a new connection takes the session over or SESSION_LINGER seconds elapse.
+ *
+ * @param client The client whose connection dropped.
+ *
+ * @return int 1 if the session was resumed, 0 if it expired.
+ */
+int linger_client(client_t *client) {
+    struct timespec deadline;
+    int resumed;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SESSION_LINGER;
+
+    pthread_mutex_lock(&client->send_mutex);
+    close(client->sockfd);
+    client->sockfd = -1;
+    if (client->compression != COMPRESSION_NONE) {
+        compressor_end(&client->compressor);
+        client->compression = COMPRESSION_NONE;
+    }
+    while (client->session) {
+        if (pthread_cond_timedwait(&client->resume_cond, &client->send_mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    resumed = client->session == NULL;
+    session_destroy(client->session);
+    client->session = NULL;
+    pthread_mutex_unlock(&client->send_mutex);
+
+    return resumed;
+}
+
+/**
+ * @brief Moves the detached session of a user to a new connection.
+ *
+ * The new connection takes over the username, status and session of the detached client,
+ * whose handler thread then leaves without announcing a departure. Messages sent to the new
+ * connection are only buffered until finish_client_resume replays the session.
+ *
+ * @param client The new connection, which has not identified yet.
+ * @param username The user resuming the session.
+ * @param token The session token the user received at IDENTIFY.
+ * @param after The highest sequence number the client received.
+ * @param missed Receives the number of messages numbered after `after` that can't be replayed.
+ *
+ * @return int 0 on success, -1 if the user has no detached session with that token.
+ */
+int resume_client_session(client_t *client, const char *username, const char *token, unsigned long after,
+                          unsigned long *missed) {
+    int result = -1;
+
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        client_t *detached = clients[i];
+
+        if (!detached || detached == client || strcmp(detached->user_name, username) != 0) {
+            continue;
+        }
+        pthread_mutex_lock(&detached->send_mutex);
+        if (detached->sockfd < 0 && detached->session && strcmp(detached->session->token, token) == 0) {
+            pthread_mutex_lock(&client->send_mutex);
+            client->session = detached->session;
+            client->resuming = 1;
+            *missed = session_missed(client->session, after);
+            strcpy(client->user_name, detached->user_name);
+            strcpy(client->status, detached->status);
+            pthread_mutex_unlock(&client->send_mutex);
+
+            detached->session = NULL;
+            detached->user_name[0] = '\0';
+            pthread_cond_signal(&detached->resume_cond);
+            result = 0;
+        }
+        pthread_mutex_unlock(&detached->send_mutex);
+        break;
+    }
+    pthread_mutex_unlock(&clients_mutex);
+
+    return result;
+}
+
+/**
+ * @brief Sends the RESUME response and replays the messages the client did not receive.
+ *
+ * The response is sent uncompressed, then the client switches to the negotiated compression
+ * and receives every buffered message numbered after `after`, before any new message.
+ *
+ * @param client The client resuming its session.
+ * @param mode The negotiated compression mode.
+ * @param response The RESUME response.
+ * @param after The highest sequence number the client received.
+ *
+ * @return int 0 on success, -1 if a write failed.
+ */
+int finish_client_resume(client_t *client, int mode, const char *response, unsigned long after) {
+    int result;
+
+    pthread_mutex_lock(&client->send_mutex);
+    result = write_all(client->sockfd, response, strlen(response));
+    if (result == 0 && mode != COMPRESSION_NONE && compressor_init(&client->compressor) == 0) {
+        client->compression = mode;
+    }
+    client->resuming = 0;
+    if (result == 0 && client->session) {
+        session_ack(client->session, after);
+        result = session_replay(client->session, after, replay_frame, client);
+    }
+    pthread_mutex_unlock(&client->send_mutex);
+
+    return result;
 }
@@ -4,30 +4,88 @@
  *
  * This header file defines the data structures and functions used to manage clients 
  * connected to the server. It includes adding and removing clients, as well as 
- * broadcasting messages to all connected clients.
+ * broadcasting messages to all connected clients and sending messages to a single client.
+ * Messages are queued per connection in priority lanes and written by the connection's
+ * writer thread, compressed when the client negotiated compression and numbered when it has
+ * a resumable session. Messages for users connected through a gateway are written to the
+ * gateway connection instead, and local clients that opened a shared-memory ring receive
+ * them through the ring.
+ *
+ * Client entries are reference counted. The handler thread of a connection, or the gateway
+ * of a user, holds the first reference, and the lookups by username take another one, so an
+ * entry removed from the list stays valid until every holder released it.
+ *
+ * Users of a gateway share its queue. A user whose messages would take more than its share of
+ * the queue is disconnected on its own, and the gateway connection stays open.
  */
 
 #ifndef CLIENT_MANAGER_H
 #define CLIENT_MANAGER_H
 
+#include "../common/compression.h"
+#include "../common/shm_ring.h"
+#include "outbox.h"
+#include "session.h"
 #include <pthread.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
+#include <sys/types.h>
 
-#define MAX_CLIENTS 100
+#ifndef MAX_CLIENTS
+#define MAX_CLIENTS 4096
+#endif
+#define CLIENT_BUFFER_SIZE 8192
+#define CLIENT_RING_POLL_MS 1
 
-typedef struct {
+typedef struct client {
     struct sockaddr_in address;
     int sockfd;
     int id;
     char user_name[32];
     char status[16];
+    int compression;
+    compressor_t compressor;
+    pthread_mutex_t send_mutex;
+    session_t *session;
+    int resuming;
+    pthread_cond_t resume_cond;
+    int is_gateway;
+    struct client *gateway;
+    int is_local;
+    shm_ring_t *ring;
+    struct transfer_upload *upload;
+    outbox_t *outbox;
+    pthread_t writer;
+    _Atomic int references;
+    int gateway_users;
+    size_t gateway_bytes;
 } client_t;
 
 extern client_t *clients[MAX_CLIENTS];
 extern pthread_mutex_t clients_mutex;
 
-void add_client(client_t *client);
-void remove_client(int id);
+int allocate_client_id(void);
+void reserve_client_id(int id);
+int add_client(client_t *client);
+int remove_client(int id);
+client_t *retain_client(client_t *client);
+void release_client(client_t *client);
 void broadcast_message(const char *message, int sender_id);
+int send_to_client(client_t *client, const char *message);
+int send_file_to_client(client_t *client, const char *header, int fd, off_t offset, size_t length);
+int start_client_writer(client_t *client);
+void stop_client_writer(client_t *client);
+void disconnect_client(client_t *client);
+int start_client_compression(client_t *client, int mode, const char *response);
+void stop_client_compression(client_t *client);
+int start_client_ring(client_t *client, shm_ring_t *ring, const char *response);
+void close_client_ring(client_t *client);
+int open_client_session(client_t *client);
+void close_client_session(client_t *client);
+void acknowledge_client(client_t *client, unsigned long seq);
+int linger_client(client_t *client);
+int resume_client_session(client_t *client, const char *username, const char *token, unsigned long after,
+                          unsigned long *missed);
+int finish_client_resume(client_t *client, int mode, const char *response, unsigned long after);
 
 #endif // CLIENT_MANAGER_H
@@ -0,0 +1,1221 @@
+/**
+ * @file cluster.c
+ * @brief Implements the cluster protocol on top of an inter-node bus.
+ *
+ * Frames are only ever sent by the node where an event happened, directly to every other
+ * node or to a single node (a home node, or the node a private message recipient is
+ * connected to), so the nodes must be configured as a full mesh. Receivers never forward
+ * frames again.
+ *
+ * Claims, lookups and user lists are requests: the calling client thread sends a frame and
+ * waits for the reply, which is matched by request ID on the thread receiving the reply.
+ * Requests are never issued from the threads that receive frames, so a node can't end up
+ * waiting for a reply it would have to receive itself.
+ */
+#include "cluster.h"
+#include "client_manager.h"
+#include "directory.h"
+#include "mailbox.h"
+#include "messaging.h"
+#include "metrics.h"
+#include "ring.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    char user_name[32];
+    char status[16];
+} local_user_t;
+
+int cluster_node_id = 0;
+
+static cluster_bus_t *cluster_bus = NULL;
+
+static cluster_request_t requests[CLUSTER_MAX_REQUESTS];
+static unsigned int next_request_id = 1;
+static pthread_mutex_t requests_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requests_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Configures the local node.
+ *
+ * @param node_id The non-zero ID of this node, unique within the cluster.
+ * @param bus The bus used to reach the other nodes.
+ *
+ * @return void
+ */
+void cluster_init(int node_id, cluster_bus_t *bus) {
+    cluster_node_id = node_id;
+    cluster_bus = bus;
+    ring_add_node(node_id);
+}
+
+/**
+ * @brief Starts the inter-node bus.
+ *
+ * @return int 0 on success or when clustering is disabled, -1 if the bus failed to start.
+ */
+int cluster_start(void) {
+    if (!cluster_bus) {
+        return 0;
+    }
+    printf("Cluster node %d starting %s bus\n", cluster_node_id, cluster_bus->name);
+    return cluster_bus->start(cluster_bus);
+}
+
+/**
+ * @brief Tells whether this server is part of a cluster.
+ *
+ * @return int 1 if clustering is enabled, 0 otherwise.
+ */
+int cluster_enabled(void) {
+    return cluster_bus != NULL;
+}
+
+/**
+ * @brief Starts a new frame originating from this node.
+ *
+ * @param frame The frame to initialize.
+ * @param type The frame type.
+ *
+ * @return void
+ */
+void cluster_frame_init(cluster_frame_t *frame, int type) {
+    frame->data[4] = (unsigned char)type;
+    frame->data[5] = (unsigned char)(cluster_node_id >> 8);
+    frame->data[6] = (unsigned char)cluster_node_id;
+    frame->length = CLUSTER_FRAME_HEADER_SIZE;
+    frame->overflow = 0;
+}
+
+/**
+ * @brief Appends a string field to a frame.
+ *
+ * @param frame The frame being built.
+ * @param value The null-terminated string to append.
+ *
+ * @return void
+ */
+void cluster_frame_put_string(cluster_frame_t *frame, const char *value) {
+    size_t length = strlen(value);
+
+    if (length > 0xFFFF || frame->length + 2 + length > sizeof(frame->data)) {
+        frame->overflow = 1;
+        return;
+    }
+    frame->data[frame->length] = (unsigned char)(length >> 8);
+    frame->data[frame->length + 1] = (unsigned char)length;
+    memcpy(frame->data + frame->length + 2, value, length);
+    frame->length += 2 + length;
+}
+
+/**
+ * @brief Appends a 32-bit integer field to a frame.
+ *
+ * @param frame The frame being built.
+ * @param value The value to append.
+ *
+ * @return void
+ */
+void cluster_frame_put_u32(cluster_frame_t *frame, unsigned int value) {
+    if (frame->length + 4 > sizeof(frame->data)) {
+        frame->overflow = 1;
+        return;
+    }
+    frame->data[frame->length] = (unsigned char)(value >> 24);
+    frame->data[frame->length + 1] = (unsigned char)(value >> 16);
+    frame->data[frame->length + 2] = (unsigned char)(value >> 8);
+    frame->data[frame->length + 3] = (unsigned char)value;
+    frame->length += 4;
+}
+
+/**
+ * @brief Writes the length prefix of a completed frame.
+ *
+ * @param frame The completed frame.
+ *
+ * @return void
+ */
+void cluster_frame_finish(cluster_frame_t *frame) {
+    size_t length = frame->length - 4;
+
+    frame->data[0] = (unsigned char)(length >> 24);
+    frame->data[1] = (unsigned char)(length >> 16);
+    frame->data[2] = (unsigned char)(length >> 8);
+    frame->data[3] = (unsigned char)length;
+}
+
+/**
+ * @brief Reads the type of a frame.
+ *
+ * @param frame A complete frame, including its length prefix.
+ * @return int The frame type.
+ */
+int cluster_frame_type(const unsigned char *frame) {
+    return frame[4];
+}
+
+/**
+ * @brief Reads the ID of the node that sent a frame.
+ *
+ * @param frame A complete frame, including its length prefix.
+ * @return int The origin node ID.
+ */
+int cluster_frame_origin(const unsigned char *frame) {
+    return (frame[5] << 8) | frame[6];
+}
+
+/**
+ * @brief Decodes the length prefix of a frame.
+ *
+ * @param header The first four bytes of a frame.
+ * @return size_t The number of bytes that follow the length prefix.
+ */
+size_t cluster_frame_length(const unsigned char *header) {
+    return ((size_t)header[0] << 24) | ((size_t)header[1] << 16) | ((size_t)header[2] << 8) | header[3];
+}
+
+/**
+ * @brief Prepares to read the fields of a frame.
+ *
+ * @param reader The reader to initialize.
+ * @param frame A complete frame, including its length prefix.
+ * @param length The total length of the frame.
+ *
+ * @return void
+ */
+void cluster_reader_init(cluster_reader_t *reader, const unsigned char *frame, size_t length) {
+    reader->data = frame;
+    reader->length = length;
+    reader->offset = CLUSTER_FRAME_HEADER_SIZE;
+}
+
+/**
+ * @brief Reads the next string field of a frame.
+ *
+ * @param reader The frame reader.
+ * @param value The buffer receiving the null-terminated string.
+ * @param size The size of the buffer.
+ *
+ * @return int 0 on success, -1 if the field is missing or does not fit in the buffer.
+ */
+int cluster_read_string(cluster_reader_t *reader, char *value, size_t size) {
+    size_t length;
+
+    if (reader->offset + 2 > reader->length) {
+        return -1;
+    }
+    length = ((size_t)reader->data[reader->offset] << 8) | reader->data[reader->offset + 1];
+    if (reader->offset + 2 + length > reader->length || length >= size) {
+        return -1;
+    }
+    memcpy(value, reader->data + reader->offset + 2, length);
+    value[length] = '\0';
+    reader->offset += 2 + length;
+    return 0;
+}
+
+/**
+ * @brief Reads the next 32-bit integer field of a frame.
+ *
+ * @param reader The frame reader.
+ * @param value Receives the value.
+ *
+ * @return int 0 on success, -1 if the field is missing.
+ */
+int cluster_read_u32(cluster_reader_t *reader, unsigned int *value) {
+    const unsigned char *data = reader->data + reader->offset;
+
+    if (reader->offset + 4 > reader->length) {
+        return -1;
+    }
+    *value = ((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) | ((unsigned int)data[2] << 8) | data[3];
+    reader->offset += 4;
+    return 0;
+}
+
+/**
+ * @brief Sends a completed frame.
+ *
+ * @param node_id The destination node, or CLUSTER_ALL_NODES.
+ * @param frame The frame to send.
+ *
+ * @return int 0 if the frame was handed to the bus, -1 otherwise.
+ */
+static int cluster_send_frame(int node_id, cluster_frame_t *frame) {
+    if (!cluster_bus) {
+        return -1;
+    }
+    cluster_frame_finish(frame);
+    if (frame->overflow) {
+        fprintf(stderr, "ERROR: cluster frame too large\n");
+        return -1;
+    }
+    return cluster_bus->send(cluster_bus, node_id, frame->data, frame->length);
+}
+
+/**
+ * @brief Builds a frame from a NULL-terminated list of string fields and sends it.
+ *
+ * @param node_id The destination node, or CLUSTER_ALL_NODES.
+ * @param type The frame type.
+ *
+ * @return int 0 if the frame was handed to the bus, -1 otherwise.
+ */
+static int cluster_send(int node_id, int type, ...) {
+    cluster_frame_t frame;
+    const char *value;
+    va_list args;
+
+    cluster_frame_init(&frame, type);
+    va_start(args, type);
+    while ((value = va_arg(args, const char *)) != NULL) {
+        cluster_frame_put_string(&frame, value);
+    }
+    va_end(args);
+    return cluster_send_frame(node_id, &frame);
+}
+
+/**
+ * @brief Reserves a slot for a request awaiting replies from other nodes.
+ *
+ * @param visit Called with each user listed in a USERS_REPLY frame, or NULL.
+ * @param arg The argument passed to `visit`.
+ *
+ * @return cluster_request_t* The request, or NULL if too many requests are pending.
+ */
+static cluster_request_t *request_begin(void (*visit)(const char *, const char *, void *), void *arg) {
+    cluster_request_t *request = NULL;
+
+    pthread_mutex_lock(&requests_mutex);
+    for (int i = 0; i < CLUSTER_MAX_REQUESTS; ++i) {
+        if (requests[i].id == 0) {
+            request = &requests[i];
+            request->id = next_request_id++;
+            if (next_request_id == 0) {
+                next_request_id = 1;
+            }
+            request->finished = 0;
+            request->value = 0;
+            request->visit = visit;
+            request->arg = arg;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&requests_mutex);
+    return request;
+}
+
+/**
+ * @brief Waits until a request received enough final replies or timed out.
+ *
+ * @param request The pending request.
+ * @param expected The number of final replies to wait for.
+ *
+ * @return int 0 if every reply arrived, -1 on timeout.
+ */
+static int request_wait(cluster_request_t *request, int expected) {
+    struct timespec deadline;
+    int result = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CLUSTER_REQUEST_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (CLUSTER_REQUEST_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&requests_mutex);
+    while (request->finished < expected) {
+        if (pthread_cond_timedwait(&requests_cond, &requests_mutex, &deadline) == ETIMEDOUT) {
+            result = request->finished < expected ? -1 : 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&requests_mutex);
+    return result;
+}
+
+/**
+ * @brief Releases the slot of a request, so late replies are ignored.
+ *
+ * @param request The request to release.
+ *
+ * @return void
+ */
+static void request_end(cluster_request_t *request) {
+    pthread_mutex_lock(&requests_mutex);
+    request->id = 0;
+    pthread_mutex_unlock(&requests_mutex);
+}
+
+/**
+ * @brief Finds a pending request by ID.
+ *
+ * Must be called with the requests lock held.
+ *
+ * @param id The request ID carried by a reply.
+ * @return cluster_request_t* The request, or NULL if it already completed or timed out.
+ */
+static cluster_request_t *request_find(unsigned int id) {
+    for (int i = 0; i < CLUSTER_MAX_REQUESTS; ++i) {
+        if (id != 0 && requests[i].id == id) {
+            return &requests[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Completes a request waiting for a single value.
+ *
+ * @param id The request ID carried by the reply.
+ * @param value The value of the reply.
+ *
+ * @return void
+ */
+static void request_complete(unsigned int id, unsigned int value) {
+    cluster_request_t *request;
+
+    pthread_mutex_lock(&requests_mutex);
+    request = request_find(id);
+    if (request) {
+        request->value = value;
+        request->finished = 1;
+        pthread_cond_broadcast(&requests_cond);
+    }
+    pthread_mutex_unlock(&requests_mutex);
+}
+
+/**
+ * @brief Sends a request frame carrying a request ID and string fields.
+ *
+ * @param node_id The destination node, or CLUSTER_ALL_NODES.
+ * @param type The frame type.
+ * @param id The request ID.
+ * @param first The first string field, or NULL.
+ * @param second The second string field, or NULL.
+ *
+ * @return int 0 if the frame was handed to the bus, -1 otherwise.
+ */
+static int cluster_send_request(int node_id, int type, unsigned int id, const char *first, const char *second) {
+    cluster_frame_t frame;
+
+    cluster_frame_init(&frame, type);
+    cluster_frame_put_u32(&frame, id);
+    if (first) {
+        cluster_frame_put_string(&frame, first);
+    }
+    if (second) {
+        cluster_frame_put_string(&frame, second);
+    }
+    return cluster_send_frame(node_id, &frame);
+}
+
+/**
+ * @brief Sends a reply frame carrying a request ID and a value.
+ *
+ * @param node_id The node that sent the request.
+ * @param type The frame type.
+ * @param id The request ID.
+ * @param value The value of the reply.
+ *
+ * @return void
+ */
+static void cluster_send_reply(int node_id, int type, unsigned int id, unsigned int value) {
+    cluster_frame_t frame;
+
+    cluster_frame_init(&frame, type);
+    cluster_frame_put_u32(&frame, id);
+    cluster_frame_put_u32(&frame, value);
+    cluster_send_frame(node_id, &frame);
+}
+
+/**
+ * @brief Tells whether this node is the home node of a username.
+ *
+ * @param username The username to place on the ring.
+ * @return int 1 if this node holds the username's directory entry, 0 otherwise.
+ */
+static int is_home_node(const char *username) {
+    int home = ring_lookup(username);
+
+    return home == 0 || home == cluster_node_id;
+}
+
+/**
+ * @brief Registers a local user on its home node without checking for conflicts.
+ *
+ * @param username The username of the local user.
+ * @param status The current status of the user.
+ *
+ * @return void
+ */
+static void register_local_user(const char *username, const char *status) {
+    if (is_home_node(username)) {
+        directory_upsert(username, status, cluster_node_id);
+    } else {
+        cluster_send(ring_lookup(username), CLUSTER_USER_JOIN, username, status, (const char *)NULL);
+    }
+}
+
+/**
+ * @brief Copies the identified local users out of the client list.
+ *
+ * The list is only locked while copying, so the users can be sent to other nodes without
+ * holding it.
+ *
+ * @param count Set to the number of users copied.
+ *
+ * @return local_user_t* The users, to be freed by the caller, or NULL if out of memory.
+ */
+static local_user_t *collect_local_users(int *count) {
+    local_user_t *users = malloc(MAX_CLIENTS * sizeof(local_user_t));
+
+    *count = 0;
+    if (!users) {
+        perror("malloc");
+        return NULL;
+    }
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        if (clients[i] && clients[i]->user_name[0]) {
+            strcpy(users[*count].user_name, clients[i]->user_name);
+            strcpy(users[*count].status, clients[i]->status);
+            ++*count;
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    return users;
+}
+
+/**
+ * @brief Checks whether a username still belongs to a local client.
+ *
+ * @param username The username to look for.
+ *
+ * @return int 1 if a local client holds the username, 0 otherwise.
+ */
+static int is_local_user(const char *username) {
+    int found = 0;
+
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS && !found; ++i) {
+        found = clients[i] && strcmp(clients[i]->user_name, username) == 0;
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    return found;
+}
+
+/**
+ * @brief Moves the directory to the new ring after a membership change.
+ *
+ * Cached locations may point at a node that left, and part of the partition now belongs to
+ * other nodes. Every node registers its local users again, so each home node ends up with
+ * the users that hash to it. The users are sent without holding the client list, so a user
+ * may leave and announce its departure before its registration reaches the home node; the
+ * users who are gone once everything is sent are removed from their home node again.
+ *
+ * @return void
+ */
+static void rebalance_directory(void) {
+    local_user_t *users;
+    int count;
+
+    directory_cache_clear();
+    directory_retain(is_home_node);
+
+    users = collect_local_users(&count);
+    if (!users) {
+        return;
+    }
+    for (int i = 0; i < count; ++i) {
+        register_local_user(users[i].user_name, users[i].status);
+    }
+    for (int i = 0; i < count; ++i) {
+        if (!is_local_user(users[i].user_name)) {
+            cluster_publish_leave(users[i].user_name);
+        }
+    }
+    free(users);
+}
+
+/**
+ * @brief Announces the departure of a user whose node left the cluster.
+ *
+ * Each home node announces the users of its own partition, to its local clients and to the
+ * other nodes, so every departure is announced once.
+ *
+ * @param username The user who left.
+ *
+ * @return void
+ */
+static void announce_remote_departure(const char *username) {
+    deliver_disconnected(username, -1);
+    cluster_publish_disconnected(username);
+}
+
+/**
+ * @brief Answers a username claim sent to this home node.
+ *
+ * @param origin The node the user is connecting to.
+ * @param reader The frame reader, positioned after the frame header.
+ *
+ * @return void
+ */
+static void handle_claim(int origin, cluster_reader_t *reader) {
+    unsigned int id;
+    char username[32];
+    char status[16];
+    int claimed;
+
+    if (cluster_read_u32(reader, &id) < 0 || cluster_read_string(reader, username, sizeof(username)) < 0 ||
+        cluster_read_string(reader, status, sizeof(status)) < 0) {
+        return;
+    }
+    claimed = directory_claim(username, status, origin) == 0;
+    directory_cache_invalidate(username);
+    cluster_send_reply(origin, CLUSTER_CLAIM_RESULT, id, claimed ? 1 : 0);
+}
+
+/**
+ * @brief Answers a location lookup sent to this home node.
+ *
+ * @param origin The node looking the user up.
+ * @param reader The frame reader, positioned after the frame header.
+ *
+ * @return void
+ */
+static void handle_lookup(int origin, cluster_reader_t *reader) {
+    unsigned int id;
+    char username[32];
+
+    if (cluster_read_u32(reader, &id) < 0 || cluster_read_string(reader, username, sizeof(username)) < 0) {
+        return;
+    }
+    cluster_send_reply(origin, CLUSTER_LOOKUP_RESULT, id, (unsigned int)directory_lookup(username));
+}
+
+/**
+ * @brief Sends the local users to a node collecting the user list.
+ *
+ * Users are packed into as many USERS_REPLY frames as needed, followed by an empty frame
+ * flagged as the last one. The frames are sent once the client list is unlocked, since a
+ * link write may block.
+ *
+ * @param origin The node collecting the user list.
+ * @param reader The frame reader, positioned after the frame header.
+ *
+ * @return void
+ */
+static void handle_users_request(int origin, cluster_reader_t *reader) {
+    cluster_frame_t frame;
+    local_user_t *users;
+    unsigned int id;
+    int count;
+
+    if (cluster_read_u32(reader, &id) < 0) {
+        return;
+    }
+
+    cluster_frame_init(&frame, CLUSTER_USERS_REPLY);
+    cluster_frame_put_u32(&frame, id);
+    cluster_frame_put_u32(&frame, 0);
+
+    users = collect_local_users(&count);
+    for (int i = 0; i < count; ++i) {
+        size_t needed = 4 + strlen(users[i].user_name) + strlen(users[i].status);
+        if (frame.length + needed > sizeof(frame.data)) {
+            cluster_send_frame(origin, &frame);
+            cluster_frame_init(&frame, CLUSTER_USERS_REPLY);
+            cluster_frame_put_u32(&frame, id);
+            cluster_frame_put_u32(&frame, 0);
+        }
+        cluster_frame_put_string(&frame, users[i].user_name);
+        cluster_frame_put_string(&frame, users[i].status);
+    }
+    free(users);
+
+    cluster_send_frame(origin, &frame);
+    cluster_send_reply(origin, CLUSTER_USERS_REPLY, id, 1);
+}
+
+/**
+ * @brief Passes the users of a USERS_REPLY frame to the request collecting them.
+ *
+ * @param reader The frame reader, positioned after the frame header.
+ *
+ * @return void
+ */
+static void handle_users_reply(cluster_reader_t *reader) {
+    cluster_request_t *request;
+    unsigned int id;
+    unsigned int last;
+    char username[32];
+    char status[16];
+
+    if (cluster_read_u32(reader, &id) < 0 || cluster_read_u32(reader, &last) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&requests_mutex);
+    request = request_find(id);
+    if (request) {
+        while (cluster_read_string(reader, username, sizeof(username)) == 0 &&
+               cluster_read_string(reader, status, sizeof(status)) == 0) {
+            if (request->visit) {
+                request->visit(username, status, request->arg);
+            }
+        }
+        if (last) {
+            request->finished++;
+            pthread_cond_broadcast(&requests_cond);
+        }
+    }
+    pthread_mutex_unlock(&requests_mutex);
+}
+
+/**
+ * @brief Handles a private message bounced by a node the recipient is no longer connected to.
+ *
+ * The stale location is dropped from the cache and the message is queued in the recipient's
+ * offline mailbox.
+ *
+ * @param from_username The local sender of the message.
+ * @param to_username The recipient of the message.
+ * @param text The message text.
+ *
+ * @return void
+ */
+static void handle_no_such_user(const char *from_username, const char *to_username, const char *text) {
+    client_t *sender = find_client_by_username(from_username);
+    int queued;
+
+    directory_cache_invalidate(to_username);
+    queued = cluster_store_offline(to_username, from_username, text, MAILBOX_KIND_TEXT) == 0;
+    if (sender) {
+        if (queued) {
+            send_message_queued(sender, to_username);
+        } else {
+            send_no_such_user(sender, to_username);
+        }
+        release_client(sender);
+    }
+}
+
+/**
+ * @brief Sends the mailbox of a user to the node the user just identified on.
+ *
+ * The messages are packed into as many MAILBOX_BATCH frames as needed.
+ *
+ * @param origin The node the user is connected to.
+ * @param username The owner of the mailbox.
+ *
+ * @return void
+ */
+static void send_mailbox(int origin, const char *username) {
+    mailbox_message_t *messages = mailbox_take(username);
+    cluster_frame_t frame;
+    int count = 0;
+
+    if (!messages) {
+        return;
+    }
+
+    cluster_frame_init(&frame, CLUSTER_MAILBOX_BATCH);
+    cluster_frame_put_string(&frame, username);
+    for (mailbox_message_t *message = messages; message; message = message->next) {
+        size_t needed = 8 + strlen(message->from) + strlen(message->text);
+        if (count > 0 && frame.length + needed > sizeof(frame.data)) {
+            cluster_send_frame(origin, &frame);
+            cluster_frame_init(&frame, CLUSTER_MAILBOX_BATCH);
+            cluster_frame_put_string(&frame, username);
+            count = 0;
+        }
+        cluster_frame_put_string(&frame, message->from);
+        cluster_frame_put_string(&frame, message->text);
+        cluster_frame_put_u32(&frame, (unsigned int)message->kind);
+        count++;
+    }
+    cluster_send_frame(origin, &frame);
+    mailbox_free(messages);
+}
+
+/**
+ * @brief Queues a mention in the mailbox of a user of this node's partition.
+ *
+ * The mention is dropped if the user is connected to a node, which notified it with the
+ * public message, or if the user never identified, so a mention of a name nobody uses
+ * doesn't create a mailbox.
+ *
+ * @param to_username The mentioned user.
+ * @param from_username The author of the public message.
+ * @param text The public message text.
+ *
+ * @return void
+ */
+static void store_mention(const char *to_username, const char *from_username, const char *text) {
+    if (directory_lookup(to_username) || !directory_known(to_username)) {
+        return;
+    }
+    if (mailbox_put(to_username, from_username, text, MAILBOX_KIND_MENTION) == 0) {
+        metrics_add(METRIC_MENTIONS_QUEUED, 1);
+    }
+}
+
+/**
+ * @brief Delivers a batch of offline messages sent by a user's home node.
+ *
+ * If the user disconnected in the meantime, the messages are queued again.
+ *
+ * @param reader The frame reader, positioned after the frame header.
+ *
+ * @return void
+ */
+static void handle_mailbox_batch(cluster_reader_t *reader) {
+    static __thread char text[CLUSTER_MAX_FRAME];
+    mailbox_message_t *messages = NULL;
+    mailbox_message_t **tail = &messages;
+    char username[32];
+    char from[32];
+    unsigned int kind;
+    client_t *client;
+
+    if (cluster_read_string(reader, username, sizeof(username)) < 0) {
+        return;
+    }
+    while (cluster_read_string(reader, from, sizeof(from)) == 0 &&
+           cluster_read_string(reader, text, sizeof(text)) == 0 && cluster_read_u32(reader, &kind) == 0) {
+        *tail = mailbox_message_new(from, text, (int)kind, time(NULL));
+        if (*tail) {
+            tail = &(*tail)->next;
+        }
+    }
+
+    client = find_client_by_username(username);
+    if (client) {
+        deliver_offline_messages(client, messages);
+        release_client(client);
+    } else {
+        for (mailbox_message_t *message = messages; message; message = message->next) {
+            cluster_store_offline(username, message->from, message->text, message->kind);
+        }
+    }
+    mailbox_free(messages);
+}
+
+/**
+ * @brief Dispatches a frame received from another node.
+ *
+ * @param frame A complete frame, including its length prefix.
+ * @param length The total length of the frame.
+ *
+ * @return void
+ */
+void cluster_on_frame(const unsigned char *frame, size_t length) {
+    static __thread char text[CLUSTER_MAX_FRAME];
+    char username[32];
+    char other[32];
+    char status[16];
+    cluster_reader_t reader;
+    unsigned int id;
+    unsigned int value;
+    int origin = cluster_frame_origin(frame);
+
+    cluster_reader_init(&reader, frame, length);
+    switch (cluster_frame_type(frame)) {
+    case CLUSTER_USER_JOIN:
+        if (cluster_read_string(&reader, username, sizeof(username)) == 0 &&
+            cluster_read_string(&reader, status, sizeof(status)) == 0 &&
+            directory_claim(username, status, origin) < 0) {
+            printf("Node %d registered %s, which is already held by node %d\n", origin, username,
+                   directory_lookup(username));
+        }
+        break;
+    case CLUSTER_USER_LEAVE:
+        if (cluster_read_string(&reader, username, sizeof(username)) == 0) {
+            directory_remove(username, origin);
+        }
+        break;
+    case CLUSTER_PUBLIC_TEXT:
+        if (cluster_read_string(&reader, username, sizeof(username)) == 0 &&
+            cluster_read_string(&reader, text, sizeof(text)) == 0) {
+            deliver_public_message(text, username);
+        }
+        break;
+    case CLUSTER_STATUS:
+        if (cluster_read_string(&reader, username, sizeof(username)) == 0 &&
+            cluster_read_string(&reader, status, sizeof(status)) == 0) {
+            directory_set_status(username, status);
+            deliver_status_change(username, status);
+        }
+        break;
+    case CLUSTER_PRIVATE_TEXT:
+        if (cluster_read_string(&reader, username, sizeof(username)) == 0 &&
+            cluster_read_string(&reader, other, sizeof(other)) == 0 &&
+            cluster_read_string(&reader, text, sizeof(text)) == 0) {
+            if (deliver_private_message(text, username, other) < 0) {
+                cluster_send(origin, CLUSTER_NO_SUCH_USER, username, other, text, (const char *)NULL);
+            }
+        }
+        break;
+    case CLUSTER_NO_SUCH_USER:
+        if (cluster_read_string(&reader, username, sizeof(username)) == 0 &&
+            cluster_read_string(&reader, other, sizeof(other)) == 0 &&
+            cluster_read_string(&reader, text, sizeof(text)) == 0) {
+            handle_no_such_user(username, other, text);
+        }
+        break;
+    case CLUSTER_DISCONNECTED:
+        if (cluster_read_string(&reader, username, sizeof(username)) == 0) {
+            directory_cache_invalidate(username);
+            deliver_disconnected(username, -1);
+        }
+        break;
+    case CLUSTER_CLAIM:
+        handle_claim(origin, &reader);
+        break;
+    case CLUSTER_LOOKUP:
+        handle_lookup(origin, &reader);
+        break;
+    case CLUSTER_CLAIM_RESULT:
+    case CLUSTER_LOOKUP_RESULT:
+        if (cluster_read_u32(&reader, &id) == 0 && cluster_read_u32(&reader, &value) == 0) {
+            request_complete(id, value);
+        }
+        break;
+    case CLUSTER_USERS_REQUEST:
+        handle_users_request(origin, &reader);
+        break;
+    case CLUSTER_USERS_REPLY:
+        handle_users_reply(&reader);
+        break;
+    case CLUSTER_MAILBOX_PUT:
+        if (cluster_read_string(&reader, username, sizeof(username)) < 0 ||
+            cluster_read_string(&reader, other, sizeof(other)) < 0 ||
+            cluster_read_string(&reader, text, sizeof(text)) < 0 || cluster_read_u32(&reader, &value) < 0) {
+            break;
+        }
+        if (value == MAILBOX_KIND_MENTION) {
+            store_mention(username, other, text);
+        } else if (mailbox_put(username, other, text, (int)value) < 0) {
+            fprintf(stderr, "WARNING: dropped an offline message from %s to %s\n", other, username);
+        }
+        break;
+    case CLUSTER_MAILBOX_FETCH:
+        if (cluster_read_string(&reader, username, sizeof(username)) == 0) {
+            send_mailbox(origin, username);
+        }
+        break;
+    case CLUSTER_MAILBOX_BATCH:
+        handle_mailbox_batch(&reader);
+        break;
+    default:
+        fprintf(stderr, "ERROR: unknown cluster frame type %d from node %d\n", cluster_frame_type(frame), origin);
+        break;
+    }
+}
+
+/**
+ * @brief Adds a node that just connected to the ring.
+ *
+ * @param node_id The node that joined.
+ *
+ * @return void
+ */
+void cluster_on_node_up(int node_id) {
+    printf("Cluster node %d is up\n", node_id);
+    ring_add_node(node_id);
+    rebalance_directory();
+}
+
+/**
+ * @brief Removes a node that left the cluster from the ring and forgets its users.
+ *
+ * @param node_id The node that left.
+ *
+ * @return void
+ */
+void cluster_on_node_down(int node_id) {
+    printf("Cluster node %d is down\n", node_id);
+    ring_remove_node(node_id);
+    directory_remove_node(node_id, announce_remote_departure);
+    rebalance_directory();
+}
+
+/**
+ * @brief Claims a username on its home node for a local user.
+ *
+ * If the home node does not answer in time the claim is accepted, so a slow node can't
+ * lock users out; the username is registered again on the next membership change.
+ *
+ * @param username The username being identified.
+ * @param status The initial status of the user.
+ *
+ * @return int 0 if the username now belongs to this node, -1 if another node holds it.
+ */
+int cluster_claim_username(const char *username, const char *status) {
+    cluster_request_t *request;
+    int home;
+    int result = 0;
+
+    if (!cluster_bus) {
+        directory_remember(username);
+        return 0;
+    }
+    home = ring_lookup(username);
+    if (home == 0 || home == cluster_node_id) {
+        return directory_claim(username, status, cluster_node_id);
+    }
+
+    request = request_begin(NULL, NULL);
+    if (!request) {
+        fprintf(stderr, "WARNING: too many pending cluster requests, accepting %s unchecked\n", username);
+        return 0;
+    }
+    if (cluster_send_request(home, CLUSTER_CLAIM, request->id, username, status) < 0 ||
+        request_wait(request, 1) < 0) {
+        fprintf(stderr, "WARNING: home node %d did not answer the claim of %s\n", home, username);
+    } else if (!request->value) {
+        result = -1;
+    }
+    request_end(request);
+    return result;
+}
+
+/**
+ * @brief Removes a departing local user from its home node's directory.
+ *
+ * @param username The username of the local user.
+ *
+ * @return void
+ */
+void cluster_publish_leave(const char *username) {
+    int home = ring_lookup(username);
+
+    if (home == 0 || home == cluster_node_id) {
+        directory_remove(username, cluster_node_id);
+    } else {
+        cluster_send(home, CLUSTER_USER_LEAVE, username, (const char *)NULL);
+    }
+}
+
+/**
+ * @brief Forwards a public message to the other nodes.
+ *
+ * @param username The sender of the message.
+ * @param text The message text.
+ *
+ * @return void
+ */
+void cluster_publish_public(const char *username, const char *text) {
+    cluster_send(CLUSTER_ALL_NODES, CLUSTER_PUBLIC_TEXT, username, text, (const char *)NULL);
+}
+
+/**
+ * @brief Forwards a status change to the other nodes.
+ *
+ * @param username The user whose status changed.
+ * @param status The new status.
+ *
+ * @return void
+ */
+void cluster_publish_status(const char *username, const char *status) {
+    directory_set_status(username, status);
+    cluster_send(CLUSTER_ALL_NODES, CLUSTER_STATUS, username, status, (const char *)NULL);
+}
+
+/**
+ * @brief Forwards a disconnection notice to the other nodes.
+ *
+ * @param username The user who disconnected.
+ *
+ * @return void
+ */
+void cluster_publish_disconnected(const char *username) {
+    cluster_send(CLUSTER_ALL_NODES, CLUSTER_DISCONNECTED, username, (const char *)NULL);
+}
+
+/**
+ * @brief Finds the node a user is connected to.
+ *
+ * Users in this node's partition are read from the directory. Other users are read from the
+ * lookup cache, or looked up on their home node and cached.
+ *
+ * @param username The username to look up.
+ * @return int The node ID, or 0 if the user is not connected to any node.
+ */
+int cluster_locate_user(const char *username) {
+    cluster_request_t *request;
+    int home;
+    int node_id;
+
+    if (!cluster_bus) {
+        return 0;
+    }
+    home = ring_lookup(username);
+    if (home == 0 || home == cluster_node_id) {
+        return directory_lookup(username);
+    }
+    node_id = directory_cache_get(username);
+    if (node_id) {
+        return node_id;
+    }
+
+    request = request_begin(NULL, NULL);
+    if (!request) {
+        return 0;
+    }
+    if (cluster_send_request(home, CLUSTER_LOOKUP, request->id, username, NULL) == 0 &&
+        request_wait(request, 1) == 0) {
+        node_id = (int)request->value;
+    }
+    request_end(request);
+
+    if (node_id && node_id != cluster_node_id) {
+        directory_cache_put(username, node_id);
+    }
+    return node_id;
+}
+
+/**
+ * @brief Forwards a private message to the node the recipient is connected to.
+ *
+ * If the cached location turns out to be stale, the recipient's node answers with
+ * NO_SUCH_USER, which drops the cache entry and notifies the sender.
+ *
+ * @param from_username The sender of the message.
+ * @param to_username The recipient of the message.
+ * @param text The message text.
+ *
+ * @return int 0 if the message was forwarded, -1 if the recipient is not known to any node.
+ */
+int cluster_send_private(const char *from_username, const char *to_username, const char *text) {
+    int node_id = cluster_locate_user(to_username);
+
+    if (!node_id || node_id == cluster_node_id) {
+        return -1;
+    }
+    if (cluster_send(node_id, CLUSTER_PRIVATE_TEXT, from_username, to_username, text, (const char *)NULL) < 0) {
+        directory_cache_invalidate(to_username);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Queues a private message or a mention in the offline mailbox of its recipient.
+ *
+ * The mailbox lives on the recipient's home node, so it can be found again whichever node
+ * the recipient reconnects to.
+ *
+ * @param to_username The offline recipient.
+ * @param from_username The sender of the message.
+ * @param text The message text.
+ * @param kind MAILBOX_KIND_TEXT for a private message, MAILBOX_KIND_MENTION for a mention.
+ *
+ * @return int 0 if the message was queued or sent to the home node, -1 otherwise.
+ */
+int cluster_store_offline(const char *to_username, const char *from_username, const char *text, int kind) {
+    int home = ring_lookup(to_username);
+    cluster_frame_t frame;
+
+    if (!cluster_bus || home == 0 || home == cluster_node_id) {
+        return mailbox_put(to_username, from_username, text, kind);
+    }
+    cluster_frame_init(&frame, CLUSTER_MAILBOX_PUT);
+    cluster_frame_put_string(&frame, to_username);
+    cluster_frame_put_string(&frame, from_username);
+    cluster_frame_put_string(&frame, text);
+    cluster_frame_put_u32(&frame, (unsigned int)kind);
+    return cluster_send_frame(home, &frame);
+}
+
+/**
+ * @brief Queues a mention for a user who is not connected to this node.
+ *
+ * The mention is sent to the user's home node without waiting for any reply. The home node
+ * holds the user's directory entry, so it can tell on its own whether the user is connected
+ * elsewhere or unknown, in which case the mention is dropped.
+ *
+ * @param to_username The mentioned user.
+ * @param from_username The author of the public message.
+ * @param text The public message text.
+ *
+ * @return void
+ */
+void cluster_store_mention(const char *to_username, const char *from_username, const char *text) {
+    int home = ring_lookup(to_username);
+    cluster_frame_t frame;
+
+    if (!cluster_bus || home == 0 || home == cluster_node_id) {
+        store_mention(to_username, from_username, text);
+        return;
+    }
+    cluster_frame_init(&frame, CLUSTER_MAILBOX_PUT);
+    cluster_frame_put_string(&frame, to_username);
+    cluster_frame_put_string(&frame, from_username);
+    cluster_frame_put_string(&frame, text);
+    cluster_frame_put_u32(&frame, MAILBOX_KIND_MENTION);
+    cluster_send_frame(home, &frame);
+}
+
+/**
+ * @brief Delivers the offline messages of a user who just identified on this node.
+ *
+ * Messages held by a remote home node arrive asynchronously in MAILBOX_BATCH frames.
+ *
+ * @param username The user who identified.
+ *
+ * @return void
+ */
+void cluster_fetch_offline(const char *username) {
+    int home = ring_lookup(username);
+
+    if (!cluster_bus || home == 0 || home == cluster_node_id) {
+        mailbox_message_t *messages = mailbox_take(username);
+        client_t *client = find_client_by_username(username);
+        if (client) {
+            deliver_offline_messages(client, messages);
+            release_client(client);
+        }
+        mailbox_free(messages);
+        return;
+    }
+    cluster_send(home, CLUSTER_MAILBOX_FETCH, username, (const char *)NULL);
+}
+
+/**
+ * @brief Collects the users connected to the other nodes.
+ *
+ * Every other node answers with its local users. Nodes that don't answer in time are left
+ * out of the list.
+ *
+ * @param visit Called with each remote user and its status.
+ * @param arg The argument passed to `visit`.
+ *
+ * @return void
+ */
+void cluster_collect_users(void (*visit)(const char *username, const char *status, void *arg), void *arg) {
+    cluster_request_t *request;
+    int expected = ring_node_count() - 1;
+
+    if (!cluster_bus || expected <= 0) {
+        return;
+    }
+    request = request_begin(visit, arg);
+    if (!request) {
+        return;
+    }
+    if (cluster_send_request(CLUSTER_ALL_NODES, CLUSTER_USERS_REQUEST, request->id, NULL, NULL) == 0 &&
+        request_wait(request, expected) < 0) {
+        fprintf(stderr, "WARNING: some cluster nodes did not send their users in time\n");
+    }
+    request_end(request);
+}
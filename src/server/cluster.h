@@ -0,0 +1,109 @@
+/**
+ * @file cluster.h
+ * @brief Links several server nodes into a single chat.
+ *
+ * Every node keeps its own clients in `clients[]`. Public messages, status changes and
+ * departures are forwarded to every other node. The directory of which node each user is
+ * connected to is partitioned over the nodes with a consistent-hash ring: usernames are
+ * claimed on their home node, and private messages are forwarded in a single hop to the
+ * recipient's node once its location has been looked up on the home node and cached.
+ * The home node also keeps the offline mailbox of each of its usernames.
+ * Nodes exchange compact binary frames over an inter-node bus, which is pluggable: the
+ * cluster logic only talks to a `cluster_bus_t`.
+ *
+ * A frame is a 4-byte big-endian length, followed by a 1-byte type, a 2-byte big-endian
+ * origin node ID, and the frame fields. String fields are a 2-byte big-endian length
+ * followed by that many bytes, and integer fields are 4 bytes big-endian.
+ */
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>
+
+#define CLUSTER_MAX_FRAME 8192
+#define CLUSTER_FRAME_HEADER_SIZE 7
+#define CLUSTER_ALL_NODES 0
+#define CLUSTER_MAX_REQUESTS 64
+#define CLUSTER_REQUEST_TIMEOUT_MS 500
+
+enum cluster_frame_type {
+    CLUSTER_HELLO = 1,
+    CLUSTER_USER_JOIN,
+    CLUSTER_USER_LEAVE,
+    CLUSTER_PUBLIC_TEXT,
+    CLUSTER_STATUS,
+    CLUSTER_PRIVATE_TEXT,
+    CLUSTER_NO_SUCH_USER,
+    CLUSTER_DISCONNECTED,
+    CLUSTER_CLAIM,
+    CLUSTER_CLAIM_RESULT,
+    CLUSTER_LOOKUP,
+    CLUSTER_LOOKUP_RESULT,
+    CLUSTER_USERS_REQUEST,
+    CLUSTER_USERS_REPLY,
+    CLUSTER_MAILBOX_PUT,
+    CLUSTER_MAILBOX_FETCH,
+    CLUSTER_MAILBOX_BATCH
+};
+
+typedef struct {
+    unsigned char data[CLUSTER_MAX_FRAME];
+    size_t length;
+    int overflow;
+} cluster_frame_t;
+
+typedef struct {
+    const unsigned char *data;
+    size_t length;
+    size_t offset;
+} cluster_reader_t;
+
+typedef struct {
+    unsigned int id;
+    int finished;
+    unsigned int value;
+    void (*visit)(const char *username, const char *status, void *arg);
+    void *arg;
+} cluster_request_t;
+
+typedef struct cluster_bus {
+    const char *name;
+    int (*start)(struct cluster_bus *bus);
+    int (*send)(struct cluster_bus *bus, int node_id, const unsigned char *frame, size_t length);
+    void *state;
+} cluster_bus_t;
+
+extern int cluster_node_id;
+
+void cluster_init(int node_id, cluster_bus_t *bus);
+int cluster_start(void);
+int cluster_enabled(void);
+
+void cluster_frame_init(cluster_frame_t *frame, int type);
+void cluster_frame_put_string(cluster_frame_t *frame, const char *value);
+void cluster_frame_put_u32(cluster_frame_t *frame, unsigned int value);
+void cluster_frame_finish(cluster_frame_t *frame);
+int cluster_frame_type(const unsigned char *frame);
+int cluster_frame_origin(const unsigned char *frame);
+size_t cluster_frame_length(const unsigned char *header);
+void cluster_reader_init(cluster_reader_t *reader, const unsigned char *frame, size_t length);
+int cluster_read_string(cluster_reader_t *reader, char *value, size_t size);
+int cluster_read_u32(cluster_reader_t *reader, unsigned int *value);
+
+void cluster_on_frame(const unsigned char *frame, size_t length);
+void cluster_on_node_up(int node_id);
+void cluster_on_node_down(int node_id);
+
+int cluster_claim_username(const char *username, const char *status);
+void cluster_publish_leave(const char *username);
+void cluster_publish_public(const char *username, const char *text);
+void cluster_publish_status(const char *username, const char *status);
+void cluster_publish_disconnected(const char *username);
+int cluster_locate_user(const char *username);
+int cluster_send_private(const char *from_username, const char *to_username, const char *text);
+int cluster_store_offline(const char *to_username, const char *from_username, const char *text, int kind);
+void cluster_store_mention(const char *to_username, const char *from_username, const char *text);
+void cluster_fetch_offline(const char *username);
+void cluster_collect_users(void (*visit)(const char *username, const char *status, void *arg), void *arg);
+
+#endif // CLUSTER_H
@@ -0,0 +1,476 @@
+/**
+ * @file cluster_tcp.c
+ * @brief Implements the TCP inter-node bus.
+ *
+ * One thread accepts inbound links and one reader thread per inbound link dispatches the
+ * frames it receives. One connector thread per peer keeps the outbound link established,
+ * reconnecting after failures, and reports the peer to the cluster once the HELLO exchange
+ * completes. A node is considered gone when its inbound link closes.
+ *
+ * Inbound links are matched to the configured peer they come from, which remembers the node
+ * ID of its live inbound link.
+ */
+#include "cluster_tcp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+typedef struct {
+    cluster_tcp_state_t *state;
+    int sockfd;
+    struct in_addr address;
+} inbound_link_t;
+
+/**
+ * @brief Writes a whole frame to a link.
+ *
+ * @param sockfd The link socket.
+ * @param data The bytes to write.
+ * @param length The number of bytes to write.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int link_write(int sockfd, const unsigned char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = send(sockfd, data, length, MSG_NOSIGNAL);
+        if (written < 0) {
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads exactly `length` bytes from a link.
+ *
+ * @param sockfd The link socket.
+ * @param data The buffer receiving the bytes.
+ * @param length The number of bytes to read.
+ *
+ * @return int 0 on success, -1 on failure or when the link is closed.
+ */
+static int link_read(int sockfd, unsigned char *data, size_t length) {
+    while (length > 0) {
+        ssize_t received = recv(sockfd, data, length, 0);
+        if (received <= 0) {
+            return -1;
+        }
+        data += received;
+        length -= (size_t)received;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads one complete frame from a link.
+ *
+ * @param sockfd The link socket.
+ * @param frame A buffer of CLUSTER_MAX_FRAME bytes.
+ * @param length Receives the total frame length.
+ *
+ * @return int 0 on success, -1 on failure, on a malformed frame or when the link is closed.
+ */
+static int link_read_frame(int sockfd, unsigned char *frame, size_t *length) {
+    size_t body_length;
+
+    if (link_read(sockfd, frame, 4) < 0) {
+        return -1;
+    }
+    body_length = cluster_frame_length(frame);
+    if (body_length < CLUSTER_FRAME_HEADER_SIZE - 4 || body_length > CLUSTER_MAX_FRAME - 4) {
+        return -1;
+    }
+    if (link_read(sockfd, frame + 4, body_length) < 0) {
+        return -1;
+    }
+    *length = body_length + 4;
+    return 0;
+}
+
+/**
+ * @brief Sends the HELLO frame identifying this node.
+ *
+ * @param sockfd The link socket.
+ * @param key The cluster key.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+static int link_send_hello(int sockfd, const char *key) {
+    cluster_frame_t hello;
+
+    cluster_frame_init(&hello, CLUSTER_HELLO);
+    cluster_frame_put_string(&hello, key);
+    cluster_frame_finish(&hello);
+    return link_write(sockfd, hello.data, hello.length);
+}
+
+/**
+ * @brief Waits for the HELLO frame of the remote node and checks its key in constant time.
+ *
+ * @param sockfd The link socket.
+ * @param key The cluster key.
+ *
+ * @return int The remote node ID, or -1 on failure or if the key doesn't match.
+ */
+static int link_receive_hello(int sockfd, const char *key) {
+    unsigned char frame[CLUSTER_MAX_FRAME];
+    char presented[CLUSTER_KEY_SIZE];
+    size_t key_length = strlen(key);
+    unsigned char difference = 0;
+    cluster_reader_t reader;
+    size_t length;
+
+    if (link_read_frame(sockfd, frame, &length) < 0 || cluster_frame_type(frame) != CLUSTER_HELLO) {
+        return -1;
+    }
+    cluster_reader_init(&reader, frame, length);
+    if (cluster_read_string(&reader, presented, sizeof(presented)) < 0 || strlen(presented) != key_length) {
+        return -1;
+    }
+    for (size_t i = 0; i < key_length; ++i) {
+        difference |= (unsigned char)(presented[i] ^ key[i]);
+    }
+    return difference == 0 ? cluster_frame_origin(frame) : -1;
+}
+
+/**
+ * @brief Finds the configured peer an inbound link comes from, and marks its node ID live.
+ *
+ * Several peers may share an address. The link belongs to the one whose outbound link
+ * learned the same node ID, or else to one whose node ID is not known yet.
+ *
+ * @param state The bus state.
+ * @param address The address the link comes from.
+ * @param node_id The node ID presented by the link.
+ *
+ * @return cluster_peer_t* The peer, or NULL if the link must be refused.
+ */
+static cluster_peer_t *claim_inbound_peer(cluster_tcp_state_t *state, struct in_addr address, int node_id) {
+    cluster_peer_t *match = NULL;
+
+    pthread_mutex_lock(&state->inbound_mutex);
+    for (int i = 0; i < state->peer_count; ++i) {
+        cluster_peer_t *peer = &state->peers[i];
+        int peer_node_id;
+
+        if (peer->inbound_node_id == node_id) {
+            match = NULL;
+            break;
+        }
+        pthread_mutex_lock(&peer->send_mutex);
+        peer_node_id = peer->node_id;
+        pthread_mutex_unlock(&peer->send_mutex);
+        if (inet_addr(peer->host) != address.s_addr || peer->inbound_node_id != 0) {
+            continue;
+        }
+        if (peer_node_id == node_id || (peer_node_id == 0 && !match)) {
+            match = peer;
+        }
+    }
+    if (match) {
+        match->inbound_node_id = node_id;
+    }
+    pthread_mutex_unlock(&state->inbound_mutex);
+    return match;
+}
+
+/**
+ * @brief Receives the frames of an inbound link.
+ *
+ * The link must present the cluster key and come from a configured peer, or it is closed
+ * before anything it sends is dispatched.
+ *
+ * @param arg The inbound link, freed by the thread.
+ * @return void* Always returns NULL when the link closes.
+ */
+static void *inbound_link_handler(void *arg) {
+    inbound_link_t link = *(inbound_link_t *)arg;
+    cluster_tcp_state_t *state = link.state;
+    unsigned char *frame = malloc(CLUSTER_MAX_FRAME);
+    cluster_peer_t *peer = NULL;
+    size_t length;
+    int node_id = link_receive_hello(link.sockfd, state->key);
+
+    free(arg);
+    if (frame && node_id > 0 && node_id != cluster_node_id) {
+        peer = claim_inbound_peer(state, link.address, node_id);
+        if (!peer) {
+            char address[INET_ADDRSTRLEN];
+
+            inet_ntop(AF_INET, &link.address, address, sizeof(address));
+            printf("Refusing cluster link from %s claiming node %d\n", address, node_id);
+        }
+    }
+    if (!peer || link_send_hello(link.sockfd, state->key) < 0) {
+        if (peer) {
+            pthread_mutex_lock(&state->inbound_mutex);
+            peer->inbound_node_id = 0;
+            pthread_mutex_unlock(&state->inbound_mutex);
+        }
+        free(frame);
+        close(link.sockfd);
+        return NULL;
+    }
+
+    while (link_read_frame(link.sockfd, frame, &length) == 0) {
+        if (cluster_frame_origin(frame) == node_id) {
+            cluster_on_frame(frame, length);
+        }
+    }
+
+    close(link.sockfd);
+    free(frame);
+    pthread_mutex_lock(&state->inbound_mutex);
+    peer->inbound_node_id = 0;
+    pthread_mutex_unlock(&state->inbound_mutex);
+    cluster_on_node_down(node_id);
+    return NULL;
+}
+
+/**
+ * @brief Accepts inbound links from the other nodes.
+ *
+ * @param arg The bus state.
+ * @return void* Never returns while the listening socket is open.
+ */
+static void *cluster_accept_loop(void *arg) {
+    cluster_tcp_state_t *state = (cluster_tcp_state_t *)arg;
+
+    while (1) {
+        struct sockaddr_in address;
+        socklen_t address_length = sizeof(address);
+        int sockfd = accept(state->listen_fd, (struct sockaddr *)&address, &address_length);
+        inbound_link_t *link;
+        pthread_t tid;
+
+        if (sockfd < 0) {
+            perror("ERROR: accept cluster link failed");
+            continue;
+        }
+        link = malloc(sizeof(inbound_link_t));
+        if (!link) {
+            close(sockfd);
+            continue;
+        }
+        link->state = state;
+        link->sockfd = sockfd;
+        link->address = address.sin_addr;
+        if (pthread_create(&tid, NULL, inbound_link_handler, link) != 0) {
+            free(link);
+            close(sockfd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Keeps the outbound link to a peer established.
+ *
+ * Once connected and identified, the thread blocks on the link only to notice when it closes,
+ * since the peer never sends anything after its HELLO frame on this link. The node ID the
+ * peer first presents is kept for the life of the server: a peer answering with another one
+ * later is not trusted.
+ *
+ * @param arg The peer.
+ * @return void* Never returns.
+ */
+static void *outbound_link_handler(void *arg) {
+    cluster_peer_t *peer = (cluster_peer_t *)arg;
+    struct sockaddr_in peer_addr;
+
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_addr.s_addr = inet_addr(peer->host);
+    peer_addr.sin_port = htons(peer->port);
+
+    while (1) {
+        unsigned char byte;
+        int node_id;
+        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (sockfd < 0 || connect(sockfd, (struct sockaddr *)&peer_addr, sizeof(peer_addr)) < 0 ||
+            link_send_hello(sockfd, peer->key) < 0 || (node_id = link_receive_hello(sockfd, peer->key)) <= 0 ||
+            (peer->node_id != 0 && node_id != peer->node_id)) {
+            if (sockfd >= 0) {
+                close(sockfd);
+            }
+            sleep(CLUSTER_RECONNECT_DELAY);
+            continue;
+        }
+
+        pthread_mutex_lock(&peer->send_mutex);
+        peer->sockfd = sockfd;
+        peer->node_id = node_id;
+        peer->up = 1;
+        pthread_mutex_unlock(&peer->send_mutex);
+
+        cluster_on_node_up(node_id);
+
+        while (recv(sockfd, &byte, 1, 0) > 0) {
+        }
+
+        pthread_mutex_lock(&peer->send_mutex);
+        peer->up = 0;
+        close(sockfd);
+        peer->sockfd = -1;
+        pthread_mutex_unlock(&peer->send_mutex);
+
+        sleep(CLUSTER_RECONNECT_DELAY);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts listening for inbound links and connecting to the peers.
+ *
+ * @param bus The TCP bus.
+ * @return int 0 on success, -1 on failure.
+ */
+static int cluster_tcp_start(cluster_bus_t *bus) {
+    cluster_tcp_state_t *state = (cluster_tcp_state_t *)bus->state;
+    struct sockaddr_in addr;
+    int option = 1;
+    pthread_t tid;
+
+    state->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (state->listen_fd < 0) {
+        perror("ERROR: cluster socket error");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(state->ip);
+    addr.sin_port = htons(state->port);
+
+    setsockopt(state->listen_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&option, sizeof(option));
+    if (bind(state->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(state->listen_fd, 10) < 0) {
+        perror("ERROR: cluster socket binding failed");
+        close(state->listen_fd);
+        return -1;
+    }
+
+    if (pthread_create(&tid, NULL, cluster_accept_loop, state) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+
+    for (int i = 0; i < state->peer_count; ++i) {
+        if (pthread_create(&tid, NULL, outbound_link_handler, &state->peers[i]) != 0) {
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+
+    printf("Cluster bus listening on %s:%d with %d peer(s)\n", state->ip, state->port, state->peer_count);
+    return 0;
+}
+
+/**
+ * @brief Sends a frame to one node or to every connected node.
+ *
+ * A failed write shuts the link down; its connector thread then reconnects.
+ *
+ * @param bus The TCP bus.
+ * @param node_id The destination node, or CLUSTER_ALL_NODES.
+ * @param frame The complete frame.
+ * @param length The total frame length.
+ *
+ * @return int 0 if the frame was written to at least one matching node, -1 otherwise.
+ */
+static int cluster_tcp_send(cluster_bus_t *bus, int node_id, const unsigned char *frame, size_t length) {
+    cluster_tcp_state_t *state = (cluster_tcp_state_t *)bus->state;
+    int result = -1;
+
+    for (int i = 0; i < state->peer_count; ++i) {
+        cluster_peer_t *peer = &state->peers[i];
+
+        pthread_mutex_lock(&peer->send_mutex);
+        if (peer->up && (node_id == CLUSTER_ALL_NODES || peer->node_id == node_id)) {
+            if (link_write(peer->sockfd, frame, length) == 0) {
+                result = 0;
+            } else {
+                perror("ERROR: write to cluster link failed");
+                shutdown(peer->sockfd, SHUT_RDWR);
+            }
+        }
+        pthread_mutex_unlock(&peer->send_mutex);
+    }
+    return result;
+}
+
+/**
+ * @brief Creates a TCP bus listening on the given address.
+ *
+ * @param ip The IP address to listen on for inbound links.
+ * @param port The cluster port to listen on.
+ * @param key The cluster key every node presents in its HELLO frame.
+ *
+ * @return cluster_bus_t* The new bus, or NULL on allocation failure.
+ */
+cluster_bus_t *cluster_tcp_create(const char *ip, int port, const char *key) {
+    cluster_bus_t *bus = calloc(1, sizeof(cluster_bus_t));
+    cluster_tcp_state_t *state = calloc(1, sizeof(cluster_tcp_state_t));
+
+    if (!bus || !state) {
+        free(bus);
+        free(state);
+        return NULL;
+    }
+
+    strncpy(state->ip, ip, sizeof(state->ip) - 1);
+    snprintf(state->key, sizeof(state->key), "%s", key);
+    state->port = port;
+    state->listen_fd = -1;
+    pthread_mutex_init(&state->inbound_mutex, NULL);
+
+    bus->name = "tcp";
+    bus->start = cluster_tcp_start;
+    bus->send = cluster_tcp_send;
+    bus->state = state;
+    return bus;
+}
+
+/**
+ * @brief Adds a peer to connect to.
+ *
+ * @param bus The TCP bus.
+ * @param address The peer's cluster address, as `ip:port`.
+ *
+ * @return int 0 on success, -1 if the address is not an IPv4 address and port, or if there
+ *         are too many peers.
+ */
+int cluster_tcp_add_peer(cluster_bus_t *bus, const char *address) {
+    cluster_tcp_state_t *state = (cluster_tcp_state_t *)bus->state;
+    const char *separator = strrchr(address, ':');
+    cluster_peer_t *peer;
+    size_t host_length;
+
+    if (!separator || state->peer_count == CLUSTER_MAX_PEERS) {
+        return -1;
+    }
+    host_length = (size_t)(separator - address);
+    if (host_length == 0 || host_length >= sizeof(peer->host) || atoi(separator + 1) <= 0) {
+        return -1;
+    }
+
+    peer = &state->peers[state->peer_count];
+    memcpy(peer->host, address, host_length);
+    peer->host[host_length] = '\0';
+    if (inet_addr(peer->host) == INADDR_NONE) {
+        return -1;
+    }
+    state->peer_count++;
+    peer->port = atoi(separator + 1);
+    peer->sockfd = -1;
+    peer->key = state->key;
+    pthread_mutex_init(&peer->send_mutex, NULL);
+    return 0;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file cluster_tcp.h
+ * @brief TCP implementation of the inter-node bus.
+ *
+ * Each node listens on a cluster port and opens one outbound connection to every configured
+ * peer. Frames are sent over the outbound connections and received on the inbound ones. Both
+ * ends of a connection exchange a HELLO frame first so each side learns the other's node ID.
+ *
+ * The HELLO frame carries the cluster key, and a link presenting another key is closed. An
+ * inbound link is only accepted from the address of a configured peer, with the node ID the
+ * outbound link to that peer learned, and while no other inbound link carries that node ID,
+ * so a link can't take over the identity of a node that is up.
+ */
+#ifndef CLUSTER_TCP_H
+#define CLUSTER_TCP_H
+
+#include "cluster.h"
+#include <pthread.h>
+
+#define CLUSTER_MAX_PEERS 16
+#define CLUSTER_RECONNECT_DELAY 1
+#define CLUSTER_KEY_SIZE 128
+
+typedef struct {
+    char host[64];
+    int port;
+    int sockfd;
+    int node_id;
+    int up;
+    int inbound_node_id;
+    const char *key;
+    pthread_mutex_t send_mutex;
+} cluster_peer_t;
+
+typedef struct {
+    char ip[64];
+    int port;
+    int listen_fd;
+    char key[CLUSTER_KEY_SIZE];
+    cluster_peer_t peers[CLUSTER_MAX_PEERS];
+    int peer_count;
+    pthread_mutex_t inbound_mutex;
+} cluster_tcp_state_t;
+
+cluster_bus_t *cluster_tcp_create(const char *ip, int port, const char *key);
+int cluster_tcp_add_peer(cluster_bus_t *bus, const char *address);
+
+#endif // CLUSTER_TCP_H
@@ -7,9 +7,14 @@
  * IP address and port.
  */
 #include "connection.h"
+#include <string.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 int server_socket_fd = 0;
+int local_socket_fd = -1;
+static char local_socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)] = "";
 
 /**
  * @brief Starts the server and binds it to the specified IP and port.
@@ -47,7 +52,7 @@ void start_server(const char *ip, int port) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_socket_fd, 10) < 0) {
+    if (listen(server_socket_fd, SOMAXCONN) < 0) {
         perror("ERROR: Socket listening failed");
         exit(EXIT_FAILURE);
     }
@@ -55,6 +60,49 @@ void start_server(const char *ip, int port) {
     printf("Server started. Listening on %s:%d\n", ip, port);
 }
 
+/**
+ * @brief Starts listening on a Unix domain socket for local clients.
+ *
+ * A stale socket file left at `path` by a previous run is replaced. If any step fails, the
+ * function prints an error and exits the program.
+ *
+ * @param path The filesystem path of the socket.
+ *
+ * @return void
+ */
+void start_local_server(const char *path) {
+    struct sockaddr_un local_addr;
+
+    if (strlen(path) >= sizeof(local_addr.sun_path)) {
+        printf("ERROR: Unix socket path is too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    local_socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (local_socket_fd < 0) {
+        perror("ERROR: socket error");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sun_family = AF_UNIX;
+    strcpy(local_addr.sun_path, path);
+    unlink(path);
+
+    if (bind(local_socket_fd, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0) {
+        perror("ERROR: Unix socket binding failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(local_socket_fd, SOMAXCONN) < 0) {
+        perror("ERROR: Unix socket listening failed");
+        exit(EXIT_FAILURE);
+    }
+
+    strcpy(local_socket_path, path);
+    printf("Listening for local clients on %s\n", path);
+}
+
 /**
  * @brief Accepts an incoming client connection.
  *
@@ -77,6 +125,72 @@ int accept_client(int server_socket_fd, struct sockaddr_in *cli_addr) {
     return client_socket_fd;
 }
 
+/**
+ * @brief Accepts an incoming connection on the Unix domain socket.
+ *
+ * @param local_socket_fd The file descriptor of the Unix domain listening socket.
+ *
+ * @return int The file descriptor for the accepted client socket, or -1 on error.
+ */
+int accept_local_client(int local_socket_fd) {
+    int client_socket_fd = accept(local_socket_fd, NULL, NULL);
+    if (client_socket_fd < 0) {
+        perror("ERROR: accept local client failed");
+        return -1;
+    }
+    return client_socket_fd;
+}
+
+/**
+ * @brief Sends a message over a Unix domain socket along with file descriptors.
+ *
+ * The descriptors travel as SCM_RIGHTS ancillary data attached to the first byte of the
+ * message; the rest of the message is written normally.
+ *
+ * @param sockfd The Unix domain socket.
+ * @param message The message to send.
+ * @param length The length of the message in bytes.
+ * @param fds The file descriptors to pass.
+ * @param fd_count The number of file descriptors, at most 4.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+int send_with_fds(int sockfd, const char *message, size_t length, const int *fds, int fd_count) {
+    union {
+        char buffer[CMSG_SPACE(4 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { (void *)message, length };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t sent;
+
+    if (fd_count < 1 || fd_count > 4 || length == 0) {
+        return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+
+    sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    while (sent >= 0 && (size_t)sent < length) {
+        ssize_t written = send(sockfd, message + sent, length - (size_t)sent, MSG_NOSIGNAL);
+        if (written < 0) {
+            return -1;
+        }
+        sent += written;
+    }
+    return sent < 0 ? -1 : 0;
+}
+
 /**
  * @brief Shuts down the server.
  *
@@ -86,6 +200,10 @@ int accept_client(int server_socket_fd, struct sockaddr_in *cli_addr) {
  * @return void
  */
 void shutdown_server() {
+    if (local_socket_fd >= 0) {
+        close(local_socket_fd);
+        unlink(local_socket_path);
+    }
     if (server_socket_fd > 0) {
         close(server_socket_fd);
         printf("Server shut down.\n");
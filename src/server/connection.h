@@ -5,6 +5,9 @@
  * This header file declares functions for starting a server, accepting incoming client connections, 
  * and shutting down the server. It includes the necessary external variables and function prototypes 
  * to manage socket connections in a server application.
+ *
+ * Besides the TCP listener, the server can listen on a Unix domain socket for clients running
+ * on the same host.
  */
 #ifndef CONNECTION_H
 #define CONNECTION_H
@@ -14,9 +17,13 @@
 #include <arpa/inet.h>
 
 extern int server_socket_fd; 
+extern int local_socket_fd;
 
 void start_server(const char *ip, int port);
+void start_local_server(const char *path);
 int accept_client(int server_socket_fd, struct sockaddr_in *cli_addr);
+int accept_local_client(int local_socket_fd);
+int send_with_fds(int sockfd, const char *message, size_t length, const int *fds, int fd_count);
 void shutdown_server();
 
 #endif // CONNECTION_H
@@ -0,0 +1,371 @@
+/**
+ * @file directory.c
+ * @brief Implements the local directory partition and the lookup cache.
+ *
+ * The partition is a chained hash table keyed by username and protected by a single mutex.
+ * The lookup cache is a direct-mapped table: a colliding username simply replaces the
+ * previous entry, which keeps it bounded without any eviction bookkeeping. Clearing the
+ * cache bumps a generation counter instead of touching every slot. The users seen since
+ * startup are kept in a direct-mapped table too, so a user can be forgotten when another one
+ * takes its slot.
+ */
+#include "directory.h"
+#include "ring.h"
+#include "utf8.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+static directory_entry_t *buckets[DIRECTORY_BUCKETS];
+static pthread_mutex_t directory_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static directory_cache_entry_t cache[DIRECTORY_CACHE_SIZE];
+static unsigned int cache_generation = 1;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char seen[DIRECTORY_SEEN_SIZE][32];
+static pthread_mutex_t seen_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Computes the bucket of a username.
+ *
+ * @param username The username to hash.
+ * @return unsigned int The bucket index.
+ */
+static unsigned int directory_bucket(const char *username) {
+    return ring_hash(username) % DIRECTORY_BUCKETS;
+}
+
+/**
+ * @brief Finds the entry of a username in its bucket.
+ *
+ * Must be called with the directory lock held.
+ *
+ * @param bucket The bucket of the username.
+ * @param username The username to find.
+ * @return directory_entry_t* The entry, or NULL if the username is not in the partition.
+ */
+static directory_entry_t *directory_find(unsigned int bucket, const char *username) {
+    for (directory_entry_t *entry = buckets[bucket]; entry; entry = entry->next) {
+        if (strcmp(entry->user_name, username) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Inserts a new entry at the head of its bucket.
+ *
+ * Must be called with the directory lock held.
+ *
+ * @param bucket The bucket of the username.
+ * @param username The username to insert.
+ * @return directory_entry_t* The new entry, or NULL on allocation failure.
+ */
+static directory_entry_t *directory_insert(unsigned int bucket, const char *username) {
+    directory_entry_t *entry = calloc(1, sizeof(directory_entry_t));
+
+    if (entry) {
+        utf8_copy(entry->user_name, username, sizeof(entry->user_name));
+        entry->next = buckets[bucket];
+        buckets[bucket] = entry;
+    }
+    return entry;
+}
+
+/**
+ * @brief Registers a username for a node unless another node already holds it.
+ *
+ * This is how usernames stay unique across the cluster: every IDENTIFY claims the username
+ * on its home node, which serializes competing claims.
+ *
+ * @param username The username being claimed.
+ * @param status The initial status of the user.
+ * @param node_id The node the user is connecting to.
+ *
+ * @return int 0 if the username now belongs to `node_id`, -1 if another node holds it.
+ */
+int directory_claim(const char *username, const char *status, int node_id) {
+    unsigned int bucket = directory_bucket(username);
+    directory_entry_t *entry;
+    int result = 0;
+
+    pthread_mutex_lock(&directory_mutex);
+    entry = directory_find(bucket, username);
+    if (entry && entry->node_id != node_id) {
+        result = -1;
+    } else if (!entry) {
+        entry = directory_insert(bucket, username);
+        result = entry ? 0 : -1;
+    }
+    if (result == 0) {
+        utf8_copy(entry->status, status, sizeof(entry->status));
+        entry->node_id = node_id;
+    }
+    pthread_mutex_unlock(&directory_mutex);
+    if (result == 0) {
+        directory_remember(username);
+    }
+    return result;
+}
+
+/**
+ * @brief Adds a user to the partition or updates its status and owner.
+ *
+ * Used when nodes register their users again after a membership change.
+ *
+ * @param username The username registered by its node.
+ * @param status The current status of the user.
+ * @param node_id The node that owns the user.
+ *
+ * @return void
+ */
+void directory_upsert(const char *username, const char *status, int node_id) {
+    unsigned int bucket = directory_bucket(username);
+    directory_entry_t *entry;
+
+    pthread_mutex_lock(&directory_mutex);
+    entry = directory_find(bucket, username);
+    if (!entry) {
+        entry = directory_insert(bucket, username);
+    }
+    if (entry) {
+        utf8_copy(entry->status, status, sizeof(entry->status));
+        entry->node_id = node_id;
+    }
+    pthread_mutex_unlock(&directory_mutex);
+    directory_remember(username);
+}
+
+/**
+ * @brief Updates the status of a user in the partition.
+ *
+ * Users that are not in this node's partition are ignored.
+ *
+ * @param username The user whose status changed.
+ * @param status The new status.
+ *
+ * @return void
+ */
+void directory_set_status(const char *username, const char *status) {
+    unsigned int bucket = directory_bucket(username);
+    directory_entry_t *entry;
+
+    pthread_mutex_lock(&directory_mutex);
+    entry = directory_find(bucket, username);
+    if (entry) {
+        utf8_copy(entry->status, status, sizeof(entry->status));
+    }
+    pthread_mutex_unlock(&directory_mutex);
+}
+
+/**
+ * @brief Removes a user from the partition.
+ *
+ * The entry is only removed if it is still owned by `node_id`, so a late departure notice
+ * from one node can't remove a user that has since connected to another node.
+ *
+ * @param username The username to remove.
+ * @param node_id The node announcing the departure.
+ *
+ * @return void
+ */
+void directory_remove(const char *username, int node_id) {
+    unsigned int bucket = directory_bucket(username);
+
+    pthread_mutex_lock(&directory_mutex);
+    for (directory_entry_t **link = &buckets[bucket]; *link; link = &(*link)->next) {
+        if (strcmp((*link)->user_name, username) == 0) {
+            if ((*link)->node_id == node_id) {
+                directory_entry_t *entry = *link;
+                *link = entry->next;
+                free(entry);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&directory_mutex);
+}
+
+/**
+ * @brief Removes every user of a node that left the cluster from the partition.
+ *
+ * @param node_id The node that left.
+ * @param removed Called with each removed username after the directory lock is released, or NULL.
+ *
+ * @return void
+ */
+void directory_remove_node(int node_id, void (*removed)(const char *username)) {
+    directory_entry_t *gone = NULL;
+
+    pthread_mutex_lock(&directory_mutex);
+    for (int i = 0; i < DIRECTORY_BUCKETS; ++i) {
+        directory_entry_t **link = &buckets[i];
+        while (*link) {
+            if ((*link)->node_id == node_id) {
+                directory_entry_t *entry = *link;
+                *link = entry->next;
+                entry->next = gone;
+                gone = entry;
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&directory_mutex);
+
+    while (gone) {
+        directory_entry_t *next = gone->next;
+        if (removed) {
+            removed(gone->user_name);
+        }
+        free(gone);
+        gone = next;
+    }
+}
+
+/**
+ * @brief Drops the users that no longer belong to this node's partition.
+ *
+ * Called after a membership change moved part of the ring to other nodes, which receive
+ * the moved users when their nodes register them again.
+ *
+ * @param keep Returns non-zero for the usernames that still belong to this node.
+ *
+ * @return void
+ */
+void directory_retain(int (*keep)(const char *username)) {
+    pthread_mutex_lock(&directory_mutex);
+    for (int i = 0; i < DIRECTORY_BUCKETS; ++i) {
+        directory_entry_t **link = &buckets[i];
+        while (*link) {
+            if (!keep((*link)->user_name)) {
+                directory_entry_t *entry = *link;
+                *link = entry->next;
+                free(entry);
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&directory_mutex);
+}
+
+/**
+ * @brief Finds the node a user in the partition is connected to.
+ *
+ * @param username The username to look up.
+ * @return int The node ID, or 0 if the user is not in the partition.
+ */
+int directory_lookup(const char *username) {
+    unsigned int bucket = directory_bucket(username);
+    directory_entry_t *entry;
+    int node_id = 0;
+
+    pthread_mutex_lock(&directory_mutex);
+    entry = directory_find(bucket, username);
+    if (entry) {
+        node_id = entry->node_id;
+    }
+    pthread_mutex_unlock(&directory_mutex);
+    return node_id;
+}
+
+/**
+ * @brief Looks up a username in the cache of remote lookups.
+ *
+ * @param username The username to look up.
+ * @return int The cached node ID, or 0 on a cache miss.
+ */
+int directory_cache_get(const char *username) {
+    directory_cache_entry_t *slot = &cache[ring_hash(username) % DIRECTORY_CACHE_SIZE];
+    int node_id = 0;
+
+    pthread_mutex_lock(&cache_mutex);
+    if (slot->generation == cache_generation && strcmp(slot->user_name, username) == 0) {
+        node_id = slot->node_id;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return node_id;
+}
+
+/**
+ * @brief Caches the result of a remote lookup.
+ *
+ * @param username The username that was looked up.
+ * @param node_id The node the user is connected to.
+ *
+ * @return void
+ */
+void directory_cache_put(const char *username, int node_id) {
+    directory_cache_entry_t *slot = &cache[ring_hash(username) % DIRECTORY_CACHE_SIZE];
+
+    pthread_mutex_lock(&cache_mutex);
+    utf8_copy(slot->user_name, username, sizeof(slot->user_name));
+    slot->node_id = node_id;
+    slot->generation = cache_generation;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * @brief Forgets the cached location of a user.
+ *
+ * @param username The user who left or moved.
+ *
+ * @return void
+ */
+void directory_cache_invalidate(const char *username) {
+    directory_cache_entry_t *slot = &cache[ring_hash(username) % DIRECTORY_CACHE_SIZE];
+
+    pthread_mutex_lock(&cache_mutex);
+    if (strcmp(slot->user_name, username) == 0) {
+        slot->generation = 0;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * @brief Forgets every cached location.
+ *
+ * @return void
+ */
+void directory_cache_clear(void) {
+    pthread_mutex_lock(&cache_mutex);
+    cache_generation++;
+    if (cache_generation == 0) {
+        cache_generation = 1;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * @brief Records that a user identified.
+ *
+ * @param username The user.
+ *
+ * @return void
+ */
+void directory_remember(const char *username) {
+    char *slot = seen[ring_hash(username) % DIRECTORY_SEEN_SIZE];
+
+    pthread_mutex_lock(&seen_mutex);
+    utf8_copy(slot, username, sizeof(seen[0]));
+    pthread_mutex_unlock(&seen_mutex);
+}
+
+/**
+ * @brief Tells whether a user identified since this node started.
+ *
+ * @param username The user.
+ * @return int 1 if the user is remembered, 0 if it never identified or was forgotten.
+ */
+int directory_known(const char *username) {
+    char *slot = seen[ring_hash(username) % DIRECTORY_SEEN_SIZE];
+    int known;
+
+    pthread_mutex_lock(&seen_mutex);
+    known = strcmp(slot, username) == 0;
+    pthread_mutex_unlock(&seen_mutex);
+    return known;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file directory.h
+ * @brief Partition of the cluster-wide user directory held by this node.
+ *
+ * Each node owns the clients connected to it in `clients[]`. The directory recording which
+ * node every user is connected to is partitioned with the consistent-hash ring: a node only
+ * stores the users whose username hashes to it, wherever they are connected. Lookups of
+ * other partitions are answered by their home node and kept in a small local cache, which
+ * is cleared whenever the cluster membership changes. A node also remembers the users of its
+ * partition that identified since it started, so mentions are only queued for real users.
+ */
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#define DIRECTORY_BUCKETS 1024
+#define DIRECTORY_CACHE_SIZE 4096
+#define DIRECTORY_SEEN_SIZE 16384
+
+typedef struct directory_entry {
+    char user_name[32];
+    char status[16];
+    int node_id;
+    struct directory_entry *next;
+} directory_entry_t;
+
+typedef struct {
+    char user_name[32];
+    int node_id;
+    unsigned int generation;
+} directory_cache_entry_t;
+
+int directory_claim(const char *username, const char *status, int node_id);
+void directory_upsert(const char *username, const char *status, int node_id);
+void directory_set_status(const char *username, const char *status);
+void directory_remove(const char *username, int node_id);
+void directory_remove_node(int node_id, void (*removed)(const char *username));
+void directory_retain(int (*keep)(const char *username));
+int directory_lookup(const char *username);
+
+int directory_cache_get(const char *username);
+void directory_cache_put(const char *username, int node_id);
+void directory_cache_invalidate(const char *username);
+void directory_cache_clear(void);
+
+void directory_remember(const char *username);
+int directory_known(const char *username);
+
+#endif // DIRECTORY_H
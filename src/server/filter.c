@@ -0,0 +1,483 @@
+/**
+ * @file filter.c
+ * @brief Implements the banned-word filter applied to public messages.
+ *
+ * Bytes are mapped to a small set of classes before indexing the transition table: every
+ * byte appearing in a word gets its own class, upper-case ASCII letters share the class of
+ * their lower-case form, and all other bytes share class 0, which always leads back to the
+ * root. Each state records the length of the longest word ending there, so a match can be
+ * masked without walking the failure links while scanning.
+ *
+ * The prefilter uses the nibble-table technique: a byte can start a word when the table
+ * entries of its low and high nibbles share a bit. Bytes are bucketed by their high nibble,
+ * so a few bytes that start no word may be reported too; the automaton discards them.
+ */
+#include "filter.h"
+#include "metrics.h"
+#include "../common/clock.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    unsigned char classes[256];
+    int class_count;
+    int state_count;
+    uint32_t *next;
+    uint16_t *match_length;
+    unsigned char starts[256];
+    unsigned char low_nibbles[16];
+    unsigned char high_nibbles[16];
+    int word_count;
+} automaton_t;
+
+typedef size_t (*candidate_finder_t)(const automaton_t *automaton, const unsigned char *text, size_t position,
+                                     size_t length);
+
+static automaton_t *current = NULL;
+static pthread_rwlock_t current_lock = PTHREAD_RWLOCK_INITIALIZER;
+static char filter_path[1024] = "";
+static int filter_action = FILTER_ACTION_MASK;
+static struct stat loaded_stat;
+static candidate_finder_t find_candidate = NULL;
+
+/**
+ * @brief Frees an automaton.
+ *
+ * @param automaton The automaton, or NULL.
+ *
+ * @return void
+ */
+static void automaton_free(automaton_t *automaton) {
+    if (automaton) {
+        free(automaton->next);
+        free(automaton->match_length);
+        free(automaton);
+    }
+}
+
+/**
+ * @brief Reads the banned words of a file, one per line.
+ *
+ * Blank lines and lines starting with `#` are skipped, surrounding whitespace is trimmed,
+ * and words are lower-cased.
+ *
+ * @param path The word file.
+ * @param words Receives the array of words, to be freed with each word by the caller.
+ * @param total_length Receives the sum of the word lengths.
+ *
+ * @return int The number of words, or -1 if the file could not be read.
+ */
+static int read_words(const char *path, char ***words, size_t *total_length) {
+    FILE *file = fopen(path, "r");
+    char line[1024];
+    char **list = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    if (!file) {
+        return -1;
+    }
+    *total_length = 0;
+    while (fgets(line, sizeof(line), file)) {
+        char *start = line;
+        size_t length;
+
+        while (isspace((unsigned char)*start)) {
+            start++;
+        }
+        length = strlen(start);
+        while (length > 0 && isspace((unsigned char)start[length - 1])) {
+            start[--length] = '\0';
+        }
+        if (length == 0 || start[0] == '#' || length > FILTER_MAX_WORD_LENGTH) {
+            continue;
+        }
+        if (count == capacity) {
+            char **grown = realloc(list, (size_t)(capacity ? capacity * 2 : 64) * sizeof(char *));
+            if (!grown) {
+                break;
+            }
+            list = grown;
+            capacity = capacity ? capacity * 2 : 64;
+        }
+        for (size_t i = 0; i < length; ++i) {
+            start[i] = (char)tolower((unsigned char)start[i]);
+        }
+        list[count] = strdup(start);
+        if (!list[count]) {
+            break;
+        }
+        *total_length += length;
+        count++;
+    }
+    fclose(file);
+
+    *words = list;
+    return count;
+}
+
+/**
+ * @brief Compiles a list of words into an automaton.
+ *
+ * @param words The lower-cased words.
+ * @param count The number of words.
+ * @param total_length The sum of the word lengths, which bounds the number of states.
+ *
+ * @return automaton_t* The automaton, or NULL on allocation failure.
+ */
+static automaton_t *automaton_build(char **words, int count, size_t total_length) {
+    automaton_t *automaton = calloc(1, sizeof(automaton_t));
+    size_t max_states = total_length + 1;
+    uint32_t *fail = NULL;
+    uint32_t *queue = NULL;
+    size_t queue_head = 0;
+    size_t queue_tail = 0;
+    int class_count = 1;
+
+    if (!automaton) {
+        return NULL;
+    }
+    for (int i = 0; i < count; ++i) {
+        for (const unsigned char *byte = (const unsigned char *)words[i]; *byte; ++byte) {
+            if (!automaton->classes[*byte]) {
+                automaton->classes[*byte] = (unsigned char)class_count;
+                if (*byte >= 'a' && *byte <= 'z') {
+                    automaton->classes[toupper(*byte)] = (unsigned char)class_count;
+                }
+                class_count++;
+            }
+        }
+        unsigned char first = (unsigned char)words[i][0];
+        automaton->starts[first] = 1;
+        automaton->starts[toupper(first)] = 1;
+    }
+    automaton->class_count = class_count;
+    automaton->word_count = count;
+
+    automaton->next = calloc(max_states * (size_t)class_count, sizeof(uint32_t));
+    automaton->match_length = calloc(max_states, sizeof(uint16_t));
+    fail = calloc(max_states, sizeof(uint32_t));
+    queue = calloc(max_states, sizeof(uint32_t));
+    if (!automaton->next || !automaton->match_length || !fail || !queue) {
+        automaton_free(automaton);
+        free(fail);
+        free(queue);
+        return NULL;
+    }
+
+    // Build the trie; 0 is the root and, until the links are resolved, "no transition".
+    automaton->state_count = 1;
+    for (int i = 0; i < count; ++i) {
+        uint32_t state = 0;
+        size_t length = strlen(words[i]);
+
+        for (size_t j = 0; j < length; ++j) {
+            uint32_t *slot = &automaton->next[state * (size_t)class_count + automaton->classes[(unsigned char)words[i][j]]];
+            if (!*slot) {
+                *slot = (uint32_t)automaton->state_count++;
+            }
+            state = *slot;
+        }
+        automaton->match_length[state] = (uint16_t)length;
+    }
+
+    // Resolve the failure links breadth-first into direct transitions.
+    for (int c = 1; c < class_count; ++c) {
+        uint32_t child = automaton->next[c];
+        if (child) {
+            fail[child] = 0;
+            queue[queue_tail++] = child;
+        }
+    }
+    while (queue_head < queue_tail) {
+        uint32_t state = queue[queue_head++];
+
+        if (!automaton->match_length[state]) {
+            automaton->match_length[state] = automaton->match_length[fail[state]];
+        }
+        for (int c = 1; c < class_count; ++c) {
+            uint32_t *slot = &automaton->next[state * (size_t)class_count + c];
+            uint32_t fallback = automaton->next[fail[state] * (size_t)class_count + c];
+            if (*slot) {
+                fail[*slot] = fallback;
+                queue[queue_tail++] = *slot;
+            } else {
+                *slot = fallback;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+
+    for (int byte = 0; byte < 256; ++byte) {
+        if (automaton->starts[byte]) {
+            unsigned char bucket = (unsigned char)(1u << ((byte >> 4) & 7));
+            automaton->low_nibbles[byte & 0x0F] |= bucket;
+            automaton->high_nibbles[byte >> 4] |= bucket;
+        }
+    }
+    return automaton;
+}
+
+/**
+ * @brief Finds the next byte that can start a word, one byte at a time.
+ *
+ * @param automaton The automaton.
+ * @param text The message.
+ * @param position The first position to look at.
+ * @param length The length of the message.
+ *
+ * @return size_t The position of the candidate, or `length` if there is none.
+ */
+static size_t find_candidate_scalar(const automaton_t *automaton, const unsigned char *text, size_t position,
+                                    size_t length) {
+    while (position < length && !automaton->starts[text[position]]) {
+        position++;
+    }
+    return position;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief Finds the next byte that can start a word, 16 bytes at a time.
+ *
+ * @param automaton The automaton.
+ * @param text The message.
+ * @param position The first position to look at.
+ * @param length The length of the message.
+ *
+ * @return size_t The position of the candidate, or `length` if there is none.
+ */
+__attribute__((target("ssse3")))
+static size_t find_candidate_ssse3(const automaton_t *automaton, const unsigned char *text, size_t position,
+                                   size_t length) {
+    const __m128i low_table = _mm_loadu_si128((const __m128i *)automaton->low_nibbles);
+    const __m128i high_table = _mm_loadu_si128((const __m128i *)automaton->high_nibbles);
+    const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+    const __m128i zero = _mm_setzero_si128();
+
+    while (position + 16 <= length) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(text + position));
+        __m128i low = _mm_shuffle_epi8(low_table, _mm_and_si128(bytes, nibble_mask));
+        __m128i high = _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble_mask));
+        int candidates = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(low, high), zero)) & 0xFFFF;
+
+        if (candidates) {
+            return position + (size_t)__builtin_ctz((unsigned int)candidates);
+        }
+        position += 16;
+    }
+    return find_candidate_scalar(automaton, text, position, length);
+}
+#endif
+
+/**
+ * @brief Parses the name of a filter action.
+ *
+ * @param name `mask`, `drop` or `flag`.
+ *
+ * @return int The FILTER_ACTION_* value, or -1 if the name is unknown.
+ */
+int filter_action_from_name(const char *name) {
+    if (strcmp(name, "mask") == 0) {
+        return FILTER_ACTION_MASK;
+    }
+    if (strcmp(name, "drop") == 0) {
+        return FILTER_ACTION_DROP;
+    }
+    if (strcmp(name, "flag") == 0) {
+        return FILTER_ACTION_FLAG;
+    }
+    return -1;
+}
+
+/**
+ * @brief Compiles the word file and swaps the new automaton in.
+ *
+ * The automaton is compiled without holding any lock; messages being scanned finish with the
+ * previous automaton, which is freed once the swap is done.
+ *
+ * @param info The status of the word file when it was read.
+ *
+ * @return int 0 on success, -1 if the file could not be read or compiled.
+ */
+static int filter_reload(const struct stat *info) {
+    char **words = NULL;
+    size_t total_length = 0;
+    int count = read_words(filter_path, &words, &total_length);
+    automaton_t *automaton;
+    automaton_t *previous;
+
+    if (count < 0) {
+        perror("ERROR: open filter word list failed");
+        return -1;
+    }
+    automaton = automaton_build(words, count, total_length);
+    for (int i = 0; i < count; ++i) {
+        free(words[i]);
+    }
+    free(words);
+    if (!automaton) {
+        printf("ERROR: could not compile the filter word list\n");
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&current_lock);
+    previous = current;
+    current = automaton;
+    pthread_rwlock_unlock(&current_lock);
+    automaton_free(previous);
+
+    loaded_stat = *info;
+    metrics_add(METRIC_FILTER_RELOADS, 1);
+    metrics_set(METRIC_FILTER_WORDS, (unsigned long long)count);
+    printf("Filter loaded %d word(s) from %s (%d states)\n", count, filter_path, automaton->state_count);
+    return 0;
+}
+
+/**
+ * @brief Reloads the word file whenever it changes.
+ *
+ * @param arg Unused.
+ *
+ * @return void* Never returns.
+ */
+static void *filter_watch(void *arg) {
+    (void)arg;
+
+    while (1) {
+        struct stat info;
+
+        sleep(FILTER_RELOAD_INTERVAL);
+        if (stat(filter_path, &info) == 0 &&
+            (info.st_mtim.tv_sec != loaded_stat.st_mtim.tv_sec || info.st_mtim.tv_nsec != loaded_stat.st_mtim.tv_nsec ||
+             info.st_size != loaded_stat.st_size || info.st_ino != loaded_stat.st_ino)) {
+            filter_reload(&info);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Loads the word file and starts watching it for changes.
+ *
+ * @param path The word file, one word per line.
+ * @param action The FILTER_ACTION_* applied to messages containing a word.
+ *
+ * @return int 0 on success, -1 if the file could not be loaded.
+ */
+int filter_init(const char *path, int action) {
+    struct stat info;
+    pthread_t tid;
+
+    snprintf(filter_path, sizeof(filter_path), "%s", path);
+    filter_action = action;
+    find_candidate = find_candidate_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("ssse3")) {
+        find_candidate = find_candidate_ssse3;
+    }
+#endif
+
+    if (stat(path, &info) < 0 || filter_reload(&info) < 0) {
+        perror("ERROR: load filter word list failed");
+        return -1;
+    }
+    if (pthread_create(&tid, NULL, filter_watch, NULL) != 0) {
+        perror("ERROR: pthread_create filter watcher failed");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/**
+ * @brief Applies the filter to a public message.
+ *
+ * @param text The message text.
+ * @param filtered Receives the masked text when FILTER_MASKED is returned, to be freed by
+ *        the caller; left untouched otherwise.
+ *
+ * @return int FILTER_PASS if the text contains no banned word or no filter is loaded,
+ *         otherwise the outcome of the configured action.
+ */
+int filter_message(const char *text, char **filtered) {
+    const unsigned char *bytes = (const unsigned char *)text;
+    size_t length = strlen(text);
+    unsigned long long started;
+    unsigned long long elapsed;
+    unsigned long matches = 0;
+    char *masked = NULL;
+    int scanned = 0;
+    uint32_t state = 0;
+    int result = FILTER_PASS;
+
+    if (!find_candidate) {
+        return FILTER_PASS;
+    }
+    started = clock_monotonic_ns();
+
+    pthread_rwlock_rdlock(&current_lock);
+    if (current && current->word_count > 0) {
+        const automaton_t *automaton = current;
+
+        for (size_t i = 0; i < length; ++i) {
+            if (state == 0) {
+                i = find_candidate(automaton, bytes, i, length);
+                if (i == length) {
+                    break;
+                }
+            }
+            scanned = 1;
+            state = automaton->next[state * (size_t)automaton->class_count + automaton->classes[bytes[i]]];
+            if (automaton->match_length[state]) {
+                matches++;
+                if (filter_action != FILTER_ACTION_MASK) {
+                    break;
+                }
+                if (!masked) {
+                    masked = strdup(text);
+                    if (!masked) {
+                        break;
+                    }
+                }
+                memset(masked + i + 1 - automaton->match_length[state], FILTER_MASK_CHARACTER,
+                       automaton->match_length[state]);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&current_lock);
+
+    if (matches) {
+        metrics_add(METRIC_FILTER_MATCHES, matches);
+        if (filter_action == FILTER_ACTION_DROP) {
+            result = FILTER_DROPPED;
+            metrics_add(METRIC_FILTER_DROPPED, 1);
+        } else if (filter_action == FILTER_ACTION_FLAG) {
+            result = FILTER_FLAGGED;
+            metrics_add(METRIC_FILTER_FLAGGED, 1);
+        } else if (masked) {
+            result = FILTER_MASKED;
+            *filtered = masked;
+            metrics_add(METRIC_FILTER_MASKED, 1);
+        }
+    }
+    if (!scanned) {
+        metrics_add(METRIC_FILTER_PREFILTER_SKIPS, 1);
+    }
+
+    elapsed = clock_monotonic_ns() - started;
+    metrics_add(METRIC_FILTER_MESSAGES, 1);
+    metrics_add(METRIC_FILTER_TOTAL_NS, elapsed);
+    metrics_max(METRIC_FILTER_MAX_NS, elapsed);
+    return result;
+}
@@ -0,0 +1,34 @@
+/**
+ * @file filter.h
+ * @brief Banned-word filter applied to public messages before they are broadcast.
+ *
+ * The word list is compiled into an Aho-Corasick automaton whose transitions are fully
+ * resolved, so scanning a message costs one table lookup per byte, and words are matched
+ * case-insensitively anywhere in the text. Before the automaton runs, a prefilter looks for
+ * bytes that can start a banned word, 16 bytes at a time with SSSE3 when the CPU supports
+ * it, and the automaton skips straight to them whenever it is back at its root.
+ *
+ * The word file is checked for changes every FILTER_RELOAD_INTERVAL seconds. A new automaton
+ * is compiled on a background thread and swapped in, so traffic is never paused.
+ */
+#ifndef FILTER_H
+#define FILTER_H
+
+#define FILTER_ACTION_MASK 0
+#define FILTER_ACTION_DROP 1
+#define FILTER_ACTION_FLAG 2
+
+#define FILTER_PASS 0
+#define FILTER_MASKED 1
+#define FILTER_DROPPED 2
+#define FILTER_FLAGGED 3
+
+#define FILTER_RELOAD_INTERVAL 2
+#define FILTER_MAX_WORD_LENGTH 255
+#define FILTER_MASK_CHARACTER '*'
+
+int filter_action_from_name(const char *name);
+int filter_init(const char *path, int action);
+int filter_message(const char *text, char **filtered);
+
+#endif // FILTER_H
@@ -0,0 +1,249 @@
+/**
+ * @file gateway.c
+ * @brief Implements the gateway connections carrying many users over one socket.
+ */
+#include "gateway.h"
+#include "messaging.h"
+#include "metrics.h"
+#include "utf8.h"
+#include "../common/framing.h"
+#include "../libs/cJSON/cJSON.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define GATEWAY_KEY_SIZE 128
+
+static char gateway_key[GATEWAY_KEY_SIZE] = "";
+
+/**
+ * @brief Sets the key gateways must present to authenticate.
+ *
+ * @param key The shared key, or NULL to refuse every gateway.
+ *
+ * @return void
+ */
+void gateway_init(const char *key) {
+    snprintf(gateway_key, sizeof(gateway_key), "%s", key ? key : "");
+}
+
+/**
+ * @brief Compares a presented key with the configured one in constant time.
+ *
+ * @param key The key presented by the connection.
+ *
+ * @return int 1 if the key matches, 0 otherwise.
+ */
+static int gateway_key_matches(const char *key) {
+    size_t length = strlen(gateway_key);
+    unsigned char difference = 0;
+
+    if (length == 0 || strlen(key) != length) {
+        return 0;
+    }
+    for (size_t i = 0; i < length; ++i) {
+        difference |= (unsigned char)(key[i] ^ gateway_key[i]);
+    }
+    return difference == 0;
+}
+
+/**
+ * @brief Turns a connection into a gateway if it presents the gateway key.
+ *
+ * The connection must not have identified as a user. The GATEWAY response is sent
+ * uncompressed, and the connection then switches to the requested compression. A connection
+ * presenting a wrong key is told so and closed.
+ *
+ * @param client The connection sending the GATEWAY message.
+ * @param key The key presented by the connection.
+ * @param compression The requested compression, or NULL.
+ *
+ * @return void
+ */
+void open_gateway(client_t *client, const char *key, const char *compression) {
+    int authorized = !client->user_name[0] && gateway_key_matches(key);
+    int mode = compression ? compression_from_name(compression) : COMPRESSION_NONE;
+    cJSON *json_response = cJSON_CreateObject();
+
+    cJSON_AddStringToObject(json_response, "type", "RESPONSE");
+    cJSON_AddStringToObject(json_response, "operation", "GATEWAY");
+    cJSON_AddStringToObject(json_response, "result", authorized ? "SUCCESS" : "UNAUTHORIZED");
+    if (authorized && mode != COMPRESSION_NONE) {
+        cJSON_AddStringToObject(json_response, "compression", compression);
+    }
+    char *response_str = cJSON_PrintUnformatted(json_response);
+
+    if (authorized) {
+        client->is_gateway = 1;
+        printf("Client %d opened a gateway connection\n", client->id);
+        start_client_compression(client, mode, response_str);
+    } else {
+        printf("Client %d presented an invalid gateway key\n", client->id);
+        send_to_client(client, response_str);
+        disconnect_client(client);
+    }
+
+    free(response_str);
+    cJSON_Delete(json_response);
+}
+
+/**
+ * @brief Finds an identified user of a gateway.
+ *
+ * @param gateway The gateway connection.
+ * @param username The user the gateway acts for.
+ *
+ * @return client_t* The user's client entry, to be released with release_client, or NULL if
+ *         the gateway has no such user.
+ */
+client_t *find_gateway_user(client_t *gateway, const char *username) {
+    client_t *user = NULL;
+
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        if (clients[i] && clients[i]->gateway == gateway && strcmp(clients[i]->user_name, username) == 0) {
+            user = clients[i];
+            user->references++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    return user;
+}
+
+/**
+ * @brief Creates the client entry of a user identifying through a gateway.
+ *
+ * The entry already carries the requested username, so the IDENTIFY response can be
+ * addressed to it, but it only joins the list of clients once IDENTIFY succeeds. Its first
+ * reference belongs to the gateway, and is dropped when the user leaves or IDENTIFY fails;
+ * the entry holds a reference on the gateway's entry in turn.
+ *
+ * @param gateway The gateway connection.
+ * @param username The username the user asked for.
+ *
+ * @return client_t* The new client entry, or NULL on allocation failure.
+ */
+client_t *create_gateway_user(client_t *gateway, const char *username) {
+    client_t *user = calloc(1, sizeof(client_t));
+
+    if (!user) {
+        return NULL;
+    }
+    user->address = gateway->address;
+    user->sockfd = -1;
+    user->id = allocate_client_id();
+    user->compression = COMPRESSION_NONE;
+    user->gateway = retain_client(gateway);
+    user->references = 1;
+    pthread_mutex_init(&user->send_mutex, NULL);
+    pthread_cond_init(&user->resume_cond, NULL);
+    utf8_copy(user->user_name, username, sizeof(user->user_name));
+    snprintf(user->status, sizeof(user->status), "%s", "ACTIVE");
+    return user;
+}
+
+/**
+ * @brief Disconnects every user of a gateway whose connection closed.
+ *
+ * A user may be shed by another thread meanwhile, so the entries are collected with a
+ * reference, and only the thread that removes a user announces its departure.
+ *
+ * @param gateway The closed gateway connection.
+ *
+ * @return void
+ */
+void close_gateway(client_t *gateway) {
+    client_t *users[MAX_CLIENTS];
+    int count = 0;
+
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        if (clients[i] && clients[i]->gateway == gateway) {
+            users[count] = clients[i];
+            users[count++]->references++;
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+
+    for (int i = 0; i < count; ++i) {
+        if (remove_client(users[i]->id)) {
+            notify_disconnected(users[i]);
+            release_client(users[i]);
+        }
+        release_client(users[i]);
+    }
+    printf("Gateway connection %d closed, %d user(s) disconnected\n", gateway->id, count);
+}
+
+/**
+ * @brief Disconnects a user of a gateway whose share of the gateway's queue is full.
+ *
+ * The gateway connection stays open. The other users are told the user disconnected, and
+ * the gateway's later messages for the user are answered with NOT_IDENTIFIED. The caller
+ * holds a reference on the user's entry.
+ *
+ * @param user The user that can't take any more messages.
+ *
+ * @return void
+ */
+void shed_gateway_user(client_t *user) {
+    printf("User %s of gateway %d is too slow, disconnecting it\n", user->user_name, user->gateway->id);
+    metrics_add(METRIC_OUTBOX_DISCONNECTS, 1);
+    if (remove_client(user->id)) {
+        notify_disconnected(user);
+        release_client(user);
+    }
+}
+
+/**
+ * @brief Prefixes every JSON message of a buffer with a recipient list.
+ *
+ * The buffer may hold several messages back to back, as offline message batches do, and
+ * each of them is addressed.
+ *
+ * @param message The JSON messages.
+ * @param length The length of the messages in bytes.
+ * @param recipients The recipients as a JSON array of usernames.
+ * @param addressed_length Receives the length of the addressed messages in bytes.
+ *
+ * @return char* The null-terminated addressed messages, to be freed by the caller, or NULL on
+ *         allocation failure or if the buffer doesn't hold JSON objects.
+ */
+char *gateway_address(const char *message, size_t length, const char *recipients, size_t *addressed_length) {
+    size_t recipients_length = strlen(recipients);
+    size_t prefix_length = strlen("{\"recipients\":,") + recipients_length;
+    size_t count = 0;
+    size_t offset = 0;
+    char *addressed;
+    char *cursor;
+
+    while (offset < length) {
+        long frame_length = json_frame_length(message + offset, length - offset);
+        if (frame_length < 2 || message[offset] != '{') {
+            return NULL;
+        }
+        offset += (size_t)frame_length;
+        count++;
+    }
+
+    addressed = malloc(length + count * prefix_length + 1);
+    if (!addressed) {
+        return NULL;
+    }
+    cursor = addressed;
+    offset = 0;
+    while (offset < length) {
+        size_t frame_length = (size_t)json_frame_length(message + offset, length - offset);
+        int empty = message[offset + 1] == '}';
+
+        cursor += sprintf(cursor, empty ? "{\"recipients\":%s" : "{\"recipients\":%s,", recipients);
+        memcpy(cursor, message + offset + 1, frame_length - 1);
+        cursor += frame_length - 1;
+        offset += frame_length;
+    }
+    *cursor = '\0';
+    *addressed_length = (size_t)(cursor - addressed);
+    return addressed;
+}
@@ -0,0 +1,26 @@
+/**
+ * @file gateway.h
+ * @brief Gateway connections carrying many users over one socket.
+ *
+ * A bridge service authenticates a connection with `{"type":"GATEWAY","key":...}`. After
+ * that, every message it sends names the user it acts for in a `user` field (IDENTIFY keeps
+ * using `username`), and each of those users gets its own client entry without a socket or a
+ * thread. Messages for the users of a gateway are written once to the gateway connection with
+ * a `recipients` array as their first field, so a broadcast costs one copy per gateway instead
+ * of one per user.
+ */
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include "client_manager.h"
+#include <stddef.h>
+
+void gateway_init(const char *key);
+void open_gateway(client_t *client, const char *key, const char *compression);
+client_t *find_gateway_user(client_t *gateway, const char *username);
+client_t *create_gateway_user(client_t *gateway, const char *username);
+void close_gateway(client_t *gateway);
+void shed_gateway_user(client_t *user);
+char *gateway_address(const char *message, size_t length, const char *recipients, size_t *addressed_length);
+
+#endif // GATEWAY_H
@@ -0,0 +1,548 @@
+/**
+ * @file mailbox.c
+ * @brief Implements the offline mailboxes and their spill file.
+ *
+ * Mailboxes are kept in a chained hash table protected by a single mutex. Queued messages
+ * form a FIFO list, so expired messages are always at its head and are dropped lazily when
+ * a mailbox is used, and by a sweep that runs at most every MAILBOX_SWEEP_INTERVAL seconds.
+ *
+ * The spill file is append-only. Each record is an 8-byte queued time, the 1-byte kind of the
+ * message, the 1-byte length of the recipient name, the 2-byte length of the sender name and
+ * the 4-byte length of the text, all big-endian, followed by the three strings. A mailbox
+ * remembers the offset of its first spilled record and how many it has, so taking it only
+ * scans the file from there up to its last record. The file is truncated once no mailbox has
+ * spilled messages left, and at startup, since the records of a previous run are not indexed.
+ * In between, once less than half of a file over MAILBOX_COMPACT_BYTES still belongs to a
+ * mailbox, the pending records are moved down over the others in one pass and the file is
+ * truncated after them.
+ */
+#include "mailbox.h"
+#include "ring.h"
+#include "utf8.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SPILL_HEADER_SIZE 16
+
+static mailbox_t *buckets[MAILBOX_BUCKETS];
+static pthread_mutex_t mailbox_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int mailbox_ttl = MAILBOX_DEFAULT_TTL;
+static int total_count = 0;
+static int total_spilled = 0;
+static int box_count = 0;
+static long spill_live_bytes = 0;
+static long spill_size = 0;
+static time_t last_sweep = 0;
+static FILE *spill_file = NULL;
+
+/**
+ * @brief Configures the mailboxes.
+ *
+ * @param ttl The number of seconds a message is kept, or 0 to disable the mailboxes.
+ * @param spill_path The spill file, or NULL to keep messages in memory only.
+ *
+ * @return int 0 on success, -1 if the spill file could not be opened.
+ */
+int mailbox_init(int ttl, const char *spill_path) {
+    mailbox_ttl = ttl;
+    if (spill_path) {
+        spill_file = fopen(spill_path, "w+b");
+        if (!spill_file) {
+            perror("ERROR: open mailbox spill file failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Allocates a queued message.
+ *
+ * @param from_username The sender of the message.
+ * @param text The message text.
+ * @param kind MAILBOX_KIND_TEXT for a private message, MAILBOX_KIND_MENTION for a mention.
+ * @param queued_at The time the message was queued.
+ *
+ * @return mailbox_message_t* The message, or NULL on allocation failure.
+ */
+mailbox_message_t *mailbox_message_new(const char *from_username, const char *text, int kind, time_t queued_at) {
+    mailbox_message_t *message = calloc(1, sizeof(mailbox_message_t));
+
+    if (!message) {
+        return NULL;
+    }
+    message->text = strdup(text);
+    if (!message->text) {
+        free(message);
+        return NULL;
+    }
+    utf8_copy(message->from, from_username, sizeof(message->from));
+    message->kind = kind;
+    message->queued_at = queued_at;
+    return message;
+}
+
+/**
+ * @brief Frees a list of messages returned by mailbox_take.
+ *
+ * @param messages The first message of the list, or NULL.
+ *
+ * @return void
+ */
+void mailbox_free(mailbox_message_t *messages) {
+    while (messages) {
+        mailbox_message_t *next = messages->next;
+        free(messages->text);
+        free(messages);
+        messages = next;
+    }
+}
+
+/**
+ * @brief Tells whether a message queued at `queued_at` has expired.
+ *
+ * @param queued_at The time the message was queued.
+ * @param now The current time.
+ * @return int 1 if the message is older than the TTL, 0 otherwise.
+ */
+static int is_expired(time_t queued_at, time_t now) {
+    return now - queued_at > mailbox_ttl;
+}
+
+/**
+ * @brief Finds the mailbox of a user.
+ *
+ * Must be called with the mailbox lock held.
+ *
+ * @param bucket The bucket of the username.
+ * @param username The owner of the mailbox.
+ * @return mailbox_t* The mailbox, or NULL if the user has none.
+ */
+static mailbox_t *mailbox_find(unsigned int bucket, const char *username) {
+    for (mailbox_t *box = buckets[bucket]; box; box = box->next) {
+        if (strcmp(box->user_name, username) == 0) {
+            return box;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Drops the expired messages of a mailbox.
+ *
+ * Spilled messages are only counted as dropped once the newest of them has expired; older
+ * ones are skipped when the mailbox is taken. Must be called with the mailbox lock held.
+ *
+ * @param box The mailbox.
+ * @param now The current time.
+ *
+ * @return void
+ */
+static void mailbox_expire(mailbox_t *box, time_t now) {
+    while (box->head && is_expired(box->head->queued_at, now)) {
+        mailbox_message_t *message = box->head;
+        box->head = message->next;
+        message->next = NULL;
+        mailbox_free(message);
+        box->count--;
+        total_count--;
+    }
+    if (!box->head) {
+        box->tail = NULL;
+    }
+    if (box->spilled && is_expired(box->spilled_at, now)) {
+        total_spilled -= box->spilled;
+        spill_live_bytes -= box->spill_bytes;
+        box->spilled = 0;
+        box->spill_bytes = 0;
+    }
+}
+
+/**
+ * @brief Writes a big-endian integer.
+ *
+ * @param data The destination bytes.
+ * @param value The value to write.
+ * @param size The number of bytes to write.
+ *
+ * @return void
+ */
+static void put_be(unsigned char *data, uint64_t value, int size) {
+    for (int i = size - 1; i >= 0; --i) {
+        data[i] = (unsigned char)value;
+        value >>= 8;
+    }
+}
+
+/**
+ * @brief Reads a big-endian integer.
+ *
+ * @param data The source bytes.
+ * @param size The number of bytes to read.
+ * @return uint64_t The value.
+ */
+static uint64_t get_be(const unsigned char *data, int size) {
+    uint64_t value = 0;
+
+    for (int i = 0; i < size; ++i) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+/**
+ * @brief Moves the pending records of the spill file down over the ones no mailbox uses.
+ *
+ * A record is pending when its recipient has a mailbox with spilled messages and it is not
+ * before the first of them. Records keep their order, so the first pending record of a
+ * mailbox is the one at its spill offset, which is updated as the record is moved. Must be
+ * called with the mailbox lock held.
+ *
+ * @return void
+ */
+static void spill_rewrite(void) {
+    unsigned char header[SPILL_HEADER_SIZE];
+    char *record = NULL;
+    size_t record_capacity = 0;
+    long read_offset = 0;
+    long write_offset = 0;
+
+    while (read_offset < spill_size) {
+        char to[32];
+        size_t to_length;
+        size_t length;
+        mailbox_t *box;
+
+        if (fseek(spill_file, read_offset, SEEK_SET) < 0 || fread(header, 1, sizeof(header), spill_file) != sizeof(header)) {
+            break;
+        }
+        to_length = header[9];
+        length = sizeof(header) + to_length + get_be(header + 10, 2) + get_be(header + 12, 4);
+        if (to_length >= sizeof(to) || fread(to, 1, to_length, spill_file) != to_length) {
+            break;
+        }
+        to[to_length] = '\0';
+
+        box = mailbox_find(ring_hash(to) % MAILBOX_BUCKETS, to);
+        if (box && box->spilled && read_offset >= box->spill_offset) {
+            if (length > record_capacity) {
+                char *grown = realloc(record, length);
+                if (!grown) {
+                    break;
+                }
+                record = grown;
+                record_capacity = length;
+            }
+            if (fseek(spill_file, read_offset, SEEK_SET) < 0 || fread(record, 1, length, spill_file) != length ||
+                fseek(spill_file, write_offset, SEEK_SET) < 0 || fwrite(record, 1, length, spill_file) != length) {
+                perror("ERROR: compact mailbox spill file failed");
+                break;
+            }
+            if (read_offset == box->spill_offset) {
+                box->spill_offset = write_offset;
+            }
+            write_offset += (long)length;
+        }
+        read_offset += (long)length;
+    }
+    free(record);
+
+    // Records that could not be read or moved are kept where they are.
+    if (read_offset < spill_size) {
+        return;
+    }
+    fflush(spill_file);
+    if (ftruncate(fileno(spill_file), write_offset) < 0) {
+        perror("ERROR: truncate mailbox spill file failed");
+        return;
+    }
+    spill_size = write_offset;
+}
+
+/**
+ * @brief Truncates the spill file once it holds no pending message, and compacts it once most
+ *        of it is no longer pending.
+ *
+ * Must be called with the mailbox lock held.
+ *
+ * @return void
+ */
+static void spill_compact(void) {
+    if (!spill_file) {
+        return;
+    }
+    if (total_spilled == 0) {
+        fflush(spill_file);
+        if (ftruncate(fileno(spill_file), 0) < 0) {
+            perror("ERROR: truncate mailbox spill file failed");
+        }
+        rewind(spill_file);
+        spill_size = 0;
+        spill_live_bytes = 0;
+    } else if (spill_size > MAILBOX_COMPACT_BYTES && spill_live_bytes * 2 < spill_size) {
+        spill_rewrite();
+    }
+}
+
+/**
+ * @brief Drops expired messages and empty mailboxes everywhere.
+ *
+ * Must be called with the mailbox lock held.
+ *
+ * @param now The current time.
+ *
+ * @return void
+ */
+static void mailbox_sweep(time_t now) {
+    for (int i = 0; i < MAILBOX_BUCKETS; ++i) {
+        mailbox_t **link = &buckets[i];
+        while (*link) {
+            mailbox_t *box = *link;
+            mailbox_expire(box, now);
+            if (!box->head && !box->spilled) {
+                *link = box->next;
+                free(box);
+                box_count--;
+            } else {
+                link = &box->next;
+            }
+        }
+    }
+    spill_compact();
+    last_sweep = now;
+}
+
+/**
+ * @brief Appends a message to the spill file.
+ *
+ * Must be called with the mailbox lock held.
+ *
+ * @param box The mailbox of the recipient.
+ * @param from_username The sender of the message.
+ * @param text The message text.
+ * @param kind The kind of the message.
+ * @param now The current time.
+ *
+ * @return int 0 on success, -1 if the pending messages would exceed MAILBOX_MAX_SPILL_BYTES or on
+ *         failure.
+ */
+static int spill_append(mailbox_t *box, const char *from_username, const char *text, int kind, time_t now) {
+    unsigned char header[SPILL_HEADER_SIZE];
+    size_t to_length = strlen(box->user_name);
+    size_t from_length = strlen(from_username);
+    size_t text_length = strlen(text);
+    long length = (long)(sizeof(header) + to_length + from_length + text_length);
+    long offset;
+
+    if (spill_live_bytes + length > MAILBOX_MAX_SPILL_BYTES) {
+        return -1;
+    }
+    if (fseek(spill_file, 0, SEEK_END) < 0 || (offset = ftell(spill_file)) < 0) {
+        return -1;
+    }
+    put_be(header, (uint64_t)now, 8);
+    header[8] = (unsigned char)kind;
+    header[9] = (unsigned char)to_length;
+    put_be(header + 10, from_length, 2);
+    put_be(header + 12, text_length, 4);
+    if (fwrite(header, 1, sizeof(header), spill_file) != sizeof(header) ||
+        fwrite(box->user_name, 1, to_length, spill_file) != to_length ||
+        fwrite(from_username, 1, from_length, spill_file) != from_length ||
+        fwrite(text, 1, text_length, spill_file) != text_length || fflush(spill_file) != 0) {
+        perror("ERROR: write to mailbox spill file failed");
+        return -1;
+    }
+
+    if (box->spilled == 0) {
+        box->spill_offset = offset;
+    }
+    box->spilled++;
+    box->spill_bytes += length;
+    box->spilled_at = now;
+    total_spilled++;
+    spill_live_bytes += length;
+    spill_size = offset + length;
+    return 0;
+}
+
+/**
+ * @brief Reads the spilled messages of a mailbox that have not expired.
+ *
+ * The file is read from the first spilled record of the mailbox until all of its records
+ * have been seen. Must be called with the mailbox lock held.
+ *
+ * @param box The mailbox.
+ * @param now The current time.
+ * @param tail The link where the first message read is stored.
+ *
+ * @return void
+ */
+static void spill_read(mailbox_t *box, time_t now, mailbox_message_t **tail) {
+    unsigned char header[SPILL_HEADER_SIZE];
+    char to[32];
+    char from[32];
+    int remaining = box->spilled;
+
+    if (fseek(spill_file, box->spill_offset, SEEK_SET) < 0) {
+        return;
+    }
+    while (remaining > 0 && fread(header, 1, sizeof(header), spill_file) == sizeof(header)) {
+        time_t queued_at = (time_t)get_be(header, 8);
+        int kind = header[8];
+        size_t to_length = header[9];
+        size_t from_length = get_be(header + 10, 2);
+        size_t text_length = get_be(header + 12, 4);
+        char *text;
+
+        if (to_length >= sizeof(to) || from_length >= sizeof(from) ||
+            fread(to, 1, to_length, spill_file) != to_length || fread(from, 1, from_length, spill_file) != from_length) {
+            break;
+        }
+        to[to_length] = '\0';
+        from[from_length] = '\0';
+
+        if (strcmp(to, box->user_name) == 0) {
+            remaining--;
+        }
+        if (strcmp(to, box->user_name) != 0 || is_expired(queued_at, now)) {
+            if (fseek(spill_file, (long)text_length, SEEK_CUR) < 0) {
+                break;
+            }
+            continue;
+        }
+
+        text = malloc(text_length + 1);
+        if (!text || fread(text, 1, text_length, spill_file) != text_length) {
+            free(text);
+            break;
+        }
+        text[text_length] = '\0';
+        *tail = mailbox_message_new(from, text, kind, queued_at);
+        free(text);
+        if (*tail) {
+            tail = &(*tail)->next;
+        }
+    }
+}
+
+/**
+ * @brief Queues a private message or a mention for a user who is not connected.
+ *
+ * Mailboxes are keyed by the recipient name truncated like at IDENTIFY, which is the name
+ * the recipient will take its mailbox with. A mailbox is only created while fewer than
+ * MAILBOX_MAX_BOXES exist, and is not kept if the message is refused.
+ *
+ * @param to_username The recipient of the message.
+ * @param from_username The sender of the message.
+ * @param text The message text.
+ * @param kind MAILBOX_KIND_TEXT for a private message, MAILBOX_KIND_MENTION for a mention.
+ *
+ * @return int 0 if the message was queued, -1 if mailboxes are disabled or full.
+ */
+int mailbox_put(const char *to_username, const char *from_username, const char *text, int kind) {
+    char user_name[sizeof(((mailbox_t *)0)->user_name)];
+    unsigned int bucket;
+    time_t now = time(NULL);
+    mailbox_t *box;
+    int created = 0;
+    int result = -1;
+
+    if (mailbox_ttl <= 0) {
+        return -1;
+    }
+    utf8_copy(user_name, to_username, sizeof(user_name));
+    bucket = ring_hash(user_name) % MAILBOX_BUCKETS;
+
+    pthread_mutex_lock(&mailbox_mutex);
+    if (now - last_sweep >= MAILBOX_SWEEP_INTERVAL) {
+        mailbox_sweep(now);
+    }
+
+    box = mailbox_find(bucket, user_name);
+    if (!box) {
+        if (box_count >= MAILBOX_MAX_BOXES && last_sweep != now) {
+            mailbox_sweep(now);
+        }
+        box = box_count < MAILBOX_MAX_BOXES ? calloc(1, sizeof(mailbox_t)) : NULL;
+        if (!box) {
+            pthread_mutex_unlock(&mailbox_mutex);
+            return -1;
+        }
+        strcpy(box->user_name, user_name);
+        box->next = buckets[bucket];
+        buckets[bucket] = box;
+        box_count++;
+        created = 1;
+    }
+    mailbox_expire(box, now);
+
+    if (!box->spilled && box->count < MAILBOX_MAX_MESSAGES && total_count < MAILBOX_MAX_TOTAL) {
+        mailbox_message_t *message = mailbox_message_new(from_username, text, kind, now);
+        if (message) {
+            if (box->tail) {
+                box->tail->next = message;
+            } else {
+                box->head = message;
+            }
+            box->tail = message;
+            box->count++;
+            total_count++;
+            result = 0;
+        }
+    } else if (spill_file && box->spilled < MAILBOX_MAX_SPILLED) {
+        result = spill_append(box, from_username, text, kind, now);
+    }
+    if (result < 0 && created) {
+        buckets[bucket] = box->next;
+        free(box);
+        box_count--;
+    }
+    pthread_mutex_unlock(&mailbox_mutex);
+    return result;
+}
+
+/**
+ * @brief Removes the mailbox of a user and returns its messages in the order they were sent.
+ *
+ * @param username The user who just identified.
+ * @return mailbox_message_t* The first message, or NULL if there is none. The caller frees
+ *         the list with mailbox_free.
+ */
+mailbox_message_t *mailbox_take(const char *username) {
+    char user_name[sizeof(((mailbox_t *)0)->user_name)];
+    unsigned int bucket;
+    time_t now = time(NULL);
+    mailbox_message_t *messages = NULL;
+
+    utf8_copy(user_name, username, sizeof(user_name));
+    bucket = ring_hash(user_name) % MAILBOX_BUCKETS;
+
+    pthread_mutex_lock(&mailbox_mutex);
+    for (mailbox_t **link = &buckets[bucket]; *link; link = &(*link)->next) {
+        mailbox_t *box = *link;
+        if (strcmp(box->user_name, user_name) != 0) {
+            continue;
+        }
+
+        mailbox_expire(box, now);
+        messages = box->head;
+        total_count -= box->count;
+        if (box->spilled) {
+            spill_read(box, now, box->tail ? &box->tail->next : &messages);
+            total_spilled -= box->spilled;
+            spill_live_bytes -= box->spill_bytes;
+            box->spilled = 0;
+        }
+        *link = box->next;
+        free(box);
+        box_count--;
+        spill_compact();
+        break;
+    }
+    pthread_mutex_unlock(&mailbox_mutex);
+    return messages;
+}
@@ -0,0 +1,59 @@
+/**
+ * @file mailbox.h
+ * @brief Offline mailboxes holding private messages for users who are not connected.
+ *
+ * Private messages sent to a user who is not connected anywhere, and mentions of that user in
+ * public messages, are queued in that user's mailbox and delivered in one batch when the user
+ * identifies again. Mailboxes are kept in memory up to a per-user and a global limit, and at
+ * most MAILBOX_MAX_BOXES users have one. When a spill file is configured, messages beyond
+ * those limits are appended to it instead of being rejected, up to MAILBOX_MAX_SPILL_BYTES of
+ * pending messages. Messages older than the mailbox TTL are dropped.
+ *
+ * In a cluster, a user's mailbox lives on the user's home node.
+ */
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <time.h>
+
+#define MAILBOX_BUCKETS 256
+#define MAILBOX_MAX_MESSAGES 64
+#define MAILBOX_MAX_TOTAL 4096
+#define MAILBOX_MAX_SPILLED 1024
+#define MAILBOX_MAX_BOXES 16384
+#define MAILBOX_MAX_SPILL_BYTES (64L * 1024 * 1024)
+#define MAILBOX_COMPACT_BYTES (1024L * 1024)
+#define MAILBOX_DEFAULT_TTL 3600
+#define MAILBOX_SWEEP_INTERVAL 60
+#define MAILBOX_BATCH_BYTES 16384
+
+#define MAILBOX_KIND_TEXT 0
+#define MAILBOX_KIND_MENTION 1
+
+typedef struct mailbox_message {
+    char from[32];
+    char *text;
+    int kind;
+    time_t queued_at;
+    struct mailbox_message *next;
+} mailbox_message_t;
+
+typedef struct mailbox {
+    char user_name[32];
+    mailbox_message_t *head;
+    mailbox_message_t *tail;
+    int count;
+    int spilled;
+    long spill_offset;
+    long spill_bytes;
+    time_t spilled_at;
+    struct mailbox *next;
+} mailbox_t;
+
+int mailbox_init(int ttl, const char *spill_path);
+int mailbox_put(const char *to_username, const char *from_username, const char *text, int kind);
+mailbox_message_t *mailbox_take(const char *username);
+mailbox_message_t *mailbox_message_new(const char *from_username, const char *text, int kind, time_t queued_at);
+void mailbox_free(mailbox_message_t *messages);
+
+#endif // MAILBOX_H
@@ -6,81 +6,546 @@
  * and managing client communication. It also includes a client handler function to manage 
  * individual client interactions using threads.
  */
+#include "admission.h"
 #include "connection.h"
 #include "client_manager.h"
 #include "messaging.h"
+#include "cluster.h"
+#include "cluster_tcp.h"
+#include "filter.h"
+#include "recorder.h"
+#include "search.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "transfer.h"
+#include "utf8.h"
+#include "gateway.h"
+#include "mailbox.h"
+#include "metrics.h"
+#include "../common/clock.h"
+#include "../common/framing.h"
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 #include <string.h>
 
+/**
+ * @brief Processes every complete message in a client's receive buffer.
+ *
+ * Clients may send several JSON messages back to back, and a message may be split across
+ * several `recv` calls, so messages are split on object boundaries. Bytes that are not part
+ * of a JSON object are discarded, and so are messages that are not valid UTF-8. The raw bytes
+ * following a FILE_CHUNK header belong to the uploaded file. Sampled messages are traced from
+ * the time their bytes were received.
+ *
+ * @param client The client that sent the data.
+ * @param buffer The receive buffer, with one spare byte after `length`.
+ * @param length The number of bytes in the buffer.
+ * @param received_at The time of the last `recv`, or 0 if tracing is disabled.
+ * @return size_t The number of bytes left in the buffer for the next `recv`.
+ */
+static size_t process_client_data(client_t *client, char *buffer, size_t length, unsigned long long received_at) {
+    size_t offset = 0;
+
+    while (offset < length) {
+        long message_length;
+        char next;
+
+        if (transfer_pending(client)) {
+            offset += transfer_receive(client, buffer + offset, length - offset);
+            continue;
+        }
+        message_length = json_frame_length(buffer + offset, length - offset);
+        if (message_length < 0) {
+            offset = length;
+            break;
+        }
+        if (message_length == 0) {
+            break;
+        }
+        if (!utf8_valid(buffer + offset, (size_t)message_length)) {
+            printf("Message from %s is not valid UTF-8, discarding it\n", client->user_name);
+            metrics_add(METRIC_UTF8_REJECTED, 1);
+            offset += (size_t)message_length;
+            continue;
+        }
+        next = buffer[offset + (size_t)message_length];
+        buffer[offset + (size_t)message_length] = '\0';
+        trace_message_begin(received_at);
+        unsigned long long dispatch_start = trace_start();
+        process_client_message(client, buffer + offset);
+        trace_end("dispatch", dispatch_start, client->id);
+        trace_message_end();
+        buffer[offset + (size_t)message_length] = next;
+        offset += (size_t)message_length;
+    }
+
+    if (offset == 0 && length == CLIENT_BUFFER_SIZE - 1) {
+        printf("Message from %s is too large, discarding it\n", client->user_name);
+        offset = length;
+    }
+    memmove(buffer, buffer + offset, length - offset);
+    return length - offset;
+}
+
+/**
+ * @brief Waits until a client that has not identified yet sends data.
+ *
+ * @param client The client.
+ * @param deadline The monotonic time, in nanoseconds, by which the client must identify.
+ *
+ * @return int 1 if data is available, 0 if the deadline passed.
+ */
+static int wait_for_identify(client_t *client, unsigned long long deadline) {
+    struct pollfd pending = { client->sockfd, POLLIN, 0 };
+
+    while (1) {
+        unsigned long long now = clock_monotonic_ns();
+        int ready;
+
+        if (now >= deadline) {
+            return 0;
+        }
+        ready = poll(&pending, 1, (int)((deadline - now + 999999) / 1000000));
+        if (ready != 0 && !(ready < 0 && errno == EINTR)) {
+            return 1;
+        }
+    }
+}
+
 /**
  * @brief Handles communication with a connected client.
  *
  * This function is executed in a separate thread for each connected client. It listens for messages 
- * from the client, processes them, and handles client disconnection if necessary.
+ * from the client, processes them, and handles client disconnection if necessary. The bytes of
+ * an uploaded chunk are moved from the socket to the spool file directly once the receive
+ * buffer holds nothing else. A client that neither identifies nor opens a gateway within the
+ * IDENTIFY deadline is told so and disconnected. The thread holds the base reference on the
+ * client, dropped once the connection, its writer and any lingering session are gone, which
+ * frees the client and its queue unless a message is being sent to it concurrently.
  *
  * @param arg Pointer to the client_t structure of the connected client.
  * @return void* Always returns NULL when the thread exits.
  */
 void *client_handler(void *arg) {
     client_t *client = (client_t *)arg;
-    char buffer[2048];
+    char buffer[CLIENT_BUFFER_SIZE];
+    size_t length = 0;
+    unsigned long long identify_deadline = 0;
+
+    if (admission_identify_timeout() > 0) {
+        identify_deadline = clock_monotonic_ns() + (unsigned long long)admission_identify_timeout() * 1000000000ULL;
+    }
 
     while (1) {
-        int receive = recv(client->sockfd, buffer, 2048, 0);
+        int receive;
+
+        if (identify_deadline && (client->user_name[0] || client->is_gateway)) {
+            identify_deadline = 0;
+        }
+        if (identify_deadline && !wait_for_identify(client, identify_deadline)) {
+            printf("Client %d did not identify in time\n", client->id);
+            metrics_add(METRIC_IDENTIFY_TIMEOUTS, 1);
+            send_identify_timeout(client);
+            disconnect_client(client);
+            identify_deadline = 0;
+            continue;
+        }
+        if (length == 0 && transfer_pending(client)) {
+            receive = transfer_splice(client);
+            if (receive > 0) {
+                continue;
+            }
+        } else {
+            receive = recv(client->sockfd, buffer + length, sizeof(buffer) - length - 1, 0);
+        }
         if (receive > 0) {
-            buffer[receive] = '\0';
-            process_client_message(client, buffer);
-        } else if (receive == 0) {
-            printf("Client %s disconnected.\n", client->user_name);
-            close(client->sockfd);
-            remove_client(client->id);
-            break;
+            recorder_data(client->id, buffer + length, (size_t)receive);
+            length += (size_t)receive;
+            length = process_client_data(client, buffer, length, trace_enabled() ? clock_monotonic_ns() : 0);
         } else {
-            perror("ERROR: recv failed");
+            if (receive == 0) {
+                printf("Client %s disconnected.\n", client->user_name);
+            } else {
+                perror("ERROR: recv failed");
+            }
+            recorder_close(client->id);
+            // The peer is gone: queued messages fail fast, but are still numbered into the session.
+            shutdown(client->sockfd, SHUT_WR);
+            stop_client_writer(client);
+            if (client->is_gateway) {
+                close_gateway(client);
+                close(client->sockfd);
+            } else if (client->session) {
+                printf("Keeping the session of %s for %d seconds\n", client->user_name, SESSION_LINGER);
+                linger_client(client);
+            } else {
+                close(client->sockfd);
+            }
+            remove_client(client->id);
             break;
         }
     }
 
+    stop_client_compression(client);
+    close_client_ring(client);
+    transfer_release(client);
+    admission_release(client->is_local ? NULL : &client->address);
+    release_client(client);
     pthread_exit(NULL);
 }
 
+/**
+ * @brief Registers a newly accepted connection and starts its handler and writer threads.
+ *
+ * The connection is first checked by the admission control, and refused before anything is
+ * allocated for it when it exceeds a limit.
+ *
+ * @param client_socket_fd The socket of the accepted connection.
+ * @param cli_addr The address of a TCP client, or NULL for a local client.
+ *
+ * @return void
+ */
+static void start_client(int client_socket_fd, const struct sockaddr_in *cli_addr) {
+    int admission = admission_admit(cli_addr);
+
+    if (admission != ADMISSION_ACCEPTED) {
+        admission_reject(client_socket_fd, admission);
+        return;
+    }
+
+    client_t *new_client = (client_t *)calloc(1, sizeof(client_t));
+    if (!new_client) {
+        perror("ERROR: calloc failed");
+        admission_reject(client_socket_fd, ADMISSION_SERVER_FULL);
+        admission_release(cli_addr);
+        return;
+    }
+    if (cli_addr) {
+        new_client->address = *cli_addr;
+    }
+    new_client->is_local = cli_addr == NULL;
+    new_client->sockfd = client_socket_fd;
+    new_client->id = allocate_client_id();
+    new_client->compression = COMPRESSION_NONE;
+    new_client->references = 1;
+    pthread_mutex_init(&new_client->send_mutex, NULL);
+    pthread_cond_init(&new_client->resume_cond, NULL);
+    strncpy(new_client->status, "ACTIVE", sizeof(new_client->status) - 1);
+    new_client->status[sizeof(new_client->status) - 1] = '\0';  // Asegura que esté null-terminated
+    if (start_client_writer(new_client) < 0 || add_client(new_client) < 0) {
+        admission_reject(client_socket_fd, ADMISSION_SERVER_FULL);
+        admission_release(cli_addr);
+        stop_client_writer(new_client);
+        release_client(new_client);
+        return;
+    }
+    recorder_open(new_client->id);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, client_handler, (void *)new_client) != 0) {
+        perror("ERROR: pthread_create failed");
+        recorder_close(new_client->id);
+        remove_client(new_client->id);
+        admission_reject(client_socket_fd, ADMISSION_SERVER_FULL);
+        admission_release(cli_addr);
+        stop_client_writer(new_client);
+        release_client(new_client);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+/**
+ * @brief Prints the command-line usage of the server.
+ *
+ * @param program The name the server was started with.
+ *
+ * @return void
+ */
+static void print_usage(const char *program) {
+    printf("Usage: %s <ip> <port> [--node-id <id> --cluster-port <port> --cluster-key <key>\n"
+           "       [--peer <ip:port>]...]\n"
+           "       [--mailbox-ttl <seconds>] [--mailbox-spill <file>] [--gateway-key <key>]\n"
+           "       [--unix-socket <path>] [--filter <file> [--filter-action mask|drop|flag]]\n"
+           "       [--search-snapshot <file>] [--trace-sample <n> [--trace-file <file>]]\n"
+           "       [--record <file>] [--file-spool <dir> [--file-max-size <bytes>]\n"
+           "       [--file-spool-size <bytes>]] [--max-connections <n>] [--max-per-ip <n>]\n"
+           "       [--accept-rate <n>] [--identify-timeout <seconds>] [--session-snapshot <file>]\n", program);
+}
+
 /**
  * @brief Main function that starts the server and handles client connections.
  *
  * This function initializes the server, accepts client connections in a loop, 
  * and spawns a new thread to handle each client's communication. The server runs 
- * until it is manually shut down.
+ * until it is manually shut down. When a node ID is given, the server joins a cluster
+ * by listening for the other nodes on the cluster port and connecting to every peer. Nodes
+ * present the `--cluster-key` to each other, and only the peers may link to the node.
+ * Private messages to offline users are kept for `--mailbox-ttl` seconds (0 disables the
+ * offline mailboxes), and overflow to the `--mailbox-spill` file when one is given.
+ * Bridge services presenting the `--gateway-key` may carry many users over one connection.
+ * With `--unix-socket`, clients on the same host can also connect through a Unix domain
+ * socket, and may then receive their messages through a shared-memory ring. Public messages
+ * are checked against the `--filter` word list, which is reloaded whenever the file changes.
+ * Messages are indexed for SEARCH requests, and the index is saved to and restored from the
+ * `--search-snapshot` file. With `--trace-sample`, one message in that many is traced, and
+ * SIGUSR1 writes the recorded spans to the `--trace-file`. With `--record`, all received
+ * traffic is captured to a file that the replayer can send again. With `--file-spool`, users
+ * can send files of up to `--file-max-size` bytes, staged in that directory, which holds at
+ * most `--file-spool-size` bytes of offered files. Connections beyond `--max-connections` in
+ * total or `--max-per-ip` from one address, or accepted faster than `--accept-rate` per
+ * second, are refused, and connections that don't identify within `--identify-timeout`
+ * seconds are closed. Resumable sessions are saved to the `--session-snapshot` file and
+ * restored from it, so clients resume them after a restart.
  *
  * @param argc Number of command-line arguments.
- * @param argv Array of command-line arguments (IP and port).
+ * @param argv Array of command-line arguments (IP, port and cluster options).
  * @return int Returns EXIT_SUCCESS on successful execution or EXIT_FAILURE on error.
  */
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        printf("Usage: %s <ip> <port>\n", argv[0]);
+    static const struct option long_options[] = {
+        {"node-id", required_argument, NULL, 'n'},
+        {"cluster-port", required_argument, NULL, 'c'},
+        {"peer", required_argument, NULL, 'p'},
+        {"cluster-key", required_argument, NULL, 'k'},
+        {"mailbox-ttl", required_argument, NULL, 't'},
+        {"mailbox-spill", required_argument, NULL, 's'},
+        {"gateway-key", required_argument, NULL, 'g'},
+        {"unix-socket", required_argument, NULL, 'u'},
+        {"filter", required_argument, NULL, 'f'},
+        {"filter-action", required_argument, NULL, 'a'},
+        {"search-snapshot", required_argument, NULL, 'i'},
+        {"trace-sample", required_argument, NULL, 'r'},
+        {"trace-file", required_argument, NULL, 'o'},
+        {"record", required_argument, NULL, 'R'},
+        {"file-spool", required_argument, NULL, 'F'},
+        {"file-max-size", required_argument, NULL, 'z'},
+        {"file-spool-size", required_argument, NULL, 'Z'},
+        {"max-connections", required_argument, NULL, 'm'},
+        {"max-per-ip", required_argument, NULL, 'P'},
+        {"accept-rate", required_argument, NULL, 'A'},
+        {"identify-timeout", required_argument, NULL, 'I'},
+        {"session-snapshot", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *peers[CLUSTER_MAX_PEERS];
+    int peer_count = 0;
+    int node_id = 0;
+    int cluster_port = 0;
+    int mailbox_ttl = MAILBOX_DEFAULT_TTL;
+    const char *mailbox_spill = NULL;
+    const char *gateway_key = NULL;
+    const char *cluster_key = NULL;
+    const char *unix_socket = NULL;
+    const char *filter_file = NULL;
+    int filter_action = FILTER_ACTION_MASK;
+    const char *search_snapshot_file = NULL;
+    int trace_sample = 0;
+    const char *trace_file = NULL;
+    const char *record_file = NULL;
+    const char *file_spool = NULL;
+    long long file_max_size = 0;
+    long long file_spool_size = 0;
+    int max_connections = 0;
+    int max_per_ip = 0;
+    int accept_rate = 0;
+    int identify_timeout = ADMISSION_DEFAULT_IDENTIFY_TIMEOUT;
+    const char *session_snapshot_file = NULL;
+    int option;
+
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'n':
+            node_id = atoi(optarg);
+            break;
+        case 'c':
+            cluster_port = atoi(optarg);
+            break;
+        case 'p':
+            if (peer_count == CLUSTER_MAX_PEERS) {
+                printf("Too many peers, at most %d are supported\n", CLUSTER_MAX_PEERS);
+                return EXIT_FAILURE;
+            }
+            peers[peer_count++] = optarg;
+            break;
+        case 't':
+            mailbox_ttl = atoi(optarg);
+            break;
+        case 's':
+            mailbox_spill = optarg;
+            break;
+        case 'k':
+            cluster_key = optarg;
+            break;
+        case 'g':
+            gateway_key = optarg;
+            break;
+        case 'u':
+            unix_socket = optarg;
+            break;
+        case 'f':
+            filter_file = optarg;
+            break;
+        case 'a':
+            filter_action = filter_action_from_name(optarg);
+            if (filter_action < 0) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            search_snapshot_file = optarg;
+            break;
+        case 'r':
+            trace_sample = atoi(optarg);
+            break;
+        case 'o':
+            trace_file = optarg;
+            break;
+        case 'R':
+            record_file = optarg;
+            break;
+        case 'F':
+            file_spool = optarg;
+            break;
+        case 'z':
+            file_max_size = atoll(optarg);
+            break;
+        case 'Z':
+            file_spool_size = atoll(optarg);
+            break;
+        case 'm':
+            max_connections = atoi(optarg);
+            break;
+        case 'P':
+            max_per_ip = atoi(optarg);
+            break;
+        case 'A':
+            accept_rate = atoi(optarg);
+            break;
+        case 'I':
+            identify_timeout = atoi(optarg);
+            break;
+        case 'S':
+            session_snapshot_file = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2 || node_id < 0 || node_id > 0xFFFF || (node_id && cluster_port <= 0)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
+
+    signal(SIGPIPE, SIG_IGN);
+    utf8_init();
+
+    if (trace_init(trace_sample, trace_file) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    gateway_init(gateway_key);
+
+    if (admission_init(max_connections, max_per_ip, accept_rate, identify_timeout) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (filter_file && filter_init(filter_file, filter_action) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (record_file && recorder_init(record_file) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (file_spool && transfer_init(file_spool, file_max_size, file_spool_size) < 0) {
         return EXIT_FAILURE;
     }
 
-    const char *ip = argv[1];
-    int port = atoi(argv[2]);
+    if (search_init(search_snapshot_file) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (mailbox_init(mailbox_ttl, mailbox_spill) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (node_id) {
+        cluster_bus_t *bus;
+
+        if (!cluster_key || !cluster_key[0] || strlen(cluster_key) >= CLUSTER_KEY_SIZE) {
+            printf("A cluster node needs a --cluster-key of at most %d bytes\n", CLUSTER_KEY_SIZE - 1);
+            return EXIT_FAILURE;
+        }
+        bus = cluster_tcp_create(ip, cluster_port, cluster_key);
+        if (!bus) {
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < peer_count; ++i) {
+            if (cluster_tcp_add_peer(bus, peers[i]) < 0) {
+                printf("Invalid peer address: %s\n", peers[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        cluster_init(node_id, bus);
+    }
 
     start_server(ip, port);
 
+    if (cluster_start() < 0) {
+        shutdown_server();
+        return EXIT_FAILURE;
+    }
+
+    if (unix_socket) {
+        start_local_server(unix_socket);
+    }
+
+    if (snapshot_init(session_snapshot_file) < 0) {
+        shutdown_server();
+        return EXIT_FAILURE;
+    }
+
     while (1) {
-        struct sockaddr_in cli_addr;
-        int client_socket_fd = accept_client(server_socket_fd, &cli_addr);
-        if (client_socket_fd != -1) {
-            client_t *new_client = (client_t *)malloc(sizeof(client_t));
-            new_client->address = cli_addr;
-            new_client->sockfd = client_socket_fd;
-            new_client->id = client_socket_fd;  
-            strncpy(new_client->status, "ACTIVE", sizeof(new_client->status) - 1);
-            new_client->status[sizeof(new_client->status) - 1] = '\0';  // Asegura que esté null-terminated
-            add_client(new_client);
-
-            pthread_t tid;
-            pthread_create(&tid, NULL, client_handler, (void *)new_client);
+        struct pollfd listeners[2] = {
+            { server_socket_fd, POLLIN, 0 },
+            { local_socket_fd, POLLIN, 0 }
+        };
+
+        if (poll(listeners, local_socket_fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("ERROR: poll failed");
+            break;
+        }
+
+        if (listeners[0].revents & POLLIN) {
+            struct sockaddr_in cli_addr;
+            int client_socket_fd = accept_client(server_socket_fd, &cli_addr);
+            if (client_socket_fd != -1) {
+                start_client(client_socket_fd, &cli_addr);
+            } else if (errno == EMFILE || errno == ENFILE) {
+                poll(NULL, 0, ADMISSION_ACCEPT_BACKOFF_MS);
+            }
+        }
+        if (local_socket_fd >= 0 && (listeners[1].revents & POLLIN)) {
+            int client_socket_fd = accept_local_client(local_socket_fd);
+            if (client_socket_fd != -1) {
+                start_client(client_socket_fd, NULL);
+            } else if (errno == EMFILE || errno == ENFILE) {
+                poll(NULL, 0, ADMISSION_ACCEPT_BACKOFF_MS);
+            }
         }
     }
 
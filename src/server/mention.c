@@ -0,0 +1,68 @@
+/**
+ * @file mention.c
+ * @brief Implements the extraction of the `@username` mentions of a public message.
+ */
+#include "mention.h"
+#include <ctype.h>
+#include <string.h>
+
+/**
+ * @brief Tells whether a byte can be part of a mentioned name.
+ *
+ * @param byte The byte.
+ * @return int Non-zero if the byte can be part of a name.
+ */
+static int is_name_byte(unsigned char byte) {
+    return isalnum(byte) || byte == '_' || byte == '-' || byte == '.' || byte >= 0x80;
+}
+
+/**
+ * @brief Extracts the users mentioned in a text.
+ *
+ * Mentions of the author, names too long to be usernames and mentions beyond the first
+ * MENTION_MAX distinct users are ignored.
+ *
+ * @param text The message text.
+ * @param author The name of the user who wrote the text.
+ * @param mentions Receives the mentioned users, none of them marked as delivered.
+ *
+ * @return int The number of mentioned users.
+ */
+int mention_extract(const char *text, const char *author, mention_list_t *mentions) {
+    const unsigned char *byte = (const unsigned char *)text;
+    unsigned char previous = ' ';
+
+    mentions->count = 0;
+    while (*byte && mentions->count < MENTION_MAX) {
+        const unsigned char *name;
+        size_t length;
+        int duplicate = 0;
+
+        if (*byte != '@' || is_name_byte(previous)) {
+            previous = *byte++;
+            continue;
+        }
+        name = ++byte;
+        while (is_name_byte(*byte)) {
+            byte++;
+        }
+        previous = byte[-1];
+        length = (size_t)(byte - name);
+        while (length > 0 && name[length - 1] == '.') {
+            length--;
+        }
+        if (length == 0 || length >= sizeof(mentions->names[0])) {
+            continue;
+        }
+
+        memcpy(mentions->names[mentions->count], name, length);
+        mentions->names[mentions->count][length] = '\0';
+        for (int i = 0; i < mentions->count; ++i) {
+            duplicate |= strcmp(mentions->names[i], mentions->names[mentions->count]) == 0;
+        }
+        if (!duplicate && strcmp(mentions->names[mentions->count], author) != 0) {
+            mentions->delivered[mentions->count++] = 0;
+        }
+    }
+    return mentions->count;
+}
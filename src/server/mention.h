@@ -0,0 +1,23 @@
+/**
+ * @file mention.h
+ * @brief Extraction of the `@username` mentions of a public message.
+ *
+ * A mention is an `@` at the start of the text or after a character that can't be part of
+ * a name, followed by a name made of letters, digits, `_`, `-`, `.` and non-ASCII bytes. A
+ * trailing `.` is left out, so a mention can end a sentence. The text is scanned once, and
+ * each mentioned user is listed once, in order of first appearance.
+ */
+#ifndef MENTION_H
+#define MENTION_H
+
+#define MENTION_MAX 8
+
+typedef struct {
+    char names[MENTION_MAX][32];
+    int delivered[MENTION_MAX];
+    int count;
+} mention_list_t;
+
+int mention_extract(const char *text, const char *author, mention_list_t *mentions);
+
+#endif // MENTION_H
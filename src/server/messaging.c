@@ -3,15 +3,212 @@
  * @brief Manages messaging on the server.
  */
 #include "messaging.h"
+#include "cluster.h"
+#include "filter.h"
+#include "gateway.h"
+#include "mention.h"
+#include "metrics.h"
+#include "search.h"
+#include "trace.h"
+#include "transfer.h"
+#include "utf8.h"
 #include "../libs/cJSON/cJSON.h"
 #include <string.h>
 #include <stdio.h>
+#include <sys/socket.h>
+
+/**
+ * @brief Finds the user a message received on a gateway connection acts for.
+ *
+ * IDENTIFY names the user in `username` and creates its client entry; every other message
+ * names an identified user in `user`. A DISCONNECT without a user closes the gateway itself.
+ * Messages for unknown users are answered with a NOT_IDENTIFIED response.
+ *
+ * @param gateway The gateway connection.
+ * @param json_msg The received message.
+ * @param type The type of the message.
+ *
+ * @return client_t* The client entry of the user, to be released with release_client once the
+ *         message is handled, or NULL if the message was handled here.
+ */
+static client_t *route_gateway_message(client_t *gateway, cJSON *json_msg, const char *type) {
+    int identify = strcmp(type, "IDENTIFY") == 0;
+    cJSON *user = cJSON_GetObjectItemCaseSensitive(json_msg, identify ? "username" : "user");
+    client_t *client = NULL;
+
+    if (!cJSON_IsString(user)) {
+        if (strcmp(type, "DISCONNECT") == 0) {
+            shutdown(gateway->sockfd, SHUT_RDWR);
+        }
+        return NULL;
+    }
+    if (identify) {
+        return retain_client(create_gateway_user(gateway, user->valuestring));
+    }
+
+    client = find_gateway_user(gateway, user->valuestring);
+    if (!client) {
+        cJSON *json_response = cJSON_CreateObject();
+        cJSON_AddStringToObject(json_response, "type", "RESPONSE");
+        cJSON_AddStringToObject(json_response, "operation", type);
+        cJSON_AddStringToObject(json_response, "result", "NOT_IDENTIFIED");
+        cJSON_AddStringToObject(json_response, "extra", user->valuestring);
+        char *response_str = cJSON_PrintUnformatted(json_response);
+
+        if (send_to_client(gateway, response_str) < 0) {
+            perror("ERROR: write to descriptor failed");
+        }
+
+        free(response_str);
+        cJSON_Delete(json_response);
+    }
+    return client;
+}
+
+/**
+ * @brief Handles a parsed message on behalf of a client.
+ *
+ * @param client A pointer to the client the message acts for.
+ * @param json_msg The parsed message, freed by the caller.
+ * @param type The type of the message.
+ *
+ * @return void
+ */
+static void handle_client_message(client_t *client, cJSON *json_msg, const char *type) {
+    if (strcmp(type, "IDENTIFY") == 0) {
+        cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
+        if (cJSON_IsString(username) && username->valuestring != NULL) {
+            char user_name[sizeof(client->user_name)];
+
+            // Names that do not fit are claimed as truncated, so that two long names
+            // sharing a prefix can't end up as the same user.
+            utf8_copy(user_name, username->valuestring, sizeof(user_name));
+            if (is_username_taken(user_name) || cluster_claim_username(user_name, client->status) < 0) {
+                send_user_already_exists(client, user_name);
+                disconnect_client(client);
+                remove_client(client->id);
+                if (client->gateway) {
+                    release_client(client);
+                }
+                return;
+            } else {
+                strcpy(client->user_name, user_name);
+                printf("User correctly identified as %s\n", client->user_name);
+
+                cJSON *compression = cJSON_GetObjectItemCaseSensitive(json_msg, "compression");
+                int compression_mode = cJSON_IsString(compression) ? compression_from_name(compression->valuestring) : COMPRESSION_NONE;
+
+                cJSON *json_response = cJSON_CreateObject();
+                cJSON_AddStringToObject(json_response, "type", "RESPONSE");
+                cJSON_AddStringToObject(json_response, "operation", "IDENTIFY");
+                cJSON_AddStringToObject(json_response, "result", "SUCCESS");
+                cJSON_AddStringToObject(json_response, "extra", client->user_name);
+                if (compression_mode != COMPRESSION_NONE) {
+                    cJSON_AddStringToObject(json_response, "compression", compression->valuestring);
+                }
+                cJSON *resume = cJSON_GetObjectItemCaseSensitive(json_msg, "resume");
+                if (cJSON_IsTrue(resume) && !client->gateway && open_client_session(client) == 0) {
+                    cJSON_AddStringToObject(json_response, "session", client->session->token);
+                }
+                char *response_str = cJSON_PrintUnformatted(json_response);
+
+                if (client->gateway && add_client(client) < 0) {
+                    send_server_full(client, client->user_name);
+                    cluster_publish_leave(client->user_name);
+                    release_client(client);
+                    free(response_str);
+                    cJSON_Delete(json_response);
+                    return;
+                }
+                start_client_compression(client, compression_mode, response_str);
+                cluster_fetch_offline(client->user_name);
+
+                free(response_str);
+                cJSON_Delete(json_response);
+            }
+        }
+    } else if (strcmp(type, "PUBLIC_TEXT") == 0) {
+        cJSON *text = cJSON_GetObjectItemCaseSensitive(json_msg, "text");
+        if (cJSON_IsString(text)) {
+            printf("Server received from %s: %s\n", client->user_name, text->valuestring);
+            publish_filtered_message(client, text->valuestring);
+        }
+
+    } else if (strcmp(type, "TEXT") == 0) {
+        cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
+        cJSON *text = cJSON_GetObjectItemCaseSensitive(json_msg, "text");
+        if (cJSON_IsString(username) && cJSON_IsString(text)) {
+            printf("Server received private message from %s to %s: %s\n", client->user_name, username->valuestring, text->valuestring);
+            send_private_message(client, text->valuestring, client->user_name, username->valuestring);
+        }
+
+    } else if (strcmp(type, "STATUS") == 0) {
+        cJSON *status = cJSON_GetObjectItemCaseSensitive(json_msg, "status");
+        if (cJSON_IsString(status)) {
+            change_user_status(client, status->valuestring);
+        }
+
+    } else if (strcmp(type, "USERS") == 0) {
+        send_user_list(client);
+    } else if (strcmp(type, "METRICS") == 0) {
+        send_metrics(client);
+    } else if (strcmp(type, "SEARCH") == 0) {
+        send_search_results(client, json_msg);
+    } else if (strcmp(type, "FILE_OFFER") == 0) {
+        transfer_offer(client, json_msg);
+    } else if (strcmp(type, "FILE_CHUNK") == 0) {
+        transfer_chunk(client, json_msg);
+    } else if (strcmp(type, "FILE_GET") == 0) {
+        transfer_get(client, json_msg);
+    } else if (strcmp(type, "RESUME") == 0) {
+        cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
+        cJSON *session = cJSON_GetObjectItemCaseSensitive(json_msg, "session");
+        cJSON *seq = cJSON_GetObjectItemCaseSensitive(json_msg, "seq");
+        if (cJSON_IsString(username) && cJSON_IsString(session) && cJSON_IsNumber(seq)) {
+            cJSON *compression = cJSON_GetObjectItemCaseSensitive(json_msg, "compression");
+            resume_session(client, username->valuestring, session->valuestring,
+                           seq->valuedouble > 0 ? (unsigned long)seq->valuedouble : 0,
+                           cJSON_IsString(compression) ? compression->valuestring : NULL);
+        }
+
+    } else if (strcmp(type, "RING") == 0) {
+        cJSON *size = cJSON_GetObjectItemCaseSensitive(json_msg, "size");
+        open_event_ring(client, cJSON_IsNumber(size) && size->valuedouble > 0 ? (size_t)size->valuedouble : 0);
+
+    } else if (strcmp(type, "GATEWAY") == 0) {
+        cJSON *key = cJSON_GetObjectItemCaseSensitive(json_msg, "key");
+        cJSON *compression = cJSON_GetObjectItemCaseSensitive(json_msg, "compression");
+        open_gateway(client, cJSON_IsString(key) ? key->valuestring : "",
+                     cJSON_IsString(compression) ? compression->valuestring : NULL);
+
+    } else if (strcmp(type, "ACK") == 0) {
+        cJSON *seq = cJSON_GetObjectItemCaseSensitive(json_msg, "seq");
+        if (cJSON_IsNumber(seq) && seq->valuedouble > 0) {
+            acknowledge_client(client, (unsigned long)seq->valuedouble);
+        }
+
+    } else if (strcmp(type, "DISCONNECT") == 0) {
+        printf("❌ %s is disconnecting...\n", client->user_name);
+
+        close_client_session(client);
+        if (remove_client(client->id)) {
+            notify_disconnected(client);
+            if (client->gateway) {
+                release_client(client);
+            }
+        }
+
+        shutdown(client->sockfd, SHUT_RDWR);
+    }
+}
 
 /**
  * @brief Processes messages received from clients.
  *
  * This function parses the received JSON message from the client and performs actions
  * based on the message type (identify, public text, private message, status, etc.).
+ * Messages received on a gateway connection are processed on behalf of the user they name,
+ * whose entry is held until the message is handled.
  *
  * @param client A pointer to the client structure that sent the message.
  * @param message A string containing the received JSON message.
@@ -21,112 +218,230 @@
 void process_client_message(client_t *client, const char *message) {
     printf("Server received raw JSON from %s: %s\n", client->user_name[0] ? client->user_name : "(Unknown)", message);
 
+    unsigned long long parse_start = trace_start();
     cJSON *json_msg = cJSON_Parse(message);
+    trace_end("parse", parse_start, client->id);
 
     if (json_msg != NULL) {
         cJSON *type = cJSON_GetObjectItemCaseSensitive(json_msg, "type");
 
-        if (cJSON_IsString(type)) {
-            if (strcmp(type->valuestring, "IDENTIFY") == 0) {
-                cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
-                if (cJSON_IsString(username) && username->valuestring != NULL) {
-                    if (is_username_taken(username->valuestring)) {
-                        cJSON *json_response = cJSON_CreateObject();
-                        cJSON_AddStringToObject(json_response, "type", "RESPONSE");
-                        cJSON_AddStringToObject(json_response, "operation", "IDENTIFY");
-                        cJSON_AddStringToObject(json_response, "result", "USER_ALREADY_EXISTS");
-                        cJSON_AddStringToObject(json_response, "extra", username->valuestring);
-                        char *response_str = cJSON_PrintUnformatted(json_response);
-                        send(client->sockfd, response_str, strlen(response_str), 0);
-                        free(response_str);
-                        cJSON_Delete(json_response);
-                        close(client->sockfd);
-                        remove_client(client->id);
-                        return;
-                    } else {
-                        strncpy(client->user_name, username->valuestring, sizeof(client->user_name) - 1);
-                        client->user_name[sizeof(client->user_name) - 1] = '\0';  
-                        printf("User correctly identified as %s\n", client->user_name);
-
-                        cJSON *json_response = cJSON_CreateObject();
-                        cJSON_AddStringToObject(json_response, "type", "RESPONSE");
-                        cJSON_AddStringToObject(json_response, "operation", "IDENTIFY");
-                        cJSON_AddStringToObject(json_response, "result", "SUCCESS");
-                        cJSON_AddStringToObject(json_response, "extra", client->user_name);
-                        char *response_str = cJSON_PrintUnformatted(json_response);
-
-                        send(client->sockfd, response_str, strlen(response_str), 0);
-
-                        free(response_str);
-                        cJSON_Delete(json_response);
-                    }
-                }
-            } else if (strcmp(type->valuestring, "PUBLIC_TEXT") == 0) {
-                cJSON *text = cJSON_GetObjectItemCaseSensitive(json_msg, "text");
-                if (cJSON_IsString(text)) {
-                    printf("Server received from %s: %s\n", client->user_name, text->valuestring);
-                    send_public_message(text->valuestring, client->user_name);
-                }
+        if (cJSON_IsString(type) && client->is_gateway) {
+            client_t *user = route_gateway_message(client, json_msg, type->valuestring);
+            if (user) {
+                handle_client_message(user, json_msg, type->valuestring);
+                release_client(user);
+            }
+        } else if (cJSON_IsString(type)) {
+            handle_client_message(client, json_msg, type->valuestring);
+        }
+        cJSON_Delete(json_msg);
+    } else {
+        printf("Error parsing message from client %d\n", client->id);
+    }
+}
 
-            } else if (strcmp(type->valuestring, "TEXT") == 0) {
-                cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
-                cJSON *text = cJSON_GetObjectItemCaseSensitive(json_msg, "text");
-                if (cJSON_IsString(username) && cJSON_IsString(text)) {
-                    printf("Server received private message from %s to %s: %s\n", client->user_name, username->valuestring, text->valuestring);
-                    send_private_message(client, text->valuestring, client->user_name, username->valuestring);
-                }
+/**
+ * @brief Moves the outbound messages of a local client to a shared-memory ring.
+ *
+ * Only uncompressed clients connected over the Unix domain socket can open a ring, since its
+ * descriptors are passed over that socket. The RESPONSE carries the capacity of the ring's
+ * data area in `extra`, and every later message is written to the ring instead of the socket.
+ *
+ * @param client A pointer to the client asking for a ring.
+ * @param size The requested capacity in bytes, or 0 for the default.
+ *
+ * @return void
+ */
+void open_event_ring(client_t *client, size_t size) {
+    shm_ring_t *ring = NULL;
+    char capacity[32] = "";
+    cJSON *json_response = cJSON_CreateObject();
+
+    if (client->is_local && !client->ring && client->compression == COMPRESSION_NONE) {
+        ring = malloc(sizeof(shm_ring_t));
+        if (ring && shm_ring_create(ring, size ? size : RING_DEFAULT_SIZE) < 0) {
+            perror("ERROR: ring creation failed");
+            free(ring);
+            ring = NULL;
+        }
+    }
 
-            } else if (strcmp(type->valuestring, "STATUS") == 0) {
-                cJSON *status = cJSON_GetObjectItemCaseSensitive(json_msg, "status");
-                if (cJSON_IsString(status)) {
-                    change_user_status(client, status->valuestring);
-                }
+    cJSON_AddStringToObject(json_response, "type", "RESPONSE");
+    cJSON_AddStringToObject(json_response, "operation", "RING");
+    cJSON_AddStringToObject(json_response, "result", ring ? "SUCCESS" : "UNAVAILABLE");
+    if (ring) {
+        snprintf(capacity, sizeof(capacity), "%llu", (unsigned long long)ring->capacity);
+        cJSON_AddStringToObject(json_response, "extra", capacity);
+    }
+    char *response_str = cJSON_PrintUnformatted(json_response);
 
-            } else if (strcmp(type->valuestring, "USERS") == 0) {
-                send_user_list(client);
-            } else if (strcmp(type->valuestring, "DISCONNECT") == 0) {
-                printf("❌ %s is disconnecting...\n", client->user_name);
+    if (!ring) {
+        send_to_client(client, response_str);
+    } else if (start_client_ring(client, ring, response_str) < 0) {
+        perror("ERROR: write to descriptor failed");
+        shm_ring_close(ring);
+        free(ring);
+    } else {
+        printf("Client %d receives its messages through a %s byte ring\n", client->id, capacity);
+    }
 
-                notify_disconnected(client);
-                remove_client(client->id);
+    free(response_str);
+    cJSON_Delete(json_response);
+}
 
-                close(client->sockfd);
-                return;
-            }
+/**
+ * @brief Handles a RESUME request sent by a reconnecting client instead of IDENTIFY.
+ *
+ * If the user has a detached session with the given token on this server, the new connection
+ * takes it over and receives every message numbered after `seq` again. Messages the session
+ * no longer holds, because its buffer overflowed or it was restored from a snapshot, are
+ * counted in the `gap` field of the response, so the client knows it missed some. Otherwise
+ * the client is told the session is invalid and may IDENTIFY as usual.
+ *
+ * @param client A pointer to the new connection.
+ * @param username The user resuming the session.
+ * @param token The session token the user received at IDENTIFY.
+ * @param seq The highest sequence number the client received.
+ * @param compression The name of the compression requested for the new connection, or NULL.
+ *
+ * @return void
+ */
+void resume_session(client_t *client, const char *username, const char *token, unsigned long seq,
+                    const char *compression) {
+    int compression_mode = compression ? compression_from_name(compression) : COMPRESSION_NONE;
+    unsigned long missed = 0;
+    cJSON *json_response = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_response, "type", "RESPONSE");
+    cJSON_AddStringToObject(json_response, "operation", "RESUME");
+
+    if (client->user_name[0] == '\0' && resume_client_session(client, username, token, seq, &missed) == 0) {
+        printf("User %s resumed its session after message %lu, %lu missed\n", username, seq, missed);
+        cJSON_AddStringToObject(json_response, "result", "SUCCESS");
+        cJSON_AddStringToObject(json_response, "extra", username);
+        if (missed > 0) {
+            cJSON_AddNumberToObject(json_response, "gap", (double)missed);
         }
-        cJSON_Delete(json_msg);
+        if (compression_mode != COMPRESSION_NONE) {
+            cJSON_AddStringToObject(json_response, "compression", compression);
+        }
+        char *response_str = cJSON_PrintUnformatted(json_response);
+        if (finish_client_resume(client, compression_mode, response_str, seq) < 0) {
+            perror("ERROR: write to descriptor failed");
+        }
+        free(response_str);
     } else {
-        printf("Error parsing message from client %d\n", client->id);
+        cJSON_AddStringToObject(json_response, "result", "INVALID_SESSION");
+        cJSON_AddStringToObject(json_response, "extra", username);
+        char *response_str = cJSON_PrintUnformatted(json_response);
+        if (send_to_client(client, response_str) < 0) {
+            perror("ERROR: write to descriptor failed");
+        }
+        free(response_str);
     }
+    cJSON_Delete(json_response);
 }
 
 /**
  * @brief Notifies all clients when a user disconnects.
  *
- * Creates a JSON message with the name of the user who has disconnected
- * and broadcasts it to all other connected clients.
+ * Broadcasts the departure to the other local clients and forwards it to the other
+ * cluster nodes.
  *
  * @param client A pointer to the client who has disconnected.
  *
  * @return void
  */
 void notify_disconnected(client_t *client) {
+    deliver_disconnected(client->user_name, client->id);
+    cluster_publish_disconnected(client->user_name);
+}
+
+/**
+ * @brief Broadcasts a DISCONNECTED message to the local clients.
+ *
+ * Creates a JSON message with the name of the user who has disconnected
+ * and broadcasts it to all other connected clients.
+ *
+ * @param username The name of the user who has disconnected.
+ * @param sender_id The ID of the local client who disconnected, or -1 for a remote user.
+ *
+ * @return void
+ */
+void deliver_disconnected(const char *username, int sender_id) {
     cJSON *json_disconnected = cJSON_CreateObject();
     cJSON_AddStringToObject(json_disconnected, "type", "DISCONNECTED");
-    cJSON_AddStringToObject(json_disconnected, "username", client->user_name);  // Añadir el nombre de usuario
+    cJSON_AddStringToObject(json_disconnected, "username", username);  // Añadir el nombre de usuario
     char *disconnected_str = cJSON_PrintUnformatted(json_disconnected);
 
-    broadcast_message(disconnected_str, client->id);  // Excluir al cliente que se desconecta
+    broadcast_message(disconnected_str, sender_id);  // Excluir al cliente que se desconecta
 
     free(disconnected_str);
     cJSON_Delete(json_disconnected);
 }
 
+/**
+ * @brief Runs a public message through the content filter, then sends it.
+ *
+ * Depending on the filter action, a message containing a banned word is sent with the word
+ * masked, logged and sent unchanged, or dropped, in which case the sender receives a
+ * BLOCKED response.
+ *
+ * @param client A pointer to the client sending the message.
+ * @param text The public message text.
+ *
+ * @return void
+ */
+void publish_filtered_message(client_t *client, const char *text) {
+    char *masked = NULL;
+
+    switch (filter_message(text, &masked)) {
+    case FILTER_MASKED:
+        send_public_message(masked, client->user_name);
+        free(masked);
+        break;
+    case FILTER_DROPPED:
+        printf("Dropped a public message from %s\n", client->user_name);
+        send_message_blocked(client);
+        break;
+    case FILTER_FLAGGED:
+        printf("⚠️ Flagged public message from %s: %s\n", client->user_name, text);
+        send_public_message(text, client->user_name);
+        break;
+    default:
+        send_public_message(text, client->user_name);
+        break;
+    }
+}
+
+/**
+ * @brief Tells a client that its public message was dropped by the content filter.
+ *
+ * @param client A pointer to the client that sent the message.
+ *
+ * @return void
+ */
+void send_message_blocked(client_t *client) {
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddStringToObject(response, "type", "RESPONSE");
+    cJSON_AddStringToObject(response, "operation", "PUBLIC_TEXT");
+    cJSON_AddStringToObject(response, "result", "BLOCKED");
+    char *response_str = cJSON_PrintUnformatted(response);
+
+    if (send_to_client(client, response_str) < 0) {
+        perror("ERROR: write to descriptor failed");
+    }
+
+    free(response_str);
+    cJSON_Delete(response);
+}
+
 /**
  * @brief Sends a public message to all connected clients.
  *
- * Creates a JSON message with the text and the name of the user who sent it,
- * and broadcasts it to all connected clients.
+ * Broadcasts the message to the local clients and forwards it to the other cluster nodes.
+ * Mentioned users who are not connected here are handed to their home node without waiting:
+ * the node they are connected to notifies them with the public message, and the others find
+ * the mention in their offline mailbox if they ever identified.
  *
  * @param text The public message text.
  * @param username The name of the user sending the message.
@@ -134,6 +449,50 @@ void notify_disconnected(client_t *client) {
  * @return void
  */
 void send_public_message(const char *text, const char *username) {
+    mention_list_t mentions;
+
+    broadcast_public_message(text, username, &mentions);
+    cluster_publish_public(username, text);
+
+    for (int i = 0; i < mentions.count; ++i) {
+        if (!mentions.delivered[i]) {
+            cluster_store_mention(mentions.names[i], username, text);
+        }
+    }
+}
+
+/**
+ * @brief Broadcasts a public message received from another cluster node to the local clients.
+ *
+ * @param text The public message text.
+ * @param username The name of the user sending the message.
+ *
+ * @return void
+ */
+void deliver_public_message(const char *text, const char *username) {
+    mention_list_t mentions;
+
+    broadcast_public_message(text, username, &mentions);
+}
+
+/**
+ * @brief Broadcasts a public message to the local clients and notifies the mentioned ones.
+ *
+ * Creates a JSON message with the text and the name of the user who sent it,
+ * and broadcasts it to all connected clients. The text is scanned once for `@username`
+ * mentions, and every mentioned user connected to this server also receives a MENTION
+ * event, built once for all of them. The event only names the author, since the text
+ * itself arrived with the broadcast; mentions queued in a mailbox carry the text too.
+ *
+ * @param text The public message text.
+ * @param username The name of the user sending the message.
+ * @param mentions Receives the mentioned users, marked as delivered when connected here.
+ *
+ * @return void
+ */
+void broadcast_public_message(const char *text, const char *username, mention_list_t *mentions) {
+    search_index_message(username, NULL, text);
+
     cJSON *json_message = cJSON_CreateObject();
     cJSON_AddStringToObject(json_message, "type", "PUBLIC_TEXT_FROM");
     cJSON_AddStringToObject(json_message, "username", username);
@@ -144,13 +503,41 @@ void send_public_message(const char *text, const char *username) {
 
     free(json_message_str);
     cJSON_Delete(json_message);
+
+    if (mention_extract(text, username, mentions) == 0) {
+        return;
+    }
+
+    cJSON *json_mention = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_mention, "type", "MENTION");
+    cJSON_AddStringToObject(json_mention, "username", username);
+    char *json_mention_str = cJSON_PrintUnformatted(json_mention);
+
+    for (int i = 0; i < mentions->count; ++i) {
+        client_t *recipient = find_client_by_username(mentions->names[i]);
+        if (!recipient) {
+            continue;
+        }
+        mentions->delivered[i] = 1;
+        metrics_add(METRIC_MENTIONS_DELIVERED, 1);
+        if (send_to_client(recipient, json_mention_str) < 0) {
+            perror("ERROR: write to descriptor failed");
+        }
+        release_client(recipient);
+    }
+
+    free(json_mention_str);
+    cJSON_Delete(json_mention);
 }
 
 /**
  * @brief Sends a private message to a specific client.
  *
- * Creates a private message in JSON format and sends it to the intended recipient.
- * If the recipient does not exist, the sending client is notified.
+ * Delivers the message to a local recipient, or forwards it to the cluster node the
+ * recipient is connected to. If the recipient is not connected anywhere, the message is
+ * queued in the recipient's offline mailbox, and the sending client is told whether it was
+ * queued or the recipient could not be reached. Messages that reached the recipient or its
+ * mailbox are added to the search index of this node.
  *
  * @param client A pointer to the client sending the message.
  * @param text The private message text.
@@ -160,42 +547,216 @@ void send_public_message(const char *text, const char *username) {
  * @return void
  */
 void send_private_message(client_t *client, const char *text, const char *from_username, const char *to_username) {
+    if (deliver_private_message(text, from_username, to_username) == 0 ||
+        cluster_send_private(from_username, to_username, text) == 0) {
+        search_index_message(from_username, to_username, text);
+        return;
+    }
+    if (cluster_store_offline(to_username, from_username, text, MAILBOX_KIND_TEXT) == 0) {
+        search_index_message(from_username, to_username, text);
+        send_message_queued(client, to_username);
+    } else {
+        send_no_such_user(client, to_username);
+    }
+}
+
+/**
+ * @brief Delivers a private message to a local client.
+ *
+ * @param text The private message text.
+ * @param from_username The name of the user sending the message.
+ * @param to_username The name of the user receiving the message.
+ *
+ * @return int 0 if the recipient is connected to this server, -1 otherwise.
+ */
+int deliver_private_message(const char *text, const char *from_username, const char *to_username) {
     client_t *recipient = find_client_by_username(to_username);
 
-    if (recipient) {
+    if (!recipient) {
+        return -1;
+    }
+
+    cJSON *json_message = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_message, "type", "TEXT_FROM");
+    cJSON_AddStringToObject(json_message, "username", from_username);
+    cJSON_AddStringToObject(json_message, "text", text);
+    char *json_message_str = cJSON_PrintUnformatted(json_message);
+
+    if (send_to_client(recipient, json_message_str) < 0) {
+        perror("ERROR: write to descriptor failed");
+    }
+    release_client(recipient);
+
+    free(json_message_str);
+    cJSON_Delete(json_message);
+    return 0;
+}
+
+/**
+ * @brief Delivers the offline messages of a user who just identified in a single write.
+ *
+ * Private messages are sent as ordinary TEXT_FROM messages and mentions as MENTION events,
+ * packed back to back into batches of at most MAILBOX_BATCH_BYTES.
+ *
+ * @param client A pointer to the recipient.
+ * @param messages The queued messages, oldest first.
+ *
+ * @return void
+ */
+void deliver_offline_messages(client_t *client, const mailbox_message_t *messages) {
+    char *batch = NULL;
+    size_t batch_length = 0;
+    int count = 0;
+
+    for (const mailbox_message_t *message = messages; message; message = message->next) {
         cJSON *json_message = cJSON_CreateObject();
-        cJSON_AddStringToObject(json_message, "type", "TEXT_FROM");
-        cJSON_AddStringToObject(json_message, "username", from_username);
-        cJSON_AddStringToObject(json_message, "text", text);
+        cJSON_AddStringToObject(json_message, "type", message->kind == MAILBOX_KIND_MENTION ? "MENTION" : "TEXT_FROM");
+        cJSON_AddStringToObject(json_message, "username", message->from);
+        cJSON_AddStringToObject(json_message, "text", message->text);
         char *json_message_str = cJSON_PrintUnformatted(json_message);
-
-        if (write(recipient->sockfd, json_message_str, strlen(json_message_str)) < 0) {
-            perror("ERROR: write to descriptor failed");
+        size_t length = strlen(json_message_str);
+        char *grown = realloc(batch, batch_length + length + 1);
+
+        if (grown) {
+            batch = grown;
+            memcpy(batch + batch_length, json_message_str, length + 1);
+            batch_length += length;
+            count++;
         }
-
         free(json_message_str);
         cJSON_Delete(json_message);
-    } else {
-        cJSON *response = cJSON_CreateObject();
-        cJSON_AddStringToObject(response, "type", "RESPONSE");
-        cJSON_AddStringToObject(response, "operation", "TEXT");
-        cJSON_AddStringToObject(response, "result", "NO_SUCH_USER");
-        cJSON_AddStringToObject(response, "extra", to_username);
-        char *response_str = cJSON_PrintUnformatted(response);
-
-        if (write(client->sockfd, response_str, strlen(response_str)) < 0) {
-            perror("ERROR: write to descriptor failed");
+
+        if (batch && (batch_length >= MAILBOX_BATCH_BYTES || !message->next)) {
+            if (send_to_client(client, batch) < 0) {
+                perror("ERROR: write to descriptor failed");
+            }
+            batch_length = 0;
         }
+    }
+    free(batch);
 
-        free(response_str);
-        cJSON_Delete(response);
+    if (count) {
+        printf("Delivered %d offline message(s) to %s\n", count, client->user_name);
     }
 }
 
+/**
+ * @brief Tells a client that its private message was queued for an offline recipient.
+ *
+ * @param client A pointer to the client that sent the private message.
+ * @param to_username The name of the offline recipient.
+ *
+ * @return void
+ */
+void send_message_queued(client_t *client, const char *to_username) {
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddStringToObject(response, "type", "RESPONSE");
+    cJSON_AddStringToObject(response, "operation", "TEXT");
+    cJSON_AddStringToObject(response, "result", "QUEUED");
+    cJSON_AddStringToObject(response, "extra", to_username);
+    char *response_str = cJSON_PrintUnformatted(response);
+
+    if (send_to_client(client, response_str) < 0) {
+        perror("ERROR: write to descriptor failed");
+    }
+
+    free(response_str);
+    cJSON_Delete(response);
+}
+
+/**
+ * @brief Tells a client that the recipient of its private message does not exist.
+ *
+ * @param client A pointer to the client that sent the private message.
+ * @param to_username The name of the missing recipient.
+ *
+ * @return void
+ */
+void send_no_such_user(client_t *client, const char *to_username) {
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddStringToObject(response, "type", "RESPONSE");
+    cJSON_AddStringToObject(response, "operation", "TEXT");
+    cJSON_AddStringToObject(response, "result", "NO_SUCH_USER");
+    cJSON_AddStringToObject(response, "extra", to_username);
+    char *response_str = cJSON_PrintUnformatted(response);
+
+    if (send_to_client(client, response_str) < 0) {
+        perror("ERROR: write to descriptor failed");
+    }
+
+    free(response_str);
+    cJSON_Delete(response);
+}
+
+/**
+ * @brief Tells a client that the username it asked for is already in use.
+ *
+ * @param client A pointer to the client that sent the IDENTIFY message.
+ * @param username The username that is already in use.
+ *
+ * @return void
+ */
+void send_user_already_exists(client_t *client, const char *username) {
+    cJSON *json_response = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_response, "type", "RESPONSE");
+    cJSON_AddStringToObject(json_response, "operation", "IDENTIFY");
+    cJSON_AddStringToObject(json_response, "result", "USER_ALREADY_EXISTS");
+    cJSON_AddStringToObject(json_response, "extra", username);
+    char *response_str = cJSON_PrintUnformatted(json_response);
+
+    send_to_client(client, response_str);
+
+    free(response_str);
+    cJSON_Delete(json_response);
+}
+
+/**
+ * @brief Tells a user of a gateway that the server can't take more clients.
+ *
+ * @param client A pointer to the client that sent the IDENTIFY message.
+ * @param username The username the client asked for.
+ *
+ * @return void
+ */
+void send_server_full(client_t *client, const char *username) {
+    cJSON *json_response = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_response, "type", "RESPONSE");
+    cJSON_AddStringToObject(json_response, "operation", "IDENTIFY");
+    cJSON_AddStringToObject(json_response, "result", "SERVER_FULL");
+    cJSON_AddStringToObject(json_response, "extra", username);
+    char *response_str = cJSON_PrintUnformatted(json_response);
+
+    send_to_client(client, response_str);
+
+    free(response_str);
+    cJSON_Delete(json_response);
+}
+
+/**
+ * @brief Tells a client that it did not identify before the IDENTIFY deadline.
+ *
+ * @param client A pointer to the client being disconnected.
+ *
+ * @return void
+ */
+void send_identify_timeout(client_t *client) {
+    cJSON *json_response = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_response, "type", "RESPONSE");
+    cJSON_AddStringToObject(json_response, "operation", "IDENTIFY");
+    cJSON_AddStringToObject(json_response, "result", "TIMEOUT");
+    char *response_str = cJSON_PrintUnformatted(json_response);
+
+    send_to_client(client, response_str);
+
+    free(response_str);
+    cJSON_Delete(json_response);
+}
+
 /**
  * @brief Updates a client's status.
  *
- * Changes the status of the client and broadcasts the new status to all connected clients.
+ * Changes the status of the client, broadcasts the new status to all connected clients
+ * and forwards it to the other cluster nodes.
  *
  * @param client A pointer to the client whose status is being updated.
  * @param status The new status of the client.
@@ -203,12 +764,24 @@ void send_private_message(client_t *client, const char *text, const char *from_u
  * @return void
  */
 void change_user_status(client_t *client, const char *status) {
-    strncpy(client->status, status, sizeof(client->status) - 1);
-    client->status[sizeof(client->status) - 1] = '\0';  
+    utf8_copy(client->status, status, sizeof(client->status));
+
+    deliver_status_change(client->user_name, client->status);
+    cluster_publish_status(client->user_name, client->status);
+}
 
+/**
+ * @brief Broadcasts a status change to the local clients.
+ *
+ * @param username The user whose status changed.
+ * @param status The new status of the user.
+ *
+ * @return void
+ */
+void deliver_status_change(const char *username, const char *status) {
     cJSON *json_status = cJSON_CreateObject();
     cJSON_AddStringToObject(json_status, "type", "NEW_STATUS");
-    cJSON_AddStringToObject(json_status, "username", client->user_name);
+    cJSON_AddStringToObject(json_status, "username", username);
     cJSON_AddStringToObject(json_status, "status", status);
     char *json_status_str = cJSON_PrintUnformatted(json_status);
 
@@ -218,11 +791,24 @@ void change_user_status(client_t *client, const char *status) {
     cJSON_Delete(json_status);
 }
 
+/**
+ * @brief Adds a remote user to a USER_LIST message.
+ *
+ * @param username The remote username.
+ * @param status The status of the remote user.
+ * @param arg The `users` object of the message.
+ *
+ * @return void
+ */
+static void add_remote_user(const char *username, const char *status, void *arg) {
+    cJSON_AddStringToObject((cJSON *)arg, username, status);
+}
+
 /**
  * @brief Sends the list of connected users to a client.
  *
  * Sends a list of connected users and their respective statuses
- * to the client who requested it.
+ * to the client who requested it, including the users of the other cluster nodes.
  *
  * @param client A pointer to the client requesting the user list.
  *
@@ -236,16 +822,18 @@ void send_user_list(client_t *client) {
 
     pthread_mutex_lock(&clients_mutex);  
     for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i]) {
+        if (clients[i] && clients[i]->user_name[0]) {
             cJSON_AddStringToObject(users, clients[i]->user_name, clients[i]->status);
         }
     }
     pthread_mutex_unlock(&clients_mutex);
 
+    cluster_collect_users(add_remote_user, users);
+
     cJSON_AddItemToObject(json_users, "users", users);
 
     char *json_users_str = cJSON_PrintUnformatted(json_users);
-    if (write(client->sockfd, json_users_str, strlen(json_users_str)) < 0) {
+    if (send_to_client(client, json_users_str) < 0) {
         perror("ERROR: write to descriptor failed");
     }
 
@@ -253,13 +841,115 @@ void send_user_list(client_t *client) {
     cJSON_Delete(json_users);
 }
 
+/**
+ * @brief Sends the server's counters to a client.
+ *
+ * @param client A pointer to the client requesting the metrics.
+ *
+ * @return void
+ */
+void send_metrics(client_t *client) {
+    cJSON *json_metrics = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_metrics, "type", "METRICS");
+
+    cJSON *metrics = cJSON_CreateObject();
+    for (int i = 0; i < METRIC_COUNT; ++i) {
+        cJSON_AddNumberToObject(metrics, metrics_name((metric_t)i), (double)metrics_get((metric_t)i));
+    }
+    cJSON_AddItemToObject(json_metrics, "metrics", metrics);
+
+    char *json_metrics_str = cJSON_PrintUnformatted(json_metrics);
+    if (send_to_client(client, json_metrics_str) < 0) {
+        perror("ERROR: write to descriptor failed");
+    }
+
+    free(json_metrics_str);
+    cJSON_Delete(json_metrics);
+}
+
+/**
+ * @brief Adds a search match to the results of a SEARCH response.
+ *
+ * @param hit The matching message.
+ * @param arg The JSON array of results.
+ *
+ * @return void
+ */
+static void add_search_result(const search_hit_t *hit, void *arg) {
+    cJSON *result = cJSON_CreateObject();
+    cJSON_AddNumberToObject(result, "id", hit->id);
+    cJSON_AddNumberToObject(result, "time", (double)hit->time);
+    cJSON_AddStringToObject(result, "username", hit->from);
+    if (hit->to) {
+        cJSON_AddStringToObject(result, "to", hit->to);
+    }
+    cJSON_AddStringToObject(result, "text", hit->text);
+    cJSON_AddItemToArray((cJSON *)arg, result);
+}
+
+/**
+ * @brief Answers a SEARCH request with the most recent matching messages.
+ *
+ * The request holds the words to look for in `query`, and optionally the sender in `from`,
+ * a time range in `since` and `until` (seconds since the epoch) and the maximum number of
+ * results in `limit`. The response holds the total number of matches and the most recent
+ * ones, newest first. A query without any word is answered with an INVALID_QUERY response.
+ *
+ * @param client A pointer to the client searching.
+ * @param json_msg The SEARCH request.
+ *
+ * @return void
+ */
+void send_search_results(client_t *client, cJSON *json_msg) {
+    cJSON *query = cJSON_GetObjectItemCaseSensitive(json_msg, "query");
+    cJSON *from = cJSON_GetObjectItemCaseSensitive(json_msg, "from");
+    cJSON *since = cJSON_GetObjectItemCaseSensitive(json_msg, "since");
+    cJSON *until = cJSON_GetObjectItemCaseSensitive(json_msg, "until");
+    cJSON *limit = cJSON_GetObjectItemCaseSensitive(json_msg, "limit");
+    search_query_t search = {
+        cJSON_IsString(query) ? query->valuestring : "",
+        client->user_name,
+        cJSON_IsString(from) ? from->valuestring : NULL,
+        cJSON_IsNumber(since) && since->valuedouble > 0 ? (time_t)since->valuedouble : 0,
+        cJSON_IsNumber(until) && until->valuedouble > 0 ? (time_t)until->valuedouble : 0,
+        SEARCH_DEFAULT_LIMIT
+    };
+    if (cJSON_IsNumber(limit) && limit->valuedouble >= 0) {
+        search.limit = limit->valuedouble < SEARCH_MAX_LIMIT ? (int)limit->valuedouble : SEARCH_MAX_LIMIT;
+    }
+
+    cJSON *json_response = cJSON_CreateObject();
+    cJSON *results = cJSON_CreateArray();
+    long total = search_run(&search, add_search_result, results);
+    if (total < 0) {
+        cJSON_Delete(results);
+        cJSON_AddStringToObject(json_response, "type", "RESPONSE");
+        cJSON_AddStringToObject(json_response, "operation", "SEARCH");
+        cJSON_AddStringToObject(json_response, "result", "INVALID_QUERY");
+    } else {
+        cJSON_AddStringToObject(json_response, "type", "SEARCH_RESULTS");
+        cJSON_AddStringToObject(json_response, "query", search.query);
+        cJSON_AddNumberToObject(json_response, "total", (double)total);
+        cJSON_AddItemToObject(json_response, "results", results);
+    }
+
+    char *json_response_str = cJSON_PrintUnformatted(json_response);
+    if (send_to_client(client, json_response_str) < 0) {
+        perror("ERROR: write to descriptor failed");
+    }
+
+    free(json_response_str);
+    cJSON_Delete(json_response);
+}
+
 /**
  * @brief Finds a client by username.
  *
  * Searches the list of connected clients to find a client with the matching username.
  *
  * @param username The username to search for.
- * @return client_t* A pointer to the client found, or NULL if no match is found.
+ * @return client_t* A pointer to the client found, to be released with release_client, or
+ *         NULL if no match is found.
  */
 client_t *find_client_by_username(const char *username) {
     client_t *client = NULL;
@@ -267,6 +957,7 @@ client_t *find_client_by_username(const char *username) {
     for (int i = 0; i < MAX_CLIENTS; ++i) {
         if (clients[i] && strcmp(clients[i]->user_name, username) == 0) {
             client = clients[i];
+            client->references++;
             break;
         }
     }
@@ -10,10 +10,15 @@
 #define MESSAGING_H
 
 #include "client_manager.h"
+#include "mailbox.h"
+#include "mention.h"
+#include "../libs/cJSON/cJSON.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h> 
 
+#define RING_DEFAULT_SIZE (1024 * 1024)
+
 void process_client_message(client_t *client, const char *message);
 void send_public_message(const char *text, const char *username);
 void process_client_message(client_t *client, const char *message);
@@ -21,8 +26,26 @@ void send_public_message(const char *text, const char *username);
 void send_private_message(client_t *client, const char *text, const char *from_username, const char *to_username);
 void change_user_status(client_t *client, const char *status);
 void send_user_list(client_t *client);
+void send_metrics(client_t *client);
+void send_search_results(client_t *client, cJSON *json_msg);
+void publish_filtered_message(client_t *client, const char *text);
+void send_message_blocked(client_t *client);
 client_t *find_client_by_username(const char *username);
 int is_username_taken(const char *username);
 void notify_disconnected(client_t *client);
+void resume_session(client_t *client, const char *username, const char *token, unsigned long seq,
+                    const char *compression);
+void open_event_ring(client_t *client, size_t size);
+void send_no_such_user(client_t *client, const char *to_username);
+void send_message_queued(client_t *client, const char *to_username);
+void deliver_offline_messages(client_t *client, const mailbox_message_t *messages);
+void send_user_already_exists(client_t *client, const char *username);
+void send_server_full(client_t *client, const char *username);
+void send_identify_timeout(client_t *client);
+void deliver_public_message(const char *text, const char *username);
+void broadcast_public_message(const char *text, const char *username, mention_list_t *mentions);
+int deliver_private_message(const char *text, const char *from_username, const char *to_username);
+void deliver_status_change(const char *username, const char *status);
+void deliver_disconnected(const char *username, int sender_id);
 
 #endif // MESSAGING_H
@@ -0,0 +1,97 @@
+/**
+ * @file metrics.c
+ * @brief Implements the process-wide counters describing the server's work.
+ */
+#include "metrics.h"
+#include <stdatomic.h>
+
+static _Atomic unsigned long long values[METRIC_COUNT];
+
+static const char *names[METRIC_COUNT] = {
+    [METRIC_FILTER_MESSAGES] = "filter_messages",
+    [METRIC_FILTER_PREFILTER_SKIPS] = "filter_prefilter_skips",
+    [METRIC_FILTER_MATCHES] = "filter_matches",
+    [METRIC_FILTER_MASKED] = "filter_masked",
+    [METRIC_FILTER_DROPPED] = "filter_dropped",
+    [METRIC_FILTER_FLAGGED] = "filter_flagged",
+    [METRIC_FILTER_TOTAL_NS] = "filter_total_ns",
+    [METRIC_FILTER_MAX_NS] = "filter_max_ns",
+    [METRIC_FILTER_RELOADS] = "filter_reloads",
+    [METRIC_FILTER_WORDS] = "filter_words",
+    [METRIC_MENTIONS_DELIVERED] = "mentions_delivered",
+    [METRIC_MENTIONS_QUEUED] = "mentions_queued",
+    [METRIC_FILES_UPLOADED] = "files_uploaded",
+    [METRIC_FILE_BYTES_RECEIVED] = "file_bytes_received",
+    [METRIC_FILE_BYTES_SENT] = "file_bytes_sent",
+    [METRIC_OUTBOX_COALESCED] = "outbox_coalesced",
+    [METRIC_OUTBOX_DISCONNECTS] = "outbox_disconnects",
+    [METRIC_CONNECTIONS_ACTIVE] = "connections_active",
+    [METRIC_CONNECTIONS_REJECTED] = "connections_rejected",
+    [METRIC_IDENTIFY_TIMEOUTS] = "identify_timeouts",
+    [METRIC_UTF8_REJECTED] = "utf8_rejected",
+    [METRIC_UTF8_TRUNCATED] = "utf8_truncated",
+};
+
+/**
+ * @brief Adds a value to a counter.
+ *
+ * @param metric The counter.
+ * @param value The value to add.
+ *
+ * @return void
+ */
+void metrics_add(metric_t metric, unsigned long long value) {
+    atomic_fetch_add_explicit(&values[metric], value, memory_order_relaxed);
+}
+
+/**
+ * @brief Sets a gauge to a value.
+ *
+ * @param metric The gauge.
+ * @param value The new value.
+ *
+ * @return void
+ */
+void metrics_set(metric_t metric, unsigned long long value) {
+    atomic_store_explicit(&values[metric], value, memory_order_relaxed);
+}
+
+/**
+ * @brief Raises a maximum to a value if the value is larger.
+ *
+ * @param metric The maximum.
+ * @param value The observed value.
+ *
+ * @return void
+ */
+void metrics_max(metric_t metric, unsigned long long value) {
+    unsigned long long current = atomic_load_explicit(&values[metric], memory_order_relaxed);
+
+    while (value > current &&
+           !atomic_compare_exchange_weak_explicit(&values[metric], &current, value,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/**
+ * @brief Reads a counter.
+ *
+ * @param metric The counter.
+ *
+ * @return unsigned long long The current value.
+ */
+unsigned long long metrics_get(metric_t metric) {
+    return atomic_load_explicit(&values[metric], memory_order_relaxed);
+}
+
+/**
+ * @brief Returns the name a counter is reported under.
+ *
+ * @param metric The counter.
+ *
+ * @return const char* The name.
+ */
+const char *metrics_name(metric_t metric) {
+    return names[metric];
+}
+
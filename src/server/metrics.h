@@ -0,0 +1,44 @@
+/**
+ * @file metrics.h
+ * @brief Process-wide counters describing the server's work.
+ *
+ * Counters are updated with atomic operations from any thread and read by clients with a
+ * METRICS request. Timings are kept as a total and a maximum in nanoseconds, alongside the
+ * count of timed operations, so clients can derive averages.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+typedef enum {
+    METRIC_FILTER_MESSAGES,
+    METRIC_FILTER_PREFILTER_SKIPS,
+    METRIC_FILTER_MATCHES,
+    METRIC_FILTER_MASKED,
+    METRIC_FILTER_DROPPED,
+    METRIC_FILTER_FLAGGED,
+    METRIC_FILTER_TOTAL_NS,
+    METRIC_FILTER_MAX_NS,
+    METRIC_FILTER_RELOADS,
+    METRIC_FILTER_WORDS,
+    METRIC_MENTIONS_DELIVERED,
+    METRIC_MENTIONS_QUEUED,
+    METRIC_FILES_UPLOADED,
+    METRIC_FILE_BYTES_RECEIVED,
+    METRIC_FILE_BYTES_SENT,
+    METRIC_OUTBOX_COALESCED,
+    METRIC_OUTBOX_DISCONNECTS,
+    METRIC_CONNECTIONS_ACTIVE,
+    METRIC_CONNECTIONS_REJECTED,
+    METRIC_IDENTIFY_TIMEOUTS,
+    METRIC_UTF8_REJECTED,
+    METRIC_UTF8_TRUNCATED,
+    METRIC_COUNT
+} metric_t;
+
+void metrics_add(metric_t metric, unsigned long long value);
+void metrics_set(metric_t metric, unsigned long long value);
+void metrics_max(metric_t metric, unsigned long long value);
+unsigned long long metrics_get(metric_t metric);
+const char *metrics_name(metric_t metric);
+
+#endif // METRICS_H
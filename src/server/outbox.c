@@ -0,0 +1,368 @@
+/**
+ * @file outbox.c
+ * @brief Implements the per-connection outbound queues.
+ *
+ * The bytes of a message are reference counted, so a broadcast queued for many connections
+ * shares one copy of the message and of its compressed frame. Presence entries are keyed by
+ * the user they describe, and by their recipients when they are addressed to the users of a
+ * gateway, so that a newer one can take the place of an older one.
+ */
+#include "outbox.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const int weights[OUTBOX_LANES] = {
+    [OUTBOX_CONTROL] = OUTBOX_WEIGHT_CONTROL,
+    [OUTBOX_CHAT] = OUTBOX_WEIGHT_CHAT,
+    [OUTBOX_PRESENCE] = OUTBOX_WEIGHT_PRESENCE,
+    [OUTBOX_BULK] = OUTBOX_WEIGHT_BULK,
+};
+
+static const struct {
+    const char *type;
+    outbox_lane_t lane;
+} lanes[] = {
+    { "RESPONSE", OUTBOX_CONTROL },
+    { "PUBLIC_TEXT_FROM", OUTBOX_CHAT },
+    { "TEXT_FROM", OUTBOX_CHAT },
+    { "MENTION", OUTBOX_CHAT },
+    { "FILE", OUTBOX_CHAT },
+    { "NEW_STATUS", OUTBOX_PRESENCE },
+    { "DISCONNECTED", OUTBOX_PRESENCE },
+    { "USER_LIST", OUTBOX_BULK },
+    { "METRICS", OUTBOX_BULK },
+    { "SEARCH_RESULTS", OUTBOX_BULK },
+    { "FILE_DATA", OUTBOX_BULK },
+};
+
+/**
+ * @brief Chooses the lane of a message from its type.
+ *
+ * The server writes the type first in every message it builds. Messages of unknown types
+ * travel in the chat lane.
+ *
+ * @param message The message.
+ * @param length The length of the message in bytes.
+ *
+ * @return outbox_lane_t The lane of the message.
+ */
+outbox_lane_t outbox_lane_of(const char *message, size_t length) {
+    static const char prefix[] = "{\"type\":\"";
+    const char *type = message + sizeof(prefix) - 1;
+    const char *end;
+
+    if (length < sizeof(prefix) || memcmp(message, prefix, sizeof(prefix) - 1) != 0) {
+        return OUTBOX_CHAT;
+    }
+    end = memchr(type, '"', length - (sizeof(prefix) - 1));
+    if (!end) {
+        return OUTBOX_CHAT;
+    }
+    for (size_t i = 0; i < sizeof(lanes) / sizeof(lanes[0]); ++i) {
+        if ((size_t)(end - type) == strlen(lanes[i].type) && memcmp(type, lanes[i].type, (size_t)(end - type)) == 0) {
+            return lanes[i].lane;
+        }
+    }
+    return OUTBOX_CHAT;
+}
+
+/**
+ * @brief Finds a string in a buffer.
+ *
+ * @param bytes The buffer.
+ * @param length The length of the buffer.
+ * @param needle The null-terminated string to find.
+ *
+ * @return const char* The first occurrence, or NULL.
+ */
+static const char *find_string(const char *bytes, size_t length, const char *needle) {
+    size_t needle_length = strlen(needle);
+
+    for (size_t i = 0; i + needle_length <= length; ++i) {
+        if (memcmp(bytes + i, needle, needle_length) == 0) {
+            return bytes + i;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds what identifies a presence entry: the user it describes and its recipients.
+ *
+ * The recipients are whatever precedes the type, empty unless the entry is addressed to the
+ * users of a gateway.
+ *
+ * @param entry The presence entry.
+ * @param prefix_length Receives the length of the bytes before the type.
+ * @param user Receives the start of the username, still JSON-escaped.
+ * @param user_length Receives the length of the username.
+ *
+ * @return int 0 on success, -1 if the entry names no user.
+ */
+static int presence_key(const outbox_entry_t *entry, size_t *prefix_length, const char **user, size_t *user_length) {
+    static const char field[] = "\"username\":\"";
+    const char *bytes = entry->message->bytes;
+    size_t length = entry->message->length;
+    const char *type = find_string(bytes, length, "\"type\":\"");
+    const char *name = find_string(bytes, length, field);
+    const char *end;
+
+    if (!type || !name) {
+        return -1;
+    }
+    name += sizeof(field) - 1;
+    for (end = name; end < bytes + length && *end != '"'; ++end) {
+        if (*end == '\\') {
+            end++;
+        }
+    }
+    if (end >= bytes + length) {
+        return -1;
+    }
+    *prefix_length = (size_t)(type - bytes);
+    *user = name;
+    *user_length = (size_t)(end - name);
+    return 0;
+}
+
+/**
+ * @brief Replaces the latest queued presence entry about the same user, if there is one.
+ *
+ * Entries queued before the queue went over budget may hold older changes about the user:
+ * they are written first, so the client still ends up with the latest one.
+ *
+ * Called with the queue locked.
+ *
+ * @param outbox The queue.
+ * @param entry The newer presence entry.
+ *
+ * @return int 1 if the entry took the place of an older one, 0 otherwise.
+ */
+static int presence_replace_locked(outbox_t *outbox, outbox_entry_t *entry) {
+    outbox_entry_t **match = NULL;
+    outbox_entry_t *queued;
+    size_t prefix_length;
+    const char *user;
+    size_t user_length;
+
+    if (presence_key(entry, &prefix_length, &user, &user_length) < 0) {
+        return 0;
+    }
+    for (outbox_entry_t **link = &outbox->head[OUTBOX_PRESENCE]; *link; link = &(*link)->next) {
+        size_t queued_prefix_length;
+        const char *queued_user;
+        size_t queued_user_length;
+
+        queued = *link;
+        if (presence_key(queued, &queued_prefix_length, &queued_user, &queued_user_length) == 0 &&
+            queued_prefix_length == prefix_length && queued_user_length == user_length &&
+            memcmp(queued->message->bytes, entry->message->bytes, prefix_length) == 0 &&
+            memcmp(queued_user, user, user_length) == 0) {
+            match = link;
+        }
+    }
+    if (!match) {
+        return 0;
+    }
+
+    queued = *match;
+    entry->next = queued->next;
+    *match = entry;
+    if (outbox->tail[OUTBOX_PRESENCE] == queued) {
+        outbox->tail[OUTBOX_PRESENCE] = entry;
+    }
+    outbox->bytes = outbox->bytes - queued->size + entry->size;
+    outbox_entry_free(queued);
+    return 1;
+}
+
+/**
+ * @brief Copies bytes into a reference-counted buffer.
+ *
+ * @param bytes The bytes to copy.
+ * @param length The number of bytes.
+ *
+ * @return outbox_data_t* The buffer with one reference, or NULL on allocation failure.
+ */
+outbox_data_t *outbox_data_create(const void *bytes, size_t length) {
+    outbox_data_t *data = malloc(sizeof(outbox_data_t) + length);
+
+    if (!data) {
+        return NULL;
+    }
+    atomic_init(&data->refs, 1);
+    data->length = length;
+    memcpy(data->bytes, bytes, length);
+    return data;
+}
+
+/**
+ * @brief Takes a reference to a buffer.
+ *
+ * @param data The buffer, or NULL.
+ *
+ * @return outbox_data_t* The buffer.
+ */
+outbox_data_t *outbox_data_retain(outbox_data_t *data) {
+    if (data) {
+        atomic_fetch_add_explicit(&data->refs, 1, memory_order_relaxed);
+    }
+    return data;
+}
+
+/**
+ * @brief Drops a reference to a buffer, freeing it with the last one.
+ *
+ * @param data The buffer, or NULL.
+ *
+ * @return void
+ */
+void outbox_data_release(outbox_data_t *data) {
+    if (data && atomic_fetch_sub_explicit(&data->refs, 1, memory_order_acq_rel) == 1) {
+        free(data);
+    }
+}
+
+/**
+ * @brief Creates a queue entry holding a message.
+ *
+ * The entry takes a reference to the message and to its shared compressed frame.
+ *
+ * @param message The message.
+ * @param frame The message compressed into a shared frame, or NULL.
+ *
+ * @return outbox_entry_t* The entry, or NULL on allocation failure.
+ */
+outbox_entry_t *outbox_entry_create(outbox_data_t *message, outbox_data_t *frame) {
+    outbox_entry_t *entry = calloc(1, sizeof(outbox_entry_t));
+
+    if (!entry) {
+        return NULL;
+    }
+    entry->message = outbox_data_retain(message);
+    entry->frame = outbox_data_retain(frame);
+    entry->fd = -1;
+    entry->size = message->length + (frame ? frame->length : 0);
+    return entry;
+}
+
+/**
+ * @brief Frees a queue entry, its references and its file descriptor.
+ *
+ * @param entry The entry.
+ *
+ * @return void
+ */
+void outbox_entry_free(outbox_entry_t *entry) {
+    outbox_data_release(entry->message);
+    outbox_data_release(entry->frame);
+    if (entry->fd >= 0) {
+        close(entry->fd);
+    }
+    free(entry);
+}
+
+/**
+ * @brief Initializes an empty queue.
+ *
+ * @param outbox The queue.
+ *
+ * @return void
+ */
+void outbox_init(outbox_t *outbox) {
+    memset(outbox, 0, sizeof(outbox_t));
+    pthread_mutex_init(&outbox->mutex, NULL);
+    pthread_cond_init(&outbox->cond, NULL);
+    memcpy(outbox->credits, weights, sizeof(weights));
+    outbox->max_bytes = OUTBOX_MAX_BYTES;
+}
+
+/**
+ * @brief Frees the entries left in a queue and releases its lock.
+ *
+ * @param outbox The queue, no longer used by any thread.
+ *
+ * @return void
+ */
+void outbox_destroy(outbox_t *outbox) {
+    for (int lane = 0; lane < OUTBOX_LANES; ++lane) {
+        while (outbox->head[lane]) {
+            outbox_entry_t *entry = outbox->head[lane];
+            outbox->head[lane] = entry->next;
+            outbox_entry_free(entry);
+        }
+    }
+    pthread_mutex_destroy(&outbox->mutex);
+    pthread_cond_destroy(&outbox->cond);
+}
+
+/**
+ * @brief Appends an entry to a lane. Called with the queue locked.
+ *
+ * An entry is always accepted by an empty queue, whatever its size. Beyond the budget of the
+ * queue, a presence entry takes the place of the queued one about the same user, or is queued
+ * anyway, since there is at most one per user; any other entry is refused, as nothing else
+ * can be lost without the client noticing.
+ *
+ * @param outbox The queue.
+ * @param lane The lane of the entry.
+ * @param entry The entry, owned by the queue unless it is refused.
+ *
+ * @return outbox_result_t OUTBOX_QUEUED, OUTBOX_COALESCED if the entry replaced an older
+ *         presence entry, or OUTBOX_FULL if it would exceed the budget of the queue.
+ */
+outbox_result_t outbox_push_locked(outbox_t *outbox, outbox_lane_t lane, outbox_entry_t *entry) {
+    if (outbox->bytes > 0 && outbox->bytes + entry->size > outbox->max_bytes) {
+        if (lane != OUTBOX_PRESENCE) {
+            return OUTBOX_FULL;
+        }
+        if (presence_replace_locked(outbox, entry)) {
+            return OUTBOX_COALESCED;
+        }
+    }
+    entry->next = NULL;
+    if (outbox->tail[lane]) {
+        outbox->tail[lane]->next = entry;
+    } else {
+        outbox->head[lane] = entry;
+    }
+    outbox->tail[lane] = entry;
+    outbox->bytes += entry->size;
+    return OUTBOX_QUEUED;
+}
+
+/**
+ * @brief Takes the next entry to write. Called with the queue locked.
+ *
+ * The entry comes from the highest-priority lane that still has credits. Each lane has as
+ * many credits per round as its weight, and credits are refilled once every non-empty lane
+ * has used its share, so a busy lane never starves the others.
+ *
+ * @param outbox The queue.
+ *
+ * @return outbox_entry_t* The entry, owned by the caller, or NULL if the queue is empty.
+ */
+outbox_entry_t *outbox_pop_locked(outbox_t *outbox) {
+    if (outbox->bytes == 0) {
+        return NULL;
+    }
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        for (int lane = 0; lane < OUTBOX_LANES; ++lane) {
+            outbox_entry_t *entry = outbox->head[lane];
+
+            if (!entry || outbox->credits[lane] == 0) {
+                continue;
+            }
+            outbox->head[lane] = entry->next;
+            if (!entry->next) {
+                outbox->tail[lane] = NULL;
+            }
+            outbox->bytes -= entry->size;
+            outbox->credits[lane]--;
+            return entry;
+        }
+        memcpy(outbox->credits, weights, sizeof(weights));
+    }
+    return NULL;
+}
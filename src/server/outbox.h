@@ -0,0 +1,93 @@
+/**
+ * @file outbox.h
+ * @brief Per-connection outbound queues with priority lanes and weighted draining.
+ *
+ * Messages for a connection are queued in one of four lanes, chosen from their type:
+ * control (responses to the client's own requests), chat (public and private text, mentions
+ * and shared files), presence (status changes and departures) and bulk (user
+ * lists, metrics, search results and file data). The connection's writer thread drains the
+ * lanes by weighted priority, up to OUTBOX_WEIGHT_* messages from each lane per round, so
+ * under load chat keeps a low latency while presence and bulk traffic absorb the delay.
+ *
+ * A queue holds at most OUTBOX_MAX_BYTES. Beyond that, a presence message replaces the
+ * queued one about the same user, so the client still ends up with every user's latest
+ * status, and any other message marks the connection as too slow. Nothing is dropped: bulk
+ * messages all answer the client's own requests, which would otherwise go unanswered.
+ *
+ * A gateway connection carries the traffic of all its users, so its budget grows by
+ * OUTBOX_GATEWAY_USER_BYTES per user, up to OUTBOX_GATEWAY_MAX_BYTES. An entry addressed to a
+ * single user of a gateway names that user, who may only have OUTBOX_MAX_BYTES queued, like a
+ * connection of its own; presence entries never name a user, as they can replace each other.
+ */
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define OUTBOX_MAX_BYTES (4 * 1024 * 1024)
+#define OUTBOX_GATEWAY_USER_BYTES (64 * 1024)
+#define OUTBOX_GATEWAY_MAX_BYTES (256 * 1024 * 1024)
+#define OUTBOX_WEIGHT_CONTROL 8
+#define OUTBOX_WEIGHT_CHAT 4
+#define OUTBOX_WEIGHT_PRESENCE 2
+#define OUTBOX_WEIGHT_BULK 1
+
+typedef enum {
+    OUTBOX_CONTROL,
+    OUTBOX_CHAT,
+    OUTBOX_PRESENCE,
+    OUTBOX_BULK,
+    OUTBOX_LANES
+} outbox_lane_t;
+
+typedef enum {
+    OUTBOX_QUEUED,
+    OUTBOX_COALESCED,
+    OUTBOX_FULL
+} outbox_result_t;
+
+typedef struct {
+    _Atomic int refs;
+    size_t length;
+    char bytes[];
+} outbox_data_t;
+
+typedef struct outbox_entry {
+    outbox_data_t *message;
+    outbox_data_t *frame;
+    int fd;
+    off_t offset;
+    size_t file_length;
+    size_t size;
+    struct client *user;
+    struct outbox_entry *next;
+} outbox_entry_t;
+
+typedef struct {
+    outbox_entry_t *head[OUTBOX_LANES];
+    outbox_entry_t *tail[OUTBOX_LANES];
+    int credits[OUTBOX_LANES];
+    size_t bytes;
+    size_t max_bytes;
+    int running;
+    int closing;
+    int hangup;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} outbox_t;
+
+outbox_lane_t outbox_lane_of(const char *message, size_t length);
+outbox_data_t *outbox_data_create(const void *bytes, size_t length);
+outbox_data_t *outbox_data_retain(outbox_data_t *data);
+void outbox_data_release(outbox_data_t *data);
+outbox_entry_t *outbox_entry_create(outbox_data_t *message, outbox_data_t *frame);
+void outbox_entry_free(outbox_entry_t *entry);
+void outbox_init(outbox_t *outbox);
+void outbox_destroy(outbox_t *outbox);
+outbox_result_t outbox_push_locked(outbox_t *outbox, outbox_lane_t lane, outbox_entry_t *entry);
+outbox_entry_t *outbox_pop_locked(outbox_t *outbox);
+
+#endif // OUTBOX_H
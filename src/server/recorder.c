@@ -0,0 +1,178 @@
+/**
+ * @file recorder.c
+ * @brief Implements the recording of the traffic received by the server.
+ */
+#include "recorder.h"
+#include "../common/capture.h"
+#include "../common/clock.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static FILE *capture_file = NULL;
+static unsigned char *buffer = NULL;
+static size_t buffer_length = 0;
+static unsigned long long start_time = 0;
+static pthread_mutex_t recorder_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Writes the buffered records to the capture file.
+ *
+ * Must be called with the recorder lock held.
+ *
+ * @return void
+ */
+static void recorder_flush_locked(void) {
+    if (buffer_length == 0) {
+        return;
+    }
+    if (fwrite(buffer, 1, buffer_length, capture_file) != buffer_length || fflush(capture_file) != 0) {
+        perror("ERROR: write to capture file failed");
+    }
+    buffer_length = 0;
+}
+
+/**
+ * @brief Appends a record to the capture.
+ *
+ * @param connection_id The connection the record is about.
+ * @param event The event: CAPTURE_OPEN, CAPTURE_DATA or CAPTURE_CLOSE.
+ * @param data The received bytes, or NULL.
+ * @param length The number of received bytes.
+ *
+ * @return void
+ */
+static void recorder_append(int connection_id, int event, const char *data, size_t length) {
+    capture_record_t record;
+
+    if (!capture_file) {
+        return;
+    }
+    record.connection = (unsigned int)connection_id;
+    record.event = event;
+    record.length = length;
+
+    pthread_mutex_lock(&recorder_mutex);
+    record.time = clock_monotonic_ns() - start_time;
+    if (buffer_length + CAPTURE_RECORD_HEADER_SIZE + length > RECORDER_BUFFER_SIZE) {
+        recorder_flush_locked();
+    }
+    if (CAPTURE_RECORD_HEADER_SIZE + length > RECORDER_BUFFER_SIZE) {
+        unsigned char header[CAPTURE_RECORD_HEADER_SIZE];
+        capture_encode_record_header(header, &record);
+        if (fwrite(header, 1, sizeof(header), capture_file) != sizeof(header) ||
+            fwrite(data, 1, length, capture_file) != length) {
+            perror("ERROR: write to capture file failed");
+        }
+    } else {
+        capture_encode_record_header(buffer + buffer_length, &record);
+        if (length > 0) {
+            memcpy(buffer + buffer_length + CAPTURE_RECORD_HEADER_SIZE, data, length);
+        }
+        buffer_length += CAPTURE_RECORD_HEADER_SIZE + length;
+    }
+    pthread_mutex_unlock(&recorder_mutex);
+}
+
+/**
+ * @brief Records that a client connected.
+ *
+ * @param connection_id The ID of the client.
+ *
+ * @return void
+ */
+void recorder_open(int connection_id) {
+    recorder_append(connection_id, CAPTURE_OPEN, NULL, 0);
+}
+
+/**
+ * @brief Records bytes received from a client.
+ *
+ * @param connection_id The ID of the client.
+ * @param data The received bytes.
+ * @param length The number of received bytes.
+ *
+ * @return void
+ */
+void recorder_data(int connection_id, const char *data, size_t length) {
+    recorder_append(connection_id, CAPTURE_DATA, data, length);
+}
+
+/**
+ * @brief Records that a client disconnected.
+ *
+ * @param connection_id The ID of the client.
+ *
+ * @return void
+ */
+void recorder_close(int connection_id) {
+    recorder_append(connection_id, CAPTURE_CLOSE, NULL, 0);
+}
+
+/**
+ * @brief Tells whether the received traffic is recorded.
+ *
+ * @return int Non-zero if recording is enabled.
+ */
+int recorder_enabled(void) {
+    return capture_file != NULL;
+}
+
+/**
+ * @brief Writes the buffered records every RECORDER_FLUSH_INTERVAL seconds.
+ *
+ * @param arg Unused.
+ *
+ * @return void* Never returns.
+ */
+static void *recorder_flush_loop(void *arg) {
+    (void)arg;
+
+    while (1) {
+        sleep(RECORDER_FLUSH_INTERVAL);
+        pthread_mutex_lock(&recorder_mutex);
+        recorder_flush_locked();
+        pthread_mutex_unlock(&recorder_mutex);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts recording the received traffic to a capture file.
+ *
+ * @param path The capture file, replaced if it exists.
+ *
+ * @return int 0 on success, -1 if the file could not be created.
+ */
+int recorder_init(const char *path) {
+    unsigned char header[CAPTURE_FILE_HEADER_SIZE];
+    pthread_t tid;
+
+    buffer = malloc(RECORDER_BUFFER_SIZE);
+    capture_file = fopen(path, "wb");
+    if (!buffer || !capture_file) {
+        perror("ERROR: open capture file failed");
+        free(buffer);
+        if (capture_file) {
+            fclose(capture_file);
+            capture_file = NULL;
+        }
+        return -1;
+    }
+    capture_encode_file_header(header, clock_realtime_ns());
+    start_time = clock_monotonic_ns();
+    if (fwrite(header, 1, sizeof(header), capture_file) != sizeof(header) || fflush(capture_file) != 0) {
+        perror("ERROR: write to capture file failed");
+        return -1;
+    }
+
+    if (pthread_create(&tid, NULL, recorder_flush_loop, NULL) != 0) {
+        perror("ERROR: pthread_create recorder failed");
+        return -1;
+    }
+    pthread_detach(tid);
+    printf("Recording received traffic to %s\n", path);
+    return 0;
+}
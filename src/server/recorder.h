@@ -0,0 +1,24 @@
+/**
+ * @file recorder.h
+ * @brief Records the traffic received by the server to a capture file.
+ *
+ * When recording is enabled, every connection opened and closed and every chunk of bytes
+ * received from a client is appended to the capture, so the traffic can be replayed
+ * against another server build. Records are collected in a buffer that is written when it
+ * is full and every RECORDER_FLUSH_INTERVAL seconds.
+ */
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stddef.h>
+
+#define RECORDER_BUFFER_SIZE (1024 * 1024)
+#define RECORDER_FLUSH_INTERVAL 1
+
+int recorder_init(const char *path);
+void recorder_open(int connection_id);
+void recorder_data(int connection_id, const char *data, size_t length);
+void recorder_close(int connection_id);
+int recorder_enabled(void);
+
+#endif // RECORDER_H
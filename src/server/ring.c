@@ -0,0 +1,169 @@
+/**
+ * @file ring.c
+ * @brief Implements the consistent-hash ring.
+ *
+ * The points are kept sorted in a fixed array so lookups are a binary search. The ring is
+ * rebuilt on every membership change, which only happens when a node joins or leaves.
+ */
+#include "ring.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+static ring_point_t ring_points[RING_MAX_NODES * RING_VIRTUAL_NODES];
+static int ring_point_count = 0;
+static int ring_nodes[RING_MAX_NODES];
+static int ring_nodes_count = 0;
+static pthread_rwlock_t ring_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * @brief Hashes a key with 32-bit FNV-1a.
+ *
+ * @param key The null-terminated key.
+ * @return unsigned int The hash of the key.
+ */
+unsigned int ring_hash(const char *key) {
+    unsigned int hash = 2166136261u;
+
+    for (const unsigned char *c = (const unsigned char *)key; *c; ++c) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Computes the position of one virtual node on the ring.
+ *
+ * @param node_id The node ID.
+ * @param replica The index of the virtual node.
+ * @return unsigned int The position of the virtual node.
+ */
+static unsigned int ring_point_hash(int node_id, int replica) {
+    unsigned int hash = ((unsigned int)node_id << 16) ^ (unsigned int)replica;
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/**
+ * @brief Orders ring points by position, then by node ID for stable ties.
+ *
+ * @param a The first point.
+ * @param b The second point.
+ * @return int A negative, zero or positive value as for qsort().
+ */
+static int compare_points(const void *a, const void *b) {
+    const ring_point_t *left = a;
+    const ring_point_t *right = b;
+
+    if (left->hash != right->hash) {
+        return left->hash < right->hash ? -1 : 1;
+    }
+    return left->node_id - right->node_id;
+}
+
+/**
+ * @brief Rebuilds the sorted point array from the member list.
+ *
+ * Must be called with the ring write lock held.
+ *
+ * @return void
+ */
+static void ring_rebuild(void) {
+    ring_point_count = 0;
+    for (int i = 0; i < ring_nodes_count; ++i) {
+        for (int replica = 0; replica < RING_VIRTUAL_NODES; ++replica) {
+            ring_points[ring_point_count].hash = ring_point_hash(ring_nodes[i], replica);
+            ring_points[ring_point_count].node_id = ring_nodes[i];
+            ring_point_count++;
+        }
+    }
+    qsort(ring_points, ring_point_count, sizeof(ring_point_t), compare_points);
+}
+
+/**
+ * @brief Adds a node to the ring.
+ *
+ * @param node_id The node joining the ring. Adding a node twice has no effect.
+ *
+ * @return void
+ */
+void ring_add_node(int node_id) {
+    pthread_rwlock_wrlock(&ring_lock);
+    for (int i = 0; i < ring_nodes_count; ++i) {
+        if (ring_nodes[i] == node_id) {
+            pthread_rwlock_unlock(&ring_lock);
+            return;
+        }
+    }
+    if (ring_nodes_count < RING_MAX_NODES) {
+        ring_nodes[ring_nodes_count++] = node_id;
+        ring_rebuild();
+    }
+    pthread_rwlock_unlock(&ring_lock);
+}
+
+/**
+ * @brief Removes a node from the ring.
+ *
+ * @param node_id The node leaving the ring.
+ *
+ * @return void
+ */
+void ring_remove_node(int node_id) {
+    pthread_rwlock_wrlock(&ring_lock);
+    for (int i = 0; i < ring_nodes_count; ++i) {
+        if (ring_nodes[i] == node_id) {
+            ring_nodes[i] = ring_nodes[--ring_nodes_count];
+            ring_rebuild();
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&ring_lock);
+}
+
+/**
+ * @brief Finds the node a key belongs to.
+ *
+ * @param key The null-terminated key, usually a username.
+ * @return int The owning node ID, or 0 if the ring is empty.
+ */
+int ring_lookup(const char *key) {
+    unsigned int hash = ring_hash(key);
+    int node_id = 0;
+    int low = 0;
+    int high;
+
+    pthread_rwlock_rdlock(&ring_lock);
+    high = ring_point_count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (ring_points[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (ring_point_count > 0) {
+        node_id = ring_points[low == ring_point_count ? 0 : low].node_id;
+    }
+    pthread_rwlock_unlock(&ring_lock);
+    return node_id;
+}
+
+/**
+ * @brief Counts the nodes on the ring.
+ *
+ * @return int The number of live nodes, including this one.
+ */
+int ring_node_count(void) {
+    int count;
+
+    pthread_rwlock_rdlock(&ring_lock);
+    count = ring_nodes_count;
+    pthread_rwlock_unlock(&ring_lock);
+    return count;
+}
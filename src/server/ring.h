@@ -0,0 +1,26 @@
+/**
+ * @file ring.h
+ * @brief Consistent-hash ring mapping usernames to cluster nodes.
+ *
+ * Every live node is placed on the ring at RING_VIRTUAL_NODES pseudo-random points. A
+ * username belongs to the first node point found clockwise from the username's hash, so
+ * adding or removing a node only moves the usernames next to that node's points.
+ */
+#ifndef RING_H
+#define RING_H
+
+#define RING_VIRTUAL_NODES 64
+#define RING_MAX_NODES 32
+
+typedef struct {
+    unsigned int hash;
+    int node_id;
+} ring_point_t;
+
+unsigned int ring_hash(const char *key);
+void ring_add_node(int node_id);
+void ring_remove_node(int node_id);
+int ring_lookup(const char *key);
+int ring_node_count(void);
+
+#endif // RING_H
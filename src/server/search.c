@@ -0,0 +1,813 @@
+/**
+ * @file search.c
+ * @brief Implements the inverted index over the chat history.
+ *
+ * Terms live in an open-addressing hash table that doubles when it is 70% full. Posting
+ * lists are byte buffers of LEB128 varints: the first one is the ID of the first message,
+ * every following one the gap to the previous ID. A term appearing twice in a message is
+ * only posted once. The index is protected by a read-write lock, so searches run in
+ * parallel and only indexing takes it exclusively.
+ *
+ * The history is split into two generations of SEARCH_MAX_MESSAGES / 2 messages, each with
+ * its own hash table and posting lists over IDs relative to the generation. When the newer
+ * generation is full, the older one is dropped as a whole and a new one is started, so
+ * nothing is tokenized again; the dropped generation is only detached under the lock, and
+ * freed after it is released. Message IDs returned by searches keep growing across
+ * generations.
+ *
+ * The snapshot file is an append-only log of the history. It starts with the magic "CHSI"
+ * and a 4-byte big-endian version, followed by the messages, each as an 8-byte time, the
+ * 2-byte lengths of the sender and recipient (0 for a public message), the 4-byte length of
+ * the text, all big-endian, and the three strings. Each snapshot only appends the messages
+ * indexed since the previous one; the file is rewritten from scratch when the history was
+ * shortened. Loading the file indexes its messages again, and a message cut short by a crash
+ * is dropped along with the end of the file.
+ */
+#include "search.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "CHSI"
+#define SNAPSHOT_VERSION 2
+
+typedef struct {
+    time_t time;
+    char *from;
+    char *to;
+    char *text;
+} indexed_message_t;
+
+typedef struct {
+    char *term;
+    unsigned char *postings;
+    uint32_t length;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t last_id;
+} posting_list_t;
+
+typedef struct {
+    indexed_message_t *messages;
+    uint32_t message_count;
+    uint32_t message_capacity;
+    posting_list_t *terms;
+    uint32_t term_count;
+    uint32_t term_capacity;
+    uint32_t first_id;
+} generation_t;
+
+typedef struct {
+    long total;
+    int emitted;
+    size_t bytes;
+    int full;
+} search_progress_t;
+
+static generation_t older;
+static generation_t newer;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint32_t history_epoch = 0;
+static char snapshot_path[1024] = "";
+static int snapshot_valid = 0;
+static uint32_t snapshot_epoch = 0;
+static uint32_t snapshot_count = 0;
+
+/**
+ * @brief Writes a big-endian integer.
+ *
+ * @param data The destination bytes.
+ * @param value The value to write.
+ * @param size The number of bytes to write.
+ *
+ * @return void
+ */
+static void put_be(unsigned char *data, uint64_t value, int size) {
+    for (int i = size - 1; i >= 0; --i) {
+        data[i] = (unsigned char)value;
+        value >>= 8;
+    }
+}
+
+/**
+ * @brief Reads a big-endian integer.
+ *
+ * @param data The source bytes.
+ * @param size The number of bytes to read.
+ * @return uint64_t The value.
+ */
+static uint64_t get_be(const unsigned char *data, int size) {
+    uint64_t value = 0;
+
+    for (int i = 0; i < size; ++i) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+/**
+ * @brief Hashes a term with FNV-1a.
+ *
+ * @param term The term.
+ * @return uint32_t The hash.
+ */
+static uint32_t term_hash(const char *term) {
+    uint32_t hash = 2166136261u;
+
+    for (const unsigned char *byte = (const unsigned char *)term; *byte; ++byte) {
+        hash = (hash ^ *byte) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Finds the slot of a term in the hash table.
+ *
+ * Must be called with the index lock held.
+ *
+ * @param generation The generation of the history.
+ * @param term The term.
+ * @return posting_list_t* The slot holding the term, or the empty slot where it belongs.
+ */
+static posting_list_t *term_slot(generation_t *generation, const char *term) {
+    uint32_t mask = generation->term_capacity - 1;
+    uint32_t index = term_hash(term) & mask;
+
+    while (generation->terms[index].term && strcmp(generation->terms[index].term, term) != 0) {
+        index = (index + 1) & mask;
+    }
+    return &generation->terms[index];
+}
+
+/**
+ * @brief Doubles the hash table, or creates it.
+ *
+ * Must be called with the index lock held exclusively.
+ *
+ * @param generation The generation of the history.
+ *
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int terms_grow(generation_t *generation) {
+    posting_list_t *previous = generation->terms;
+    uint32_t previous_capacity = generation->term_capacity;
+    uint32_t capacity = previous_capacity ? previous_capacity * 2 : SEARCH_INITIAL_TERMS;
+    posting_list_t *grown = calloc(capacity, sizeof(posting_list_t));
+
+    if (!grown) {
+        return -1;
+    }
+    generation->terms = grown;
+    generation->term_capacity = capacity;
+    for (uint32_t i = 0; i < previous_capacity; ++i) {
+        if (previous[i].term) {
+            *term_slot(generation, previous[i].term) = previous[i];
+        }
+    }
+    free(previous);
+    return 0;
+}
+
+/**
+ * @brief Finds the posting list of a term, creating it if needed.
+ *
+ * Must be called with the index lock held exclusively.
+ *
+ * @param generation The generation of the history.
+ * @param term The term.
+ * @return posting_list_t* The posting list, or NULL on allocation failure.
+ */
+static posting_list_t *term_get(generation_t *generation, const char *term) {
+    posting_list_t *list;
+
+    if ((generation->term_count + 1) * 10 > generation->term_capacity * 7 && terms_grow(generation) < 0) {
+        return NULL;
+    }
+    list = term_slot(generation, term);
+    if (!list->term) {
+        list->term = strdup(term);
+        if (!list->term) {
+            return NULL;
+        }
+        generation->term_count++;
+    }
+    return list;
+}
+
+/**
+ * @brief Appends a varint to a posting list.
+ *
+ * @param list The posting list.
+ * @param value The value.
+ *
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int postings_append(posting_list_t *list, uint32_t value) {
+    if (list->length + 5 > list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 8;
+        unsigned char *grown = realloc(list->postings, capacity);
+        if (!grown) {
+            return -1;
+        }
+        list->postings = grown;
+        list->capacity = capacity;
+    }
+    while (value >= 0x80) {
+        list->postings[list->length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    list->postings[list->length++] = (unsigned char)value;
+    return 0;
+}
+
+/**
+ * @brief Decodes a posting list into message IDs.
+ *
+ * @param list The posting list.
+ * @param ids The array receiving `list->count` IDs.
+ *
+ * @return void
+ */
+static void postings_decode(const posting_list_t *list, uint32_t *ids) {
+    uint32_t id = 0;
+    uint32_t offset = 0;
+
+    for (uint32_t i = 0; i < list->count; ++i) {
+        uint32_t value = 0;
+        int shift = 0;
+        unsigned char byte;
+
+        do {
+            byte = list->postings[offset++];
+            value |= (uint32_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        id = i == 0 ? value : id + value;
+        ids[i] = id;
+    }
+}
+
+/**
+ * @brief Extracts the next term of a text.
+ *
+ * Terms are runs of ASCII letters and digits and of non-ASCII bytes, lower-cased and cut to
+ * SEARCH_MAX_TERM_LENGTH bytes.
+ *
+ * @param cursor The position in the text, advanced past the term.
+ * @param term The buffer of SEARCH_MAX_TERM_LENGTH + 1 bytes receiving the term.
+ *
+ * @return int 1 if a term was extracted, 0 at the end of the text.
+ */
+static int next_term(const char **cursor, char *term) {
+    const unsigned char *byte = (const unsigned char *)*cursor;
+    size_t length = 0;
+
+    while (*byte && !isalnum(*byte) && *byte < 0x80) {
+        byte++;
+    }
+    if (!*byte) {
+        *cursor = (const char *)byte;
+        return 0;
+    }
+    while (*byte && (isalnum(*byte) || *byte >= 0x80)) {
+        if (length < SEARCH_MAX_TERM_LENGTH) {
+            term[length++] = (char)tolower(*byte);
+        }
+        byte++;
+    }
+    term[length] = '\0';
+    *cursor = (const char *)byte;
+    return 1;
+}
+
+/**
+ * @brief Posts a message under each of the terms of its text.
+ *
+ * Must be called with the index lock held exclusively.
+ *
+ * @param generation The generation holding the message.
+ * @param id The ID of the message in its generation.
+ * @param text The message text.
+ *
+ * @return void
+ */
+static void index_terms(generation_t *generation, uint32_t id, const char *text) {
+    char term[SEARCH_MAX_TERM_LENGTH + 1];
+    const char *cursor = text;
+
+    while (next_term(&cursor, term)) {
+        posting_list_t *list = term_get(generation, term);
+        if (!list || (list->count > 0 && list->last_id == id)) {
+            continue;
+        }
+        if (postings_append(list, list->count == 0 ? id : id - list->last_id) == 0) {
+            list->last_id = id;
+            list->count++;
+        }
+    }
+}
+
+/**
+ * @brief Frees a generation of the history.
+ *
+ * @param generation The generation, no longer reachable from the index.
+ *
+ * @return void
+ */
+static void generation_free(generation_t *generation) {
+    for (uint32_t i = 0; i < generation->message_count; ++i) {
+        free(generation->messages[i].from);
+        free(generation->messages[i].to);
+        free(generation->messages[i].text);
+    }
+    free(generation->messages);
+    for (uint32_t i = 0; i < generation->term_capacity; ++i) {
+        free(generation->terms[i].term);
+        free(generation->terms[i].postings);
+    }
+    free(generation->terms);
+}
+
+/**
+ * @brief Makes room for one more message at the end of the history.
+ *
+ * When the newer generation holds SEARCH_MAX_MESSAGES / 2 messages, it becomes the older one
+ * and a new generation is started. Must be called with the index lock held exclusively.
+ *
+ * @param dropped Receives the generation dropped to make room, to be freed by the caller once
+ *        the lock is released, or is left empty.
+ *
+ * @return indexed_message_t* The slot of the next message, or NULL on allocation failure.
+ */
+static indexed_message_t *message_slot(generation_t *dropped) {
+    if (newer.message_count == SEARCH_MAX_MESSAGES / 2) {
+        *dropped = older;
+        older = newer;
+        memset(&newer, 0, sizeof(newer));
+        newer.first_id = older.first_id + older.message_count;
+        if (dropped->message_count > 0) {
+            history_epoch++;
+        }
+    }
+    if (newer.message_count == newer.message_capacity) {
+        uint32_t capacity = newer.message_capacity ? newer.message_capacity * 2 : 1024;
+        indexed_message_t *grown = realloc(newer.messages, capacity * sizeof(indexed_message_t));
+        if (!grown) {
+            return NULL;
+        }
+        newer.messages = grown;
+        newer.message_capacity = capacity;
+    }
+    return &newer.messages[newer.message_count];
+}
+
+/**
+ * @brief Returns a message of the history by its position.
+ *
+ * Must be called with the index lock held.
+ *
+ * @param position The position of the message, counted from the oldest one.
+ * @return const indexed_message_t* The message.
+ */
+static const indexed_message_t *history_message(uint32_t position) {
+    if (position < older.message_count) {
+        return &older.messages[position];
+    }
+    return &newer.messages[position - older.message_count];
+}
+
+/**
+ * @brief Adds a message to the index.
+ *
+ * @param from The sender.
+ * @param to The recipient of a private message, or NULL for a public message.
+ * @param text The message text.
+ *
+ * @return void
+ */
+void search_index_message(const char *from, const char *to, const char *text) {
+    generation_t dropped = { 0 };
+    indexed_message_t *message;
+
+    pthread_rwlock_wrlock(&index_lock);
+    message = message_slot(&dropped);
+    if (!message) {
+        pthread_rwlock_unlock(&index_lock);
+        generation_free(&dropped);
+        return;
+    }
+    message->time = time(NULL);
+    message->from = strdup(from);
+    message->to = to ? strdup(to) : NULL;
+    message->text = strdup(text);
+    if (!message->from || !message->text || (to && !message->to)) {
+        free(message->from);
+        free(message->to);
+        free(message->text);
+        pthread_rwlock_unlock(&index_lock);
+        generation_free(&dropped);
+        return;
+    }
+    index_terms(&newer, newer.message_count++, message->text);
+    pthread_rwlock_unlock(&index_lock);
+    generation_free(&dropped);
+}
+
+/**
+ * @brief Compares two posting lists by length, for sorting.
+ *
+ * @param a The first posting list pointer.
+ * @param b The second posting list pointer.
+ * @return int The comparison result.
+ */
+static int compare_lists(const void *a, const void *b) {
+    const posting_list_t *first = *(const posting_list_t *const *)a;
+    const posting_list_t *second = *(const posting_list_t *const *)b;
+
+    return (first->count > second->count) - (first->count < second->count);
+}
+
+/**
+ * @brief Finds the first message sent at or after a time.
+ *
+ * Message times never decrease with their IDs. Must be called with the index lock held.
+ *
+ * @param generation The generation of the history to look in.
+ * @param since The time.
+ * @return uint32_t The ID of the message in its generation, or the number of messages of the
+ *         generation if there is none.
+ */
+static uint32_t first_message_since(const generation_t *generation, time_t since) {
+    uint32_t low = 0;
+    uint32_t high = generation->message_count;
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (generation->messages[middle].time < since) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Searches one generation of the history, from its most recent message.
+ *
+ * Must be called with the index lock held.
+ *
+ * @param generation The generation.
+ * @param query The query.
+ * @param query_terms The distinct terms of the query.
+ * @param count The number of terms.
+ * @param emit Called for each match while the results have room for it.
+ * @param arg The argument passed to `emit`.
+ * @param progress The matches counted and emitted so far, updated.
+ *
+ * @return void
+ */
+static void search_generation(generation_t *generation, const search_query_t *query,
+                              char query_terms[][SEARCH_MAX_TERM_LENGTH + 1], int count,
+                              void (*emit)(const search_hit_t *hit, void *arg), void *arg,
+                              search_progress_t *progress) {
+    posting_list_t *lists[SEARCH_MAX_TERMS];
+    uint32_t *ids = NULL;
+    uint32_t *other = NULL;
+    uint32_t id_count;
+    uint32_t first_id = 0;
+    uint32_t last_id;
+
+    for (int i = 0; i < count; ++i) {
+        lists[i] = generation->term_capacity ? term_slot(generation, query_terms[i]) : NULL;
+        if (!lists[i] || !lists[i]->term) {
+            return;
+        }
+    }
+    qsort(lists, (size_t)count, sizeof(lists[0]), compare_lists);
+
+    // Intersect the posting lists, starting with the shortest.
+    id_count = lists[0]->count;
+    ids = malloc(id_count * sizeof(uint32_t));
+    other = count > 1 ? malloc(lists[count - 1]->count * sizeof(uint32_t)) : NULL;
+    if (!ids || (count > 1 && !other)) {
+        free(ids);
+        free(other);
+        return;
+    }
+    postings_decode(lists[0], ids);
+    for (int i = 1; i < count && id_count > 0; ++i) {
+        uint32_t kept = 0;
+        uint32_t j = 0;
+
+        postings_decode(lists[i], other);
+        for (uint32_t k = 0; k < id_count && j < lists[i]->count; ++k) {
+            while (j < lists[i]->count && other[j] < ids[k]) {
+                j++;
+            }
+            if (j < lists[i]->count && other[j] == ids[k]) {
+                ids[kept++] = ids[k];
+            }
+        }
+        id_count = kept;
+    }
+
+    if (query->since) {
+        first_id = first_message_since(generation, query->since);
+    }
+    last_id = query->until ? first_message_since(generation, query->until + 1) : generation->message_count;
+
+    for (uint32_t k = id_count; k-- > 0;) {
+        uint32_t id = ids[k];
+        const indexed_message_t *message = &generation->messages[id];
+        size_t size;
+
+        if (id < first_id) {
+            break;
+        }
+        if (id >= last_id || (query->from && strcmp(message->from, query->from) != 0)) {
+            continue;
+        }
+        if (message->to && strcmp(message->from, query->requester) != 0 && strcmp(message->to, query->requester) != 0) {
+            continue;
+        }
+        progress->total++;
+        if (progress->full || progress->emitted == query->limit) {
+            continue;
+        }
+        size = strlen(message->from) + (message->to ? strlen(message->to) : 0) + strlen(message->text);
+        if (progress->emitted > 0 && progress->bytes + size > SEARCH_MAX_RESULT_BYTES) {
+            progress->full = 1;
+            continue;
+        }
+        search_hit_t hit = { generation->first_id + id, message->time, message->from, message->to, message->text };
+        emit(&hit, arg);
+        progress->emitted++;
+        progress->bytes += size;
+    }
+
+    free(ids);
+    free(other);
+}
+
+/**
+ * @brief Searches the history.
+ *
+ * The messages containing every term of the query are visited from the most recent one.
+ * Messages outside the time range, not sent by the requested sender, or private messages
+ * the requester neither sent nor received are skipped; the others are counted, and the
+ * first `limit` of them are passed to `emit` while the index is locked. The results stop
+ * early when their sender, recipient and text would exceed SEARCH_MAX_RESULT_BYTES.
+ *
+ * @param query The query.
+ * @param emit Called for each of the most recent matches.
+ * @param arg The argument passed to `emit`.
+ *
+ * @return long The number of matches, or -1 if the query holds no term.
+ */
+long search_run(const search_query_t *query, void (*emit)(const search_hit_t *hit, void *arg), void *arg) {
+    char query_terms[SEARCH_MAX_TERMS][SEARCH_MAX_TERM_LENGTH + 1];
+    const char *cursor = query->query;
+    search_progress_t progress = { 0 };
+    int count = 0;
+
+    while (count < SEARCH_MAX_TERMS && next_term(&cursor, query_terms[count])) {
+        int duplicate = 0;
+        for (int i = 0; i < count; ++i) {
+            duplicate |= strcmp(query_terms[i], query_terms[count]) == 0;
+        }
+        if (!duplicate) {
+            count++;
+        }
+    }
+    if (count == 0) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&index_lock);
+    search_generation(&newer, query, query_terms, count, emit, arg, &progress);
+    search_generation(&older, query, query_terms, count, emit, arg, &progress);
+    pthread_rwlock_unlock(&index_lock);
+
+    return progress.total;
+}
+
+/**
+ * @brief Appends the messages indexed since the last snapshot to the snapshot file.
+ *
+ * Only the new messages are serialized under the read lock. The whole history is written
+ * instead when it was shortened since the last snapshot, or when the file may not match it,
+ * to a temporary file that replaces the snapshot so a crash never leaves a partial one
+ * behind.
+ *
+ * @return int 0 on success or if there is nothing to write, -1 on failure.
+ */
+int search_snapshot(void) {
+    char temporary_path[sizeof(snapshot_path) + 4];
+    unsigned char header[16];
+    char *buffer = NULL;
+    size_t buffer_length = 0;
+    uint32_t count;
+    uint32_t epoch;
+    int rewrite;
+    FILE *memory;
+    FILE *file;
+    int result = 0;
+
+    if (!snapshot_path[0]) {
+        return 0;
+    }
+    memory = open_memstream(&buffer, &buffer_length);
+    if (!memory) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&index_lock);
+    count = older.message_count + newer.message_count;
+    epoch = history_epoch;
+    rewrite = !snapshot_valid || snapshot_epoch != epoch;
+    if (!rewrite && count == snapshot_count) {
+        pthread_rwlock_unlock(&index_lock);
+        fclose(memory);
+        free(buffer);
+        return 0;
+    }
+    if (rewrite) {
+        memcpy(header, SNAPSHOT_MAGIC, 4);
+        put_be(header + 4, SNAPSHOT_VERSION, 4);
+        fwrite(header, 1, 8, memory);
+    }
+    for (uint32_t i = rewrite ? 0 : snapshot_count; i < count; ++i) {
+        const indexed_message_t *message = history_message(i);
+        size_t from_length = strlen(message->from);
+        size_t to_length = message->to ? strlen(message->to) : 0;
+        size_t text_length = strlen(message->text);
+
+        put_be(header, (uint64_t)message->time, 8);
+        put_be(header + 8, from_length, 2);
+        put_be(header + 10, to_length, 2);
+        put_be(header + 12, text_length, 4);
+        fwrite(header, 1, 16, memory);
+        fwrite(message->from, 1, from_length, memory);
+        fwrite(message->to ? message->to : "", 1, to_length, memory);
+        fwrite(message->text, 1, text_length, memory);
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    if (fclose(memory) != 0) {
+        free(buffer);
+        return -1;
+    }
+
+    if (rewrite) {
+        snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", snapshot_path);
+        file = fopen(temporary_path, "wb");
+        if (!file || fwrite(buffer, 1, buffer_length, file) != buffer_length || fclose(file) != 0 ||
+            rename(temporary_path, snapshot_path) < 0) {
+            perror("ERROR: write search snapshot failed");
+            result = -1;
+        }
+    } else {
+        file = fopen(snapshot_path, "ab");
+        if (!file || fwrite(buffer, 1, buffer_length, file) != buffer_length || fclose(file) != 0) {
+            perror("ERROR: append to search snapshot failed");
+            result = -1;
+        }
+    }
+    // After a failed append, the end of the file is unknown: the next snapshot rewrites it.
+    snapshot_valid = result == 0;
+    snapshot_epoch = epoch;
+    snapshot_count = count;
+    free(buffer);
+    return result;
+}
+
+/**
+ * @brief Reads a string of known length from the snapshot.
+ *
+ * @param file The snapshot file.
+ * @param length The length of the string.
+ * @return char* The null-terminated string, or NULL on failure.
+ */
+static char *read_string(FILE *file, size_t length) {
+    char *string = malloc(length + 1);
+
+    if (string && fread(string, 1, length, file) != length) {
+        free(string);
+        return NULL;
+    }
+    if (string) {
+        string[length] = '\0';
+    }
+    return string;
+}
+
+/**
+ * @brief Loads the snapshot file into the empty index.
+ *
+ * Loading stops at the first message cut short, like the last one written before a crash.
+ *
+ * @param file The snapshot file.
+ * @param valid_length Receives the length of the file up to the end of its last complete
+ *        message.
+ *
+ * @return int 0 on success, -1 if the snapshot is invalid.
+ */
+static int search_load(FILE *file, long *valid_length) {
+    unsigned char header[16];
+
+    if (fread(header, 1, 8, file) != 8 || memcmp(header, SNAPSHOT_MAGIC, 4) != 0 ||
+        get_be(header + 4, 4) != SNAPSHOT_VERSION) {
+        return -1;
+    }
+    *valid_length = 8;
+
+    while (fread(header, 1, 16, file) == 16) {
+        generation_t dropped = { 0 };
+        indexed_message_t *message;
+        size_t to_length = get_be(header + 10, 2);
+        char *from = read_string(file, get_be(header + 8, 2));
+        char *to = to_length ? read_string(file, to_length) : NULL;
+        char *text = read_string(file, get_be(header + 12, 4));
+
+        if (!from || !text || (to_length && !to) || !(message = message_slot(&dropped))) {
+            free(from);
+            free(to);
+            free(text);
+            generation_free(&dropped);
+            break;
+        }
+        generation_free(&dropped);
+        message->time = (time_t)get_be(header, 8);
+        message->from = from;
+        message->to = to;
+        message->text = text;
+        index_terms(&newer, newer.message_count++, text);
+        *valid_length = ftell(file);
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a snapshot every SEARCH_SNAPSHOT_INTERVAL seconds.
+ *
+ * @param arg Unused.
+ *
+ * @return void* Never returns.
+ */
+static void *search_snapshot_loop(void *arg) {
+    (void)arg;
+
+    while (1) {
+        sleep(SEARCH_SNAPSHOT_INTERVAL);
+        search_snapshot();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Prepares the index, loading the snapshot file if there is one.
+ *
+ * An invalid snapshot is ignored, and the index starts empty.
+ *
+ * @param path The snapshot file, or NULL to keep the index in memory only.
+ *
+ * @return int 0 on success, -1 if the snapshot thread could not be started.
+ */
+int search_init(const char *path) {
+    pthread_t tid;
+    FILE *file;
+
+    if (!path) {
+        return 0;
+    }
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s", path);
+
+    file = fopen(path, "rb");
+    if (file) {
+        long valid_length = 0;
+
+        if (search_load(file, &valid_length) == 0) {
+            printf("Search index loaded %u message(s) and %u term(s) from %s\n",
+                   older.message_count + newer.message_count, older.term_count + newer.term_count, path);
+            // Drop a message cut short, so the next snapshot appends after the last whole one.
+            if (truncate(path, valid_length) == 0) {
+                snapshot_valid = 1;
+                snapshot_count = older.message_count + newer.message_count;
+            }
+        } else {
+            printf("Ignoring invalid search snapshot %s\n", path);
+        }
+        fclose(file);
+    }
+
+    if (pthread_create(&tid, NULL, search_snapshot_loop, NULL) != 0) {
+        perror("ERROR: pthread_create search snapshot failed");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
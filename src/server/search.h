@@ -0,0 +1,55 @@
+/**
+ * @file search.h
+ * @brief Inverted index over the chat history, answering SEARCH requests.
+ *
+ * Every public and private message is kept and its text split into lower-cased terms. Each
+ * term maps to a posting list of the IDs of the messages containing it, stored as varint
+ * deltas since IDs only grow. A search intersects the posting lists of its terms, narrows
+ * the result to a time range by binary search over the message times, and returns the most
+ * recent matches the requesting user is allowed to see: public messages, and private
+ * messages the user sent or received. The matches returned hold SEARCH_MAX_RESULT_BYTES of
+ * senders, recipients and texts at most, so a result always fits in a response.
+ *
+ * The history keeps the last SEARCH_MAX_MESSAGES messages at most. It can be saved to a
+ * snapshot file, to which the new messages are appended every SEARCH_SNAPSHOT_INTERVAL
+ * seconds, and which is loaded and indexed again at startup.
+ */
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SEARCH_MAX_TERMS 8
+#define SEARCH_MAX_TERM_LENGTH 64
+#define SEARCH_DEFAULT_LIMIT 20
+#define SEARCH_MAX_LIMIT 100
+#define SEARCH_MAX_RESULT_BYTES (64 * 1024)
+#define SEARCH_INITIAL_TERMS 4096
+#define SEARCH_MAX_MESSAGES (1024 * 1024)
+#define SEARCH_SNAPSHOT_INTERVAL 60
+
+typedef struct {
+    uint32_t id;
+    time_t time;
+    const char *from;
+    const char *to;
+    const char *text;
+} search_hit_t;
+
+typedef struct {
+    const char *query;
+    const char *requester;
+    const char *from;
+    time_t since;
+    time_t until;
+    int limit;
+} search_query_t;
+
+int search_init(const char *snapshot_path);
+void search_index_message(const char *from, const char *to, const char *text);
+long search_run(const search_query_t *query, void (*emit)(const search_hit_t *hit, void *arg), void *arg);
+int search_snapshot(void);
+
+#endif // SEARCH_H
@@ -0,0 +1,202 @@
+/**
+ * @file session.c
+ * @brief Implements the sequence numbering and retransmit buffer of resumable sessions.
+ *
+ * The retransmit buffer is a ring of the last SESSION_BUFFER_SIZE unacknowledged messages,
+ * already stamped with their sequence number. When it is full, the oldest message is dropped
+ * and a client resuming from before it sees a jump in the sequence numbers. Sessions are not
+ * locked here: they are only used under the send lock of the client owning them.
+ */
+#include "session.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief Fills a session token with random hex digits.
+ *
+ * @param token The buffer of SESSION_TOKEN_BYTES * 2 + 1 bytes receiving the token.
+ *
+ * @return void
+ */
+static void session_generate_token(char *token) {
+    unsigned char bytes[SESSION_TOKEN_BYTES];
+    FILE *random = fopen("/dev/urandom", "rb");
+
+    if (!random || fread(bytes, 1, sizeof(bytes), random) != sizeof(bytes)) {
+        srand((unsigned int)time(NULL) ^ (unsigned int)(size_t)token);
+        for (int i = 0; i < SESSION_TOKEN_BYTES; ++i) {
+            bytes[i] = (unsigned char)rand();
+        }
+    }
+    if (random) {
+        fclose(random);
+    }
+    for (int i = 0; i < SESSION_TOKEN_BYTES; ++i) {
+        sprintf(token + i * 2, "%02x", bytes[i]);
+    }
+}
+
+/**
+ * @brief Creates a session with a new token.
+ *
+ * @return session_t* The session, or NULL on allocation failure.
+ */
+session_t *session_create(void) {
+    session_t *session = calloc(1, sizeof(session_t));
+
+    if (session) {
+        session_generate_token(session->token);
+        session->next_seq = 1;
+    }
+    return session;
+}
+
+/**
+ * @brief Recreates a session saved in a snapshot, with an empty retransmit buffer.
+ *
+ * The session is flagged as restored until its client acknowledges a message, which lets
+ * that first acknowledgement move the numbering forward.
+ *
+ * @param token The token of the saved session.
+ * @param next_seq The sequence number of the next message.
+ *
+ * @return session_t* The session, or NULL on allocation failure.
+ */
+session_t *session_restore(const char *token, unsigned long next_seq) {
+    session_t *session = calloc(1, sizeof(session_t));
+
+    if (session) {
+        memcpy(session->token, token, sizeof(session->token) - 1);
+        session->next_seq = next_seq ? next_seq : 1;
+        session->restored = 1;
+    }
+    return session;
+}
+
+/**
+ * @brief Frees a session and its retransmit buffer.
+ *
+ * @param session The session, or NULL.
+ *
+ * @return void
+ */
+void session_destroy(session_t *session) {
+    if (!session) {
+        return;
+    }
+    session_ack(session, session->next_seq - 1);
+    free(session);
+}
+
+/**
+ * @brief Numbers an outbound message and keeps it for retransmission.
+ *
+ * The message must be a JSON object; the sequence number is added as its first field.
+ *
+ * @param session The session of the recipient.
+ * @param message The JSON message.
+ * @param length The length of the message in bytes.
+ *
+ * @return const session_entry_t* The stamped message, owned by the session, or NULL on
+ *         allocation failure.
+ */
+const session_entry_t *session_stamp(session_t *session, const char *message, size_t length) {
+    char prefix[32];
+    int prefix_length;
+    session_entry_t *entry;
+    char *stamped;
+
+    if (length < 2 || message[0] != '{') {
+        return NULL;
+    }
+    prefix_length = snprintf(prefix, sizeof(prefix), message[1] == '}' ? "{\"seq\":%lu" : "{\"seq\":%lu,",
+                             session->next_seq);
+    stamped = malloc((size_t)prefix_length + length);
+    if (!stamped) {
+        return NULL;
+    }
+    memcpy(stamped, prefix, (size_t)prefix_length);
+    memcpy(stamped + prefix_length, message + 1, length - 1);
+    stamped[prefix_length + length - 1] = '\0';
+
+    if (session->count == SESSION_BUFFER_SIZE) {
+        free(session->entries[session->first].message);
+        session->first = (session->first + 1) % SESSION_BUFFER_SIZE;
+        session->count--;
+    }
+    entry = &session->entries[(session->first + session->count) % SESSION_BUFFER_SIZE];
+    entry->seq = session->next_seq++;
+    entry->message = stamped;
+    entry->length = (size_t)prefix_length + length - 1;
+    session->count++;
+    return entry;
+}
+
+/**
+ * @brief Drops the messages a client acknowledged from the retransmit buffer.
+ *
+ * A client of a session restored from a snapshot may have received messages numbered after
+ * the snapshot; the first acknowledgement of a restored session continues the numbering
+ * after them, so the client does not discard new messages as duplicates. Any other
+ * acknowledgement of a message that was never sent is ignored.
+ *
+ * @param session The session of the client.
+ * @param seq The highest sequence number the client received.
+ *
+ * @return void
+ */
+void session_ack(session_t *session, unsigned long seq) {
+    if (seq >= session->next_seq) {
+        if (!session->restored || seq == ULONG_MAX) {
+            return;
+        }
+        session->next_seq = seq + 1;
+    }
+    session->restored = 0;
+    while (session->count > 0 && session->entries[session->first].seq <= seq) {
+        free(session->entries[session->first].message);
+        session->entries[session->first].message = NULL;
+        session->first = (session->first + 1) % SESSION_BUFFER_SIZE;
+        session->count--;
+    }
+}
+
+/**
+ * @brief Counts the messages that follow a sequence number but are no longer buffered.
+ *
+ * Messages are missing when the retransmit buffer overflowed, or when the session was
+ * restored from a snapshot, whose buffer starts empty.
+ *
+ * @param session The session being resumed.
+ * @param after The highest sequence number the client received.
+ * @return unsigned long The number of messages session_replay can't write again.
+ */
+unsigned long session_missed(const session_t *session, unsigned long after) {
+    unsigned long first = session->count > 0 ? session->entries[session->first].seq : session->next_seq;
+
+    return after + 1 < first ? first - after - 1 : 0;
+}
+
+/**
+ * @brief Writes the buffered messages that follow a sequence number again.
+ *
+ * @param session The session being resumed.
+ * @param after The highest sequence number the client received.
+ * @param write Writes one message to the client.
+ * @param arg The argument passed to `write`.
+ *
+ * @return int 0 on success, -1 if a write failed.
+ */
+int session_replay(session_t *session, unsigned long after,
+                   int (*write)(void *arg, const char *message, size_t length), void *arg) {
+    for (int i = 0; i < session->count; ++i) {
+        const session_entry_t *entry = &session->entries[(session->first + i) % SESSION_BUFFER_SIZE];
+        if (entry->seq > after && write(arg, entry->message, entry->length) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
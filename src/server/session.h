@@ -0,0 +1,44 @@
+/**
+ * @file session.h
+ * @brief Resumable sessions: sequence numbers and the retransmit buffer of a client.
+ *
+ * A client that asks for a resumable session at IDENTIFY receives a session token, and every
+ * message sent to it afterwards carries a `seq` field numbering it from 1. Sent messages are
+ * kept in a bounded retransmit buffer until the client acknowledges them with an ACK. When
+ * the connection drops, the session survives for SESSION_LINGER seconds, and a new connection
+ * presenting the token with RESUME takes it over and receives the unacknowledged tail again.
+ */
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+
+#define SESSION_TOKEN_BYTES 16
+#define SESSION_BUFFER_SIZE 256
+#define SESSION_LINGER 120
+
+typedef struct {
+    unsigned long seq;
+    char *message;
+    size_t length;
+} session_entry_t;
+
+typedef struct {
+    char token[SESSION_TOKEN_BYTES * 2 + 1];
+    unsigned long next_seq;
+    session_entry_t entries[SESSION_BUFFER_SIZE];
+    int first;
+    int count;
+    int restored;
+} session_t;
+
+session_t *session_create(void);
+session_t *session_restore(const char *token, unsigned long next_seq);
+void session_destroy(session_t *session);
+const session_entry_t *session_stamp(session_t *session, const char *message, size_t length);
+void session_ack(session_t *session, unsigned long seq);
+unsigned long session_missed(const session_t *session, unsigned long after);
+int session_replay(session_t *session, unsigned long after,
+                   int (*write)(void *arg, const char *message, size_t length), void *arg);
+
+#endif // SESSION_H
@@ -0,0 +1,310 @@
+/**
+ * @file snapshot.c
+ * @brief Implements the snapshot of the resumable sessions.
+ *
+ * The snapshot file starts with a header holding the magic "CHSS", a version, the size of a
+ * record, the number of records and the time the snapshot was written, followed by the
+ * records. Records have a fixed size and hold fixed-size, null-terminated strings, so the
+ * file is loaded by mapping it and walking the records, without parsing anything. Integers
+ * are in the byte order of the host: a file written by a host of the other order fails the
+ * version check and is ignored.
+ */
+#include "snapshot.h"
+#include "client_manager.h"
+#include "cluster.h"
+#include "messaging.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "CHSS"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t count;
+    int64_t written_at;
+} snapshot_header_t;
+
+typedef struct {
+    uint64_t next_seq;
+    int32_t id;
+    char user_name[32];
+    char status[16];
+    char token[SESSION_TOKEN_BYTES * 2 + 1];
+    char reserved[3];
+} snapshot_record_t;
+
+static char snapshot_path[1024] = "";
+static client_t **restored = NULL;
+static uint32_t restored_count = 0;
+
+/**
+ * @brief Writes the sessions of all clients to the snapshot file.
+ *
+ * The records are gathered in memory with the client list locked, then written to a
+ * temporary file that replaces the snapshot, so a crash never leaves a partial snapshot
+ * behind.
+ *
+ * @return int 0 on success or without a snapshot file, -1 on failure.
+ */
+int snapshot_write(void) {
+    char temporary_path[sizeof(snapshot_path) + 4];
+    snapshot_header_t *header;
+    snapshot_record_t *records;
+    uint32_t count = 0;
+    size_t size;
+    FILE *file;
+    int result = 0;
+
+    if (!snapshot_path[0]) {
+        return 0;
+    }
+    header = calloc(1, sizeof(snapshot_header_t) + sizeof(snapshot_record_t) * MAX_CLIENTS);
+    if (!header) {
+        perror("ERROR: calloc failed");
+        return -1;
+    }
+    records = (snapshot_record_t *)(header + 1);
+
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        client_t *client = clients[i];
+
+        if (!client || client->is_gateway || client->gateway) {
+            continue;
+        }
+        pthread_mutex_lock(&client->send_mutex);
+        if (client->session && client->user_name[0]) {
+            snapshot_record_t *record = &records[count++];
+
+            record->next_seq = client->session->next_seq;
+            record->id = client->id;
+            memcpy(record->user_name, client->user_name, sizeof(record->user_name));
+            memcpy(record->status, client->status, sizeof(record->status));
+            memcpy(record->token, client->session->token, sizeof(record->token));
+        }
+        pthread_mutex_unlock(&client->send_mutex);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+
+    memcpy(header->magic, SNAPSHOT_MAGIC, 4);
+    header->version = SNAPSHOT_VERSION;
+    header->record_size = sizeof(snapshot_record_t);
+    header->count = count;
+    header->written_at = (int64_t)time(NULL);
+    size = sizeof(snapshot_header_t) + sizeof(snapshot_record_t) * count;
+
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", snapshot_path);
+    file = fopen(temporary_path, "wb");
+    if (!file || fwrite(header, 1, size, file) != size || fclose(file) != 0 ||
+        rename(temporary_path, snapshot_path) < 0) {
+        perror("ERROR: write session snapshot failed");
+        result = -1;
+    }
+    free(header);
+    return result;
+}
+
+/**
+ * @brief Turns a record of the snapshot into a detached client holding its session.
+ *
+ * The username is claimed again, like at IDENTIFY, and records with invalid strings or a
+ * username that is already taken are skipped.
+ *
+ * @param record The record.
+ *
+ * @return client_t* The detached client, or NULL if the record was skipped.
+ */
+static client_t *restore_client(const snapshot_record_t *record) {
+    client_t *client;
+
+    if (!memchr(record->user_name, '\0', sizeof(record->user_name)) || !record->user_name[0] ||
+        !memchr(record->status, '\0', sizeof(record->status)) ||
+        strnlen(record->token, sizeof(record->token)) != sizeof(record->token) - 1) {
+        return NULL;
+    }
+    if (is_username_taken(record->user_name) || cluster_claim_username(record->user_name, record->status) < 0) {
+        printf("Not restoring the session of %s, the username is taken\n", record->user_name);
+        return NULL;
+    }
+
+    client = calloc(1, sizeof(client_t));
+    if (!client) {
+        perror("ERROR: calloc failed");
+        cluster_publish_leave(record->user_name);
+        return NULL;
+    }
+    client->sockfd = -1;
+    client->id = record->id;
+    client->compression = COMPRESSION_NONE;
+    client->references = 1;
+    pthread_mutex_init(&client->send_mutex, NULL);
+    pthread_cond_init(&client->resume_cond, NULL);
+    strcpy(client->user_name, record->user_name);
+    strcpy(client->status, record->status);
+    client->session = session_restore(record->token, (unsigned long)record->next_seq);
+    if (!client->session || add_client(client) < 0) {
+        cluster_publish_leave(record->user_name);
+        release_client(client);
+        return NULL;
+    }
+    reserve_client_id(client->id);
+    return client;
+}
+
+/**
+ * @brief Restores the sessions saved in the snapshot file.
+ *
+ * A snapshot older than SESSION_LINGER seconds is ignored, since its sessions would have
+ * expired had the server kept running.
+ *
+ * @param path The snapshot file.
+ *
+ * @return int 0 on success or if there is no recent snapshot, -1 if the snapshot is invalid.
+ */
+static int snapshot_load(const char *path) {
+    const snapshot_header_t *header;
+    const snapshot_record_t *records;
+    struct stat file_stat;
+    void *map;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &file_stat) < 0 || (size_t)file_stat.st_size < sizeof(snapshot_header_t)) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("ERROR: mmap failed");
+        return -1;
+    }
+
+    header = (const snapshot_header_t *)map;
+    records = (const snapshot_record_t *)(header + 1);
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 4) != 0 || header->version != SNAPSHOT_VERSION ||
+        header->record_size != sizeof(snapshot_record_t) || header->count > MAX_CLIENTS ||
+        (size_t)file_stat.st_size != sizeof(snapshot_header_t) + sizeof(snapshot_record_t) * header->count) {
+        munmap(map, (size_t)file_stat.st_size);
+        return -1;
+    }
+    if ((int64_t)time(NULL) - header->written_at > SESSION_LINGER) {
+        printf("Ignoring the session snapshot %s, its sessions have expired\n", path);
+        munmap(map, (size_t)file_stat.st_size);
+        return 0;
+    }
+
+    restored = calloc(header->count ? header->count : 1, sizeof(client_t *));
+    if (!restored) {
+        perror("ERROR: calloc failed");
+        munmap(map, (size_t)file_stat.st_size);
+        return 0;
+    }
+    for (uint32_t i = 0; i < header->count; ++i) {
+        client_t *client = restore_client(&records[i]);
+
+        if (client) {
+            restored[restored_count++] = client;
+        }
+    }
+    printf("Restored %u of %u session(s) from %s\n", restored_count, header->count, path);
+    munmap(map, (size_t)file_stat.st_size);
+    return 0;
+}
+
+/**
+ * @brief Expires the restored sessions nobody resumed, SESSION_LINGER seconds after startup.
+ *
+ * Restored clients have no handler thread, so their entries are freed here too, once the
+ * last thread sending them a message drops its reference.
+ *
+ * @param arg Unused.
+ *
+ * @return void* Always NULL.
+ */
+static void *snapshot_expire_loop(void *arg) {
+    (void)arg;
+
+    sleep(SESSION_LINGER);
+    for (uint32_t i = 0; i < restored_count; ++i) {
+        client_t *client = restored[i];
+
+        pthread_mutex_lock(&client->send_mutex);
+        session_destroy(client->session);
+        client->session = NULL;
+        pthread_mutex_unlock(&client->send_mutex);
+        if (remove_client(client->id)) {
+            release_client(client);
+        }
+    }
+    free(restored);
+    restored = NULL;
+    restored_count = 0;
+    return NULL;
+}
+
+/**
+ * @brief Writes a snapshot every SNAPSHOT_INTERVAL seconds.
+ *
+ * @param arg Unused.
+ *
+ * @return void* Never returns.
+ */
+static void *snapshot_loop(void *arg) {
+    (void)arg;
+
+    while (1) {
+        sleep(SNAPSHOT_INTERVAL);
+        snapshot_write();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Restores the sessions of the snapshot file, if there is one, and starts writing it.
+ *
+ * Called before the server accepts its first connection. An invalid snapshot is ignored.
+ *
+ * @param path The snapshot file, or NULL to keep sessions in memory only.
+ *
+ * @return int 0 on success, -1 if a thread could not be started.
+ */
+int snapshot_init(const char *path) {
+    pthread_t tid;
+
+    if (!path) {
+        return 0;
+    }
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s", path);
+
+    if (snapshot_load(path) < 0) {
+        printf("Ignoring invalid session snapshot %s\n", path);
+    }
+    if (restored_count > 0) {
+        if (pthread_create(&tid, NULL, snapshot_expire_loop, NULL) != 0) {
+            perror("ERROR: pthread_create session expiry failed");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+
+    if (pthread_create(&tid, NULL, snapshot_loop, NULL) != 0) {
+        perror("ERROR: pthread_create session snapshot failed");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,21 @@
+/**
+ * @file snapshot.h
+ * @brief Snapshot of the resumable sessions, so clients can resume them after a restart.
+ *
+ * Every SNAPSHOT_INTERVAL seconds, the ID, username, status, session token and next sequence
+ * number of every client with a resumable session, connected or lingering, are written to
+ * the snapshot file as fixed-size records. At startup, the file is mapped into memory and
+ * each record becomes a detached client holding its session, exactly as if its connection
+ * had just dropped. Reconnecting clients then resume their sessions with RESUME, keeping
+ * their status and without announcing themselves again, and sessions nobody resumes expire
+ * after SESSION_LINGER seconds.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#define SNAPSHOT_INTERVAL 5
+
+int snapshot_init(const char *path);
+int snapshot_write(void);
+
+#endif // SNAPSHOT_H
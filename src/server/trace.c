@@ -0,0 +1,294 @@
+/**
+ * @file trace.c
+ * @brief Implements the sampled per-message tracing and its Chrome trace-event export.
+ *
+ * Each thread records into its own ring buffer, taken from a shared pool the first time the
+ * thread records a span. When the thread exits its buffer goes back to the pool with its
+ * events, so they can still be dumped until another thread reuses it. Every buffer has its
+ * own lock, which is only contended while a dump copies the buffer out.
+ */
+#include "trace.h"
+#include "../common/clock.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct {
+    const char *name;
+    unsigned long long trace_id;
+    unsigned long long start;
+    unsigned long long duration;
+    int thread_id;
+    int client_id;
+} trace_event_t;
+
+typedef struct trace_buffer {
+    trace_event_t events[TRACE_THREAD_EVENTS];
+    unsigned long long count;
+    int in_use;
+    pthread_mutex_t mutex;
+    struct trace_buffer *next;
+} trace_buffer_t;
+
+static int sample_rate = 0;
+static char trace_path[1024] = TRACE_DEFAULT_FILE;
+static trace_buffer_t *buffers = NULL;
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t buffer_key;
+static _Atomic unsigned long long next_trace_id = 1;
+static __thread trace_buffer_t *thread_buffer = NULL;
+static __thread unsigned long long current_trace = 0;
+static __thread int countdown = 0;
+static __thread int thread_id = 0;
+
+/**
+ * @brief Tells whether tracing is enabled.
+ *
+ * @return int Non-zero if messages are sampled.
+ */
+int trace_enabled(void) {
+    return sample_rate > 0;
+}
+
+/**
+ * @brief Returns the buffer of an exiting thread to the pool.
+ *
+ * @param buffer The buffer of the thread.
+ *
+ * @return void
+ */
+static void release_buffer(void *buffer) {
+    pthread_mutex_lock(&buffers_mutex);
+    ((trace_buffer_t *)buffer)->in_use = 0;
+    pthread_mutex_unlock(&buffers_mutex);
+}
+
+/**
+ * @brief Gives the calling thread a buffer, reusing one released by an exited thread.
+ *
+ * @return trace_buffer_t* The buffer, or NULL on allocation failure.
+ */
+static trace_buffer_t *acquire_buffer(void) {
+    trace_buffer_t *buffer;
+
+    pthread_mutex_lock(&buffers_mutex);
+    for (buffer = buffers; buffer && buffer->in_use; buffer = buffer->next) {
+    }
+    if (!buffer) {
+        buffer = calloc(1, sizeof(trace_buffer_t));
+        if (!buffer) {
+            pthread_mutex_unlock(&buffers_mutex);
+            return NULL;
+        }
+        pthread_mutex_init(&buffer->mutex, NULL);
+        buffer->next = buffers;
+        buffers = buffer;
+    }
+    buffer->in_use = 1;
+    pthread_mutex_unlock(&buffers_mutex);
+
+    pthread_setspecific(buffer_key, buffer);
+    thread_id = (int)syscall(SYS_gettid);
+    return buffer;
+}
+
+/**
+ * @brief Decides whether the message about to be processed by this thread is traced.
+ *
+ * A traced message is given a new trace ID, and the time it waited since it was received
+ * is recorded as its first span.
+ *
+ * @param received_at The time the bytes of the message were received, or 0 if unknown.
+ *
+ * @return void
+ */
+void trace_message_begin(unsigned long long received_at) {
+    if (sample_rate == 0 || countdown-- > 0) {
+        return;
+    }
+    countdown = sample_rate - 1;
+    current_trace = atomic_fetch_add_explicit(&next_trace_id, 1, memory_order_relaxed);
+    if (received_at) {
+        trace_end("receive", received_at, -1);
+    }
+}
+
+/**
+ * @brief Ends the trace of the message processed by this thread.
+ *
+ * @return void
+ */
+void trace_message_end(void) {
+    current_trace = 0;
+}
+
+/**
+ * @brief Starts a span of the message processed by this thread.
+ *
+ * @return unsigned long long The start time to pass to `trace_end`, or 0 if the message is
+ *         not traced.
+ */
+unsigned long long trace_start(void) {
+    return current_trace ? clock_monotonic_ns() : 0;
+}
+
+/**
+ * @brief Records a span of the message processed by this thread.
+ *
+ * @param name The name of the span, a string literal.
+ * @param start The value returned by `trace_start`; nothing is recorded if it is 0.
+ * @param client_id The client the span is about, or -1.
+ *
+ * @return void
+ */
+void trace_end(const char *name, unsigned long long start, int client_id) {
+    unsigned long long now;
+    trace_event_t *event;
+
+    if (!start || !current_trace) {
+        return;
+    }
+    now = clock_monotonic_ns();
+    if (!thread_buffer && !(thread_buffer = acquire_buffer())) {
+        return;
+    }
+
+    pthread_mutex_lock(&thread_buffer->mutex);
+    event = &thread_buffer->events[thread_buffer->count % TRACE_THREAD_EVENTS];
+    event->name = name;
+    event->trace_id = current_trace;
+    event->start = start;
+    event->duration = now - start;
+    event->thread_id = thread_id;
+    event->client_id = client_id;
+    thread_buffer->count++;
+    pthread_mutex_unlock(&thread_buffer->mutex);
+}
+
+/**
+ * @brief Writes the buffered spans to a file in the Chrome trace-event format.
+ *
+ * Each buffer is copied out under its lock and formatted afterwards, so threads keep
+ * recording while the file is written. The file is written under a temporary name and
+ * renamed, so a viewer never opens a partial trace.
+ *
+ * @param path The trace file.
+ *
+ * @return int The number of spans written, or -1 on failure.
+ */
+int trace_dump(const char *path) {
+    char temporary_path[sizeof(trace_path) + 4];
+    trace_event_t *events = malloc(sizeof(trace_event_t) * TRACE_THREAD_EVENTS);
+    int pid = (int)getpid();
+    int written = 0;
+    FILE *file;
+
+    if (!events) {
+        return -1;
+    }
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", path);
+    file = fopen(temporary_path, "w");
+    if (!file) {
+        perror("ERROR: open trace file failed");
+        free(events);
+        return -1;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    pthread_mutex_lock(&buffers_mutex);
+    for (trace_buffer_t *buffer = buffers; buffer; buffer = buffer->next) {
+        size_t count;
+
+        pthread_mutex_lock(&buffer->mutex);
+        count = buffer->count < TRACE_THREAD_EVENTS ? (size_t)buffer->count : TRACE_THREAD_EVENTS;
+        memcpy(events, buffer->events, count * sizeof(trace_event_t));
+        pthread_mutex_unlock(&buffer->mutex);
+
+        for (size_t i = 0; i < count; ++i) {
+            const trace_event_t *event = &events[i];
+            fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":%d,\"tid\":%d,\"args\":{\"trace_id\":%llu",
+                    written ? "," : "", event->name, event->start / 1000.0, event->duration / 1000.0, pid,
+                    event->thread_id, event->trace_id);
+            if (event->client_id >= 0) {
+                fprintf(file, ",\"client\":%d", event->client_id);
+            }
+            fprintf(file, "}}");
+            written++;
+        }
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+    fprintf(file, "\n]}\n");
+    free(events);
+
+    if (fclose(file) != 0 || rename(temporary_path, path) < 0) {
+        perror("ERROR: write trace file failed");
+        return -1;
+    }
+    return written;
+}
+
+/**
+ * @brief Writes the trace file every time the server receives SIGUSR1.
+ *
+ * @param arg The set holding SIGUSR1.
+ *
+ * @return void* Never returns.
+ */
+static void *trace_signal_loop(void *arg) {
+    sigset_t *signals = (sigset_t *)arg;
+    int signal_number;
+
+    while (1) {
+        if (sigwait(signals, &signal_number) == 0) {
+            int written = trace_dump(trace_path);
+            if (written >= 0) {
+                printf("Wrote %d trace span(s) to %s\n", written, trace_path);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Enables tracing and starts waiting for SIGUSR1.
+ *
+ * Must be called before any other thread is started, so that SIGUSR1 stays blocked in all
+ * of them and is only received by the trace thread.
+ *
+ * @param sample Trace one message in `sample` per handler thread, or 0 to disable tracing.
+ * @param path The trace file, or NULL for TRACE_DEFAULT_FILE.
+ *
+ * @return int 0 on success, -1 if the trace thread could not be started.
+ */
+int trace_init(int sample, const char *path) {
+    static sigset_t signals;
+    pthread_t tid;
+
+    if (sample <= 0) {
+        return 0;
+    }
+    if (path) {
+        snprintf(trace_path, sizeof(trace_path), "%s", path);
+    }
+    if (pthread_key_create(&buffer_key, release_buffer) != 0) {
+        perror("ERROR: pthread_key_create failed");
+        return -1;
+    }
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (pthread_create(&tid, NULL, trace_signal_loop, &signals) != 0) {
+        perror("ERROR: pthread_create trace failed");
+        return -1;
+    }
+    pthread_detach(tid);
+    sample_rate = sample;
+    return 0;
+}
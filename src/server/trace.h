@@ -0,0 +1,29 @@
+/**
+ * @file trace.h
+ * @brief Sampled per-message tracing, exported as Chrome trace-event JSON.
+ *
+ * One message in every `sample` received by a handler thread is given a trace ID, and the
+ * stages it goes through are timed as spans: its wait in the receive buffer, JSON parsing,
+ * dispatch, acquiring the client list lock, the broadcast fan-out and each message queued
+ * for, or written to, a recipient. Spans are recorded into per-thread ring buffers of
+ * TRACE_THREAD_EVENTS events, so recording never contends with other threads. Messages that
+ * are not sampled only cost a thread-local check per span.
+ *
+ * Sending SIGUSR1 to the server writes the buffered spans to the trace file, which can be
+ * opened in Perfetto or chrome://tracing.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#define TRACE_THREAD_EVENTS 4096
+#define TRACE_DEFAULT_FILE "trace.json"
+
+int trace_init(int sample, const char *path);
+int trace_enabled(void);
+void trace_message_begin(unsigned long long received_at);
+void trace_message_end(void);
+unsigned long long trace_start(void);
+void trace_end(const char *name, unsigned long long start, int client_id);
+int trace_dump(const char *path);
+
+#endif // TRACE_H
@@ -0,0 +1,755 @@
+/**
+ * @file transfer.c
+ * @brief Implements the file transfers staged in the spool directory.
+ *
+ * Spool files are kept in a list guarded by a mutex, each with an open descriptor. A chunk
+ * being uploaded or downloaded works on a duplicate of that descriptor, so the sweeper can
+ * close and unlink an expired file while a transfer still reads or writes it. Uploads are
+ * written in order: a chunk is only accepted at the offset where the previous one ended.
+ * The list also accounts for the offered sizes of its files, which are reserved against the
+ * spool size when a file is offered and released when it is deleted.
+ */
+#define _GNU_SOURCE
+#include "transfer.h"
+#include "messaging.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "utf8.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRANSFER_SUFFIX ".spool"
+
+typedef struct spool_file {
+    char id[TRANSFER_ID_BYTES * 2 + 1];
+    char name[TRANSFER_NAME_MAX];
+    char from[32];
+    char to[32];
+    unsigned long long size;
+    unsigned long long received;
+    int fd;
+    time_t created;
+    struct spool_file *next;
+} spool_file_t;
+
+struct transfer_upload {
+    char id[TRANSFER_ID_BYTES * 2 + 1];
+    int fd;
+    int failed;
+    int splice_unsupported;
+    int pipe[2];
+    unsigned long long offset;
+    unsigned long long length;
+    unsigned long long remaining;
+};
+
+static char spool_dir[1024] = "";
+static unsigned long long max_file_size = TRANSFER_DEFAULT_MAX_SIZE;
+static unsigned long long spool_size = TRANSFER_DEFAULT_SPOOL_SIZE;
+static spool_file_t *files = NULL;
+static unsigned long long spool_bytes = 0;
+static int file_count = 0;
+static pthread_mutex_t files_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Builds the path of a spool file.
+ *
+ * @param path The buffer receiving the path.
+ * @param size The size of the buffer.
+ * @param id The ID of the file.
+ *
+ * @return void
+ */
+static void spool_path(char *path, size_t size, const char *id) {
+    snprintf(path, size, "%s/%s%s", spool_dir, id, TRANSFER_SUFFIX);
+}
+
+/**
+ * @brief Fills a file ID with random hex digits.
+ *
+ * @param id The buffer of TRANSFER_ID_BYTES * 2 + 1 bytes receiving the ID.
+ *
+ * @return void
+ */
+static void generate_id(char *id) {
+    unsigned char bytes[TRANSFER_ID_BYTES];
+    FILE *random = fopen("/dev/urandom", "rb");
+
+    if (!random || fread(bytes, 1, sizeof(bytes), random) != sizeof(bytes)) {
+        srand((unsigned int)time(NULL) ^ (unsigned int)(size_t)id);
+        for (int i = 0; i < TRANSFER_ID_BYTES; ++i) {
+            bytes[i] = (unsigned char)rand();
+        }
+    }
+    if (random) {
+        fclose(random);
+    }
+    for (int i = 0; i < TRANSFER_ID_BYTES; ++i) {
+        sprintf(id + i * 2, "%02x", bytes[i]);
+    }
+}
+
+/**
+ * @brief Finds a spool file by ID. Called with the file list locked.
+ *
+ * @param id The ID of the file.
+ *
+ * @return spool_file_t* The file, or NULL if there is none with this ID.
+ */
+static spool_file_t *find_file_locked(const char *id) {
+    for (spool_file_t *file = files; file; file = file->next) {
+        if (strcmp(file->id, id) == 0) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Counts the uploads a user has in progress. Called with the file list locked.
+ *
+ * @param username The user.
+ *
+ * @return int The number of files offered by the user and not completely uploaded.
+ */
+static int count_offers_locked(const char *username) {
+    int count = 0;
+
+    for (spool_file_t *file = files; file; file = file->next) {
+        if (file->received < file->size && strcmp(file->from, username) == 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Unlinks a spool file, closes it and releases its share of the spool size.
+ *
+ * Called with the file list locked, once the file is out of the list.
+ *
+ * @param file The file.
+ *
+ * @return void
+ */
+static void delete_file_locked(spool_file_t *file) {
+    char path[sizeof(spool_dir) + 64];
+
+    spool_path(path, sizeof(path), file->id);
+    unlink(path);
+    close(file->fd);
+    spool_bytes -= file->size;
+    file_count--;
+    free(file);
+}
+
+/**
+ * @brief Answers a file transfer request.
+ *
+ * @param client The client to answer.
+ * @param operation The request type.
+ * @param result The result of the request.
+ * @param id The ID of the file, or NULL.
+ * @param field The name of a numeric field to add, or NULL.
+ * @param value The value of the numeric field.
+ *
+ * @return void
+ */
+static void send_file_response(client_t *client, const char *operation, const char *result, const char *id,
+                               const char *field, unsigned long long value) {
+    cJSON *json_response = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_response, "type", "RESPONSE");
+    cJSON_AddStringToObject(json_response, "operation", operation);
+    cJSON_AddStringToObject(json_response, "result", result);
+    if (id) {
+        cJSON_AddStringToObject(json_response, "id", id);
+    }
+    if (field) {
+        cJSON_AddNumberToObject(json_response, field, (double)value);
+    }
+    char *response_str = cJSON_PrintUnformatted(json_response);
+
+    if (send_to_client(client, response_str) < 0) {
+        perror("ERROR: write to descriptor failed");
+    }
+
+    free(response_str);
+    cJSON_Delete(json_response);
+}
+
+/**
+ * @brief Tells the recipients of a file that it was uploaded.
+ *
+ * A public file is announced to every local client but its uploader, a private file to its
+ * recipient if still connected.
+ *
+ * @param file A copy of the uploaded file's entry.
+ * @param uploader The client that uploaded the file.
+ *
+ * @return void
+ */
+static void announce_file(const spool_file_t *file, client_t *uploader) {
+    cJSON *json_file = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_file, "type", "FILE");
+    cJSON_AddStringToObject(json_file, "id", file->id);
+    cJSON_AddStringToObject(json_file, "name", file->name);
+    cJSON_AddNumberToObject(json_file, "size", (double)file->size);
+    cJSON_AddStringToObject(json_file, "username", file->from);
+    char *json_file_str = cJSON_PrintUnformatted(json_file);
+
+    if (file->to[0] == '\0') {
+        broadcast_message(json_file_str, uploader->id);
+    } else {
+        client_t *recipient = find_client_by_username(file->to);
+        if (recipient && send_to_client(recipient, json_file_str) < 0) {
+            perror("ERROR: write to descriptor failed");
+        }
+        release_client(recipient);
+    }
+
+    free(json_file_str);
+    cJSON_Delete(json_file);
+}
+
+/**
+ * @brief Handles a FILE_OFFER request, creating the spool file of an upload.
+ *
+ * The request names the file, its size in bytes and optionally a `username` to send it to.
+ * Only the base name of the file is kept. A READY response gives the ID of the file and the
+ * largest chunk the server accepts. The offer is refused with TOO_MANY_OFFERS when the user
+ * already has TRANSFER_MAX_OFFERS uploads in progress, and with SPOOL_FULL when the spool
+ * can't take another file of that size.
+ *
+ * @param client A pointer to the client offering the file.
+ * @param json_msg The FILE_OFFER request.
+ *
+ * @return void
+ */
+void transfer_offer(client_t *client, cJSON *json_msg) {
+    cJSON *name = cJSON_GetObjectItemCaseSensitive(json_msg, "name");
+    cJSON *size = cJSON_GetObjectItemCaseSensitive(json_msg, "size");
+    cJSON *username = cJSON_GetObjectItemCaseSensitive(json_msg, "username");
+    const char *base_name;
+    char path[sizeof(spool_dir) + 64];
+    spool_file_t *file;
+    const char *result = "READY";
+
+    if (!spool_dir[0] || client->gateway || client->ring || client->user_name[0] == '\0') {
+        send_file_response(client, "FILE_OFFER", "UNSUPPORTED", NULL, NULL, 0);
+        return;
+    }
+    if (!cJSON_IsString(name) || !cJSON_IsNumber(size) || size->valuedouble < 1 ||
+        (username && !cJSON_IsString(username))) {
+        send_file_response(client, "FILE_OFFER", "INVALID_FILE", NULL, NULL, 0);
+        return;
+    }
+    if (size->valuedouble > (double)max_file_size) {
+        send_file_response(client, "FILE_OFFER", "FILE_TOO_LARGE", NULL, "max_size", max_file_size);
+        return;
+    }
+    if (username && !is_username_taken(username->valuestring)) {
+        send_file_response(client, "FILE_OFFER", "NO_SUCH_USER", NULL, NULL, 0);
+        return;
+    }
+    base_name = strrchr(name->valuestring, '/') ? strrchr(name->valuestring, '/') + 1 : name->valuestring;
+    if (base_name[0] == '\0' || strcmp(base_name, ".") == 0 || strcmp(base_name, "..") == 0) {
+        send_file_response(client, "FILE_OFFER", "INVALID_FILE", NULL, NULL, 0);
+        return;
+    }
+
+    file = calloc(1, sizeof(spool_file_t));
+    if (!file) {
+        send_file_response(client, "FILE_OFFER", "UNAVAILABLE", NULL, NULL, 0);
+        return;
+    }
+    generate_id(file->id);
+    utf8_copy(file->name, base_name, sizeof(file->name));
+    utf8_copy(file->from, client->user_name, sizeof(file->from));
+    utf8_copy(file->to, username ? username->valuestring : "", sizeof(file->to));
+    file->size = (unsigned long long)size->valuedouble;
+    file->created = time(NULL);
+
+    spool_path(path, sizeof(path), file->id);
+    file->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (file->fd < 0) {
+        perror("ERROR: create spool file failed");
+        free(file);
+        send_file_response(client, "FILE_OFFER", "UNAVAILABLE", NULL, NULL, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&files_mutex);
+    if (count_offers_locked(client->user_name) >= TRANSFER_MAX_OFFERS) {
+        result = "TOO_MANY_OFFERS";
+    } else if (file_count >= TRANSFER_MAX_FILES || spool_bytes + file->size > spool_size) {
+        result = "SPOOL_FULL";
+    } else {
+        spool_bytes += file->size;
+        file_count++;
+        file->next = files;
+        files = file;
+    }
+    pthread_mutex_unlock(&files_mutex);
+
+    if (strcmp(result, "READY") != 0) {
+        close(file->fd);
+        unlink(path);
+        free(file);
+        send_file_response(client, "FILE_OFFER", result, NULL, NULL, 0);
+        return;
+    }
+    printf("%s offers %s (%llu bytes) as file %s\n", client->user_name, file->name, file->size, file->id);
+    send_file_response(client, "FILE_OFFER", "READY", file->id, "chunk", TRANSFER_CHUNK_SIZE);
+}
+
+/**
+ * @brief Handles a FILE_CHUNK header, preparing to receive the bytes that follow it.
+ *
+ * The chunk must continue the upload of a file offered by the same user. The `length` bytes
+ * following an invalid header are read and discarded, so the connection stays in sync.
+ * Chunks are received on the connection the header arrived on. Disk space is allocated for
+ * the chunk before its bytes arrive, so a full disk fails the chunk instead of the write.
+ *
+ * @param client A pointer to the client uploading the chunk.
+ * @param json_msg The FILE_CHUNK header.
+ *
+ * @return void
+ */
+void transfer_chunk(client_t *client, cJSON *json_msg) {
+    client_t *connection = client->gateway ? client->gateway : client;
+    cJSON *id = cJSON_GetObjectItemCaseSensitive(json_msg, "id");
+    cJSON *offset = cJSON_GetObjectItemCaseSensitive(json_msg, "offset");
+    cJSON *length = cJSON_GetObjectItemCaseSensitive(json_msg, "length");
+    struct transfer_upload *upload = connection->upload;
+    spool_file_t *file;
+
+    if (!cJSON_IsNumber(length) || length->valuedouble < 1) {
+        send_file_response(client, "FILE_CHUNK", "INVALID_CHUNK", cJSON_IsString(id) ? id->valuestring : NULL,
+                           NULL, 0);
+        return;
+    }
+    if (!upload) {
+        upload = calloc(1, sizeof(struct transfer_upload));
+        if (!upload) {
+            perror("ERROR: calloc failed");
+            shutdown(connection->sockfd, SHUT_RDWR);
+            return;
+        }
+        upload->fd = -1;
+        upload->pipe[0] = upload->pipe[1] = -1;
+        connection->upload = upload;
+    }
+    upload->fd = -1;
+    upload->failed = 0;
+    upload->length = (unsigned long long)length->valuedouble;
+    upload->remaining = upload->length;
+    upload->offset = cJSON_IsNumber(offset) && offset->valuedouble >= 0 ? (unsigned long long)offset->valuedouble : 0;
+    snprintf(upload->id, sizeof(upload->id), "%s", cJSON_IsString(id) ? id->valuestring : "");
+
+    pthread_mutex_lock(&files_mutex);
+    file = cJSON_IsString(id) && cJSON_IsNumber(offset) ? find_file_locked(id->valuestring) : NULL;
+    if (file && strcmp(file->from, client->user_name) == 0 && file->received == upload->offset &&
+        upload->length <= TRANSFER_CHUNK_SIZE && upload->offset + upload->length <= file->size) {
+        upload->fd = dup(file->fd);
+    }
+    pthread_mutex_unlock(&files_mutex);
+
+    if (upload->fd >= 0 && posix_fallocate(upload->fd, (off_t)upload->offset, (off_t)upload->length) != 0) {
+        perror("ERROR: allocate spool file failed");
+        upload->failed = 2;
+    }
+    if (upload->fd < 0) {
+        upload->failed = 1;
+        send_file_response(client, "FILE_CHUNK", "INVALID_CHUNK", upload->id[0] ? upload->id : NULL, NULL, 0);
+    }
+}
+
+/**
+ * @brief Ends the chunk being received: records its bytes and acknowledges it.
+ *
+ * The uploader receives an OK response with the number of bytes received so far, or a
+ * COMPLETE response once the whole file arrived, at which point the file is announced.
+ *
+ * @param connection The connection the chunk was received on.
+ *
+ * @return void
+ */
+static void finish_chunk(client_t *connection) {
+    struct transfer_upload *upload = connection->upload;
+    spool_file_t *file;
+    spool_file_t completed;
+    unsigned long long received = 0;
+    int complete = 0;
+    int found = 0;
+
+    if (upload->fd >= 0) {
+        close(upload->fd);
+        upload->fd = -1;
+    }
+    if (upload->failed) {
+        // Invalid chunks were answered when their header arrived.
+        if (upload->failed > 1) {
+            send_file_response(connection, "FILE_CHUNK", "WRITE_FAILED", upload->id, NULL, 0);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&files_mutex);
+    file = find_file_locked(upload->id);
+    if (file && file->received == upload->offset) {
+        file->received += upload->length;
+        received = file->received;
+        complete = file->received == file->size;
+        completed = *file;
+        found = 1;
+    }
+    pthread_mutex_unlock(&files_mutex);
+
+    if (!found) {
+        send_file_response(connection, "FILE_CHUNK", "NO_SUCH_FILE", upload->id, NULL, 0);
+        return;
+    }
+    metrics_add(METRIC_FILE_BYTES_RECEIVED, upload->length);
+    if (complete) {
+        printf("File %s from %s is complete\n", completed.id, completed.from);
+        metrics_add(METRIC_FILES_UPLOADED, 1);
+        send_file_response(connection, "FILE_CHUNK", "COMPLETE", upload->id, "received", received);
+        announce_file(&completed, connection);
+    } else {
+        send_file_response(connection, "FILE_CHUNK", "OK", upload->id, "received", received);
+    }
+}
+
+/**
+ * @brief Tells whether a connection still expects bytes of an uploaded chunk.
+ *
+ * @param connection The connection.
+ *
+ * @return int Non-zero if the next received bytes belong to a chunk.
+ */
+int transfer_pending(client_t *connection) {
+    return connection->upload && connection->upload->remaining > 0;
+}
+
+/**
+ * @brief Consumes the bytes of the pending chunk found in a receive buffer.
+ *
+ * @param connection The connection the bytes were received on.
+ * @param data The received bytes.
+ * @param length The number of received bytes.
+ *
+ * @return size_t The number of bytes that belonged to the chunk.
+ */
+size_t transfer_receive(client_t *connection, const char *data, size_t length) {
+    struct transfer_upload *upload = connection->upload;
+    size_t count = length < upload->remaining ? length : (size_t)upload->remaining;
+    size_t written = 0;
+
+    while (upload->fd >= 0 && !upload->failed && written < count) {
+        ssize_t result = pwrite(upload->fd, data + written, count - written,
+                                (off_t)(upload->offset + upload->length - upload->remaining + written));
+        if (result <= 0) {
+            perror("ERROR: write to spool file failed");
+            upload->failed = 2;
+            break;
+        }
+        written += (size_t)result;
+    }
+    upload->remaining -= count;
+    if (upload->remaining == 0) {
+        finish_chunk(connection);
+    }
+    return count;
+}
+
+/**
+ * @brief Receives the pending chunk straight from the socket into the spool file.
+ *
+ * The bytes are spliced from the socket into a pipe and from the pipe into the file, so they
+ * are never copied to user space. Discarded chunks, recorded connections and sockets that
+ * can't be spliced fall back to `recv`.
+ *
+ * @param connection The connection expecting the bytes of a chunk.
+ *
+ * @return int The number of bytes received, 0 if the connection was closed, or -1 on failure.
+ */
+int transfer_splice(client_t *connection) {
+    struct transfer_upload *upload = connection->upload;
+    size_t wanted = upload->remaining < TRANSFER_CHUNK_SIZE ? (size_t)upload->remaining : TRANSFER_CHUNK_SIZE;
+    ssize_t received;
+
+    if (upload->fd >= 0 && !upload->failed && !upload->splice_unsupported && !recorder_enabled()) {
+        if (upload->pipe[0] < 0 && pipe(upload->pipe) < 0) {
+            upload->splice_unsupported = 1;
+        } else {
+            received = splice(connection->sockfd, NULL, upload->pipe[1], NULL, wanted, SPLICE_F_MOVE);
+            if (received > 0) {
+                loff_t offset = (loff_t)(upload->offset + upload->length - upload->remaining);
+                ssize_t moved = 0;
+
+                while (moved < received) {
+                    ssize_t result = splice(upload->pipe[0], NULL, upload->fd, &offset, (size_t)(received - moved),
+                                            SPLICE_F_MOVE);
+                    if (result <= 0) {
+                        char discard[4096];
+
+                        perror("ERROR: splice to spool file failed");
+                        upload->failed = 2;
+                        while (moved < received) {
+                            size_t step = (size_t)(received - moved) < sizeof(discard) ? (size_t)(received - moved)
+                                                                                       : sizeof(discard);
+                            ssize_t drained = read(upload->pipe[0], discard, step);
+                            if (drained <= 0) {
+                                return -1;
+                            }
+                            moved += drained;
+                        }
+                        break;
+                    }
+                    moved += result;
+                }
+                upload->remaining -= (unsigned long long)received;
+                if (upload->remaining == 0) {
+                    finish_chunk(connection);
+                }
+                return (int)received;
+            }
+            if (received == 0 || errno != EINVAL) {
+                return (int)received;
+            }
+            upload->splice_unsupported = 1;
+        }
+    }
+
+    char buffer[TRANSFER_CHUNK_SIZE];
+    received = recv(connection->sockfd, buffer, wanted, 0);
+    if (received > 0) {
+        recorder_data(connection->id, buffer, (size_t)received);
+        transfer_receive(connection, buffer, (size_t)received);
+    }
+    return (int)received;
+}
+
+/**
+ * @brief Frees the upload state of a closed connection and deletes its unfinished uploads.
+ *
+ * An interrupted upload can't be resumed, so its file would only hold its share of the spool
+ * until it expires.
+ *
+ * @param connection The connection.
+ *
+ * @return void
+ */
+void transfer_release(client_t *connection) {
+    struct transfer_upload *upload = connection->upload;
+
+    if (spool_dir[0] && connection->user_name[0]) {
+        pthread_mutex_lock(&files_mutex);
+        for (spool_file_t **link = &files; *link;) {
+            spool_file_t *file = *link;
+            if (file->received == file->size || strcmp(file->from, connection->user_name) != 0) {
+                link = &file->next;
+                continue;
+            }
+            *link = file->next;
+            printf("Upload of file %s was interrupted\n", file->id);
+            delete_file_locked(file);
+        }
+        pthread_mutex_unlock(&files_mutex);
+    }
+    if (!upload) {
+        return;
+    }
+    if (upload->fd >= 0) {
+        close(upload->fd);
+    }
+    if (upload->pipe[0] >= 0) {
+        close(upload->pipe[0]);
+        close(upload->pipe[1]);
+    }
+    free(upload);
+    connection->upload = NULL;
+}
+
+/**
+ * @brief Handles a FILE_GET request, sending one chunk of a file.
+ *
+ * Public files can be downloaded by anyone, private files by their uploader and recipient.
+ * The FILE_DATA header carries the name and size of the file, the offset of the chunk and
+ * its length, and is followed by the bytes of the chunk.
+ *
+ * @param client A pointer to the client downloading the file.
+ * @param json_msg The FILE_GET request, with the file `id` and the `offset` to read from.
+ *
+ * @return void
+ */
+void transfer_get(client_t *client, cJSON *json_msg) {
+    cJSON *id = cJSON_GetObjectItemCaseSensitive(json_msg, "id");
+    cJSON *offset = cJSON_GetObjectItemCaseSensitive(json_msg, "offset");
+    spool_file_t *file;
+    spool_file_t copy;
+    unsigned long long start;
+    size_t length;
+    int fd = -1;
+
+    if (!spool_dir[0] || client->gateway || client->ring) {
+        send_file_response(client, "FILE_GET", "UNSUPPORTED", NULL, NULL, 0);
+        return;
+    }
+    if (!cJSON_IsString(id)) {
+        send_file_response(client, "FILE_GET", "NO_SUCH_FILE", NULL, NULL, 0);
+        return;
+    }
+    start = cJSON_IsNumber(offset) && offset->valuedouble > 0 ? (unsigned long long)offset->valuedouble : 0;
+
+    pthread_mutex_lock(&files_mutex);
+    file = find_file_locked(id->valuestring);
+    if (file && file->received == file->size &&
+        (file->to[0] == '\0' || strcmp(file->to, client->user_name) == 0 ||
+         strcmp(file->from, client->user_name) == 0)) {
+        copy = *file;
+        fd = dup(file->fd);
+    }
+    pthread_mutex_unlock(&files_mutex);
+
+    if (fd < 0) {
+        send_file_response(client, "FILE_GET", "NO_SUCH_FILE", id->valuestring, NULL, 0);
+        return;
+    }
+    if (start >= copy.size) {
+        send_file_response(client, "FILE_GET", "INVALID_OFFSET", id->valuestring, "size", copy.size);
+        close(fd);
+        return;
+    }
+    length = copy.size - start < TRANSFER_CHUNK_SIZE ? (size_t)(copy.size - start) : TRANSFER_CHUNK_SIZE;
+
+    cJSON *json_header = cJSON_CreateObject();
+    cJSON_AddStringToObject(json_header, "type", "FILE_DATA");
+    cJSON_AddStringToObject(json_header, "id", copy.id);
+    cJSON_AddStringToObject(json_header, "name", copy.name);
+    cJSON_AddNumberToObject(json_header, "size", (double)copy.size);
+    cJSON_AddNumberToObject(json_header, "offset", (double)start);
+    cJSON_AddNumberToObject(json_header, "length", (double)length);
+    char *header_str = cJSON_PrintUnformatted(json_header);
+
+    if (send_file_to_client(client, header_str, fd, (off_t)start, length) < 0) {
+        perror("ERROR: send file chunk failed");
+        shutdown(client->sockfd, SHUT_RDWR);
+    } else {
+        metrics_add(METRIC_FILE_BYTES_SENT, length);
+    }
+
+    free(header_str);
+    cJSON_Delete(json_header);
+    close(fd);
+}
+
+/**
+ * @brief Deletes the spool files older than TRANSFER_TTL seconds.
+ *
+ * @return void
+ */
+static void sweep_files(void) {
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&files_mutex);
+    for (spool_file_t **link = &files; *link;) {
+        spool_file_t *file = *link;
+        if (now - file->created < TRANSFER_TTL) {
+            link = &file->next;
+            continue;
+        }
+        *link = file->next;
+        printf("File %s expired\n", file->id);
+        delete_file_locked(file);
+    }
+    pthread_mutex_unlock(&files_mutex);
+}
+
+/**
+ * @brief Deletes expired spool files every TRANSFER_SWEEP_INTERVAL seconds.
+ *
+ * @param arg Unused.
+ *
+ * @return void* Never returns.
+ */
+static void *transfer_sweep_loop(void *arg) {
+    (void)arg;
+
+    while (1) {
+        sleep(TRANSFER_SWEEP_INTERVAL);
+        sweep_files();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Enables file transfers through a spool directory.
+ *
+ * The directory is created if needed, and spool files left by a previous run are deleted,
+ * since their offers are gone.
+ *
+ * @param spool The spool directory.
+ * @param max_size The largest file accepted in bytes, or 0 for TRANSFER_DEFAULT_MAX_SIZE.
+ * @param size The total size of the files the spool holds, or 0 for
+ *        TRANSFER_DEFAULT_SPOOL_SIZE. It caps the size of a file.
+ *
+ * @return int 0 on success, -1 if the directory can't be used.
+ */
+int transfer_init(const char *spool, long long max_size, long long size) {
+    char path[sizeof(spool_dir) + 512];
+    struct dirent *entry;
+    pthread_t tid;
+    DIR *dir;
+
+    if (strlen(spool) >= sizeof(spool_dir)) {
+        printf("Spool directory path is too long\n");
+        return -1;
+    }
+    if (mkdir(spool, 0700) < 0 && errno != EEXIST) {
+        perror("ERROR: create spool directory failed");
+        return -1;
+    }
+    dir = opendir(spool);
+    if (!dir) {
+        perror("ERROR: open spool directory failed");
+        return -1;
+    }
+    snprintf(spool_dir, sizeof(spool_dir), "%s", spool);
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length > strlen(TRANSFER_SUFFIX) &&
+            strcmp(entry->d_name + length - strlen(TRANSFER_SUFFIX), TRANSFER_SUFFIX) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", spool_dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+    if (max_size > 0) {
+        max_file_size = (unsigned long long)max_size;
+    }
+    if (size > 0) {
+        spool_size = (unsigned long long)size;
+    }
+    if (max_file_size > spool_size) {
+        max_file_size = spool_size;
+    }
+
+    if (pthread_create(&tid, NULL, transfer_sweep_loop, NULL) != 0) {
+        perror("ERROR: pthread_create transfer failed");
+        return -1;
+    }
+    pthread_detach(tid);
+    printf("Staging file transfers of up to %llu bytes in %s, %llu bytes in total\n", max_file_size, spool_dir,
+           spool_size);
+    return 0;
+}
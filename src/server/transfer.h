@@ -0,0 +1,50 @@
+/**
+ * @file transfer.h
+ * @brief File transfers staged in a spool directory and served in chunks.
+ *
+ * A user offers a file with FILE_OFFER, naming a recipient or none to share it publicly, and
+ * uploads it in FILE_CHUNK messages, each followed on the connection by `length` raw bytes.
+ * The bytes are moved from the socket to the spool file with `splice`, without passing
+ * through user space. Every chunk is acknowledged, so the uploader keeps a bounded window of
+ * chunks in flight. When the last byte arrives, the recipients are told with a FILE message.
+ *
+ * Recipients download a file by asking for one chunk at a time with FILE_GET. Each FILE_DATA
+ * header is followed by at most TRANSFER_CHUNK_SIZE raw bytes, sent with `sendfile` straight
+ * from the page cache, or compressed with the header into one frame on compressed
+ * connections. The send lock of the connection is only held for one chunk, so chat messages
+ * are delivered between the chunks of a transfer. File data is never numbered nor buffered
+ * for retransmission: after a reconnection the client asks again for what it missed.
+ *
+ * A user has at most TRANSFER_MAX_OFFERS uploads in progress, and the spool holds at most
+ * TRANSFER_MAX_FILES files whose offered sizes add up to the spool size: offers beyond these
+ * limits are refused. The offered size only counts against the spool size; disk space is
+ * allocated chunk by chunk as the upload arrives. Spool files expire TRANSFER_TTL seconds
+ * after the offer, and uploads in progress are abandoned when their uploader disconnects.
+ */
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include "client_manager.h"
+#include "../libs/cJSON/cJSON.h"
+#include <stddef.h>
+
+#define TRANSFER_CHUNK_SIZE 32768
+#define TRANSFER_DEFAULT_MAX_SIZE (64LL * 1024 * 1024)
+#define TRANSFER_DEFAULT_SPOOL_SIZE (1024LL * 1024 * 1024)
+#define TRANSFER_MAX_OFFERS 4
+#define TRANSFER_MAX_FILES 256
+#define TRANSFER_TTL 3600
+#define TRANSFER_SWEEP_INTERVAL 60
+#define TRANSFER_ID_BYTES 8
+#define TRANSFER_NAME_MAX 128
+
+int transfer_init(const char *spool, long long max_size, long long size);
+void transfer_offer(client_t *client, cJSON *json_msg);
+void transfer_chunk(client_t *client, cJSON *json_msg);
+void transfer_get(client_t *client, cJSON *json_msg);
+int transfer_pending(client_t *connection);
+size_t transfer_receive(client_t *connection, const char *data, size_t length);
+int transfer_splice(client_t *connection);
+void transfer_release(client_t *connection);
+
+#endif // TRANSFER_H
@@ -0,0 +1,339 @@
+/**
+ * @file utf8.c
+ * @brief Implements the UTF-8 validation of inbound messages.
+ *
+ * The vectorized validators use the lookup technique of Keiser and Lemire: each byte is
+ * classified together with the byte before it by three 16-entry tables, indexed by the high
+ * nibble of the previous byte, its low nibble and the high nibble of the byte itself. Each
+ * table entry is a set of error bits, and a pair of bytes is invalid when a bit is set in all
+ * three entries. The third and fourth bytes of longer sequences are checked separately,
+ * against the lead byte two or three positions back. Blocks of ASCII bytes only check that
+ * the previous block did not end inside a sequence.
+ */
+#include "utf8.h"
+#include "metrics.h"
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define TOO_SHORT (1 << 0)
+#define TOO_LONG (1 << 1)
+#define OVERLONG_3 (1 << 2)
+#define TOO_LARGE (1 << 3)
+#define SURROGATE (1 << 4)
+#define OVERLONG_2 (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4 (1 << 6)
+#define TWO_CONTINUATIONS (1 << 7)
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTINUATIONS)
+
+#define BYTE_1_HIGH                                                                                     \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TWO_CONTINUATIONS, \
+        TWO_CONTINUATIONS, TWO_CONTINUATIONS, TWO_CONTINUATIONS, TOO_SHORT | OVERLONG_2, TOO_SHORT,     \
+        TOO_SHORT | OVERLONG_3 | SURROGATE, TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define BYTE_1_LOW                                                                                       \
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY, CARRY | TOO_LARGE,   \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,                          \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,                          \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,                          \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,                          \
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, CARRY | TOO_LARGE | TOO_LARGE_1000,              \
+        CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define BYTE_2_HIGH                                                                                      \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,              \
+        TOO_LONG | OVERLONG_2 | TWO_CONTINUATIONS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,            \
+        TOO_LONG | OVERLONG_2 | TWO_CONTINUATIONS | OVERLONG_3 | TOO_LARGE,                              \
+        TOO_LONG | OVERLONG_2 | TWO_CONTINUATIONS | SURROGATE | TOO_LARGE,                               \
+        TOO_LONG | OVERLONG_2 | TWO_CONTINUATIONS | SURROGATE | TOO_LARGE, TOO_SHORT, TOO_SHORT,          \
+        TOO_SHORT, TOO_SHORT
+
+static int utf8_valid_scalar(const unsigned char *data, size_t length);
+
+static int (*validate)(const unsigned char *data, size_t length) = utf8_valid_scalar;
+static const char *implementation = "scalar";
+
+/**
+ * @brief Validates UTF-8 one codepoint at a time, skipping runs of ASCII 8 bytes at a time.
+ *
+ * @param data The bytes to validate.
+ * @param length The number of bytes.
+ *
+ * @return int 1 if the bytes are valid UTF-8, 0 otherwise.
+ */
+static int utf8_valid_scalar(const unsigned char *data, size_t length) {
+    size_t position = 0;
+
+    while (position < length) {
+        unsigned char lead = data[position];
+        uint32_t codepoint;
+        size_t size;
+
+        if (lead < 0x80) {
+            uint64_t word;
+
+            while (position + 8 <= length) {
+                memcpy(&word, data + position, sizeof(word));
+                if (word & 0x8080808080808080ULL) {
+                    break;
+                }
+                position += 8;
+            }
+            while (position < length && data[position] < 0x80) {
+                position++;
+            }
+            continue;
+        }
+        if (lead >= 0xC2 && lead <= 0xDF) {
+            size = 2;
+            codepoint = lead & 0x1F;
+        } else if (lead >= 0xE0 && lead <= 0xEF) {
+            size = 3;
+            codepoint = lead & 0x0F;
+        } else if (lead >= 0xF0 && lead <= 0xF4) {
+            size = 4;
+            codepoint = lead & 0x07;
+        } else {
+            return 0;
+        }
+        if (position + size > length) {
+            return 0;
+        }
+        for (size_t i = 1; i < size; ++i) {
+            if ((data[position + i] & 0xC0) != 0x80) {
+                return 0;
+            }
+            codepoint = (codepoint << 6) | (data[position + i] & 0x3F);
+        }
+        if ((size == 3 && codepoint < 0x800) || (size == 4 && codepoint < 0x10000) || codepoint > 0x10FFFF ||
+            (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+            return 0;
+        }
+        position += size;
+    }
+    return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief Computes the error bits of a block of 16 bytes.
+ *
+ * @param input The block.
+ * @param previous The block before it, or zeros for the first block.
+ *
+ * @return __m128i The error bits of each byte, all zero if the block is valid so far.
+ */
+__attribute__((target("ssse3")))
+static __m128i check_block_ssse3(__m128i input, __m128i previous) {
+    const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+    const __m128i byte_1_high_table = _mm_setr_epi8(BYTE_1_HIGH);
+    const __m128i byte_1_low_table = _mm_setr_epi8(BYTE_1_LOW);
+    const __m128i byte_2_high_table = _mm_setr_epi8(BYTE_2_HIGH);
+    __m128i previous_1 = _mm_alignr_epi8(input, previous, 15);
+    __m128i previous_2 = _mm_alignr_epi8(input, previous, 14);
+    __m128i previous_3 = _mm_alignr_epi8(input, previous, 13);
+    __m128i byte_1_high =
+        _mm_shuffle_epi8(byte_1_high_table, _mm_and_si128(_mm_srli_epi16(previous_1, 4), nibble_mask));
+    __m128i byte_1_low = _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(previous_1, nibble_mask));
+    __m128i byte_2_high = _mm_shuffle_epi8(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), nibble_mask));
+    __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+    __m128i third_byte = _mm_subs_epu8(previous_2, _mm_set1_epi8((char)(0xE0 - 0x80)));
+    __m128i fourth_byte = _mm_subs_epu8(previous_3, _mm_set1_epi8((char)(0xF0 - 0x80)));
+    __m128i must_continue = _mm_and_si128(_mm_or_si128(third_byte, fourth_byte), _mm_set1_epi8((char)0x80));
+
+    return _mm_xor_si128(must_continue, special_cases);
+}
+
+/**
+ * @brief Validates UTF-8 16 bytes at a time.
+ *
+ * The last partial block is padded with zeros, which also catches a sequence cut short by
+ * the end of the data.
+ *
+ * @param data The bytes to validate.
+ * @param length The number of bytes.
+ *
+ * @return int 1 if the bytes are valid UTF-8, 0 otherwise.
+ */
+__attribute__((target("ssse3")))
+static int utf8_valid_ssse3(const unsigned char *data, size_t length) {
+    const __m128i incomplete_limits = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                    (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    __m128i previous = _mm_setzero_si128();
+    __m128i previous_incomplete = _mm_setzero_si128();
+    __m128i error = _mm_setzero_si128();
+    size_t position = 0;
+
+    while (1) {
+        unsigned char tail[16] = { 0 };
+        int last = position + 16 > length;
+        __m128i input;
+
+        if (last) {
+            memcpy(tail, data + position, length - position);
+            input = _mm_loadu_si128((const __m128i *)tail);
+        } else {
+            input = _mm_loadu_si128((const __m128i *)(data + position));
+        }
+        if (_mm_movemask_epi8(input) == 0) {
+            error = _mm_or_si128(error, previous_incomplete);
+        } else {
+            error = _mm_or_si128(error, check_block_ssse3(input, previous));
+        }
+        previous_incomplete = _mm_subs_epu8(input, incomplete_limits);
+        previous = input;
+        if (last) {
+            break;
+        }
+        position += 16;
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+}
+
+/**
+ * @brief Computes the error bits of a block of 32 bytes.
+ *
+ * @param input The block.
+ * @param previous The block before it, or zeros for the first block.
+ *
+ * @return __m256i The error bits of each byte, all zero if the block is valid so far.
+ */
+__attribute__((target("avx2")))
+static __m256i check_block_avx2(__m256i input, __m256i previous) {
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+    const __m256i byte_1_high_table = _mm256_setr_epi8(BYTE_1_HIGH, BYTE_1_HIGH);
+    const __m256i byte_1_low_table = _mm256_setr_epi8(BYTE_1_LOW, BYTE_1_LOW);
+    const __m256i byte_2_high_table = _mm256_setr_epi8(BYTE_2_HIGH, BYTE_2_HIGH);
+    __m256i shifted = _mm256_permute2x128_si256(previous, input, 0x21);
+    __m256i previous_1 = _mm256_alignr_epi8(input, shifted, 15);
+    __m256i previous_2 = _mm256_alignr_epi8(input, shifted, 14);
+    __m256i previous_3 = _mm256_alignr_epi8(input, shifted, 13);
+    __m256i byte_1_high =
+        _mm256_shuffle_epi8(byte_1_high_table, _mm256_and_si256(_mm256_srli_epi16(previous_1, 4), nibble_mask));
+    __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(previous_1, nibble_mask));
+    __m256i byte_2_high =
+        _mm256_shuffle_epi8(byte_2_high_table, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble_mask));
+    __m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+    __m256i third_byte = _mm256_subs_epu8(previous_2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i fourth_byte = _mm256_subs_epu8(previous_3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must_continue =
+        _mm256_and_si256(_mm256_or_si256(third_byte, fourth_byte), _mm256_set1_epi8((char)0x80));
+
+    return _mm256_xor_si256(must_continue, special_cases);
+}
+
+/**
+ * @brief Validates UTF-8 32 bytes at a time.
+ *
+ * The last partial block is padded with zeros, which also catches a sequence cut short by
+ * the end of the data.
+ *
+ * @param data The bytes to validate.
+ * @param length The number of bytes.
+ *
+ * @return int 1 if the bytes are valid UTF-8, 0 otherwise.
+ */
+__attribute__((target("avx2")))
+static int utf8_valid_avx2(const unsigned char *data, size_t length) {
+    const __m256i incomplete_limits = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    __m256i previous = _mm256_setzero_si256();
+    __m256i previous_incomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    size_t position = 0;
+
+    while (1) {
+        unsigned char tail[32] = { 0 };
+        int last = position + 32 > length;
+        __m256i input;
+
+        if (last) {
+            memcpy(tail, data + position, length - position);
+            input = _mm256_loadu_si256((const __m256i *)tail);
+        } else {
+            input = _mm256_loadu_si256((const __m256i *)(data + position));
+        }
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, previous_incomplete);
+        } else {
+            error = _mm256_or_si256(error, check_block_avx2(input, previous));
+        }
+        previous_incomplete = _mm256_subs_epu8(input, incomplete_limits);
+        previous = input;
+        if (last) {
+            break;
+        }
+        position += 32;
+    }
+    return _mm256_testz_si256(error, error);
+}
+#endif
+
+/**
+ * @brief Chooses the fastest validator the CPU supports.
+ *
+ * @return void
+ */
+void utf8_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        validate = utf8_valid_avx2;
+        implementation = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        validate = utf8_valid_ssse3;
+        implementation = "ssse3";
+    }
+#endif
+}
+
+/**
+ * @brief Names the validator chosen by utf8_init.
+ *
+ * @return const char* `avx2`, `ssse3` or `scalar`.
+ */
+const char *utf8_implementation(void) {
+    return implementation;
+}
+
+/**
+ * @brief Tells whether bytes are valid UTF-8.
+ *
+ * @param data The bytes to validate.
+ * @param length The number of bytes.
+ *
+ * @return int 1 if the bytes are valid UTF-8, 0 otherwise.
+ */
+int utf8_valid(const char *data, size_t length) {
+    return validate((const unsigned char *)data, length);
+}
+
+/**
+ * @brief Copies valid UTF-8 text into a fixed-size field.
+ *
+ * Text that does not fit is cut before the codepoint that would cross the end of the field,
+ * and counted in the utf8_truncated metric.
+ *
+ * @param destination The field.
+ * @param source The null-terminated text, valid UTF-8.
+ * @param size The size of the field in bytes, including the terminating null byte.
+ *
+ * @return size_t The number of bytes copied, without the terminating null byte.
+ */
+size_t utf8_copy(char *destination, const char *source, size_t size) {
+    size_t length = strnlen(source, size);
+
+    if (length == size) {
+        metrics_add(METRIC_UTF8_TRUNCATED, 1);
+        length = size - 1;
+        while (length > 0 && ((unsigned char)source[length] & 0xC0) == 0x80) {
+            length--;
+        }
+    }
+    memmove(destination, source, length);
+    destination[length] = '\0';
+    return length;
+}
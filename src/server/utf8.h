@@ -0,0 +1,23 @@
+/**
+ * @file utf8.h
+ * @brief UTF-8 validation of inbound messages and truncation on codepoint boundaries.
+ *
+ * Every message received from a client is validated once, as raw bytes, before it is parsed:
+ * overlong encodings, surrogates, codepoints above U+10FFFF and truncated sequences are
+ * rejected. The validator checks 32 bytes at a time with AVX2 or 16 bytes at a time with
+ * SSSE3 when the CPU supports them, and one byte at a time otherwise.
+ *
+ * Text copied from a valid message into a fixed-size field is truncated on a codepoint
+ * boundary, so the field stays valid UTF-8.
+ */
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+
+void utf8_init(void);
+const char *utf8_implementation(void);
+int utf8_valid(const char *data, size_t length);
+size_t utf8_copy(char *destination, const char *source, size_t size);
+
+#endif // UTF8_H